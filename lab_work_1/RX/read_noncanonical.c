@@ -14,6 +14,8 @@
 //#define DEBUG
 
 #include "../include/linklayer.h"
+#include "../include/bond.h"
+#include "../include/async.h"
 
 // Define roles for the connection
 #define RX 0
@@ -49,14 +51,87 @@ void display_progress_bar(long total_bytes, long fileSize)
     fflush(stdout); // Ensure the output is displayed immediately
 }
 
+// Writes the link counters as JSON to path, if one was given.
+void save_stats(const char *path, const ll_stats_t *stats)
+{
+    if (path == NULL)
+        return;
+
+    FILE *json = fopen(path, "w");
+    if (json == NULL)
+    {
+        fprintf(stderr, "Error creating file %s\n", path);
+        return;
+    }
+
+    llstats_json(stats, json);
+    fclose(json);
+}
+
+// Reads the next packet, from the I/O thread of a single port (async.h) if
+// there is one. The thread keeps receiving while the file is written.
+// Returns the length of the packet, a negative error code otherwise.
+int read_packet(ll_bond_t *conn, ll_async_t *async, unsigned char *packet, int timeout)
+{
+    if (async == NULL)
+        return llbond_read(conn, packet);
+
+    while (TRUE)
+    {
+        int length = llpoll_read(async, packet);
+        if (length != TIMEOUT_ERROR)
+            return length;
+        if (!llasync_wait(async, timeout > 0 ? timeout : -1))
+            return TIMEOUT_ERROR;
+    }
+}
+
 int main(int argc, char *argv[])
 {
+    // Waits forever for the transmitter unless a deadline is given
+    ll_params_t params;
+    llparams_default(&params);
+    const char *jsonPath = NULL;
+    const char *tracePath = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:j:T:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                params.rxTimeout = atoi(optarg);
+                break;
+            case 'b':
+                params.baudRate = atoi(optarg);
+                break;
+            case 'j':
+                jsonPath = optarg;
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            default:
+                exit(1);
+        }
+    }
+
     // Check if the program was called with the correct arguments
-    if (argc < 3)
+    if (argc - optind < 2)
     {
         printf("Incorrect program usage\n"
-               "Usage: %s <SerialPortNumber> <FilePath>\n"
-               "Example: %s 1 file.gif\n",
+               "Usage: %s [-t TimeoutMs] [-b BaudRate] [-j StatsFile] [-T TraceFile] <SerialPortNumber>[,<SerialPortNumber>...] <FilePath>\n"
+               "Example: %s 1 file.gif\n"
+               "         %s -t 10000 1 file.gif (give up after 10 s without frames)\n"
+               "         %s 1,2,3 file.gif (file split over three serial ports)\n"
+               "         %s -b 115200 1 file.gif (never faster than 115200 baud)\n"
+               "         %s -j stats.json 1 file.gif (link counters saved as JSON)\n"
+               "         %s -T trace.bin 1 file.gif (last frames saved, see test/trace)\n",
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
                argv[0],
                argv[0]);
         exit(1);
@@ -64,7 +139,7 @@ int main(int argc, char *argv[])
 
     // In the case of the receiver file path will be 
     // the path to store the received file
-    char *file_path = argv[2];
+    char *file_path = argv[optind + 1];
     char file_name[MAX_SIZE];
     long fileSize = 0;
 
@@ -79,21 +154,50 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    // Read the serial port number
-    const char *portNumberString = argv[1];
-    int portNumber = atoi(portNumberString);
+    // Read the serial port numbers, in the same order as the transmitter
+    const char *portNumberString = argv[optind];
+    int ports[MAX_LINKS];
+    int portCount = llbond_parse_ports(portNumberString, ports, MAX_LINKS);
+    if (portCount < 0)
+    {
+        printf("Invalid serial port list: %s\n", portNumberString);
+        exit(1);
+    }
 
     // Begin communication in RX mode
-    int fd = llopen(portNumber, RX);
-    if (fd == -1)
+    int err;
+    ll_bond_t *conn = llbond_open(ports, portCount, RX, &params, &err);
+    if (conn == NULL && err == TIMEOUT_ERROR)
+    {
+        printf("Connection time out. The program will now close.\n");
+        exit(1);
+    }
+    else if (conn == NULL)
     {
         printf("Connection could not be established\n");
         exit(1);
     }
 
+    // The frames of each link are saved at the end, or as soon as it fails
+    if (tracePath != NULL)
+        llbond_trace_file(conn, tracePath, TRUE);
+
+    // Packets can be as large as the payload agreed during llopen
+    llbond_getparams(conn, &params);
+    unsigned char *rcv_packet = malloc(params.maxPayload);
+    if (rcv_packet == NULL)
+    {
+        printf("Could not allocate %d bytes for the packets\n", params.maxPayload);
+        exit(1);
+    }
+
+    // With a single port the link runs in its own thread
+    ll_async_t *async = NULL;
+    if (portCount == 1)
+        async = llasync_start(llbond_conn(conn, 0), LL_ASYNC_DEPTH);
+
     // Read the file metadata
-    unsigned char rcv_packet[MAX_SIZE];
-    int rcv_packet_size = llread(fd, rcv_packet);
+    int rcv_packet_size = read_packet(conn, async, rcv_packet, params.rxTimeout);
     if (rcv_packet_size < 0)
     {
         printf("Error reading file metadata\n");
@@ -132,7 +236,12 @@ int main(int argc, char *argv[])
 
     if (rcv_packet[3 + rcv_packet[2]] == FILE_NAME)
     {
-        strcpy(file_name, (char *)&rcv_packet[4 + rcv_packet[2]]);
+        // The name is not null terminated, it takes the rest of the packet
+        int nameLength = rcv_packet_size - (4 + rcv_packet[2]);
+        if (nameLength >= (int)sizeof(file_name))
+            nameLength = sizeof(file_name) - 1;
+        memcpy(file_name, &rcv_packet[4 + rcv_packet[2]], nameLength);
+        file_name[nameLength] = '\0';
     }
     else
     {
@@ -145,18 +254,18 @@ int main(int argc, char *argv[])
     // Read the file data while checking for END packets
     int run = TRUE;
 
-    unsigned char data_packet[MAX_SIZE];
+    unsigned char *data_packet = rcv_packet;
     int data_packet_size = 0;
     int total_bytes = 0;
 
     while (run)
     {
-        data_packet_size = llread(fd, data_packet);
-        /*if (data_packet_size <= 0)
+        data_packet_size = read_packet(conn, async, data_packet, params.rxTimeout);
+        if (data_packet_size < 0)
         {
-            printf("Error reading data packet (%d)\n", data_packet_size);
+            printf("\nError reading data packet (%d)\n", data_packet_size);
             exit(1);
-        }*/
+        }
 
         #ifdef DEBUG
         printf("Received packet:\n");
@@ -199,8 +308,47 @@ int main(int argc, char *argv[])
                     printf("Terminating communication\n");
                 }
 
-                llclose(fd, RX);
+                // The link is used directly from now on
+                if (async != NULL)
+                    llasync_stop(async);
+
+                // Out-of-order frames kept while waiting for retransmissions
+                ll_bond_link_t links[MAX_LINKS];
+                int linkCount = llbond_links(conn, links);
+                for (int i = 0; i < linkCount; i++)
+                {
+                    if (linkCount > 1)
+                        printf("Port %d: %ld packets, %lld bytes\n", links[i].port, links[i].packets, links[i].bytes);
+                    if (params.arq == ARQ_SELECTIVE_REPEAT)
+                        printf("Reorder buffer peak: %d of %d frames\n", links[i].reorderPeak, params.window);
+                }
+
+                if (params.compress != COMPRESS_NONE)
+                {
+                    ll_compress_stats_t stats;
+                    llbond_compress_stats(conn, &stats);
+                    printf("Decompression: %lld -> %lld bytes, %.1f ms\n", stats.receivedBytes,
+                           stats.deliveredBytes, stats.decompressUs / 1000.0);
+                }
+
+                if (params.fec > 0)
+                {
+                    ll_fec_stats_t stats;
+                    llbond_fec_stats(conn, &stats);
+                    printf("FEC: %ld frames corrected (%ld bytes), %ld could not be corrected\n",
+                           stats.framesCorrected, stats.bytesCorrected, stats.framesFailed);
+                }
+
+                ll_timing_t timing;
+                ll_stats_t stats;
+                llbond_close(conn, &timing, &stats);
                 close(file);
+                free(rcv_packet);
+
+                printf("Setup: %.1f ms, teardown: %.1f ms\n",
+                       timing.openUs / 1000.0, timing.closeUs / 1000.0);
+                llstats_print(&stats, stdout);
+                save_stats(jsonPath, &stats);
                 break;
         }
     }
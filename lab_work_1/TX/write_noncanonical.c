@@ -18,6 +18,8 @@
 #define DEBUG
 
 #include "../include/linklayer.h"
+#include "../include/bond.h"
+#include "../include/async.h"
 
 #define FALSE 0
 #define TRUE 1
@@ -34,24 +36,202 @@
 #define FILE_NAME 0x01
 
 
+// Writes the link counters as JSON to path, if one was given.
+void save_stats(const char *path, const ll_stats_t *stats)
+{
+    if (path == NULL)
+        return;
+
+    FILE *json = fopen(path, "w");
+    if (json == NULL)
+    {
+        fprintf(stderr, "Error creating file %s\n", path);
+        return;
+    }
+
+    llstats_json(stats, json);
+    fclose(json);
+}
+
+// Packets given to the I/O thread of a single port (async.h). Each one
+// keeps its buffer until the thread is done with it.
+typedef struct {
+    ll_async_t *async;
+    unsigned char *buffers[LL_ASYNC_DEPTH];
+    long submitted;
+    long completed;
+} sender_t;
+
+// Takes the completions of the I/O thread, waiting until at most maxPending
+// packets are left.
+// Returns 0 if successful, the error code of a packet that failed otherwise.
+int collect_packets(sender_t *sender, int maxPending)
+{
+    ll_completion_t completion;
+
+    while (TRUE)
+    {
+        while (llpoll_write(sender->async, &completion))
+        {
+            if (completion.result < 0)
+                return completion.result;
+            sender->completed++;
+        }
+
+        if (sender->submitted - sender->completed <= maxPending)
+            return 0;
+        llasync_wait(sender->async, -1);
+    }
+}
+
+// Gives a packet to the I/O thread and gets the buffer for the next one,
+// which the thread is done with.
+// Returns the buffer, NULL if a packet failed (the code is left in *err).
+unsigned char *submit_packet(sender_t *sender, unsigned char *packet, int length, int *err)
+{
+    *err = llsubmit_write(sender->async, packet, length, NULL);
+    if (*err < 0)
+        return NULL;
+    sender->submitted++;
+
+    *err = collect_packets(sender, LL_ASYNC_DEPTH - 1);
+    if (*err < 0)
+        return NULL;
+
+    return sender->buffers[sender->submitted % LL_ASYNC_DEPTH];
+}
+
 int main(int argc, char *argv[])
 {
+    // Link layer parameters, stop-and-wait unless a window is given
+    ll_params_t params;
+    llparams_default(&params);
+
+    int selectiveRepeat = FALSE;
+    int fixedPayload = FALSE;
+    const char *jsonPath = NULL;
+    const char *tracePath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:sc:p:a:zf:Fb:oj:T:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'w':
+                params.window = atoi(optarg);
+                params.arq = params.window > 1 ? ARQ_GO_BACK_N : ARQ_STOP_AND_WAIT;
+                params.seqBits = 0;
+                break;
+            case 's':
+                selectiveRepeat = TRUE;
+                break;
+            case 'c':
+                if (strcmp(optarg, "crc16") == 0)
+                    params.fcs = FCS_CRC16;
+                else if (strcmp(optarg, "crc32c") == 0)
+                    params.fcs = FCS_CRC32C;
+                else if (strcmp(optarg, "xor") == 0)
+                    params.fcs = FCS_XOR;
+                else
+                {
+                    printf("Unknown frame check: %s (xor, crc16 or crc32c)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                params.maxPayload = atoi(optarg);
+                break;
+            case 'a':
+            {
+                // Every N frames, or after the given delay in ms
+                char *delay = strchr(optarg, ',');
+                params.ackEvery = atoi(optarg);
+                params.ackDelay = delay != NULL ? atoi(delay + 1) : ACK_DELAY_MS;
+                break;
+            }
+            case 'z':
+                params.compress = COMPRESS_LZ;
+                break;
+            case 'f':
+                params.fec = atoi(optarg);
+                break;
+            case 'F':
+                fixedPayload = TRUE;
+                break;
+            case 'b':
+                params.baudRate = atoi(optarg);
+                break;
+            case 'o':
+                params.framing = FRAMING_COBS;
+                break;
+            case 'j':
+                jsonPath = optarg;
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            default:
+                exit(1);
+        }
+    }
+
+    if (selectiveRepeat && params.arq == ARQ_GO_BACK_N)
+        params.arq = ARQ_SELECTIVE_REPEAT;
+
     // Check if the program was called with the correct arguments
-    if (argc < 3)
+    if (argc - optind < 2)
     {
         printf("Incorrect program usage\n"
-               "Usage: %s <SerialPortNumber> <FilePath>\n"
-               "Example: %s 1 file.gif\n",
+               "Usage: %s [-w WindowSize [-s]] [-c xor|crc16|crc32c] [-p MaxPayload] [-a AckEvery[,AckDelay]] [-z] [-f Errors] [-F] [-b BaudRate] [-o] [-j StatsFile] [-T TraceFile] <SerialPortNumber>[,<SerialPortNumber>...] <FilePath>\n"
+               "Example: %s 1 file.gif\n"
+               "         %s -w 7 1 file.gif (Go-Back-N with a window of 7 frames)\n"
+               "         %s -w 4 -s 1 file.gif (Selective Repeat with a window of 4 frames)\n"
+               "         %s -c crc32c 1 file.gif (CRC-32C instead of the XOR BCC2)\n"
+               "         %s -p 4096 1 file.gif (I-frames with up to 4096 bytes)\n"
+               "         %s -w 7 1,2,3 file.gif (file split over three serial ports)\n"
+               "         %s -w 7 -a 4,20 1 file.gif (one RR every 4 frames, or after 20 ms)\n"
+               "         %s -z 1 file.txt (data fields compressed when they get shorter)\n"
+               "         %s -f 4 1 file.gif (Reed-Solomon code correcting 4 bytes per 255)\n"
+               "         %s -p 4096 -F 1 file.gif (always 4096-byte I-frames, even on noisy lines)\n"
+               "         %s -b 921600 1 file.gif (switch to up to 921600 baud after llopen)\n"
+               "         %s -o 1 file.gif (COBS framing instead of flags and byte stuffing)\n"
+               "         %s -j stats.json 1 file.gif (link counters saved as JSON)\n"
+               "         %s -T trace.bin 1 file.gif (last frames saved, see test/trace)\n",
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
                argv[0],
                argv[0]);
         exit(1);
     }
 
+    if (llcheckparams(&params) != 0)
+    {
+        printf("Invalid link parameters: window %d (1 to %d, %d with -s), payload %d (1 to %d), "
+               "acknowledgment every %d frames (1 to the window) after %d ms (1 to %d), "
+               "FEC %d (0 to %d), %d baud (0 or at least %d)\n",
+               params.window, MAX_WINDOW, MAX_MODULUS / 2, params.maxPayload, MAX_PAYLOAD,
+               params.ackEvery, params.ackDelay, RTO_MAX_MS, params.fec, MAX_FEC, params.baudRate, MIN_BAUD_RATE);
+        exit(1);
+    }
+
+    const char *portNumberString = argv[optind];
+    const char *filePath = argv[optind + 1];
+
     // Open the file to be sent
-    int file = open(argv[2], O_RDONLY);
+    int file = open(filePath, O_RDONLY);
     if (file < 0)
     {
-        fprintf(stderr, "Error opening file %s\n", argv[2]);
+        fprintf(stderr, "Error opening file %s\n", filePath);
         exit(1);
     }
 
@@ -66,28 +246,64 @@ int main(int argc, char *argv[])
     // Get the file size in bytes.
     unsigned int fileSize = fileStat.st_size;
 
-    printf("File: %s\nSize: %d bytes\n", argv[2], fileSize);
+    printf("File: %s\nSize: %d bytes\n", filePath, fileSize);
 
-    // Read the serial port number
-    const char *portNumberString = argv[1];
-    int portNumber = atoi(portNumberString);
+    // Read the serial port numbers, the packets are split between them
+    int ports[MAX_LINKS];
+    int portCount = llbond_parse_ports(portNumberString, ports, MAX_LINKS);
+    if (portCount < 0)
+    {
+        printf("Invalid serial port list: %s\n", portNumberString);
+        exit(1);
+    }
 
     // Begin communication
-    int fd = llopen(portNumber, TX);
-    if (fd == DEFAULT_ERROR)
+    int err;
+    ll_bond_t *conn = llbond_open(ports, portCount, TX, &params, &err);
+    if (conn == NULL && err == TIMEOUT_ERROR)
+    {
+        printf("Connection time out. The program will now close.\n");
+        exit(1);
+    }
+    else if (conn == NULL)
     {
         printf("Connection could not be established\n");
         exit(1);
     }
-    else if (fd == TIMEOUT_ERROR)
+
+    // The frames of each link are saved at the end, or as soon as it fails
+    if (tracePath != NULL)
+        llbond_trace_file(conn, tracePath, TRUE);
+
+    // Packets can be as large as the payload agreed during llopen
+    llbond_getparams(conn, &params);
+    unsigned char *packet = malloc(params.maxPayload);
+    if (packet == NULL)
     {
-        printf("Connection time out. The program will now close.\n");
+        printf("Could not allocate %d bytes for the packets\n", params.maxPayload);
         exit(1);
     }
 
+    // With a single port the link runs in its own thread, so the next
+    // packets are read from the file while the last ones are sent
+    sender_t sender;
+    memset(&sender, 0, sizeof(sender));
+    if (portCount == 1)
+    {
+        for (int i = 0; i < LL_ASYNC_DEPTH; i++)
+        {
+            sender.buffers[i] = i == 0 ? packet : malloc(params.maxPayload);
+            if (sender.buffers[i] == NULL)
+            {
+                printf("Could not allocate %d bytes for the packets\n", params.maxPayload);
+                exit(1);
+            }
+        }
+        sender.async = llasync_start(llbond_conn(conn, 0), LL_ASYNC_DEPTH);
+    }
+
     // Read the file and send it to the receiver
     // Start by sending START packet with file size and name.
-    unsigned char packet[MAX_SIZE];
 
     packet[0] = START;
     packet[1] = FILE_SIZE;
@@ -101,42 +317,72 @@ int main(int argc, char *argv[])
     packet[6] = fileSize & 0xFF;
     
     packet[7] = FILE_NAME;
-    if (strlen(argv[2]) > (MAX_SIZE-8))
+    if ((int)strlen(filePath) + 8 > params.maxPayload)
     {
         printf("File name is too long\n");
         exit(1);
     }
-    strcpy((char *)&packet[8], argv[2]);
+    strcpy((char *)&packet[8], filePath);
 
-    int bytes = llwrite(fd, packet, strlen(argv[2]) + 8);
-    if (bytes == -1)
+    int bytes;
+    if (sender.async != NULL)
+        packet = submit_packet(&sender, packet, strlen(filePath) + 8, &bytes);
+    else
+        bytes = llbond_write(conn, packet, strlen(filePath) + 8);
+    if (bytes == -1 || packet == NULL)
     {
         printf("Error sending file size and name\n");
         exit(1);
     }
 
-    sleep(1);
-    
     // Start sending the file in data packets
     int bytesRead = 0;
-    int packet_size = 3;
+    unsigned char header[3];
 
-    unsigned char file_data[MAX_SIZE];
-    packet[0] = DATA;
-    
-    while ((bytesRead = read(file, file_data, MAX_SIZE)) > 0)
-    {
-        packet_size = bytesRead + 3;
+    header[0] = DATA;
 
-        packet[1] = (bytesRead >> 8);
-        packet[2] = bytesRead & 0xFF;
+    // The header and the data read from the file are sent as two segments,
+    // the link layer stuffs them straight into the I-frame
+    struct iovec segments[2] = {{header, 3}, {packet, 0}};
 
-        for (int i = 0; i < bytesRead; i++)
+    while (TRUE)
+    {
+        // Packets follow the size that suits the error rate of the link,
+        // unless -F was given. The data packet header takes 3 bytes of the
+        // I-frame, and its length field has 16 bits.
+        int payload = sender.async != NULL ? llasync_payload(sender.async) : llbond_payload(conn, NULL);
+        int chunkSize = (fixedPayload ? params.maxPayload : payload) - 3;
+        if (chunkSize > 0xFFFF)
+            chunkSize = 0xFFFF;
+
+        if (sender.async != NULL)
         {
-            packet[i + 3] = file_data[i];
+            // The header goes in front of the data in the packet buffer
+            bytesRead = read(file, &packet[3], chunkSize);
+            if (bytesRead <= 0)
+                break;
+
+            packet[0] = DATA;
+            packet[1] = (bytesRead >> 8);
+            packet[2] = bytesRead & 0xFF;
+            packet = submit_packet(&sender, packet, bytesRead + 3, &bytes);
+            if (packet == NULL)
+            {
+                printf("Error sending file data. Code: %d\n", bytes);
+                exit(1);
+            }
+            continue;
         }
-        
-        bytes = llwrite(fd, packet, packet_size);
+
+        bytesRead = read(file, packet, chunkSize);
+        if (bytesRead <= 0)
+            break;
+
+        header[1] = (bytesRead >> 8);
+        header[2] = bytesRead & 0xFF;
+        segments[1].iov_len = bytesRead;
+
+        bytes = llbond_writev(conn, segments, 2);
         if (bytes <= 0)
         {
             printf("Error sending file data. Code: %d\n", bytes);
@@ -146,15 +392,59 @@ int main(int argc, char *argv[])
 
     // Send END packet
     packet[0] = END;
-    bytes = llwrite(fd, packet, 1); 
-    if (bytes <= 0)
+    if (sender.async != NULL)
+    {
+        // Wait for the thread to send everything and take the link back
+        if (submit_packet(&sender, packet, 1, &bytes) == NULL || (bytes = collect_packets(&sender, 0)) < 0)
+        {
+            printf("Error sending END. Code: %d\n", bytes);
+            exit(1);
+        }
+        llasync_stop(sender.async);
+    }
+    else if ((bytes = llbond_write(conn, packet, 1)) <= 0)
     {
         printf("Error sending END. Code: %d\n", bytes);
         exit(1);
     }
 
-    llclose(fd, TX);
+    // Share of the file sent through each serial port
+    ll_bond_link_t links[MAX_LINKS];
+    int linkCount = llbond_links(conn, links);
+    for (int i = 0; linkCount > 1 && i < linkCount; i++)
+    {
+        printf("Port %d: %s, %ld packets, %lld bytes, %.0f B/s\n", links[i].port,
+               links[i].up ? "up" : "down", links[i].packets, links[i].bytes, links[i].goodput);
+    }
+
+    double ber;
+    int payload = llbond_payload(conn, &ber);
+    printf("Payload: %d of %d bytes (estimated BER %.1e)\n", fixedPayload ? params.maxPayload : payload,
+           params.maxPayload, ber);
+
+    if (params.compress != COMPRESS_NONE)
+    {
+        ll_compress_stats_t stats;
+        llbond_compress_stats(conn, &stats);
+        printf("Compression: %lld -> %lld bytes (%.1f%%), %.1f ms\n", stats.rawBytes, stats.sentBytes,
+               stats.rawBytes > 0 ? 100.0 * stats.sentBytes / stats.rawBytes : 100.0, stats.compressUs / 1000.0);
+    }
+
+    ll_timing_t timing;
+    ll_stats_t stats;
+    llbond_close(conn, &timing, &stats);
     close(file);
+    for (int i = 0; i < LL_ASYNC_DEPTH; i++)
+    {
+        if (sender.buffers[i] != packet)
+            free(sender.buffers[i]);
+    }
+    free(packet);
+
+    printf("Setup: %.1f ms, flush: %.1f ms, teardown: %.1f ms\n",
+           timing.openUs / 1000.0, timing.flushUs / 1000.0, timing.closeUs / 1000.0);
+    llstats_print(&stats, stdout);
+    save_stats(jsonPath, &stats);
 
     return 0;
 }
@@ -1,3 +1,9 @@
-gcc TX/write_noncanonical.c src/linklayer.c -o TX/write
-gcc RX/read_noncanonical.c src/linklayer.c -o RX/read
-gcc test/main.c src/linklayer.c -o test/test
\ No newline at end of file
+CFLAGS="-O2 -pthread"
+SRC="src/linklayer.c src/stuffing.c src/parser.c src/fcs.c src/compress.c src/fec.c src/baud.c src/stats.c src/trace.c src/transport.c src/async.c src/bond.c"
+
+gcc $CFLAGS TX/write_noncanonical.c $SRC -o TX/write
+gcc $CFLAGS RX/read_noncanonical.c $SRC -o RX/read
+gcc $CFLAGS test/main.c $SRC -o test/test
+gcc $CFLAGS test/bench.c $SRC -o test/bench
+gcc $CFLAGS test/trace.c $SRC -o test/trace
+gcc $CFLAGS test/framing.c $SRC -o test/framing
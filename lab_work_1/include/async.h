@@ -0,0 +1,129 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: async.h
+*
+* Description:
+* Runs a connection in its own I/O thread, so the application does not
+* stop the link while it reads the file or writes it to disk. Packets to
+* send are submitted to a ring and sent by the thread as soon as the
+* window has room; packets received are put in another ring until the
+* application takes them. Each ring has one producer and one consumer and
+* needs no locks. The thread sleeps in poll() on the serial port, the
+* timers and an eventfd the application writes to; the application can
+* sleep on another eventfd (llasync_fd) that the thread writes to when
+* there is something new.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include "linklayer.h"
+
+#define LL_ASYNC_DEPTH 16 // Packets in each ring. Must be a power of 2.
+
+// An I/O thread and its rings, returned by llasync_start.
+typedef struct ll_async ll_async_t;
+
+// Result of a packet given to llsubmit_write.
+typedef struct {
+    void *tag;  // As given to llsubmit_write
+    int result; // As returned by llwrite
+} ll_completion_t;
+
+/*
+*   Starts the I/O thread of a connection. From then on only the thread
+*   uses the connection, until llasync_stop gives it back. The other
+*   functions of this file must all be called from the same thread.
+*
+*   @param *conn Connection returned by llopen.
+*   @param depth Packets in each ring (power of 2, LL_ASYNC_DEPTH if 0).
+*
+*   @returns the I/O thread, NULL on error.
+*/
+ll_async_t *llasync_start(ll_conn_t *conn, int depth);
+
+/*
+*   Gives a packet to the I/O thread to send it, as llwrite would. The
+*   buffer must not change until its completion is returned by
+*   llpoll_write.
+*
+*   @param *async I/O thread.
+*   @param *buffer Packet to send.
+*   @param length Length of the packet.
+*   @param *tag Returned with the completion.
+*
+*   @returns 0 if the packet was queued, -2 if the ring is full (wait for a
+*            completion) and -1 if the connection failed.
+*/
+int llsubmit_write(ll_async_t *async, const unsigned char *buffer, int length, void *tag);
+
+/*
+*   Gets the next packet the I/O thread finished sending, in the order
+*   they were submitted. Its buffer can be used again.
+*
+*   @param *async I/O thread.
+*   @param *completion Pointer to where the result will be stored.
+*
+*   @returns TRUE if a completion was returned, FALSE if there is none.
+*/
+int llpoll_write(ll_async_t *async, ll_completion_t *completion);
+
+/*
+*   Takes the next packet received by the I/O thread, as llread_nowait
+*   would (receiver or full duplex).
+*
+*   @param *async I/O thread.
+*   @param *buffer Where the packet is copied (room for the payload agreed).
+*
+*   @returns length of the packet, -2 if none arrived yet and -1 if the
+*            connection failed.
+*/
+int llpoll_read(ll_async_t *async, unsigned char *buffer);
+
+/*
+*   Gets the eventfd that becomes readable when the I/O thread has a new
+*   completion or packet, or the connection failed. llasync_wait reads it.
+*
+*   @param *async I/O thread.
+*
+*   @returns the file descriptor.
+*/
+int llasync_fd(ll_async_t *async);
+
+/*
+*   Waits until the I/O thread has something new for llpoll_write or
+*   llpoll_read. It may return with nothing new, so they must be called
+*   again.
+*
+*   @param *async I/O thread.
+*   @param timeout Milliseconds to wait, -1 to wait forever.
+*
+*   @returns TRUE if the thread had something new, FALSE on timeout.
+*/
+int llasync_wait(ll_async_t *async, int timeout);
+
+/*
+*   Gets the payload size llpayload gave after the last packet sent.
+*
+*   @param *async I/O thread.
+*
+*   @returns payload size in bytes.
+*/
+int llasync_payload(ll_async_t *async);
+
+/*
+*   Waits for the I/O thread to send the packets submitted (not for their
+*   acknowledgments) and stops it. Completions and packets received that
+*   were not taken are dropped.
+*
+*   @param *async I/O thread, freed.
+*
+*   @returns the connection, to be used again or closed with llclose.
+*/
+ll_conn_t *llasync_stop(ll_async_t *async);
+
+#endif // ASYNC_H
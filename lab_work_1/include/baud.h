@@ -0,0 +1,55 @@
+#ifndef BAUD_H
+#define BAUD_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: baud.h
+*
+* Description:
+* Line rate of the serial port. Any rate the driver can make is accepted,
+* not only the Bxxx constants of <termios.h>, by setting it with termios2
+* and BOTHER. It is kept apart from the rest of the link layer because
+* <asm/termbits.h> cannot be included together with <termios.h>.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#define SAFE_BAUD_RATE 38400 // Rate every connection starts at (BAUDRATE)
+#define MIN_BAUD_RATE 50     // Slowest rate that can be negotiated
+#define BAUD_TOLERANCE 2     // Percentage a UART can be off and still be understood
+
+/*
+*   Sets the rate of a serial port, in both directions. Only the speed is
+*   changed, the other settings stay as they are.
+*
+*   @param fd Serial port.
+*   @param rate Rate in baud.
+*
+*   @returns rate the driver actually set, -1 on error.
+*/
+int baud_set(int fd, int rate);
+
+/*
+*   Gets the rate of a serial port.
+*
+*   @param fd Serial port.
+*
+*   @returns output rate in baud, -1 on error.
+*/
+int baud_get(int fd);
+
+/*
+*   Finds the highest rate up to a limit that the serial port can be set
+*   to within BAUD_TOLERANCE. The limit itself is tried first, then the
+*   standard rates below it. The port is left at the rate it had.
+*
+*   @param fd Serial port.
+*   @param limit Highest rate wanted, in baud.
+*
+*   @returns the rate, 0 if none above SAFE_BAUD_RATE works.
+*/
+int baud_highest(int fd, int limit);
+
+#endif // BAUD_H
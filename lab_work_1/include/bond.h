@@ -0,0 +1,212 @@
+#ifndef BOND_H
+#define BOND_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: bond.h
+*
+* Description:
+* Bonding of several serial ports between the same two machines. Each
+* packet goes through one of the links, chosen by how soon it would be
+* acknowledged there, and carries a packet number so the receiver can put
+* them back in order. A link that stops answering has its packets sent
+* again through the others, so the transfer goes on without it.
+* With a single port the packets are sent unchanged, as in llwrite/llread.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include "linklayer.h"
+
+#define MAX_LINKS 8
+#define BOND_HEADER_SIZE 4       // Packet number in front of each payload
+#define BOND_SUSPECT_RETRIES 3   // Timeouts in a row before a link's packets go through the others
+#define BOND_RATE_INTERVAL_MS 200 // Goodput is measured over intervals of this length
+#define BOND_OPEN_WAIT_MS 1000   // A receiver waits for the SET of a link this long at a time
+
+// State of one of the links of a bond.
+typedef struct {
+    int port;          // Serial port number
+    int up;            // FALSE if it could not be opened or failed
+    int suspect;       // TRUE while it is not acknowledging (TX)
+    long packets;      // Packets sent (TX) or received (RX) through it
+    long long bytes;   // Bytes of those packets
+    double goodput;    // Bytes acknowledged per second (TX), 0 until measured
+    int reorderPeak;   // Highest occupancy of its reorder buffer (Selective Repeat)
+} ll_bond_link_t;
+
+// A set of connections used together, returned by llbond_open.
+typedef struct ll_bond ll_bond_t;
+
+/*
+*   Reads a list of serial port numbers separated by commas ("1,2,3").
+*
+*   @param *list Text to be read.
+*   @param *ports Output array.
+*   @param max Size of the ports array.
+*
+*   @returns number of ports read, -1 if the list is invalid.
+*/
+int llbond_parse_ports(const char *list, int *ports, int max);
+
+/*
+*   Opens a connection on every port, all at the same time. Both ends must
+*   give their ports in the same order, so the n-th port of one end is
+*   wired to the n-th port of the other. Ports that cannot be opened are
+*   left out. With more than one port the receiver waits for the first link
+*   until params->rxTimeout (forever if it is not set), and then gives the
+*   others as long as the transmitter keeps sending the SET.
+*
+*   @param *ports Serial port numbers.
+*   @param count Number of ports (1 to MAX_LINKS).
+*   @param role Role of the connection (Transmitter|Receiver).
+*   @param *params Parameters requested on every link, as in llopen. Can be NULL.
+*   @param *error Pointer to where the reason of a failure will be stored,
+*                 as in llopen. Can be NULL.
+*
+*   @returns the bond if at least one link was opened, NULL otherwise.
+*/
+ll_bond_t *llbond_open(const int *ports, int count, int role, const ll_params_t *params, int *error);
+
+/*
+*   Gets the parameters agreed on the links. maxPayload is the largest
+*   packet llbond_write accepts, which leaves room for the packet number.
+*
+*   @param *bond Bond.
+*   @param *params Pointer to where the parameters will be stored.
+*/
+void llbond_getparams(ll_bond_t *bond, ll_params_t *params);
+
+/*
+*   Sends a packet through the link that should deliver it first. It only
+*   blocks while every link is busy.
+*
+*   @param *bond Bond.
+*   @param *buffer Packet to be sent.
+*   @param length Number of bytes in buffer (at most maxPayload of llbond_getparams).
+*
+*   @returns length if successful, -1 on error and -2 if every link failed.
+*/
+int llbond_write(ll_bond_t *bond, const unsigned char *buffer, int length);
+
+/*
+*   Same as llbond_write, but the packet is made of several segments, as in
+*   llwritev.
+*
+*   @param *bond Bond.
+*   @param *iov Segments of the packet, in order.
+*   @param iovcnt Number of segments.
+*
+*   @returns total length if successful, -1 on error and -2 if every link failed.
+*/
+int llbond_writev(ll_bond_t *bond, const struct iovec *iov, int iovcnt);
+
+/*
+*   Reads the next packet in the order they were sent.
+*
+*   @param *bond Bond.
+*   @param *buffer Pointer to the buffer where the packet will be stored,
+*                  with room for maxPayload bytes.
+*
+*   @returns length of the packet, -2 if the receive deadline passed and -1
+*            on other errors.
+*/
+int llbond_read(ll_bond_t *bond, unsigned char *buffer);
+
+/*
+*   Gets the state of every link of the bond.
+*
+*   @param *bond Bond.
+*   @param *links Array with room for MAX_LINKS entries.
+*
+*   @returns number of links.
+*/
+int llbond_links(ll_bond_t *bond, ll_bond_link_t *links);
+
+/*
+*   Gets the connection of a link, to use it directly (for example with
+*   llasync_start). The bond must not be used meanwhile.
+*
+*   @param *bond Bond.
+*   @param index Link (0 to the number of ports - 1).
+*
+*   @returns the connection, NULL if the link is down.
+*/
+ll_conn_t *llbond_conn(ll_bond_t *bond, int index);
+
+/*
+*   Gets the packet size that gives the best goodput on the links (see
+*   llpayload), for the worst of them.
+*
+*   @param *bond Bond.
+*   @param *ber Pointer to where the highest estimated bit error rate will
+*               be stored. Can be NULL.
+*
+*   @returns packet size, at most the maxPayload of llbond_getparams.
+*/
+int llbond_payload(ll_bond_t *bond, double *ber);
+
+/*
+*   Gets the compression counters of the bond, added over every link.
+*
+*   @param *bond Bond.
+*   @param *stats Pointer to where the counters will be stored.
+*/
+void llbond_compress_stats(ll_bond_t *bond, ll_compress_stats_t *stats);
+
+/*
+*   Gets the FEC counters of the bond, added over every link.
+*
+*   @param *bond Bond.
+*   @param *stats Pointer to where the counters will be stored.
+*/
+void llbond_fec_stats(ll_bond_t *bond, ll_fec_stats_t *stats);
+
+/*
+*   Gets the counters of the bond (see llstats), added over every link. The
+*   line rate is the sum of the rates of the links.
+*
+*   @param *bond Bond.
+*   @param *stats Pointer to where the counters will be stored.
+*/
+void llbond_stats(ll_bond_t *bond, ll_stats_t *stats);
+
+/*
+*   Writes the trace of every link that is up (see lltrace_dump). With more
+*   than one link each one goes to its own file, path followed by a dot and
+*   the port number.
+*
+*   @param *bond Bond.
+*   @param *path File to write.
+*
+*   @returns 0 if every trace was written, -1 otherwise.
+*/
+int llbond_trace_dump(ll_bond_t *bond, const char *path);
+
+/*
+*   Sets the file where the trace of each link is written when it fails
+*   (see lltrace_file), named as in llbond_trace_dump.
+*
+*   @param *bond Bond.
+*   @param *path File to write, NULL to stop writing it.
+*   @param always TRUE to also write it when the link is closed.
+*/
+void llbond_trace_file(ll_bond_t *bond, const char *path, int always);
+
+/*
+*   Waits until every packet is acknowledged and closes every link. The bond
+*   is freed even if it fails.
+*
+*   @param *bond Bond.
+*   @param *timing Pointer to where the duration of each phase will be
+*                  stored, added over the links that were closed. Can be NULL.
+*   @param *stats Pointer to where the final counters will be stored, added
+*                 over every link. Can be NULL.
+*
+*   @returns 0 if successful, -1 if a link could not be closed.
+*/
+int llbond_close(ll_bond_t *bond, ll_timing_t *timing, ll_stats_t *stats);
+
+#endif // BOND_H
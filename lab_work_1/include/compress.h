@@ -0,0 +1,82 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: compress.h
+*
+* Description:
+* Fast LZ77 compression of the data field of I-frames, in the style of
+* LZ4. Each end of the connection keeps the last LZ_HISTORY bytes it sent
+* or received, so a frame can refer to data of the frames before it. Both
+* histories stay the same as long as every frame goes through them once,
+* in order, which the link layer guarantees.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include <sys/uio.h>
+
+// Compression types that can be negotiated in llopen
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ 1
+
+#define LZ_HISTORY 65536 // How far back a match can be (16-bit offsets)
+
+// History and match finder of one direction of a connection.
+typedef struct lz_stream lz_stream_t;
+
+/*
+*   Creates an empty stream.
+*
+*   @param maxBlock Largest block that will be compressed or decompressed.
+*
+*   @returns the stream, NULL if there is not enough memory.
+*/
+lz_stream_t *lz_create(int maxBlock);
+
+/*
+*   Frees a stream.
+*
+*   @param *stream Stream, can be NULL.
+*/
+void lz_free(lz_stream_t *stream);
+
+/*
+*   Compresses a block made of several segments and adds it to the history.
+*
+*   @param *stream Stream.
+*   @param *iov Segments of the block, in order (at most maxBlock bytes).
+*   @param iovcnt Number of segments.
+*   @param *dst Output buffer.
+*   @param capacity Size of dst.
+*
+*   @returns length of the compressed block, -1 if it does not fit in
+*            capacity bytes. The block is added to the history either way.
+*/
+int lz_compress(lz_stream_t *stream, const struct iovec *iov, int iovcnt, unsigned char *dst, int capacity);
+
+/*
+*   Decompresses a block and adds the result to the history.
+*
+*   @param *stream Stream.
+*   @param *src Compressed block.
+*   @param length Length of src.
+*   @param *dst Output buffer with room for maxBlock bytes.
+*
+*   @returns length of the block, -1 if src is not a valid block.
+*/
+int lz_decompress(lz_stream_t *stream, const unsigned char *src, int length, unsigned char *dst);
+
+/*
+*   Adds a block that was sent without compression to the history.
+*
+*   @param *stream Stream.
+*   @param *src Block (at most maxBlock bytes).
+*   @param length Length of src.
+*/
+void lz_append(lz_stream_t *stream, const unsigned char *src, int length);
+
+#endif // COMPRESS_H
@@ -0,0 +1,114 @@
+#ifndef FCS_H
+#define FCS_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: fcs.h
+*
+* Description:
+* Frame check sequences for the data field of I-frames. The original XOR
+* BCC2 is kept for compatibility, CRC-16 (HDLC/X.25) and CRC-32C can be
+* negotiated in llopen. The CRCs use slicing-by-8 tables, and CRC-32C uses
+* the SSE4.2 crc32 instruction when the CPU has it.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include "stuffing.h"
+
+// Frame check types
+#define FCS_XOR 0     // 1 byte, XOR of the data (original BCC2)
+#define FCS_CRC16 1   // 2 bytes, CRC-16/X.25 as used by HDLC
+#define FCS_CRC32C 2  // 4 bytes, CRC-32C (Castagnoli)
+
+#define MAX_FCS_SIZE 4
+
+// CRC-32C implementations
+#define CRC32C_AUTO -1
+#define CRC32C_TABLE 0
+#define CRC32C_SSE42 1
+
+/*
+*   Gets the number of bytes of a frame check.
+*
+*   @param type Frame check type.
+*
+*   @returns size in bytes, 0 if the type is unknown.
+*/
+int fcs_size(int type);
+
+/*
+*   Gets the initial value of a frame check.
+*
+*   @param type Frame check type.
+*
+*   @returns value to pass to the first fcs_update().
+*/
+unsigned int fcs_init(int type);
+
+/*
+*   Adds a block of data to a frame check.
+*
+*   @param type Frame check type.
+*   @param fcs Value so far.
+*   @param *data Data to add.
+*   @param length Number of bytes in data.
+*
+*   @returns the updated value.
+*/
+unsigned int fcs_update(int type, unsigned int fcs, const unsigned char *data, int length);
+
+/*
+*   Writes the frame check as it is sent after the data (least significant
+*   byte first).
+*
+*   @param type Frame check type.
+*   @param fcs Value after the last fcs_update().
+*   @param *trailer Output with room for fcs_size(type) bytes.
+*/
+void fcs_final(int type, unsigned int fcs, unsigned char *trailer);
+
+/*
+*   Stuffs a block of data and adds it to a frame check in the same pass.
+*   The data is processed in blocks small enough to stay in the cache
+*   between the two steps.
+*
+*   @param type Frame check type.
+*   @param *dst Output buffer with room for 2*length bytes.
+*   @param *src Data to be stuffed.
+*   @param length Number of bytes in src.
+*   @param *fcs Value so far, updated with the data.
+*
+*   @returns number of bytes written to dst.
+*/
+int fcs_stuff(int type, unsigned char *dst, const unsigned char *src, int length, unsigned int *fcs);
+
+/*
+*   Codes a block of data with COBS and adds it to a frame check in the
+*   same pass, like fcs_stuff().
+*
+*   @param type Frame check type.
+*   @param *dst Output buffer, as for cobs_encode().
+*   @param *src Data to be coded.
+*   @param length Number of bytes in src.
+*   @param *state Encoder state.
+*   @param *fcs Value so far, updated with the data.
+*
+*   @returns number of bytes written to dst.
+*/
+int fcs_cobs(int type, unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+             unsigned int *fcs);
+
+/*
+*   Selects the CRC-32C implementation. By default the SSE4.2 instruction
+*   is used when the CPU has it.
+*
+*   @param impl Implementation (CRC32C_AUTO | CRC32C_TABLE | CRC32C_SSE42).
+*
+*   @returns the implementation selected, -1 if the CPU does not support it.
+*/
+int crc32c_select(int impl);
+
+#endif // FCS_H
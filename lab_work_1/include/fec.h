@@ -0,0 +1,114 @@
+#ifndef FEC_H
+#define FEC_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: fec.h
+*
+* Description:
+* Reed-Solomon forward error correction of the data field of I-frames,
+* over GF(256) with log/exp and multiplication tables. The data field
+* (with its frame check) is split in blocks of FEC_BLOCK - 2t bytes, and
+* the 2t parity bytes of every block go after the frame check. The
+* receiver corrects up to t wrong bytes per block before checking the
+* frame.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#define MAX_FEC 16    // Most byte errors that can be corrected per block
+#define FEC_BLOCK 255 // Longest Reed-Solomon code word over GF(256)
+
+// Generator polynomial and encoding tables for a number of errors.
+typedef struct fec_code fec_code_t;
+
+// Parity of a data field that is being encoded.
+typedef struct {
+    unsigned char remainder[2 * MAX_FEC]; // Parity of the current block so far
+    int count;                            // Bytes in the current block
+    unsigned char *parity;                // Where the parity of the block goes
+    unsigned char *start;
+} fec_state_t;
+
+/*
+*   Creates a code that corrects up to t byte errors per block.
+*
+*   @param t Errors per block (1 to MAX_FEC).
+*
+*   @returns the code, NULL if t is invalid or there is not enough memory.
+*/
+fec_code_t *fec_create(int t);
+
+/*
+*   Frees a code.
+*
+*   @param *code Code, can be NULL.
+*/
+void fec_free(fec_code_t *code);
+
+/*
+*   Gets the number of parity bytes of a data field.
+*
+*   @param *code Code.
+*   @param length Length of the data field, with the frame check.
+*
+*   @returns number of parity bytes.
+*/
+int fec_parity_length(const fec_code_t *code, int length);
+
+/*
+*   Gets the length of the data field from the length of the data field
+*   plus its parity, as received.
+*
+*   @param *code Code.
+*   @param length Length of the data field with the parity.
+*
+*   @returns length of the data field, -1 if no data field has that length.
+*/
+int fec_data_length(const fec_code_t *code, int length);
+
+/*
+*   Starts the parity of a data field.
+*
+*   @param *code Code.
+*   @param *state State to be initialized.
+*   @param *parity Output with room for fec_parity_length() bytes.
+*/
+void fec_init(const fec_code_t *code, fec_state_t *state, unsigned char *parity);
+
+/*
+*   Adds a block of data to the parity.
+*
+*   @param *code Code.
+*   @param *state State.
+*   @param *data Data to add.
+*   @param length Number of bytes in data.
+*/
+void fec_update(const fec_code_t *code, fec_state_t *state, const unsigned char *data, int length);
+
+/*
+*   Writes the parity of the last block.
+*
+*   @param *code Code.
+*   @param *state State.
+*
+*   @returns number of parity bytes written since fec_init().
+*/
+int fec_final(const fec_code_t *code, fec_state_t *state);
+
+/*
+*   Corrects a data field in place.
+*
+*   @param *code Code.
+*   @param *data Data field, with the frame check.
+*   @param length Length of data.
+*   @param *parity Parity that follows the data field.
+*
+*   @returns number of bytes corrected, -1 if a block has more errors than
+*            can be corrected.
+*/
+int fec_decode(const fec_code_t *code, unsigned char *data, int length, const unsigned char *parity);
+
+#endif // FEC_H
@@ -22,10 +22,25 @@
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
-#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include "stuffing.h"
+#include "fcs.h"
+#include "compress.h"
+#include "fec.h"
+#include "baud.h"
+#include "stats.h"
+#include "trace.h"
+#include "transport.h"
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
+// included by <termios.h>. Connections start at this rate (SAFE_BAUD_RATE)
+// and can switch to a faster one agreed in llopen.
 #define BAUDRATE B38400
 #define _POSIX_SOURCE 1 // POSIX compliant source.
 
@@ -37,71 +52,383 @@
 #define TX 1
 
 #define BUF_SIZE 5
-#define MAX_SIZE 255
-#define ALARM_TIMEOUT 5  // Alarm timeout in seconds.
-#define MAX_RETRIES 3
+#define MAX_SIZE 255         // Payload of an I-frame in the original protocol
+#define MAX_PAYLOAD 65536    // Largest payload that can be negotiated
+#define ACK_TIMEOUT_MS 50        // First retransmission timeout, on top of the time to send the frame
+#define RTO_MIN_MS 20            // Limits of the retransmission timeout measured from the round trip
+#define RTO_MAX_MS 2000          // (plus the time to send the largest frame)
+#define COMMAND_TIMEOUT_MS 5000  // Wait for the answer to SET and DISC
+#define MAX_RETRIES 3            // Retries of SET and DISC
+#define MAX_DATA_RETRIES 10      // Retries of an I-frame, doubling the timeout every time
+#define ACK_DELAY_MS 50          // Longest delay of a delayed acknowledgment, unless one is given
+#define MIN_PAYLOAD 32           // Smallest payload llpayload suggests
+#define BAUD_CONFIRM_MS 500      // Wait for the UA after switching to the agreed rate
+#define BAUD_SETTLE_MS 50        // Wait before switching, for ports that return from tcdrain early
 
 // Define the flag we are using for this protocol.
 #define FLAG 0x7E
 
+// ARQ modes that can be negotiated during llopen.
+#define ARQ_STOP_AND_WAIT 0
+#define ARQ_GO_BACK_N 1
+#define ARQ_SELECTIVE_REPEAT 2
+
+// Sliding window limits. Go-Back-N and Selective Repeat use 3-bit
+// (modulo 8) or 7-bit (modulo 128) sequence numbers. Selective Repeat
+// windows can only use half of the sequence numbers.
+#define MAX_MODULUS 128
+#define MAX_WINDOW (MAX_MODULUS - 1)
+
+// Entries filled by llpollfds
+#define LL_POLL_FDS 3
+
 // Error defines
 #define TIMEOUT_ERROR -2
 #define DEFAULT_ERROR -1
 
+// Link parameters requested by the transmitter and agreed during llopen.
+// rxTimeout is not negotiated, each end keeps its own. baudRate is the
+// highest rate the transmitter asks for and the receiver allows.
+typedef struct {
+    int arq;        // ARQ mode (ARQ_STOP_AND_WAIT | ARQ_GO_BACK_N | ARQ_SELECTIVE_REPEAT)
+    int seqBits;    // Sequence number size in bits (1, 3 or 7)
+    int window;     // Number of I-frames that can be sent without acknowledgment
+    int fcs;        // Frame check of I-frames (FCS_XOR | FCS_CRC16 | FCS_CRC32C)
+    int maxPayload; // Largest information field of an I-frame (1 to MAX_PAYLOAD)
+    int ackEvery;   // The receiver acknowledges every ackEvery I-frames (1 to window)...
+    int ackDelay;   // ...or ackDelay ms after the first one it did not acknowledge
+    int duplex;     // TRUE if both ends send I-frames, which carry the acknowledgments
+    int compress;   // Compression of the data field (COMPRESS_NONE | COMPRESS_LZ)
+    int fec;        // Byte errors corrected per block of the data field (0 to MAX_FEC, 0 for none)
+    int baudRate;   // Line rate after llopen, in baud (0 to stay at SAFE_BAUD_RATE)
+    int framing;    // Framing after llopen (FRAMING_HDLC | FRAMING_COBS)
+    int rxTimeout;  // How long llread and llopen (RX) wait for a frame in ms, 0 to wait forever
+} ll_params_t;
+
+// Duration of the phases of a connection, in microseconds.
+typedef struct {
+    long long openUs;  // llopen handshake (TX: SET sent to UA received, RX: SET received to UA sent)
+    long long flushUs; // llclose, until the last I-frame is acknowledged (TX, or both in full duplex)
+    long long closeUs; // llclose DISC/DISC/UA exchange
+} ll_timing_t;
+
+// Compression counters of a connection, in bytes of the data field.
+typedef struct {
+    long long rawBytes;       // Given to llwrite
+    long long sentBytes;      // Sent in I-frames (each sent once, retransmissions not counted)
+    long long compressUs;     // Time spent compressing, in microseconds
+    long long receivedBytes;  // Received in I-frames that were delivered
+    long long deliveredBytes; // Given back by llread
+    long long decompressUs;   // Time spent decompressing, in microseconds
+} ll_compress_stats_t;
+
+// Forward error correction counters of the I-frames received.
+typedef struct {
+    long framesCorrected; // I-frames with errors that were all corrected
+    long bytesCorrected;  // Bytes corrected in them
+    long framesFailed;    // I-frames with more errors than could be corrected
+} ll_fec_stats_t;
+
+// A connection through one serial port, returned by llopen. It owns the
+// port settings, sequence numbers, timers and buffers of the link, so
+// several connections can be used at the same time.
+typedef struct ll_conn ll_conn_t;
+
+
+/*
+*   Fills the parameters with the defaults (stop-and-wait, as in the
+*   original protocol).
+*
+*   @param *params Pointer to the parameters to be filled.
+*/
+void llparams_default(ll_params_t *params);
+
+/*
+*   Checks the parameters the transmitter will request in llopen.
+*
+*   @param *params Requested parameters. The sequence number size is chosen
+*                  from the window when seqBits is 0.
+*
+*   @returns 0 if successful, -1 if the parameters are invalid.
+*/
+int llcheckparams(ll_params_t *params);
+
+/*
+*   Gets the parameters agreed with the other end during llopen.
+*   The buffers given to llwrite and llread must hold maxPayload bytes.
+*
+*   @param *conn Connection.
+*   @param *params Pointer to where the parameters will be stored.
+*/
+void llgetparams(ll_conn_t *conn, ll_params_t *params);
+
+/*
+*   Sets how long llread waits for a frame (rxTimeout of ll_params_t).
+*
+*   @param *conn Connection.
+*   @param rxTimeout Milliseconds, 0 to wait forever.
+*/
+void llsettimeout(ll_conn_t *conn, int rxTimeout);
+
+/*
+*   Gets the occupancy of the receiver reorder buffer. With Selective Repeat
+*   the receiver keeps I-frames that arrive out of order until the missing
+*   ones are retransmitted.
+*
+*   @param *conn Connection.
+*   @param *peak Pointer to where the highest occupancy since llopen will be
+*                stored. Can be NULL.
+*
+*   @returns number of I-frames currently waiting in the reorder buffer.
+*/
+int llreorder_occupancy(ll_conn_t *conn, int *peak);
+
+/*
+*   Gets how much compression saved and what it cost, in both directions.
+*
+*   @param *conn Connection.
+*   @param *stats Pointer to where the counters will be stored.
+*/
+void llcompress_stats(ll_conn_t *conn, ll_compress_stats_t *stats);
+
+/*
+*   Gets how many received I-frames the forward error correction fixed.
+*
+*   @param *conn Connection.
+*   @param *stats Pointer to where the counters will be stored.
+*/
+void llfec_stats(ll_conn_t *conn, ll_fec_stats_t *stats);
+
+/*
+*   Gets the counters of the connection: frames and bytes sent and received,
+*   retransmissions by cause, errors, goodput and the latency of the
+*   acknowledgments (see stats.h).
+*
+*   @param *conn Connection.
+*   @param *stats Pointer to where the counters will be stored.
+*/
+void llstats(ll_conn_t *conn, ll_stats_t *stats);
+
+/*
+*   Writes the trace of the connection to a file: the last TRACE_RECORDS
+*   frames sent and received since llopen, with their time (see trace.h).
+*
+*   @param *conn Connection.
+*   @param *path File to write.
+*
+*   @returns number of records written, -1 if the file could not be written.
+*/
+int lltrace_dump(ll_conn_t *conn, const char *path);
+
+/*
+*   Sets a file where the trace is written when llwrite, llread or llclose
+*   fail, or when the connection is aborted.
+*
+*   @param *conn Connection.
+*   @param *path File to write, NULL to stop writing it.
+*   @param always TRUE to also write it when llclose succeeds.
+*/
+void lltrace_file(ll_conn_t *conn, const char *path, int always);
 
-// Alarm function handler
-void alarmHandler(int signal);
+/*
+*   Gets the payload size that gives the best goodput for the error rate
+*   seen so far: large I-frames on clean lines, where headers and
+*   acknowledgments are the main cost, and small ones on noisy lines, where
+*   large frames fail more often and cost more to send again. The error rate
+*   is estimated from the REJ, SREJ and timeouts of the recent I-frames,
+*   starting from the rate for which MAX_SIZE is the best payload.
+*
+*   @param *conn Connection.
+*   @param *ber Pointer to where the estimated bit error rate will be stored.
+*               Can be NULL.
+*
+*   @returns payload size, from MIN_PAYLOAD to the maxPayload agreed in llopen.
+*/
+int llpayload(ll_conn_t *conn, double *ber);
 
 /*
 *   Establishes a connection between the transmitter and the receiver.
 *
-*   @param fd File descriptor of the serial port.
+*   @param portNumber Serial port number (/dev/ttyS<portNumber>).
 *   @param role Role of the connection (Transmitter|Receiver).
+*   @param *params Parameters requested by the transmitter (see llcheckparams).
+*                  The receiver accepts whatever the transmitter requests and
+*                  only uses rxTimeout, and baudRate as the highest rate it
+*                  allows (0 for no limit). NULL for the defaults.
+*                  Both ends start at SAFE_BAUD_RATE and switch together to
+*                  the highest rate up to baudRate that both serial ports can
+*                  make. If they cannot hear each other there, they go back
+*                  to SAFE_BAUD_RATE. COBS framing is switched to in the
+*                  same way, and dropped along with the rate.
+*   @param *error Pointer to where the reason of a failure will be stored:
+*                 -1 if the connection could not be established and -2 on
+*                 time out. Can be NULL.
 *
-*   @returns 0 if successful, -1 if the connection could not be established.
+*   @returns the connection if successful, NULL otherwise.
 */
-int llopen(int fd, int role);
+ll_conn_t *llopen(int portNumber, int role, const ll_params_t *params, int *error);
+
+/*
+*   Establishes a connection, as llopen does, through another transport:
+*   a pseudo-terminal, pipe or socket pair, descriptors the application
+*   already has, or a channel in memory (see transport.h). Transports
+*   without a line rate never switch rates and do not wait for frames to
+*   be sent, so the protocol runs as fast as the CPU allows.
+*
+*   @param *transport Transport, owned by the connection from then on and
+*                     closed by llclose (or here if the connection fails).
+*   @param role Role of the connection (Transmitter|Receiver).
+*   @param *params Parameters, as in llopen.
+*   @param *error Pointer to where the reason of a failure will be stored,
+*                 as in llopen. Can be NULL.
+*
+*   @returns the connection if successful, NULL otherwise.
+*/
+ll_conn_t *llopen_transport(ll_transport_t *transport, int role, const ll_params_t *params, int *error);
 
 /*
 *   Sends data to the receiver.
+*   In stop-and-wait mode it returns once the frame is acknowledged. With
+*   Go-Back-N and Selective Repeat it only blocks while the window is full,
+*   so several frames can be in flight at the same time.
+*   In full duplex either end can call it, and I-frames that arrive in the
+*   meantime are kept (up to one per sequence number) for llread.
 *   
-*   @param fd File descriptor of the serial port.
+*   @param *conn Connection.
 *   @param *buffer Pointer to the buffer containing the data to be sent.
+*   @param length Number of bytes to send (at most the maxPayload agreed in llopen).
+*
+*   @returns number of bytes written, -1 on error and -2 if retries were exceeded.
+*/
+int llwrite(ll_conn_t *conn, unsigned char *buffer, int length);
+
+/*
+*   Same as llwrite, but the data is made of several segments (for example
+*   a packet header and the data that follows it), which are stuffed into
+*   the I-frame one after the other without being copied together first.
+*
+*   @param *conn Connection.
+*   @param *iov Segments to be sent, in order.
+*   @param iovcnt Number of segments (their total length is at most maxPayload).
+*
+*   @returns number of bytes written, -1 on error and -2 if retries were exceeded.
+*/
+int llwritev(ll_conn_t *conn, const struct iovec *iov, int iovcnt);
+
+/*
+*   Handles the acknowledgments and retransmission timeouts that are due,
+*   without blocking. Together with llpollfds and llread_nowait it lets a
+*   single poll() loop drive several connections.
+*
+*   @param *conn Connection.
+*
+*   @returns number of I-frames llwrite can send without waiting for the
+*            window, -1 on error and -2 if retries were exceeded.
+*/
+int llwritable(ll_conn_t *conn);
+
+/*
+*   Gets how many times the retransmission timer went off since the other
+*   end last acknowledged something.
+*
+*   @param *conn Connection.
 *
-*   @returns 0 if successful, -1 if the file could not be sent.
+*   @returns number of consecutive timeouts.
 */
-int llwrite(int fd, unsigned char *buffer, int length);
+int llretries(ll_conn_t *conn);
+
+/*
+*   Gets the role of the connection.
+*
+*   @param *conn Connection.
+*
+*   @returns TX or RX.
+*/
+int llrole(ll_conn_t *conn);
+
+/*
+*   Gets the file descriptors to wait on (POLLIN) before calling llwritable
+*   or llread_nowait: the serial port, the retransmission timer and the
+*   timer of delayed acknowledgments.
+*
+*   @param *conn Connection.
+*   @param *fds Array with room for LL_POLL_FDS entries.
+*
+*   @returns number of entries filled.
+*/
+int llpollfds(ll_conn_t *conn, struct pollfd *fds);
 
 /*
 *   Reads data from the receiver.
+*   In full duplex either end can call it, and it also handles the
+*   acknowledgments and retransmissions of the frames sent with llwrite.
 *
-*   @param fd File descriptor of the serial port.
+*   @param *conn Connection.
+*   @param *buffer Pointer to the buffer where the data will be stored, with
+*                  room for the maxPayload agreed in llopen.
+*
+*   @returns array length of received data, -2 if the receive deadline passed
+*            and -1 on other errors.
+*/
+int llread(ll_conn_t *conn, unsigned char *buffer);
+
+/*
+*   Same as llread, but only handles the bytes that already arrived.
+*
+*   @param *conn Connection.
 *   @param *buffer Pointer to the buffer where the data will be stored.
 *
-*   @returns array length of received data, negative if an error occurred.
+*   @returns array length of received data, -2 if no I-frame is complete yet
+*            and -1 on other errors.
+*/
+int llread_nowait(ll_conn_t *conn, unsigned char *buffer);
+
+/*
+*   Tells if the transmitter already asked to disconnect (DISC), in which
+*   case llclose answers it right away.
+*
+*   @param *conn Connection.
+*
+*   @returns TRUE if the DISC arrived, FALSE otherwise.
 */
-int llread(int fd, unsigned char *buffer);
+int llpeer_closed(ll_conn_t *conn);
 
 /*
 *   Closes the connection between the transmitter and the receiver.
+*   The transmitter waits for every outstanding I-frame to be acknowledged
+*   before disconnecting. The connection is freed even if it fails.
 *   
-*   @param fd File descriptor of the serial port.
+*   @param *conn Connection.
+*   @param *timing Pointer to where the duration of each phase of the
+*                  connection will be stored. Can be NULL.
+*   @param *stats Pointer to where the final counters (see llstats) will be
+*                 stored. Can be NULL.
 *
 *   @returns 0 if successful, -1 if the connection could not be closed.
 */
-int llclose(int fd, int role);
+int llclose(ll_conn_t *conn, ll_timing_t *timing, ll_stats_t *stats);
+
+/*
+*   Restores the serial port and frees the connection without telling the
+*   other end, for links that stopped answering.
+*
+*   @param *conn Connection.
+*
+*   @returns 0 if successful, -1 if the port settings could not be restored.
+*/
+int llabort(ll_conn_t *conn);
 
 // Data link layer functions
 
 /*
 *   Reads incomming bytes until a valid command is received.
 *
-*   @param fd File descriptor of the serial port.
+*   @param *conn Connection.
 *   @param *CMD - Pointer to the command to be read.
 *   @param *RPT - Pointer to the command to be repeated.
 *
-*   @returns 0 if successful, -1 if *CMD or *RPT is NULL and -2 if alarm timeout is reached.
+*   @returns 0 if successful, -1 if *CMD or *RPT is NULL and -2 if the retries time out.
 */
-int read_command(int fd, unsigned char *CMD, unsigned char *RPT);
+int read_command(ll_conn_t *conn, const unsigned char *CMD, const unsigned char *RPT);
 
 #endif // LINKLAYER_H
\ No newline at end of file
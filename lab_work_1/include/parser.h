@@ -0,0 +1,153 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: parser.h
+*
+* Description:
+* Frame parser shared by every receive path of the link layer. It takes
+* the bytes read from the serial port, in spans of any size, and returns
+* the frames in them destuffed and classified as I, RR, REJ, SREJ, SET,
+* UA or DISC with their sequence numbers. The scanner is a small state
+* machine driven by a transition table, and the control byte is decoded
+* with a table of its 256 values built for the parameters agreed in
+* llopen, so the loop that runs for every frame has almost no branches.
+* Frames are delimited by flags and byte stuffed, or delimited by zero
+* bytes and coded with COBS, as agreed in llopen.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+// Address and control field values
+#define A_FIELD 0x03
+#define C_SET 0x03
+#define C_UA 0x07
+#define C_DISC 0x0B
+#define C_RR 0x05
+#define C_REJ 0x01
+#define C_SREJ 0x09
+#define C_COMPRESSED 0x10 // P/F bit of HDLC, set in I-frames with a compressed data field
+
+// Types of frames recognised by the parser.
+enum FRAME_TYPE {
+    FRAME_INVALID,
+    FRAME_I,
+    FRAME_RR,
+    FRAME_REJ,
+    FRAME_SREJ,
+    FRAME_SET,
+    FRAME_UA,
+    FRAME_DISC
+};
+
+// Results of parser_scan()
+#define PARSE_MORE 0   // Every byte was used, the frame is not complete yet
+#define PARSE_FRAME 1  // A frame with a valid header is complete
+#define PARSE_ERROR 2  // A frame was dropped: damaged header or too long
+
+// What the control byte tells about a frame
+typedef struct {
+    unsigned char type;       // FRAME_*
+    unsigned char length;     // Control bytes: C, [C2], [C3]
+    unsigned char ns;         // N(S) when it is in C
+    unsigned char nr;         // N(R) when it is in C
+    unsigned char nsByte;     // Byte of the header with N(S) << 1 (C2), 0 if it is in C
+    unsigned char nrByte;     // Byte of the header with N(R) << 1 (C2 or C3), 0 if it is in C
+    unsigned char compressed; // TRUE if the data field is compressed
+} control_info_t;
+
+// A frame returned by the parser. It points into the parser buffer and is
+// valid until the next call.
+typedef struct {
+    int type;             // FRAME_*
+    unsigned char C;
+    int ns;               // Send sequence number (I-frames)
+    int nr;               // Receive sequence number (RR, REJ, SREJ and full duplex I-frames)
+    int compressed;       // TRUE if the data field is compressed
+    unsigned char *field; // Information field, destuffed, with its frame check
+    int fieldLength;
+    unsigned char bcc;    // XOR of the information field, 0 if BCC2 matches
+    int length;           // Bytes between the flags (or zero bytes), after destuffing
+} parsed_frame_t;
+
+typedef struct {
+    control_info_t control[256]; // Indexed by the control byte
+    int framing;                 // FRAMING_HDLC or FRAMING_COBS
+    int state;
+    unsigned char *frame; // Frame being collected, without flags
+    int frameSize;
+    int length;
+} frame_parser_t;
+
+/*
+*   Sets up a parser for the parameters agreed in llopen and starts looking
+*   for a flag. Called again when they change. The framing starts as
+*   FRAMING_HDLC.
+*
+*   @param *parser Parser.
+*   @param *buffer Where frames are collected. It must hold the largest
+*                  frame, stuffed.
+*   @param size Size of buffer.
+*   @param seqBits Bits of the sequence numbers (1, 3 or 7).
+*   @param duplex TRUE if I-frames carry N(R).
+*   @param compress TRUE if the P/F bit of I-frames marks compressed data.
+*/
+void parser_init(frame_parser_t *parser, unsigned char *buffer, int size, int seqBits, int duplex, int compress);
+
+/*
+*   Changes the framing of the frames received. The frame being collected
+*   is dropped.
+*
+*   @param *parser Parser.
+*   @param framing FRAMING_HDLC or FRAMING_COBS.
+*/
+void parser_set_framing(frame_parser_t *parser, int framing);
+
+/*
+*   Drops the frame being collected and looks for a flag again.
+*
+*   @param *parser Parser.
+*/
+void parser_reset(frame_parser_t *parser);
+
+/*
+*   Scans a span of received bytes up to the end of the next frame.
+*
+*   @param *parser Parser.
+*   @param *data Bytes received.
+*   @param length Number of bytes in data.
+*   @param *frame Filled with the frame for PARSE_FRAME. For PARSE_ERROR
+*                 only C and length are set, for the trace.
+*   @param *used Set to the number of bytes of data used. The rest are
+*                given again in the next call.
+*
+*   @returns PARSE_MORE, PARSE_FRAME or PARSE_ERROR.
+*/
+int parser_scan(frame_parser_t *parser, const unsigned char *data, int length, parsed_frame_t *frame, int *used);
+
+/*
+*   Classifies a frame from its header.
+*
+*   @param *parser Parser.
+*   @param *header A, C, C2 and C3 destuffed (the ones the frame does not
+*                  have can hold anything).
+*   @param *frame Filled with the type, control byte and sequence numbers.
+*
+*   @returns the length of the header with BCC1.
+*/
+int parser_classify(const frame_parser_t *parser, const unsigned char *header, parsed_frame_t *frame);
+
+/*
+*   Gets the number of control bytes of frames with a control byte.
+*
+*   @param *parser Parser.
+*   @param C Control byte.
+*
+*   @returns 1, 2 or 3.
+*/
+int parser_control_length(const frame_parser_t *parser, unsigned char C);
+
+#endif // PARSER_H
@@ -0,0 +1,144 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: stats.h
+*
+* Description:
+* Counters of what a connection sent and received, and a histogram of the
+* time from sending an I-frame to its acknowledgment. The histogram keeps
+* HISTOGRAM_SUB_BITS significant bits of every value, in the style of HDR
+* histograms: a few hundred buckets cover microseconds to an hour with
+* the same relative precision.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include <stdio.h>
+
+#define HISTOGRAM_SUB_BITS 4 // Buckets per power of 2 are 2^HISTOGRAM_SUB_BITS (6.25% wide)
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) // Up to 2^32 - 1
+
+// Log-linear histogram of values from 0 to 2^32 - 1.
+typedef struct {
+    long count;
+    long long min;
+    long long max;
+    long long sum;
+    long buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+// Counters of a connection since llopen. Frames and bytes are counted as
+// they go through the serial port.
+typedef struct {
+    // Sent
+    long framesSent;          // Every frame written to the port, retransmissions included
+    long long bytesSent;      // Bytes written to the port
+    long iFramesSent;         // I-frames sent for the first time
+    long long payloadBytes;   // Data fields of those I-frames
+    long long stuffingBytes;  // Escape bytes byte stuffing added to them
+    long retransmissions;     // I-frames sent again...
+    long retransmitTimeout;   // ...after a timeout
+    long retransmitRej;       // ...after a REJ
+    long retransmitSrej;      // ...after a SREJ
+    long long retransmitBytes; // Bytes of the I-frames sent again
+    long timeouts;            // Times the retransmission timer went off
+
+    // Received
+    long framesReceived;      // Frames with a valid header
+    long long bytesReceived;  // Bytes read from the port
+    long headerErrors;        // Frames dropped because the header was damaged or they were too long
+    long dataErrors;          // I-frames dropped because the frame check failed
+    long duplicates;          // I-frames received again
+    long rrSent;
+    long rejSent;
+    long srejSent;
+
+    // Application data
+    long long writtenBytes;   // Given to llwrite
+    long long deliveredBytes; // Given back by llread
+    long long elapsedUs;      // Since the connection was established
+    long long lineRate;       // Rate of the port in baud (added over the links of a bond)
+
+    // Time from sending an I-frame to its acknowledgment, in microseconds.
+    // Retransmitted frames are left out, as in the round trip estimate.
+    histogram_t latency;
+} ll_stats_t;
+
+/*
+*   Adds a value to a histogram.
+*
+*   @param *histogram Histogram.
+*   @param value Value, from 0 (larger ones go to the last bucket).
+*/
+void histogram_add(histogram_t *histogram, long long value);
+
+/*
+*   Gets the smallest value that goes to a bucket.
+*
+*   @param index Bucket (0 to HISTOGRAM_BUCKETS - 1).
+*
+*   @returns the value.
+*/
+long long histogram_bucket_value(int index);
+
+/*
+*   Gets a percentile of the values in a histogram.
+*
+*   @param *histogram Histogram.
+*   @param percent Percentile (0 to 100).
+*
+*   @returns the highest value of the bucket where the percentile falls
+*            (within the maximum), 0 if the histogram is empty.
+*/
+long long histogram_percentile(const histogram_t *histogram, double percent);
+
+/*
+*   Adds the counters of a connection to a total, as for the links of a
+*   bond. The elapsed time is the longest one.
+*
+*   @param *total Total.
+*   @param *stats Counters to add.
+*/
+void llstats_add(ll_stats_t *total, const ll_stats_t *stats);
+
+/*
+*   Gets the application bytes written and delivered per second.
+*
+*   @param *stats Counters.
+*
+*   @returns goodput in bytes per second.
+*/
+double llstats_goodput(const ll_stats_t *stats);
+
+/*
+*   Gets the goodput as a fraction of what the line can carry (10 bits per
+*   byte at lineRate).
+*
+*   @param *stats Counters.
+*
+*   @returns efficiency, from 0 to 1.
+*/
+double llstats_efficiency(const ll_stats_t *stats);
+
+/*
+*   Prints a summary of the counters, a few lines of text.
+*
+*   @param *stats Counters.
+*   @param *file Where to print.
+*/
+void llstats_print(const ll_stats_t *stats, FILE *file);
+
+/*
+*   Writes the counters as a JSON object, with the non-empty buckets of the
+*   latency histogram and its percentiles.
+*
+*   @param *stats Counters.
+*   @param *file Where to write.
+*/
+void llstats_json(const ll_stats_t *stats, FILE *file);
+
+#endif // STATS_H
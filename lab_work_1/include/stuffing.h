@@ -0,0 +1,136 @@
+#ifndef STUFFING_H
+#define STUFFING_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: stuffing.h
+*
+* Description:
+* Byte stuffing kernels used by the link layer. 0x7E and 0x7D in the data
+* field are sent as 0x7D followed by the byte XORed with 0x20, and the BCC
+* (XOR of the data) is computed in the same pass. Frames can instead be
+* coded with COBS (Consistent Overhead Byte Stuffing), which removes every
+* zero byte so a zero can delimit them, and adds at most one byte per 254
+* whatever the data is. There are SSE2 and AVX2 versions, chosen at
+* runtime from what the CPU supports, and a portable version for every
+* other CPU.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+// Kernel implementations
+#define STUFFING_AUTO -1
+#define STUFFING_SCALAR 0
+#define STUFFING_SSE2 1
+#define STUFFING_AVX2 2
+
+// Framing of the frames after llopen
+#define FRAMING_HDLC 0 // Between flags, with byte stuffing
+#define FRAMING_COBS 1 // Between zero bytes, coded with COBS
+
+#define COBS_DELIMITER 0x00
+#define COBS_MAX_RUN 254 // Bytes of a COBS group, after its code byte
+
+// State of a COBS encoder between blocks
+typedef struct {
+    int run; // Bytes written after the code byte of the group being filled
+} cobs_state_t;
+
+/*
+*   Selects the implementation used by stuff_data(), destuff_data(),
+*   cobs_encode() and cobs_decode().
+*   By default the fastest one the CPU supports is chosen on the first call.
+*
+*   @param impl Implementation (STUFFING_AUTO | STUFFING_SCALAR | STUFFING_SSE2 | STUFFING_AVX2).
+*
+*   @returns the implementation selected, -1 if the CPU does not support it.
+*/
+int stuffing_select(int impl);
+
+/*
+*   Gets the name of an implementation.
+*
+*   @param impl Implementation.
+*
+*   @returns the name ("scalar", "sse2" or "avx2").
+*/
+const char *stuffing_name(int impl);
+
+/*
+*   Stuffs a block of data and updates its BCC.
+*
+*   @param *dst Output buffer. It must have room for 2*length bytes, even if
+*               the result is shorter.
+*   @param *src Data to be stuffed.
+*   @param length Number of bytes in src.
+*   @param *bcc BCC so far, XORed with every byte of src. Blocks can be
+*               stuffed one after the other with the same BCC.
+*
+*   @returns number of bytes written to dst.
+*/
+int stuff_data(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc);
+
+/*
+*   Destuffs a block of data and updates its BCC.
+*
+*   @param *dst Output buffer with room for length bytes. It can be the same
+*               as src (destuffing in place).
+*   @param *src Stuffed data, without flags.
+*   @param length Number of bytes in src.
+*   @param *bcc BCC so far, XORed with every destuffed byte.
+*
+*   @returns number of bytes written to dst, -1 if the data ends with 0x7D.
+*/
+int destuff_data(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc);
+
+/*
+*   Starts a block coded with COBS by leaving room for its first code byte.
+*
+*   @param *dst Output buffer.
+*   @param *state Encoder state.
+*
+*   @returns number of bytes written to dst (1).
+*/
+int cobs_init(unsigned char *dst, cobs_state_t *state);
+
+/*
+*   Codes data with COBS and updates its BCC. Blocks can be coded one after
+*   the other with the same state.
+*
+*   @param *dst Output buffer, right after the previous block. It must have
+*               room for length + length / COBS_MAX_RUN + 1 bytes.
+*   @param *src Data to be coded.
+*   @param length Number of bytes in src.
+*   @param *state Encoder state.
+*   @param *bcc BCC so far, XORed with every byte of src.
+*
+*   @returns number of bytes written to dst.
+*/
+int cobs_encode(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state, unsigned char *bcc);
+
+/*
+*   Ends a block coded with COBS by writing the code byte of its last group.
+*
+*   @param *dst Output buffer, right after the last byte coded.
+*   @param *state Encoder state.
+*/
+void cobs_final(unsigned char *dst, cobs_state_t *state);
+
+/*
+*   Decodes data coded with COBS and updates its BCC. Blocks coded one after
+*   the other are decoded as one, with a zero byte between them.
+*
+*   @param *dst Output buffer with room for length bytes. It can be the same
+*               as src (decoding in place).
+*   @param *src Coded data, without delimiters.
+*   @param length Number of bytes in src.
+*   @param *bcc BCC so far, XORed with every decoded byte.
+*
+*   @returns number of bytes written to dst, -1 if a code byte points past
+*            the end of the data.
+*/
+int cobs_decode(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc);
+
+#endif // STUFFING_H
@@ -0,0 +1,182 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: trace.h
+*
+* Description:
+* Trace of the frames of a connection. Every frame sent or received (and
+* every timeout) is kept as a 16-byte record in a ring in memory, so the
+* last TRACE_RECORDS of them can be written to a file when something goes
+* wrong. Adding a record takes a few nanoseconds: the time is the raw CPU
+* time stamp counter, which is only converted to nanoseconds when the
+* trace is read. The ring has a single writer (the thread that uses the
+* connection) and can be dumped from any thread without locks.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TRACE_RECORDS 4096 // Records kept per connection. Must be a power of 2.
+#define TRACE_MAGIC 0x52544C4C // "LLTR" at the start of a trace file
+#define TRACE_VERSION 1
+
+// What happened to a frame, in the low 4 bits of event
+enum TRACE_EVENT {
+    TRACE_SENT,         // Sent for the first time
+    TRACE_RESENT,       // I-frame sent again
+    TRACE_RECEIVED,     // Received with a valid header and frame check
+    TRACE_FCS_ERROR,    // Received, but the data field failed the frame check
+    TRACE_HEADER_ERROR, // Dropped, the header was damaged (no type or numbers)
+    TRACE_DUPLICATE,    // I-frame received again, dropped
+    TRACE_TIMEOUT       // Retransmission timer went off (ns = oldest frame)
+};
+
+// Type of the frame, in the high 4 bits of event
+enum TRACE_FRAME {
+    TRACE_FRAME_NONE,
+    TRACE_FRAME_I,
+    TRACE_FRAME_RR,
+    TRACE_FRAME_REJ,
+    TRACE_FRAME_SREJ,
+    TRACE_FRAME_SET,
+    TRACE_FRAME_UA,
+    TRACE_FRAME_DISC
+};
+
+// Value of the event field of a record
+#define TRACE_CODE(event, frame) ((event) | (frame) << 4)
+
+// One event. The fields that do not apply are 0.
+typedef struct {
+    uint64_t time;   // Time stamp counter (see trace_clock)
+    uint32_t length; // Bytes of the frame: as sent (stuffed), or as received after destuffing
+    uint8_t event;   // TRACE_CODE(TRACE_EVENT, TRACE_FRAME)
+    uint8_t control; // Control byte C
+    uint8_t ns;      // N(S) of I-frames
+    uint8_t nr;      // N(R) of RR/REJ/SREJ, and of I-frames in full duplex
+} trace_record_t;
+
+// Ring of the last TRACE_RECORDS records. head counts every record ever
+// added; record i is at i % TRACE_RECORDS until it is overwritten.
+typedef struct {
+    trace_record_t records[TRACE_RECORDS];
+    uint64_t head;
+    uint64_t startTicks; // Time stamp counter and CLOCK_MONOTONIC (ns) when
+    int64_t startNs;     // the ring was created, to convert the time stamps
+} trace_ring_t;
+
+// Header of a trace file, followed by count records, oldest first.
+typedef struct {
+    uint32_t magic;   // TRACE_MAGIC
+    uint16_t version; // TRACE_VERSION
+    uint8_t role;     // TX or RX
+    uint8_t seqBits;  // Sequence numbers agreed in llopen
+    uint8_t arq;
+    uint8_t window;
+    uint16_t port;
+    uint32_t count;   // Records in the file
+    uint32_t lost;    // Records overwritten before the dump
+    uint8_t duplex;   // I-frames also carry N(R)
+    uint8_t unused[3];
+    // Two readings of the time stamp counter and CLOCK_MONOTONIC (ns),
+    // when the ring was created and when it was dumped
+    uint64_t startTicks;
+    int64_t startNs;
+    uint64_t endTicks;
+    int64_t endNs;
+} trace_header_t;
+
+// Reads the time stamp counter, or CLOCK_MONOTONIC in ns on CPUs without one.
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+*   Starts an empty ring.
+*
+*   @param *ring Ring.
+*/
+void trace_init(trace_ring_t *ring);
+
+/*
+*   Adds a record to the ring, overwriting the oldest one when it is full.
+*   Only one thread may add records to a ring.
+*
+*   @param *ring Ring.
+*   @param event TRACE_CODE(TRACE_EVENT, TRACE_FRAME).
+*   @param control Control byte.
+*   @param ns N(S).
+*   @param nr N(R).
+*   @param length Bytes of the frame.
+*/
+static inline void trace_add(trace_ring_t *ring, int event, int control, int ns, int nr, int length)
+{
+    uint64_t head = ring->head;
+    trace_record_t *record = &ring->records[head & (TRACE_RECORDS - 1)];
+
+    record->time = trace_clock();
+    record->length = length;
+    record->event = event;
+    record->control = control;
+    record->ns = ns;
+    record->nr = nr;
+
+    // The record must be complete before a reader sees the new head
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+*   Writes the records in the ring to a file, oldest first. Records that
+*   the writer may overwrite while they are copied are left out, so a full
+*   ring gives TRACE_RECORDS - 1 of them.
+*
+*   @param *ring Ring.
+*   @param *header Header of the file, with role, seqBits, arq, window,
+*                  duplex and port filled in. The rest is filled by this
+*                  function.
+*   @param *path File to write.
+*
+*   @returns number of records written, -1 if the file could not be written.
+*/
+int trace_dump(const trace_ring_t *ring, trace_header_t *header, const char *path);
+
+/*
+*   Reads a trace file.
+*
+*   @param *path File to read.
+*   @param *header Pointer to where the header will be stored.
+*   @param **records Pointer to where the records will be stored, allocated
+*                    with malloc.
+*
+*   @returns number of records, -1 if the file is not a valid trace.
+*/
+int trace_load(const char *path, trace_header_t *header, trace_record_t **records);
+
+/*
+*   Converts a time stamp of a trace to nanoseconds of CLOCK_MONOTONIC.
+*
+*   @param *header Header of the trace.
+*   @param ticks Time stamp.
+*
+*   @returns time in nanoseconds.
+*/
+int64_t trace_time_ns(const trace_header_t *header, uint64_t ticks);
+
+#endif // TRACE_H
@@ -0,0 +1,145 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+/*------------------------------------------------------------------------
+* RC 24/25 L.EEC
+* File: transport.h
+*
+* Description:
+* Byte channels a connection can run on. The link layer only reads, writes
+* and waits on a transport, so the same protocol runs on a serial port, a
+* pseudo-terminal pair, a pipe or socket pair, file descriptors owned by
+* the application, or a channel in memory between two threads of one
+* process, which can damage and drop bytes like cable.c does. Only the
+* serial port has a line rate; the others send as fast as the CPU goes,
+* which measures the protocol itself.
+*
+* Authors: José Santos; José Filipe
+*
+* Date: October 2026
+-------------------------------------------------------------------------*/
+
+#include <sys/uio.h>
+
+typedef struct ll_transport ll_transport_t;
+
+// Operations of a transport. Only read and write are required.
+typedef struct {
+    const char *name;
+
+    // Reads what already arrived into the segments, without waiting.
+    // Returns the number of bytes read, 0 if there were none and -1 on error.
+    int (*read)(ll_transport_t *transport, const struct iovec *iov, int count);
+
+    // Writes all the segments, waiting for room if needed.
+    // Returns the number of bytes written, -1 on error.
+    int (*write)(ll_transport_t *transport, const struct iovec *iov, int count);
+
+    // Waits until the bytes written have left. NULL if they leave at once.
+    void (*drain)(ll_transport_t *transport);
+
+    // Sets the line rate in baud. Returns the rate set, -1 on error. NULL
+    // if the transport has no line rate.
+    int (*set_rate)(ll_transport_t *transport, int rate);
+
+    // Highest rate up to limit that can be set (see baud_highest), 0 if
+    // none. NULL if the transport has no line rate.
+    int (*highest_rate)(ll_transport_t *transport, int limit);
+
+    // Restores what the transport changed and releases its descriptors.
+    // Returns 0 if successful, -1 otherwise. Can be NULL.
+    int (*close)(ll_transport_t *transport);
+} ll_transport_ops_t;
+
+// A transport, given to llopen_transport, which owns it from then on.
+// Other transports can be made by filling one with their own operations.
+struct ll_transport {
+    const ll_transport_ops_t *ops;
+    int readFd;   // Becomes readable (POLLIN) when bytes arrive
+    int writeFd;  // Where the bytes are written (same as readFd for a socket or tty)
+    int lineRate; // Rate in baud, 0 if the transport is not limited by one
+    int port;     // Serial port number, shown in the traces (0 if none)
+    void *state;  // Owned by the operations
+};
+
+/*
+*   Opens a serial port in raw mode at SAFE_BAUD_RATE. Its settings are
+*   restored when the transport is closed.
+*
+*   @param *path Device, such as /dev/ttyS0.
+*
+*   @returns the transport, NULL on error.
+*/
+ll_transport_t *lltransport_tty(const char *path);
+
+/*
+*   Creates a pseudo-terminal pair in raw mode. What is written to one end
+*   is read from the other, with the buffering of a tty but no line rate.
+*
+*   @param **a Pointer to where one end will be stored.
+*   @param **b Pointer to where the other end will be stored.
+*
+*   @returns 0 if successful, -1 otherwise.
+*/
+int lltransport_pty_pair(ll_transport_t **a, ll_transport_t **b);
+
+/*
+*   Creates two pipes, one for each direction.
+*
+*   @param **a Pointer to where one end will be stored.
+*   @param **b Pointer to where the other end will be stored.
+*
+*   @returns 0 if successful, -1 otherwise.
+*/
+int lltransport_pipe_pair(ll_transport_t **a, ll_transport_t **b);
+
+/*
+*   Creates a Unix stream socket pair.
+*
+*   @param **a Pointer to where one end will be stored.
+*   @param **b Pointer to where the other end will be stored.
+*
+*   @returns 0 if successful, -1 otherwise.
+*/
+int lltransport_socketpair(ll_transport_t **a, ll_transport_t **b);
+
+/*
+*   Uses file descriptors the application already has, such as a connected
+*   socket. They are made nonblocking and closed with the transport.
+*
+*   @param readFd Descriptor the bytes are read from.
+*   @param writeFd Descriptor the bytes are written to (can be readFd).
+*
+*   @returns the transport, NULL on error.
+*/
+ll_transport_t *lltransport_fd(int readFd, int writeFd);
+
+/*
+*   Creates a channel in memory between two threads of the process, with
+*   a ring of capacity bytes in each direction. Like cable.c, it can flip
+*   one bit of a byte with the probability byteErrorRate; it can also drop
+*   whole writes (one frame each) with the probability dropRate. The errors
+*   come from a fixed seed, so a run can be repeated.
+*
+*   @param **a Pointer to where one end will be stored.
+*   @param **b Pointer to where the other end will be stored.
+*   @param capacity Bytes buffered in each direction (0 for 64 KiB).
+*   @param byteErrorRate Probability of damaging each byte (0 for none).
+*   @param dropRate Probability of dropping each write (0 for none).
+*
+*   @returns 0 if successful, -1 otherwise.
+*/
+int lltransport_memory_pair(ll_transport_t **a, ll_transport_t **b, int capacity, double byteErrorRate,
+                            double dropRate);
+
+/*
+*   Closes a transport and frees it. llclose does this with the transport
+*   of the connection.
+*
+*   @param *transport Transport, freed.
+*
+*   @returns 0 if successful, -1 if its settings could not be restored.
+*/
+int lltransport_close(ll_transport_t *transport);
+
+#endif // TRANSPORT_H
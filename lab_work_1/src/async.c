@@ -0,0 +1,341 @@
+#include "../include/async.h"
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+// Packet waiting to be sent, and then its result
+typedef struct {
+    const unsigned char *data;
+    int length;
+    void *tag;
+    int result;
+} async_write_t;
+
+struct ll_async {
+    ll_conn_t *conn;
+    int depth;
+    int writing; // Transmitter or full duplex
+    int reading; // Receiver or full duplex
+    int maxPayload;
+    pthread_t thread;
+    int wakeFd;   // Written by the application to wake the thread
+    int notifyFd; // Written by the thread to wake the application
+
+    async_write_t *writes;
+    unsigned char *readBuffers; // depth packets of maxPayload bytes
+    int *readLength;
+
+    // Written by the application. Writes from writeHead to writeDone are
+    // done and wait for llpoll_write, from writeDone to writeTail wait for
+    // the thread. Packets received are from readHead to readTail.
+    // The counters only grow, the slot is taken with the mask.
+    unsigned int writeHead;
+    unsigned int writeTail;
+    unsigned int readHead;
+    int stopping;
+
+    // Written by the thread, in a cache line of their own
+    unsigned int writeDone __attribute__((aligned(64)));
+    unsigned int readTail;
+    int error;   // Code returned by llwrite or llread when the connection failed
+    int payload; // llpayload after the last packet sent
+};
+
+// Adds 1 to an eventfd, which wakes whoever polls it.
+static void signal_fd(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("[ASYNC] eventfd");
+}
+
+// Sends the packets submitted while the window has room. After an error
+// every packet fails with it.
+// Returns TRUE if packets were failed without telling the application.
+static int send_packets(ll_async_t *async)
+{
+    unsigned int mask = async->depth - 1;
+    unsigned int done = async->writeDone;
+    unsigned int tail = __atomic_load_n(&async->writeTail, __ATOMIC_ACQUIRE);
+
+    // Acknowledgments and timeouts are handled even with nothing to send.
+    // The window is checked again when it looks full, since llwrite may
+    // have taken the acknowledgments itself (stop-and-wait waits for them)
+    // and then nothing would wake the thread.
+    int space = 0;
+    while (async->error == 0)
+    {
+        if (space == 0)
+            space = llwritable(async->conn);
+        if (space < 0)
+            __atomic_store_n(&async->error, space, __ATOMIC_RELEASE);
+        if (space <= 0 || done == tail)
+            break;
+
+        async_write_t *slot = &async->writes[done & mask];
+        struct iovec iov = {(void *)slot->data, slot->length};
+
+        slot->result = llwritev(async->conn, &iov, 1);
+        if (slot->result < 0)
+        {
+            __atomic_store_n(&async->error, slot->result, __ATOMIC_RELEASE);
+            break;
+        }
+        done++;
+        space--;
+
+        // Stop-and-wait sends one packet per round trip, so each one is
+        // handed back as soon as it is done
+        __atomic_store_n(&async->payload, llpayload(async->conn, NULL), __ATOMIC_RELAXED);
+        __atomic_store_n(&async->writeDone, done, __ATOMIC_RELEASE);
+        signal_fd(async->notifyFd);
+    }
+
+    if (async->error == 0 || done == tail)
+        return FALSE;
+
+    while (done != tail)
+        async->writes[done++ & mask].result = async->error;
+    __atomic_store_n(&async->writeDone, done, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+// Reads the packets that arrived while the ring has room.
+// Returns TRUE if a packet was added, and sets *full if the ring is full.
+static int receive_packets(ll_async_t *async, int *full)
+{
+    unsigned int mask = async->depth - 1;
+    unsigned int tail = async->readTail;
+
+    *full = FALSE;
+    while (async->error == 0)
+    {
+        if (tail - __atomic_load_n(&async->readHead, __ATOMIC_ACQUIRE) == (unsigned int)async->depth)
+        {
+            *full = TRUE;
+            break;
+        }
+
+        int length = llread_nowait(async->conn, &async->readBuffers[(size_t)(tail & mask) * async->maxPayload]);
+        if (length == TIMEOUT_ERROR)
+            break;
+        if (length < 0)
+        {
+            __atomic_store_n(&async->error, length, __ATOMIC_RELEASE);
+            break;
+        }
+
+        async->readLength[tail & mask] = length;
+        tail++;
+    }
+
+    if (tail == async->readTail)
+        return FALSE;
+
+    __atomic_store_n(&async->readTail, tail, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static void *io_thread(void *arg)
+{
+    ll_async_t *async = arg;
+
+    while (TRUE)
+    {
+        // Packets submitted before llasync_stop are sent first
+        int stopping = __atomic_load_n(&async->stopping, __ATOMIC_ACQUIRE);
+        int failed = async->error != 0;
+        int full = FALSE;
+        int news = FALSE;
+
+        if (async->writing)
+            news |= send_packets(async);
+        if (async->reading)
+            news |= receive_packets(async, &full);
+        if (news || (!failed && async->error != 0))
+            signal_fd(async->notifyFd);
+
+        if (stopping && async->writeDone == __atomic_load_n(&async->writeTail, __ATOMIC_ACQUIRE))
+            break;
+
+        // Sleep until the serial port or a timer have something, or the
+        // application submits, takes a packet from a full ring or stops.
+        // A receiver with a full ring leaves the port alone until then.
+        struct pollfd fds[1 + LL_POLL_FDS];
+        int count = 1;
+        fds[0].fd = async->wakeFd;
+        fds[0].events = POLLIN;
+        if (async->error == 0 && (async->writing || !full))
+            count += llpollfds(async->conn, &fds[1]);
+
+        if (poll(fds, count, -1) < 0 && errno != EINTR)
+        {
+            perror("[ASYNC] poll");
+            __atomic_store_n(&async->error, DEFAULT_ERROR, __ATOMIC_RELEASE);
+        }
+
+        uint64_t value;
+        if (fds[0].revents & POLLIN)
+            read(async->wakeFd, &value, sizeof(value));
+    }
+
+    return NULL;
+}
+
+static void free_async(ll_async_t *async)
+{
+    if (async->wakeFd >= 0)
+        close(async->wakeFd);
+    if (async->notifyFd >= 0)
+        close(async->notifyFd);
+    free(async->writes);
+    free(async->readBuffers);
+    free(async->readLength);
+    free(async);
+}
+
+ll_async_t *llasync_start(ll_conn_t *conn, int depth)
+{
+    if (depth == 0)
+        depth = LL_ASYNC_DEPTH;
+    if (conn == NULL || depth < 0 || (depth & (depth - 1)) != 0)
+    {
+        printf("[ASYNC] Invalid ring size %d\n", depth);
+        return NULL;
+    }
+
+    ll_async_t *async = calloc(1, sizeof(ll_async_t));
+    if (async == NULL)
+    {
+        perror("[ASYNC] Could not allocate the rings");
+        return NULL;
+    }
+
+    ll_params_t params;
+    llgetparams(conn, &params);
+
+    async->conn = conn;
+    async->depth = depth;
+    async->writing = llrole(conn) == TX || params.duplex;
+    async->reading = llrole(conn) == RX || params.duplex;
+    async->maxPayload = params.maxPayload;
+    async->payload = llpayload(conn, NULL);
+    async->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    async->notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    async->writes = calloc(depth, sizeof(async_write_t));
+    if (async->reading)
+    {
+        async->readBuffers = malloc((size_t)depth * params.maxPayload);
+        async->readLength = calloc(depth, sizeof(int));
+    }
+
+    if (async->wakeFd < 0 || async->notifyFd < 0 || async->writes == NULL ||
+        (async->reading && (async->readBuffers == NULL || async->readLength == NULL)))
+    {
+        perror("[ASYNC] Could not allocate the rings");
+        free_async(async);
+        return NULL;
+    }
+
+    int err = pthread_create(&async->thread, NULL, io_thread, async);
+    if (err != 0)
+    {
+        printf("[ASYNC] Could not start the I/O thread (%s)\n", strerror(err));
+        free_async(async);
+        return NULL;
+    }
+
+    return async;
+}
+
+int llsubmit_write(ll_async_t *async, const unsigned char *buffer, int length, void *tag)
+{
+    if (__atomic_load_n(&async->error, __ATOMIC_ACQUIRE) != 0)
+        return DEFAULT_ERROR;
+
+    unsigned int tail = async->writeTail;
+    if (tail - async->writeHead == (unsigned int)async->depth)
+        return TIMEOUT_ERROR;
+
+    async_write_t *slot = &async->writes[tail & (async->depth - 1)];
+    slot->data = buffer;
+    slot->length = length;
+    slot->tag = tag;
+
+    __atomic_store_n(&async->writeTail, tail + 1, __ATOMIC_RELEASE);
+    signal_fd(async->wakeFd);
+
+    return 0;
+}
+
+int llpoll_write(ll_async_t *async, ll_completion_t *completion)
+{
+    unsigned int head = async->writeHead;
+    if (head == __atomic_load_n(&async->writeDone, __ATOMIC_ACQUIRE))
+        return FALSE;
+
+    async_write_t *slot = &async->writes[head & (async->depth - 1)];
+    completion->tag = slot->tag;
+    completion->result = slot->result;
+    async->writeHead = head + 1;
+
+    return TRUE;
+}
+
+int llpoll_read(ll_async_t *async, unsigned char *buffer)
+{
+    // The error is set after the last packet read, so those come first
+    int error = __atomic_load_n(&async->error, __ATOMIC_ACQUIRE);
+    unsigned int head = async->readHead;
+    unsigned int tail = __atomic_load_n(&async->readTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return error != 0 ? DEFAULT_ERROR : TIMEOUT_ERROR;
+
+    unsigned int slot = head & (async->depth - 1);
+    int length = async->readLength[slot];
+    memcpy(buffer, &async->readBuffers[(size_t)slot * async->maxPayload], length);
+
+    __atomic_store_n(&async->readHead, head + 1, __ATOMIC_RELEASE);
+
+    // The thread stops reading the port while the ring is full
+    if (tail - head == (unsigned int)async->depth)
+        signal_fd(async->wakeFd);
+
+    return length;
+}
+
+int llasync_fd(ll_async_t *async)
+{
+    return async->notifyFd;
+}
+
+int llasync_wait(ll_async_t *async, int timeout)
+{
+    struct pollfd fd = {async->notifyFd, POLLIN, 0};
+
+    int res = poll(&fd, 1, timeout);
+    if (res <= 0)
+        return FALSE;
+
+    uint64_t value;
+    read(async->notifyFd, &value, sizeof(value));
+    return TRUE;
+}
+
+int llasync_payload(ll_async_t *async)
+{
+    return __atomic_load_n(&async->payload, __ATOMIC_RELAXED);
+}
+
+ll_conn_t *llasync_stop(ll_async_t *async)
+{
+    __atomic_store_n(&async->stopping, TRUE, __ATOMIC_RELEASE);
+    signal_fd(async->wakeFd);
+    pthread_join(async->thread, NULL);
+
+    ll_conn_t *conn = async->conn;
+    free_async(async);
+
+    return conn;
+}
@@ -0,0 +1,73 @@
+#include "../include/baud.h"
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+// Standard rates above SAFE_BAUD_RATE, fastest first, tried when the
+// requested one cannot be made
+static const int standardRates[] = {
+    4000000, 3500000, 3000000, 2500000, 2000000, 1500000, 1152000, 1000000,
+    921600, 576000, 500000, 460800, 230400, 115200, 57600
+};
+
+int baud_set(int fd, int rate)
+{
+    struct termios2 tio;
+
+    if (rate < MIN_BAUD_RATE || ioctl(fd, TCGETS2, &tio) == -1)
+        return -1;
+
+    // BOTHER takes the rate from c_ispeed and c_ospeed instead of a Bxxx code
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = rate;
+    tio.c_ospeed = rate;
+
+    if (ioctl(fd, TCSETS2, &tio) == -1)
+        return -1;
+
+    // The driver rounds to the nearest rate its clock can divide down to
+    return baud_get(fd);
+}
+
+int baud_get(int fd)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) == -1)
+        return -1;
+
+    return tio.c_ospeed;
+}
+
+// Returns 1 if the port can be set to rate within BAUD_TOLERANCE.
+static int try_rate(int fd, int rate)
+{
+    int actual = baud_set(fd, rate);
+    if (actual <= 0)
+        return 0;
+
+    int error = actual > rate ? actual - rate : rate - actual;
+    return (long long)error * 100 <= (long long)rate * BAUD_TOLERANCE;
+}
+
+int baud_highest(int fd, int limit)
+{
+    int current = baud_get(fd);
+    if (current <= 0)
+        return 0;
+
+    int rate = 0;
+    if (limit > SAFE_BAUD_RATE && try_rate(fd, limit))
+        rate = limit;
+
+    for (int i = 0; rate == 0 && i < (int)(sizeof(standardRates) / sizeof(standardRates[0])); i++)
+    {
+        if (standardRates[i] < limit && try_rate(fd, standardRates[i]))
+            rate = standardRates[i];
+    }
+
+    baud_set(fd, current);
+
+    return rate;
+}
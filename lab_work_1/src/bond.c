@@ -0,0 +1,952 @@
+#include "../include/bond.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+//#define DEBUG
+
+// One link of the bond.
+typedef struct {
+    ll_conn_t *conn;
+    ll_bond_link_t info;
+    int window;   // I-frames the link can have in flight
+    int space;    // Free window slots the last time it was checked
+    int rerouted; // Its packets were already given to the other links
+
+    // Packets in flight on the link, oldest first (TX)
+    unsigned int inFlight[MAX_MODULUS];
+    int inFlightHead;
+    int inFlightCount;
+    long long inFlightBytes;
+
+    // Goodput measurement (TX)
+    long long rateStart; // Start of the interval in microseconds
+    long long rateBytes; // Bytes acknowledged since then
+} bond_link_t;
+
+struct ll_bond {
+    int role;
+    int count;
+    bond_link_t links[MAX_LINKS];
+    ll_params_t params; // Agreed on the links
+
+    // Packets sent or received that are not yet done, indexed by packet
+    // number modulo spread. The transmitter keeps a copy (with the packet
+    // number) until a link acknowledges it, the receiver keeps the ones
+    // that arrive before their turn.
+    int spread;
+    unsigned char *slots;
+    int *slotLength;
+    int *slotDone;         // TX: acknowledged, RX: holds a packet
+    unsigned int nextSeq;  // TX: next packet number, RX: next one to deliver
+    unsigned int oldest;   // TX: oldest packet not acknowledged
+
+    // Packets waiting for a link (TX), including the ones taken from a
+    // link that stopped answering
+    unsigned int *queue;
+    int queueSize;
+    int queueHead;
+    int queueCount;
+
+    unsigned char *scratch; // Packet just read from a link (RX)
+    int rxTimeout;
+    ll_timing_t timing;
+    ll_compress_stats_t downStats; // Compression counters of the links that failed
+    ll_fec_stats_t downFecStats;
+    ll_stats_t downLinkStats;
+};
+
+// Current CLOCK_MONOTONIC time in microseconds.
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int llbond_parse_ports(const char *list, int *ports, int max)
+{
+    int count = 0;
+    const char *p = list;
+
+    while (TRUE)
+    {
+        char *end;
+        long port = strtol(p, &end, 10);
+        if (end == p || port < 0 || count == max)
+            return -1;
+
+        ports[count++] = port;
+
+        if (*end == '\0')
+            return count;
+        if (*end != ',')
+            return -1;
+        p = end + 1;
+    }
+}
+
+// Opening of the links, shared by the threads that open them.
+typedef struct {
+    int role;
+    int count;
+    ll_params_t params;
+    int rxTimeout;       // Asked by the caller, 0 to wait forever
+    long long start;     // When the opening started, in microseconds
+    long long firstUp;   // When the first link came up, 0 until then
+    pthread_mutex_t lock;
+} bond_open_t;
+
+typedef struct {
+    bond_open_t *open;
+    bond_link_t *link;
+    int error;
+    pthread_t thread;
+    int started; // The thread was started and must be joined
+} open_task_t;
+
+// Tells whether a receiver still waiting for the SET of a link should go
+// on. It waits as long as no link is up, and then as long as a transmitter
+// would still be sending the SET, as every link is opened at the same time.
+static int keep_opening(bond_open_t *open, long long now)
+{
+    pthread_mutex_lock(&open->lock);
+    long long firstUp = open->firstUp;
+    pthread_mutex_unlock(&open->lock);
+
+    if (open->rxTimeout > 0 && now - open->start >= open->rxTimeout * 1000LL)
+        return FALSE;
+    return firstUp == 0 || now - firstUp < (MAX_RETRIES + 1) * COMMAND_TIMEOUT_MS * 1000LL;
+}
+
+static void *open_link(void *arg)
+{
+    open_task_t *task = arg;
+    bond_open_t *open = task->open;
+    bond_link_t *link = task->link;
+    ll_params_t params = open->params;
+
+    // The transmitter gives up after MAX_RETRIES, but a receiver on a dead
+    // port would wait forever. With other links it waits for the SET a
+    // while at a time, so it can stop once they are up.
+    int bounded = open->role == RX && open->count > 1;
+
+    while (TRUE)
+    {
+        if (bounded)
+        {
+            params.rxTimeout = BOND_OPEN_WAIT_MS;
+            if (open->rxTimeout > 0)
+            {
+                long long left = open->rxTimeout - (now_us() - open->start) / 1000;
+                if (left < params.rxTimeout)
+                    params.rxTimeout = left > 0 ? left : 1;
+            }
+        }
+
+        link->conn = llopen(link->info.port, open->role, &params, &task->error);
+        if (link->conn != NULL)
+            break;
+        if (!bounded || task->error != TIMEOUT_ERROR || !keep_opening(open, now_us()))
+            return NULL;
+    }
+
+    if (bounded)
+        llsettimeout(link->conn, open->rxTimeout);
+
+    pthread_mutex_lock(&open->lock);
+    if (open->firstUp == 0)
+        open->firstUp = now_us();
+    pthread_mutex_unlock(&open->lock);
+
+    return NULL;
+}
+
+ll_bond_t *llbond_open(const int *ports, int count, int role, const ll_params_t *params, int *error)
+{
+    if (error != NULL)
+        *error = DEFAULT_ERROR;
+
+    if (count < 1 || count > MAX_LINKS)
+    {
+        printf("[BOND] Invalid number of links: %d (1 to %d)\n", count, MAX_LINKS);
+        return NULL;
+    }
+    if (count > 1 && params != NULL && params->maxPayload <= BOND_HEADER_SIZE)
+    {
+        printf("[BOND] The payload has no room for the packet number\n");
+        return NULL;
+    }
+
+    ll_bond_t *bond = calloc(1, sizeof(ll_bond_t));
+    if (bond == NULL)
+    {
+        perror("[BOND] Could not allocate the bond");
+        return NULL;
+    }
+
+    bond->role = role;
+    bond->count = count;
+    bond->rxTimeout = params != NULL ? params->rxTimeout : 0;
+
+    bond_open_t open = {.role = role, .count = count, .rxTimeout = bond->rxTimeout, .start = now_us()};
+    if (params != NULL)
+        open.params = *params;
+    else
+        llparams_default(&open.params);
+    pthread_mutex_init(&open.lock, NULL);
+
+    // Every link is opened at the same time, so one that does not answer
+    // does not hold the others up. The n-th port of one end is still the
+    // n-th of the other.
+    open_task_t tasks[MAX_LINKS];
+    for (int i = 0; i < count; i++)
+    {
+        tasks[i] = (open_task_t){.open = &open, .link = &bond->links[i], .error = DEFAULT_ERROR};
+        bond->links[i].info.port = ports[i];
+        if (count > 1)
+        {
+            int err = pthread_create(&tasks[i].thread, NULL, open_link, &tasks[i]);
+            tasks[i].started = err == 0;
+            if (err != 0)
+                printf("[BOND] Could not start the opening of link %d (%s)\n", i, strerror(err));
+        }
+    }
+
+    // A link whose thread could not be started is opened here, after the others
+    for (int i = 0; i < count; i++)
+    {
+        if (!tasks[i].started)
+            open_link(&tasks[i]);
+    }
+
+    int first = -1;
+    for (int i = 0; i < count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+
+        if (tasks[i].started)
+            pthread_join(tasks[i].thread, NULL);
+        if (link->conn == NULL)
+        {
+            printf("[BOND] Link %d (port %d) could not be opened\n", i, ports[i]);
+            if (error != NULL)
+                *error = tasks[i].error;
+            continue;
+        }
+
+        link->info.up = TRUE;
+        llgetparams(link->conn, &bond->params);
+        link->window = bond->params.window;
+        if (first < 0)
+            first = i;
+    }
+    pthread_mutex_destroy(&open.lock);
+
+    if (first < 0)
+    {
+        free(bond);
+        return NULL;
+    }
+
+    // Every link was given the same parameters, so they agree on the same ones
+    llgetparams(bond->links[first].conn, &bond->params);
+    if (count == 1)
+        return bond;
+
+    // The transmitter never gets further ahead of the oldest packet that
+    // was not acknowledged than twice what all the windows hold. Both ends
+    // work it out from the number of ports, so it is the same on both.
+    bond->spread = 2 * count * bond->params.window;
+    bond->queueSize = 2 * bond->spread;
+
+    size_t payload = bond->params.maxPayload;
+    bond->slots = malloc(bond->spread * payload);
+    bond->slotLength = calloc(bond->spread, sizeof(int));
+    bond->slotDone = calloc(bond->spread, sizeof(int));
+    bond->queue = malloc(bond->queueSize * sizeof(unsigned int));
+    bond->scratch = malloc(payload);
+    if (bond->slots == NULL || bond->slotLength == NULL || bond->slotDone == NULL ||
+        bond->queue == NULL || bond->scratch == NULL)
+    {
+        perror("[BOND] Could not allocate the packet buffers");
+        llbond_close(bond, NULL, NULL);
+        return NULL;
+    }
+
+    return bond;
+}
+
+void llbond_getparams(ll_bond_t *bond, ll_params_t *params)
+{
+    *params = bond->params;
+    if (bond->count > 1)
+        params->maxPayload -= BOND_HEADER_SIZE;
+}
+
+int llbond_links(ll_bond_t *bond, ll_bond_link_t *links)
+{
+    for (int i = 0; i < bond->count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+        if (link->info.up)
+            llreorder_occupancy(link->conn, &link->info.reorderPeak);
+        links[i] = link->info;
+    }
+
+    return bond->count;
+}
+
+ll_conn_t *llbond_conn(ll_bond_t *bond, int index)
+{
+    if (index < 0 || index >= bond->count || !bond->links[index].info.up)
+        return NULL;
+
+    return bond->links[index].conn;
+}
+
+int llbond_payload(ll_bond_t *bond, double *ber)
+{
+    int payload = bond->params.maxPayload;
+    double worst = 0;
+
+    // Packets can go through any link, so they must suit the worst one
+    for (int i = 0; i < bond->count; i++)
+    {
+        double linkBer;
+        if (!bond->links[i].info.up)
+            continue;
+
+        int linkPayload = llpayload(bond->links[i].conn, &linkBer);
+        if (linkPayload < payload)
+            payload = linkPayload;
+        if (linkBer > worst)
+            worst = linkBer;
+    }
+
+    if (ber != NULL)
+        *ber = worst;
+
+    return bond->count > 1 ? payload - BOND_HEADER_SIZE : payload;
+}
+
+// Adds the compression counters of a link to a total.
+static void add_compress_stats(ll_compress_stats_t *total, ll_conn_t *conn)
+{
+    ll_compress_stats_t stats;
+    llcompress_stats(conn, &stats);
+
+    total->rawBytes += stats.rawBytes;
+    total->sentBytes += stats.sentBytes;
+    total->compressUs += stats.compressUs;
+    total->receivedBytes += stats.receivedBytes;
+    total->deliveredBytes += stats.deliveredBytes;
+    total->decompressUs += stats.decompressUs;
+}
+
+void llbond_compress_stats(ll_bond_t *bond, ll_compress_stats_t *stats)
+{
+    *stats = bond->downStats;
+    for (int i = 0; i < bond->count; i++)
+    {
+        if (bond->links[i].info.up)
+            add_compress_stats(stats, bond->links[i].conn);
+    }
+}
+
+// Adds the FEC counters of a link to a total.
+static void add_fec_stats(ll_fec_stats_t *total, ll_conn_t *conn)
+{
+    ll_fec_stats_t stats;
+    llfec_stats(conn, &stats);
+
+    total->framesCorrected += stats.framesCorrected;
+    total->bytesCorrected += stats.bytesCorrected;
+    total->framesFailed += stats.framesFailed;
+}
+
+void llbond_fec_stats(ll_bond_t *bond, ll_fec_stats_t *stats)
+{
+    *stats = bond->downFecStats;
+    for (int i = 0; i < bond->count; i++)
+    {
+        if (bond->links[i].info.up)
+            add_fec_stats(stats, bond->links[i].conn);
+    }
+}
+
+// Adds the counters of a link to a total.
+static void add_link_stats(ll_stats_t *total, ll_conn_t *conn)
+{
+    ll_stats_t stats;
+    llstats(conn, &stats);
+    llstats_add(total, &stats);
+}
+
+void llbond_stats(ll_bond_t *bond, ll_stats_t *stats)
+{
+    *stats = bond->downLinkStats;
+    for (int i = 0; i < bond->count; i++)
+    {
+        if (bond->links[i].info.up)
+            add_link_stats(stats, bond->links[i].conn);
+    }
+}
+
+// Gets the trace file of a link: path itself with a single link, path
+// followed by the port number otherwise.
+static void link_trace_path(ll_bond_t *bond, bond_link_t *link, const char *path, char *linkPath, int size)
+{
+    if (bond->count == 1)
+        snprintf(linkPath, size, "%s", path);
+    else
+        snprintf(linkPath, size, "%s.%d", path, link->info.port);
+}
+
+int llbond_trace_dump(ll_bond_t *bond, const char *path)
+{
+    int res = 0;
+    for (int i = 0; i < bond->count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+        char linkPath[PATH_MAX];
+
+        if (!link->info.up)
+            continue;
+
+        link_trace_path(bond, link, path, linkPath, sizeof(linkPath));
+        if (lltrace_dump(link->conn, linkPath) < 0)
+            res = -1;
+    }
+
+    return res;
+}
+
+void llbond_trace_file(ll_bond_t *bond, const char *path, int always)
+{
+    for (int i = 0; i < bond->count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+        char linkPath[PATH_MAX];
+
+        if (!link->info.up)
+            continue;
+
+        if (path == NULL)
+        {
+            lltrace_file(link->conn, NULL, always);
+            continue;
+        }
+
+        link_trace_path(bond, link, path, linkPath, sizeof(linkPath));
+        lltrace_file(link->conn, linkPath, always);
+    }
+}
+
+// Puts a packet back in the queue, ahead of the new ones.
+static void requeue(ll_bond_t *bond, unsigned int seq)
+{
+    if (bond->queueCount == bond->queueSize)
+        return; // Still in flight on some link
+
+    bond->queueHead = (bond->queueHead + bond->queueSize - 1) % bond->queueSize;
+    bond->queue[bond->queueHead] = seq;
+    bond->queueCount++;
+}
+
+// Gives the packets in flight on a link to the other links, newest first
+// so they end up in the queue in order.
+static void reroute(ll_bond_t *bond, bond_link_t *link)
+{
+    for (int i = link->inFlightCount - 1; i >= 0; i--)
+    {
+        unsigned int seq = link->inFlight[(link->inFlightHead + i) % MAX_MODULUS];
+        if (seq - bond->oldest < bond->nextSeq - bond->oldest && !bond->slotDone[seq % bond->spread])
+            requeue(bond, seq);
+    }
+
+    link->rerouted = TRUE;
+}
+
+// Stops using a link that failed.
+static void link_down(ll_bond_t *bond, bond_link_t *link)
+{
+    printf("[BOND] Link on port %d failed\n", link->info.port);
+
+    if (bond->role == TX)
+        reroute(bond, link);
+
+    add_compress_stats(&bond->downStats, link->conn);
+    add_fec_stats(&bond->downFecStats, link->conn);
+    add_link_stats(&bond->downLinkStats, link->conn);
+    llabort(link->conn);
+    link->conn = NULL;
+    link->info.up = FALSE;
+    link->inFlightCount = 0;
+    link->inFlightBytes = 0;
+}
+
+// Adds the bytes acknowledged on a link to its goodput, which is averaged
+// over intervals of BOND_RATE_INTERVAL_MS while the link is busy.
+static void update_goodput(bond_link_t *link, long long now)
+{
+    long long elapsed = now - link->rateStart;
+    if (elapsed < BOND_RATE_INTERVAL_MS * 1000LL)
+        return;
+
+    double sample = link->rateBytes * 1e6 / elapsed;
+    if (link->info.goodput == 0)
+        link->info.goodput = sample;
+    else
+        link->info.goodput = 0.75 * link->info.goodput + 0.25 * sample;
+
+    link->rateStart = now;
+    link->rateBytes = 0;
+}
+
+// Handles what happened on every link: acknowledgments, timeouts and
+// failures.
+static void update_links(ll_bond_t *bond)
+{
+    long long now = now_us();
+
+    for (int i = 0; i < bond->count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+        if (!link->info.up)
+            continue;
+
+        int space = llwritable(link->conn);
+        if (space < 0)
+        {
+            link_down(bond, link);
+            continue;
+        }
+        link->space = space;
+
+        // Acknowledgments are cumulative, so the oldest packets are done
+        int acked = link->inFlightCount - (link->window - space);
+        for (int k = 0; k < acked; k++)
+        {
+            unsigned int seq = link->inFlight[link->inFlightHead];
+            int length = bond->slotLength[seq % bond->spread];
+
+            link->inFlightHead = (link->inFlightHead + 1) % MAX_MODULUS;
+            link->inFlightCount--;
+            link->inFlightBytes -= length;
+            link->rateBytes += length;
+
+            if (seq - bond->oldest < bond->nextSeq - bond->oldest)
+                bond->slotDone[seq % bond->spread] = TRUE;
+        }
+
+        if (link->inFlightCount > 0 || link->rateBytes > 0)
+            update_goodput(link, now);
+
+        // A link that keeps timing out holds up the packets after the ones
+        // it has in flight. They go through the other links as well, and
+        // whichever copy arrives first is used.
+        int retries = llretries(link->conn);
+        if (retries >= BOND_SUSPECT_RETRIES)
+        {
+            #ifdef DEBUG
+            if (!link->info.suspect)
+                printf("[BOND] Link on port %d is not answering\n", link->info.port);
+            #endif
+            link->info.suspect = TRUE;
+            if (!link->rerouted)
+                reroute(bond, link);
+        }
+        else if (retries == 0)
+        {
+            link->info.suspect = FALSE;
+            link->rerouted = FALSE;
+        }
+    }
+
+    while (bond->oldest != bond->nextSeq && bond->slotDone[bond->oldest % bond->spread])
+        bond->oldest++;
+}
+
+// Picks the link that should acknowledge a packet first: the one with the
+// least data in flight for its goodput. Links without a measure yet are
+// taken as fast as the fastest one, so they get measured.
+// Returns -1 if no link can take it.
+static int choose_link(ll_bond_t *bond, int length)
+{
+    double fastest = 0;
+    for (int i = 0; i < bond->count; i++)
+    {
+        if (bond->links[i].info.goodput > fastest)
+            fastest = bond->links[i].info.goodput;
+    }
+    if (fastest == 0)
+        fastest = 1;
+
+    int best = -1;
+    double bestTime = 0;
+    for (int i = 0; i < bond->count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+        if (!link->info.up || link->info.suspect)
+            continue;
+
+        double rate = link->info.goodput > 0 ? link->info.goodput : fastest;
+        double time = (link->inFlightBytes + length) / rate;
+        if (best < 0 || time < bestTime)
+        {
+            best = i;
+            bestTime = time;
+        }
+    }
+
+    return best;
+}
+
+// Sends the queued packets while the best link for them has room.
+static void send_queue(ll_bond_t *bond)
+{
+    update_links(bond);
+
+    while (bond->queueCount > 0)
+    {
+        unsigned int seq = bond->queue[bond->queueHead];
+        int slot = seq % bond->spread;
+
+        // Acknowledged through another link in the meantime
+        if (seq - bond->oldest >= bond->nextSeq - bond->oldest || bond->slotDone[slot])
+        {
+            bond->queueHead = (bond->queueHead + 1) % bond->queueSize;
+            bond->queueCount--;
+            continue;
+        }
+
+        int length = bond->slotLength[slot];
+        int best = choose_link(bond, length);
+        if (best < 0 || bond->links[best].space <= 0)
+            return;
+
+        bond_link_t *link = &bond->links[best];
+        unsigned char *packet = &bond->slots[(size_t)slot * bond->params.maxPayload];
+        if (llwrite(link->conn, packet, length) < 0)
+        {
+            link_down(bond, link);
+            continue;
+        }
+
+        if (link->inFlightCount == 0 && link->rateBytes == 0)
+            link->rateStart = now_us();
+
+        link->inFlight[(link->inFlightHead + link->inFlightCount) % MAX_MODULUS] = seq;
+        link->inFlightCount++;
+        link->inFlightBytes += length;
+        link->space--;
+        link->info.packets++;
+        link->info.bytes += length;
+
+        bond->queueHead = (bond->queueHead + 1) % bond->queueSize;
+        bond->queueCount--;
+    }
+}
+
+// Waits until something happens on one of the links.
+// Returns 0 if something happened (or the wait timed out), -1 on error and
+// TIMEOUT_ERROR if every link failed.
+static int wait_links(ll_bond_t *bond)
+{
+    struct pollfd fds[LL_POLL_FDS * MAX_LINKS];
+    int count = 0;
+
+    for (int i = 0; i < bond->count; i++)
+    {
+        if (bond->links[i].info.up)
+            count += llpollfds(bond->links[i].conn, &fds[count]);
+    }
+
+    if (count == 0)
+        return TIMEOUT_ERROR;
+
+    // The timers wake us up for retransmissions, the timeout is only a
+    // safety net
+    if (poll(fds, count, RTO_MAX_MS) < 0 && errno != EINTR)
+        return -1;
+
+    return 0;
+}
+
+int llbond_write(ll_bond_t *bond, const unsigned char *buffer, int length)
+{
+    struct iovec iov = {(void *)buffer, length};
+
+    return llbond_writev(bond, &iov, 1);
+}
+
+int llbond_writev(ll_bond_t *bond, const struct iovec *iov, int iovcnt)
+{
+    if (bond->count == 1)
+        return llwritev(bond->links[0].conn, iov, iovcnt);
+
+    long long length = 0;
+    for (int i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+
+    if (iovcnt < 0 || length > bond->params.maxPayload - BOND_HEADER_SIZE)
+    {
+        printf("[BOND] Invalid length %lld\n", length);
+        return -1;
+    }
+
+    int res;
+
+    // Wait until the packet is close enough to the oldest one that was not
+    // acknowledged for the receiver to hold it
+    while (TRUE)
+    {
+        send_queue(bond);
+        if (bond->nextSeq - bond->oldest < (unsigned int)bond->spread)
+            break;
+        if ((res = wait_links(bond)) < 0)
+            return res;
+    }
+
+    // Keep a copy, with the packet number, until it is acknowledged. It is
+    // the only copy: it may have to be sent again through another link.
+    unsigned int seq = bond->nextSeq++;
+    int slot = seq % bond->spread;
+    unsigned char *packet = &bond->slots[(size_t)slot * bond->params.maxPayload];
+
+    packet[0] = (seq >> 24) & 0xFF;
+    packet[1] = (seq >> 16) & 0xFF;
+    packet[2] = (seq >> 8) & 0xFF;
+    packet[3] = seq & 0xFF;
+
+    int pos = BOND_HEADER_SIZE;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(&packet[pos], iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    bond->slotLength[slot] = pos;
+    bond->slotDone[slot] = FALSE;
+
+    bond->queue[(bond->queueHead + bond->queueCount) % bond->queueSize] = seq;
+    bond->queueCount++;
+
+    // Like llwrite, only wait while every link is busy
+    while (TRUE)
+    {
+        send_queue(bond);
+        if (bond->queueCount == 0)
+            return length;
+        if ((res = wait_links(bond)) < 0)
+            return res;
+    }
+}
+
+// Keeps a packet read from a link until its turn comes. Packets already
+// delivered or already kept are copies sent through two links.
+static void store_packet(ll_bond_t *bond, bond_link_t *link, int length)
+{
+    if (length < BOND_HEADER_SIZE)
+        return;
+
+    unsigned char *p = bond->scratch;
+    unsigned int seq = ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    int slot = seq % bond->spread;
+
+    link->info.packets++;
+    link->info.bytes += length;
+
+    if (seq - bond->nextSeq >= (unsigned int)bond->spread || bond->slotDone[slot])
+        return;
+
+    memcpy(&bond->slots[(size_t)slot * bond->params.maxPayload], &p[BOND_HEADER_SIZE],
+           length - BOND_HEADER_SIZE);
+    bond->slotLength[slot] = length - BOND_HEADER_SIZE;
+    bond->slotDone[slot] = TRUE;
+}
+
+int llbond_read(ll_bond_t *bond, unsigned char *buffer)
+{
+    if (bond->count == 1)
+        return llread(bond->links[0].conn, buffer);
+
+    long long deadline = bond->rxTimeout > 0 ? now_us() / 1000 + bond->rxTimeout : 0;
+
+    while (TRUE)
+    {
+        // The next packet may already be waiting
+        int slot = bond->nextSeq % bond->spread;
+        if (bond->slotDone[slot])
+        {
+            int length = bond->slotLength[slot];
+            memcpy(buffer, &bond->slots[(size_t)slot * bond->params.maxPayload], length);
+            bond->slotDone[slot] = FALSE;
+            bond->nextSeq++;
+            return length;
+        }
+
+        // Take one packet from every link that has one
+        int received = FALSE;
+        for (int i = 0; i < bond->count; i++)
+        {
+            bond_link_t *link = &bond->links[i];
+            if (!link->info.up)
+                continue;
+
+            int length = llread_nowait(link->conn, bond->scratch);
+            if (length == TIMEOUT_ERROR)
+                continue;
+            if (length < 0)
+            {
+                link_down(bond, link);
+                continue;
+            }
+
+            store_packet(bond, link, length);
+            received = TRUE;
+        }
+        if (received)
+            continue;
+
+        // Nothing complete, wait for more bytes on any link
+        struct pollfd fds[LL_POLL_FDS * MAX_LINKS];
+        int count = 0;
+        for (int i = 0; i < bond->count; i++)
+        {
+            if (bond->links[i].info.up)
+                count += llpollfds(bond->links[i].conn, &fds[count]);
+        }
+        if (count == 0)
+            return -1;
+
+        int timeout = -1;
+        if (deadline > 0)
+        {
+            long long left = deadline - now_us() / 1000;
+            if (left <= 0)
+                return TIMEOUT_ERROR;
+            timeout = left;
+        }
+
+        if (poll(fds, count, timeout) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+int llbond_close(ll_bond_t *bond, ll_timing_t *timing, ll_stats_t *stats)
+{
+    int res = 0;
+    long long start = now_us();
+    ll_stats_t total = bond->downLinkStats;
+    ll_stats_t linkStats;
+
+    // Every packet must be acknowledged through some link first
+    if (bond->role == TX && bond->count > 1 && bond->slots != NULL)
+    {
+        while (TRUE)
+        {
+            send_queue(bond);
+            if (bond->oldest == bond->nextSeq)
+                break;
+            if (wait_links(bond) < 0)
+            {
+                printf("[BOND] Could not deliver the remaining packets\n");
+                res = -1;
+                break;
+            }
+        }
+    }
+    bond->timing.flushUs = now_us() - start;
+
+    // The receiver waits for the DISC of every link at once and answers
+    // each one as it comes, so a link that died does not hold up the
+    // others. It is given as long as the transmitter retries DISC.
+    if (bond->role == RX && bond->count > 1)
+    {
+        long long deadline = now_us() / 1000 + COMMAND_TIMEOUT_MS * MAX_RETRIES;
+        int open = 0;
+
+        while (TRUE)
+        {
+            struct pollfd fds[LL_POLL_FDS * MAX_LINKS];
+            int count = 0;
+            open = 0;
+
+            for (int i = 0; i < bond->count; i++)
+            {
+                bond_link_t *link = &bond->links[i];
+                if (!link->info.up)
+                    continue;
+
+                // Frames still coming are copies of packets already delivered
+                while (llread_nowait(link->conn, bond->scratch) >= 0)
+                    ;
+
+                if (!llpeer_closed(link->conn))
+                {
+                    count += llpollfds(link->conn, &fds[count]);
+                    open++;
+                    continue;
+                }
+
+                ll_timing_t linkTiming;
+                if (llclose(link->conn, &linkTiming, &linkStats) != 0)
+                    res = -1;
+                llstats_add(&total, &linkStats);
+                link->info.up = FALSE;
+                bond->timing.openUs += linkTiming.openUs;
+                bond->timing.closeUs += linkTiming.closeUs;
+                deadline = now_us() / 1000 + COMMAND_TIMEOUT_MS * MAX_RETRIES;
+            }
+
+            long long left = deadline - now_us() / 1000;
+            if (open == 0 || left <= 0)
+                break;
+
+            poll(fds, count, left);
+        }
+
+        if (open > 0)
+            printf("[BOND] %d link(s) did not disconnect\n", open);
+    }
+
+    for (int i = 0; i < bond->count; i++)
+    {
+        bond_link_t *link = &bond->links[i];
+        if (!link->info.up)
+            continue;
+
+        // Links of the receiver that never got a DISC are dead, and a link
+        // that is not answering would only make us wait for its retries
+        // (its packets were delivered through the others)
+        if ((bond->role == RX && bond->count > 1) || link->info.suspect)
+        {
+            add_link_stats(&total, link->conn);
+            llabort(link->conn);
+            continue;
+        }
+
+        ll_timing_t linkTiming;
+        if (llclose(link->conn, &linkTiming, &linkStats) != 0)
+            res = -1;
+        llstats_add(&total, &linkStats);
+        bond->timing.openUs += linkTiming.openUs;
+        bond->timing.flushUs += linkTiming.flushUs;
+        bond->timing.closeUs += linkTiming.closeUs;
+    }
+
+    if (timing != NULL)
+        *timing = bond->timing;
+    if (stats != NULL)
+        *stats = total;
+
+    free(bond->slots);
+    free(bond->slotLength);
+    free(bond->slotDone);
+    free(bond->queue);
+    free(bond->scratch);
+    free(bond);
+
+    return res;
+}
@@ -0,0 +1,276 @@
+#include "../include/compress.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A block is a list of sequences. Each one has a token (literal length in
+// the upper 4 bits, match length minus MIN_MATCH in the lower 4 bits), more
+// literal length bytes when it is 15, the literals, then a 2-byte offset
+// (little endian) and more match length bytes when it is 15. Lengths of 15
+// or more go on in bytes of 255 until a smaller one. The last sequence only
+// has literals.
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET (LZ_HISTORY - 1)
+
+struct lz_stream {
+    unsigned char *history; // Data sent or received, the newest at the end
+    int length;             // Bytes in history
+    int capacity;           // Size of history
+    int maxBlock;
+    int table[1 << HASH_BITS]; // Last position of each 4-byte hash (compressor), -1 if none
+};
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static int hash32(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+lz_stream_t *lz_create(int maxBlock)
+{
+    lz_stream_t *stream = malloc(sizeof(lz_stream_t));
+    if (stream == NULL)
+        return NULL;
+
+    // Room for two histories, so it only slides every LZ_HISTORY bytes
+    stream->capacity = 2 * LZ_HISTORY + maxBlock;
+    stream->history = malloc(stream->capacity);
+    if (stream->history == NULL)
+    {
+        free(stream);
+        return NULL;
+    }
+
+    stream->length = 0;
+    stream->maxBlock = maxBlock;
+    memset(stream->table, 0xFF, sizeof(stream->table));
+
+    return stream;
+}
+
+void lz_free(lz_stream_t *stream)
+{
+    if (stream == NULL)
+        return;
+
+    free(stream->history);
+    free(stream);
+}
+
+// Makes room for the next block by dropping all but the last LZ_HISTORY
+// bytes. Both ends do it at the same point, since it only depends on the
+// lengths of the blocks.
+static void make_room(lz_stream_t *stream)
+{
+    if (stream->length + stream->maxBlock <= stream->capacity)
+        return;
+
+    int shift = stream->length - LZ_HISTORY;
+    memmove(stream->history, stream->history + shift, LZ_HISTORY);
+    stream->length = LZ_HISTORY;
+
+    for (int i = 0; i < (1 << HASH_BITS); i++)
+        stream->table[i] = stream->table[i] >= shift ? stream->table[i] - shift : -1;
+}
+
+// Writes a length that did not fit in a token.
+// Returns the new position in the output, NULL if there is no room.
+static unsigned char *write_length(unsigned char *op, unsigned char *end, int length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (op >= end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= end)
+        return NULL;
+    *op++ = length;
+
+    return op;
+}
+
+// Writes one sequence (literals followed by a match, if matchLength > 0).
+// Returns the new position in the output, NULL if there is no room.
+static unsigned char *write_sequence(unsigned char *op, unsigned char *end, const unsigned char *literals,
+                                     int literalLength, int matchLength, int offset)
+{
+    int matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+
+    if (op >= end)
+        return NULL;
+    *op++ = (literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+
+    if (literalLength >= 15 && (op = write_length(op, end, literalLength - 15)) == NULL)
+        return NULL;
+
+    if (literalLength > end - op)
+        return NULL;
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (matchLength == 0)
+        return op;
+
+    if (end - op < 2)
+        return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    if (matchCode >= 15 && (op = write_length(op, end, matchCode - 15)) == NULL)
+        return NULL;
+
+    return op;
+}
+
+int lz_compress(lz_stream_t *stream, const struct iovec *iov, int iovcnt, unsigned char *dst, int capacity)
+{
+    make_room(stream);
+
+    // The block goes to the end of the history, where it is compressed
+    int start = stream->length;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(stream->history + stream->length, iov[i].iov_base, iov[i].iov_len);
+        stream->length += iov[i].iov_len;
+    }
+
+    const unsigned char *h = stream->history;
+    int end = stream->length;
+    int anchor = start; // First literal not written yet
+    int pos = start;
+    unsigned char *op = dst;
+    unsigned char *opEnd = dst + capacity;
+
+    while (pos + MIN_MATCH <= end)
+    {
+        uint32_t sequence = read32(h + pos);
+        int slot = hash32(sequence);
+        int candidate = stream->table[slot];
+        stream->table[slot] = pos;
+
+        if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(h + candidate) != sequence)
+        {
+            // Go faster through data that does not compress
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        int matchLength = MIN_MATCH;
+        while (pos + matchLength < end && h[candidate + matchLength] == h[pos + matchLength])
+            matchLength++;
+
+        op = write_sequence(op, opEnd, h + anchor, pos - anchor, matchLength, pos - candidate);
+        if (op == NULL)
+            return -1;
+
+        pos += matchLength;
+        anchor = pos;
+
+        // Remember a position near the end of the match as well
+        if (pos + 2 <= end)
+            stream->table[hash32(read32(h + pos - 2))] = pos - 2;
+    }
+
+    if (anchor < end)
+    {
+        op = write_sequence(op, opEnd, h + anchor, end - anchor, 0, 0);
+        if (op == NULL)
+            return -1;
+    }
+
+    return op - dst;
+}
+
+int lz_decompress(lz_stream_t *stream, const unsigned char *src, int length, unsigned char *dst)
+{
+    make_room(stream);
+
+    unsigned char *h = stream->history;
+    int start = stream->length;
+    int limit = start + stream->maxBlock;
+    int op = start;
+    const unsigned char *ip = src;
+    const unsigned char *ipEnd = src + length;
+
+    while (ip < ipEnd)
+    {
+        int token = *ip++;
+
+        int literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            int more;
+            do
+            {
+                if (ip >= ipEnd)
+                    return -1;
+                more = *ip++;
+                literalLength += more;
+            } while (more == 255);
+        }
+
+        if (literalLength > ipEnd - ip || literalLength > limit - op)
+            return -1;
+        memcpy(h + op, ip, literalLength);
+        op += literalLength;
+        ip += literalLength;
+
+        // The last sequence has no match
+        if (ip == ipEnd)
+            break;
+
+        if (ipEnd - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        int matchLength = (token & 0x0F) + MIN_MATCH;
+        if ((token & 0x0F) == 15)
+        {
+            int more;
+            do
+            {
+                if (ip >= ipEnd)
+                    return -1;
+                more = *ip++;
+                matchLength += more;
+            } while (more == 255);
+        }
+
+        if (offset == 0 || offset > op || matchLength > limit - op)
+            return -1;
+
+        // The match can overlap the bytes it produces
+        const unsigned char *match = h + op - offset;
+        if (offset >= matchLength)
+            memcpy(h + op, match, matchLength);
+        else
+        {
+            for (int i = 0; i < matchLength; i++)
+                h[op + i] = match[i];
+        }
+        op += matchLength;
+    }
+
+    stream->length = op;
+    memcpy(dst, h + start, op - start);
+
+    return op - start;
+}
+
+void lz_append(lz_stream_t *stream, const unsigned char *src, int length)
+{
+    make_room(stream);
+
+    memcpy(stream->history + stream->length, src, length);
+    stream->length += length;
+}
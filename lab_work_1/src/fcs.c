@@ -0,0 +1,247 @@
+#include "../include/fcs.h"
+#include "../include/stuffing.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FCS_X86_64 1
+#endif
+
+// Reflected polynomials (the bits are sent least significant first)
+#define CRC16_POLY 0x8408      // x^16 + x^12 + x^5 + 1
+#define CRC32C_POLY 0x82F63B78 // Castagnoli
+
+// Data is stuffed and checked in blocks of this size (see fcs_stuff and fcs_cobs)
+#define FCS_BLOCK 1024
+
+// Slicing-by-8 tables. crcTable[0] is the usual byte table, crcTable[k]
+// gives the effect of a byte followed by k zero bytes.
+static uint32_t crc16Table[8][256];
+static uint32_t crc32cTable[8][256];
+
+static void build_table(uint32_t table[8][256], uint32_t poly)
+{
+    for (int n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        table[0][n] = crc;
+    }
+
+    for (int n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++)
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+    }
+}
+
+
+// Slicing-by-8 for any reflected CRC up to 32 bits: 8 bytes are looked up
+// in 8 tables at once instead of one byte after the other.
+static uint32_t crc_slice8(uint32_t table[8][256], uint32_t crc, const unsigned char *data, int length)
+{
+    int i = 0;
+
+    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= crc;
+
+        crc = table[7][word & 0xFF] ^
+              table[6][(word >> 8) & 0xFF] ^
+              table[5][(word >> 16) & 0xFF] ^
+              table[4][(word >> 24) & 0xFF] ^
+              table[3][(word >> 32) & 0xFF] ^
+              table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^
+              table[0][word >> 56];
+    }
+    #endif
+
+    for (; i < length; i++)
+        crc = (crc >> 8) ^ table[0][(crc ^ data[i]) & 0xFF];
+
+    return crc;
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *data, int length)
+{
+    return crc_slice8(crc32cTable, crc, data, length);
+}
+
+#ifdef FCS_X86_64
+// The crc32 instruction takes 8 bytes per cycle of throughput.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, int length)
+{
+    uint64_t crc64 = crc;
+    int i = 0;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = (uint32_t)crc64;
+    for (; i < length; i++)
+        crc = _mm_crc32_u8(crc, data[i]);
+
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32cImpl)(uint32_t, const unsigned char *, int) = crc32c_table;
+
+int crc32c_select(int impl)
+{
+    #ifdef FCS_X86_64
+    __builtin_cpu_init();
+    if (impl == CRC32C_AUTO)
+        impl = __builtin_cpu_supports("sse4.2") ? CRC32C_SSE42 : CRC32C_TABLE;
+
+    if (impl == CRC32C_SSE42)
+    {
+        if (!__builtin_cpu_supports("sse4.2"))
+            return -1;
+        crc32cImpl = crc32c_sse42;
+        return impl;
+    }
+    #else
+    if (impl == CRC32C_AUTO)
+        impl = CRC32C_TABLE;
+    #endif
+
+    if (impl == CRC32C_TABLE)
+    {
+        crc32cImpl = crc32c_table;
+        return impl;
+    }
+
+    return -1;
+}
+
+// The tables and the CRC-32C code are shared by every connection, which
+// may be opened from several threads (see bond.c), so they are set up
+// before main().
+__attribute__((constructor))
+static void build_tables(void)
+{
+    build_table(crc16Table, CRC16_POLY);
+    build_table(crc32cTable, CRC32C_POLY);
+    crc32c_select(CRC32C_AUTO);
+}
+
+int fcs_size(int type)
+{
+    switch (type)
+    {
+        case FCS_XOR:
+            return 1;
+        case FCS_CRC16:
+            return 2;
+        case FCS_CRC32C:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+unsigned int fcs_init(int type)
+{
+    switch (type)
+    {
+        case FCS_CRC16:
+            return 0xFFFF;
+        case FCS_CRC32C:
+            return 0xFFFFFFFF;
+        default:
+            return 0;
+    }
+}
+
+unsigned int fcs_update(int type, unsigned int fcs, const unsigned char *data, int length)
+{
+    switch (type)
+    {
+        case FCS_CRC16:
+            return crc_slice8(crc16Table, fcs, data, length);
+
+        case FCS_CRC32C:
+            return crc32cImpl(fcs, data, length);
+
+        default:
+        {
+            unsigned char x = fcs;
+            for (int i = 0; i < length; i++)
+                x ^= data[i];
+            return x;
+        }
+    }
+}
+
+void fcs_final(int type, unsigned int fcs, unsigned char *trailer)
+{
+    // The CRCs are sent inverted
+    if (type != FCS_XOR)
+        fcs = ~fcs;
+
+    for (int i = 0; i < fcs_size(type); i++)
+        trailer[i] = (fcs >> (8 * i)) & 0xFF;
+}
+
+int fcs_stuff(int type, unsigned char *dst, const unsigned char *src, int length, unsigned int *fcs)
+{
+    // The stuffing kernels compute the XOR themselves
+    if (type == FCS_XOR)
+    {
+        unsigned char bcc = *fcs;
+        int pos = stuff_data(dst, src, length, &bcc);
+        *fcs = bcc;
+        return pos;
+    }
+
+    unsigned char unused = 0;
+    int pos = 0;
+
+    for (int i = 0; i < length; i += FCS_BLOCK)
+    {
+        int block = length - i < FCS_BLOCK ? length - i : FCS_BLOCK;
+
+        pos += stuff_data(dst + pos, src + i, block, &unused);
+        *fcs = fcs_update(type, *fcs, src + i, block);
+    }
+
+    return pos;
+}
+
+int fcs_cobs(int type, unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+             unsigned int *fcs)
+{
+    if (type == FCS_XOR)
+    {
+        unsigned char bcc = *fcs;
+        int pos = cobs_encode(dst, src, length, state, &bcc);
+        *fcs = bcc;
+        return pos;
+    }
+
+    unsigned char unused = 0;
+    int pos = 0;
+
+    for (int i = 0; i < length; i += FCS_BLOCK)
+    {
+        int block = length - i < FCS_BLOCK ? length - i : FCS_BLOCK;
+
+        pos += cobs_encode(dst + pos, src + i, block, state, &unused);
+        *fcs = fcs_update(type, *fcs, src + i, block);
+    }
+
+    return pos;
+}
@@ -0,0 +1,288 @@
+#include "../include/fec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 and generator
+// alpha = 2. The roots of the code are alpha^0 to alpha^(2t - 1).
+#define GF_POLY 0x11D
+
+static unsigned char gfExp[2 * 255]; // alpha^i, twice so sums of logs need no modulo
+static unsigned char gfLog[256];
+
+struct fec_code {
+    int t;
+    int roots;     // 2t, also the number of parity bytes per block
+    int blockData; // Data bytes per block
+    unsigned char generator[2 * MAX_FEC + 1]; // Highest degree first, generator[0] = 1
+    // Products of each feedback value with the generator, so the encoder
+    // needs one lookup per parity byte
+    unsigned char feedback[256][2 * MAX_FEC];
+    // Products with each root, so a syndrome needs one lookup per byte
+    unsigned char root[2 * MAX_FEC][256];
+};
+
+// The tables are shared by every connection and built before main().
+__attribute__((constructor))
+static void build_tables(void)
+{
+    int x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gfExp[i] = gfExp[i + 255] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    return a == 0 || b == 0 ? 0 : gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b)
+{
+    return a == 0 ? 0 : gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+fec_code_t *fec_create(int t)
+{
+    if (t < 1 || t > MAX_FEC)
+        return NULL;
+
+    fec_code_t *code = malloc(sizeof(fec_code_t));
+    if (code == NULL)
+        return NULL;
+
+    code->t = t;
+    code->roots = 2 * t;
+    code->blockData = FEC_BLOCK - code->roots;
+
+    // g(x) = (x + alpha^0)(x + alpha^1)...(x + alpha^(2t - 1))
+    unsigned char *g = code->generator;
+    memset(g, 0, sizeof(code->generator));
+    g[0] = 1;
+    for (int j = 0; j < code->roots; j++)
+    {
+        for (int i = j + 1; i > 0; i--)
+            g[i] ^= gf_mul(g[i - 1], gfExp[j]);
+    }
+
+    for (int f = 0; f < 256; f++)
+    {
+        for (int i = 0; i < code->roots; i++)
+        {
+            code->feedback[f][i] = gf_mul(f, g[i + 1]);
+            code->root[i][f] = gf_mul(f, gfExp[i]);
+        }
+    }
+
+    return code;
+}
+
+void fec_free(fec_code_t *code)
+{
+    free(code);
+}
+
+int fec_parity_length(const fec_code_t *code, int length)
+{
+    return (length + code->blockData - 1) / code->blockData * code->roots;
+}
+
+int fec_data_length(const fec_code_t *code, int length)
+{
+    // Every block but the last one is FEC_BLOCK bytes long
+    int blocks = (length + FEC_BLOCK - 1) / FEC_BLOCK;
+    int dataLength = length - blocks * code->roots;
+
+    if (dataLength < 1 || fec_parity_length(code, dataLength) != blocks * code->roots)
+        return -1;
+
+    return dataLength;
+}
+
+void fec_init(const fec_code_t *code, fec_state_t *state, unsigned char *parity)
+{
+    memset(state->remainder, 0, code->roots);
+    state->count = 0;
+    state->parity = parity;
+    state->start = parity;
+}
+
+// Writes the parity of the current block and starts the next one.
+static void end_block(const fec_code_t *code, fec_state_t *state)
+{
+    memcpy(state->parity, state->remainder, code->roots);
+    state->parity += code->roots;
+    memset(state->remainder, 0, code->roots);
+    state->count = 0;
+}
+
+void fec_update(const fec_code_t *code, fec_state_t *state, const unsigned char *data, int length)
+{
+    unsigned char *r = state->remainder;
+    int last = code->roots - 1;
+
+    for (int i = 0; i < length; i++)
+    {
+        // Division by g(x) with a shift register: the byte that leaves it
+        // is added to the generator times the feedback
+        const unsigned char *product = code->feedback[data[i] ^ r[0]];
+        for (int j = 0; j < last; j++)
+            r[j] = r[j + 1] ^ product[j];
+        r[last] = product[last];
+
+        if (++state->count == code->blockData)
+            end_block(code, state);
+    }
+}
+
+int fec_final(const fec_code_t *code, fec_state_t *state)
+{
+    if (state->count > 0)
+        end_block(code, state);
+
+    return state->parity - state->start;
+}
+
+// Corrects one block of length data bytes followed by its parity with the
+// Berlekamp-Massey algorithm, a Chien search and the Forney algorithm.
+// Returns the number of bytes corrected, -1 if there are too many errors.
+static int decode_block(const fec_code_t *code, unsigned char *data, int length, const unsigned char *parity)
+{
+    int roots = code->roots;
+    int n = length + roots;
+    unsigned char syndrome[2 * MAX_FEC];
+    int errors = 0;
+
+    // S_j = r(alpha^j), all zero if the block is intact
+    for (int j = 0; j < roots; j++)
+    {
+        const unsigned char *times = code->root[j];
+        unsigned char s = 0;
+        for (int i = 0; i < length; i++)
+            s = times[s] ^ data[i];
+        for (int i = 0; i < roots; i++)
+            s = times[s] ^ parity[i];
+        syndrome[j] = s;
+        errors |= s;
+    }
+    if (errors == 0)
+        return 0;
+
+    // Error locator polynomial Lambda(x), lowest degree first
+    unsigned char lambda[2 * MAX_FEC + 1] = {1};
+    unsigned char prev[2 * MAX_FEC + 1] = {1};
+    unsigned char temp[2 * MAX_FEC + 1];
+    int degree = 0;
+    int shift = 1;
+    unsigned char prevDiscrepancy = 1;
+
+    for (int r = 0; r < roots; r++)
+    {
+        unsigned char d = syndrome[r];
+        for (int i = 1; i <= degree; i++)
+            d ^= gf_mul(lambda[i], syndrome[r - i]);
+
+        if (d == 0)
+        {
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gf_div(d, prevDiscrepancy);
+        if (2 * degree <= r)
+        {
+            memcpy(temp, lambda, sizeof(lambda));
+            for (int i = 0; i + shift <= roots; i++)
+                lambda[i + shift] ^= gf_mul(scale, prev[i]);
+            memcpy(prev, temp, sizeof(prev));
+            degree = r + 1 - degree;
+            prevDiscrepancy = d;
+            shift = 1;
+        }
+        else
+        {
+            for (int i = 0; i + shift <= roots; i++)
+                lambda[i + shift] ^= gf_mul(scale, prev[i]);
+            shift++;
+        }
+    }
+
+    if (degree > code->t)
+        return -1;
+
+    // Error evaluator Omega(x) = S(x) Lambda(x) mod x^2t
+    unsigned char omega[2 * MAX_FEC];
+    for (int k = 0; k < roots; k++)
+    {
+        omega[k] = 0;
+        for (int i = 0; i <= k && i <= degree; i++)
+            omega[k] ^= gf_mul(lambda[i], syndrome[k - i]);
+    }
+
+    // Byte i of the block has locator X = alpha^(n - 1 - i). It is wrong if
+    // Lambda(1/X) = 0, and the error is X Omega(1/X) / Lambda'(1/X).
+    int found = 0;
+    int position[MAX_FEC];
+    unsigned char value[MAX_FEC];
+    for (int i = 0; i < n && found < degree; i++)
+    {
+        int e = n - 1 - i;
+        int inverse = (255 - e) % 255; // log of 1/X
+
+        unsigned char sum = 0;
+        for (int k = 0; k <= degree; k++)
+            sum ^= gf_mul(lambda[k], gfExp[(inverse * k) % 255]);
+        if (sum != 0)
+            continue;
+
+        unsigned char numerator = 0;
+        for (int k = 0; k < roots; k++)
+            numerator ^= gf_mul(omega[k], gfExp[(inverse * k) % 255]);
+
+        unsigned char derivative = 0;
+        for (int k = 1; k <= degree; k += 2)
+            derivative ^= gf_mul(lambda[k], gfExp[(inverse * (k - 1)) % 255]);
+        if (derivative == 0)
+            return -1;
+
+        position[found] = i;
+        value[found] = gf_mul(gfExp[e], gf_div(numerator, derivative));
+        found++;
+    }
+
+    // Roots outside the block mean there were more errors than we can fix
+    if (found != degree)
+        return -1;
+
+    // Only the data needs fixing, the parity is not used again
+    for (int k = 0; k < found; k++)
+    {
+        if (position[k] < length)
+            data[position[k]] ^= value[k];
+    }
+
+    return found;
+}
+
+int fec_decode(const fec_code_t *code, unsigned char *data, int length, const unsigned char *parity)
+{
+    int corrected = 0;
+
+    for (int pos = 0; pos < length; pos += code->blockData)
+    {
+        int blockLength = length - pos < code->blockData ? length - pos : code->blockData;
+        int res = decode_block(code, data + pos, blockLength, parity);
+        if (res < 0)
+            return -1;
+
+        corrected += res;
+        parity += code->roots;
+    }
+
+    return corrected;
+}
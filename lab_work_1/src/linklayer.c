@@ -1,1041 +1,2901 @@
 #include "../include/linklayer.h"
+#include "../include/stuffing.h"
+#include "../include/parser.h"
 
 //#define DEBUG
 
-// Serial port settings
-static struct termios oldtio, newtio;
-
-// Keep track when we need to repeat the last command sent.
-volatile int RETRANSMIT = FALSE;
-
-// Define the states of the state machine.
-//volatile int STOP = FALSE;
-enum STATE {
-    START,
-    FLAG_RCV,
-    A_RCV,
-    C_RCV, 
-    BCC_OK,
-    STOP
+// The trace keeps the frame type as it is
+_Static_assert((int)FRAME_I == TRACE_FRAME_I && (int)FRAME_DISC == TRACE_FRAME_DISC, "Frame types differ from trace.h");
+
+// Returned when a frame was handled but carried no data for the application
+#define NO_DATA -3
+// Returned when an I-frame could not be kept for the application
+#define NO_ROOM -4
+
+// Weight of the previous I-frames in the error rate estimate, for each new
+// one (about the last 64 frames count)
+#define ERROR_DECAY (63.0 / 64.0)
+
+// How long receive_frame() waits for a frame.
+enum WAIT_MODE {
+    WAIT_NONE,    // Only process bytes that already arrived
+    WAIT_TIMER,   // Return when the retransmission timer goes off
+    WAIT_RX,      // Return when the receive deadline passes, if there is one
+    WAIT_ANY      // Return when either of them happens (full duplex llread)
+};
+
+// Parameters exchanged in the information field of SET and UA.
+// Each one is coded as type, length and value, with the value size given
+// in the comment.
+#define PARAM_ARQ 0x01         // 1 byte
+#define PARAM_SEQ_BITS 0x02    // 1 byte
+#define PARAM_WINDOW 0x03      // 1 byte
+#define PARAM_FCS 0x04         // 1 byte
+#define PARAM_MAX_PAYLOAD 0x05 // 4 bytes
+#define PARAM_ACK_EVERY 0x06   // 1 byte
+#define PARAM_ACK_DELAY 0x07   // 2 bytes
+#define PARAM_DUPLEX 0x08      // 1 byte
+#define PARAM_COMPRESS 0x09    // 1 byte
+#define PARAM_FEC 0x0A         // 1 byte
+#define PARAM_BAUD 0x0B        // 4 bytes
+#define PARAM_FRAMING 0x0C     // 1 byte
+#define PARAM_LAST PARAM_FRAMING
+
+// Size of the information field with every parameter in it. A new
+// parameter must be counted here with its value size.
+#define PARAM_HEADER 2 // Type and length
+#define PARAMS_1_BYTE 9
+#define PARAMS_2_BYTES 1
+#define PARAMS_4_BYTES 2
+#define MAX_PARAMS_SIZE (PARAMS_1_BYTE * (PARAM_HEADER + 1) + PARAMS_2_BYTES * (PARAM_HEADER + 2) + \
+                         PARAMS_4_BYTES * (PARAM_HEADER + 4))
+_Static_assert(PARAMS_1_BYTE + PARAMS_2_BYTES + PARAMS_4_BYTES == PARAM_LAST,
+               "Every parameter must be counted in MAX_PARAMS_SIZE");
+
+// Largest frame for a payload: FLAG, A, C, C2, C3, BCC1, data and frame
+// check (all stuffed), FLAG. COBS frames are always shorter.
+#define FRAME_SIZE(payload) (2*(5 + (payload) + MAX_FCS_SIZE) + 2)
+#define MAX_FRAME_SIZE FRAME_SIZE(MAX_SIZE)
+
+// Largest frame without information field, with the header stuffed
+#define COMMAND_SIZE (1 + 2*5 + 1)
+
+// A frame after it has been received and decoded.
+typedef struct {
+    int type;
+    unsigned char C;
+    int ns;              // Send sequence number (I-frames)
+    int nr;              // Receive sequence number (RR, REJ, SREJ and full duplex I-frames)
+    unsigned char *data; // Destuffed information field
+    int length;          // Length of the information field
+    int isDataValid;     // FALSE if the frame check failed
+    int compressed;      // TRUE if the data field is compressed
+} frame_t;
+
+// Receive ring buffer size. Must be a power of 2.
+#define RX_RING_SIZE 4096
+
+// State of one connection. Everything the protocol keeps between calls
+// lives here, so a process can drive several serial ports at once.
+struct ll_conn {
+    ll_transport_t *transport; // Serial port or another byte channel (transport.h)
+    int role; // TX or RX
+    int port; // Number of the serial port
+
+    int lineRate; // Current rate in baud, 0 if the transport has none
+    int framing;  // Current framing (FRAMING_HDLC or FRAMING_COBS)
+
+    // Parameters agreed with the other end. They start as the original
+    // stop-and-wait protocol until SET and UA are exchanged.
+    ll_params_t linkParams;
+
+    // Duration of the phases of the connection
+    ll_timing_t timing;
+
+    // Counters for llstats, since the connection was established at
+    // openedAt (microseconds)
+    ll_stats_t stats;
+    long long openedAt;
+
+    // Last frames sent and received, for lltrace_dump, and the file where
+    // they are written when something fails (NULL if none) or, if
+    // traceAlways, also when the connection is closed
+    trace_ring_t trace;
+    char *tracePath;
+    int traceAlways;
+
+    // Retransmission timer. It is a timerfd, so it is waited on together
+    // with the serial port in poll() and needs no signals.
+    int timerFd;
+    int timerExpired; // Went off and was not restarted yet
+    int retryCount;   // Times it went off without progress
+
+    // Timer of delayed acknowledgments, also a timerfd
+    int ackTimerFd;
+
+    // Round trip time estimates of the transmitter (Jacobson/Karels), used
+    // to set the retransmission timeout.
+    int rttValid;     // FALSE until the first round trip is measured
+    long long srtt;   // Smoothed round trip time in microseconds
+    long long rttvar; // Round trip time variation in microseconds
+    int rto;          // Retransmission timeout in milliseconds
+
+    // Receive deadline of llread() and llopen() on the RX side.
+    int rxTimeout;        // Milliseconds, 0 to wait forever
+    long long rxDeadline; // CLOCK_MONOTONIC time in ms, 0 if none
+
+    // Frame buffers, sized for the agreed parameters and allocated in a
+    // single block by alloc_buffers().
+    unsigned char *linkBuffers;
+
+    // Transmitter window. I-frames are kept, indexed by their sequence
+    // number, until they are acknowledged so they can be sent again.
+    unsigned char *txFrames[MAX_MODULUS];
+    int txFrameLength[MAX_MODULUS];
+    int txHeaderLength[MAX_MODULUS]; // Stuffed header at the start of the frame
+    int txBase;        // Oldest unacknowledged sequence number
+    int txNextSeq;     // Sequence number of the next new I-frame
+    int txOutstanding; // I-frames sent and not yet acknowledged
+    long long txSentAt[MAX_MODULUS]; // When each I-frame was sent, in microseconds
+    long long txTimeoutAt;           // When the retransmission timer last went off
+    int txResent[MAX_MODULUS];       // TRUE if it was sent more than once
+    int txCompressed[MAX_MODULUS];   // TRUE if its data field is compressed
+    int txLost[MAX_MODULUS];         // TRUE if it was counted as lost
+
+    // Receiver window.
+    int rxExpectedSeq;
+    int rxRejSent;
+    int ackPending; // I-frames accepted since the last RR or REJ
+
+    // Receiver reorder buffer (Selective Repeat). I-frames that arrive out
+    // of order wait here, indexed by their sequence number, until the
+    // missing ones are retransmitted. Frames before rxExpectedSeq were
+    // acknowledged but not yet handed to the application, starting at
+    // rxDeliverSeq.
+    unsigned char *rxBuffer[MAX_MODULUS];
+    int rxBufferLength[MAX_MODULUS];
+    int rxBuffered[MAX_MODULUS]; // TRUE if the slot holds a frame
+    int rxSrejSent[MAX_MODULUS]; // TRUE if the missing frame was requested
+    int rxCompressed[MAX_MODULUS]; // TRUE if the data kept is compressed
+    int rxDeliverSeq;
+    int rxOccupancy;
+    int rxPeakOccupancy;
+
+    // I-frames that arrive in order while llwrite waits (full duplex), kept
+    // for the next calls to llread, oldest first. They have slots of their
+    // own, as many as the sequence numbers, so the window of the other end
+    // can still move while the application is not reading.
+    unsigned char *keptFrames[MAX_MODULUS];
+    int keptLength[MAX_MODULUS];
+    int keptCompressed[MAX_MODULUS];
+    int keptFirst; // Slot of the oldest kept frame
+    int keptCount;
+    int keptRefused; // An I-frame found no room, it is asked for again once there is
+
+    // Last UA sent by the receiver, repeated if the SET arrives again.
+    unsigned char uaFrame[MAX_FRAME_SIZE];
+    int uaLength;
+
+    // The DISC of the transmitter arrived while waiting for I-frames
+    int discReceived;
+
+    // llclose was called, I-frames that still arrive are acknowledged and
+    // dropped since nobody will read them
+    int closing;
+
+    // Compression history of each direction (see compress.h), when it was
+    // agreed. Data fields are compressed into compressBuffer before being
+    // stuffed, and decompressed when the frame is delivered in order.
+    lz_stream_t *txStream;
+    lz_stream_t *rxStream;
+    unsigned char *compressBuffer;
+    ll_compress_stats_t compressStats;
+
+    // Error rate estimate of the I-frames sent, for llpayload: bytes sent
+    // and frames lost, both decayed so the older frames count less
+    double errorBytes;
+    double errorFrames;
+
+    // Reed-Solomon code of the data field (see fec.h), when it was agreed,
+    // and the parity of the I-frame being built
+    fec_code_t *fecCode;
+    unsigned char *fecParity;
+    ll_fec_stats_t fecStats;
+
+    // Receive ring buffer. The serial port is read in large blocks into it
+    // and the frame scanner takes frames out of it, so bytes of the next
+    // frame are never lost between calls. Head and tail only grow, the
+    // position in the buffer is taken with the mask.
+    unsigned char rxRing[RX_RING_SIZE];
+    unsigned int rxHead; // Next byte to scan
+    unsigned int rxTail; // Next free position
+
+    // Frame parser, which takes the frames out of the ring buffer
+    frame_parser_t parser;
 };
 
-// Alarm variables. 
-int alarmEnabled = FALSE;
-int alarmCount = 0;
+// The stuffing kernels and the CRC tables are shared by every connection.
+// They are set up before main(), so connections opened by different
+// threads never race to build them.
+__attribute__((constructor))
+static void select_kernels(void)
+{
+    stuffing_select(STUFFING_AUTO);
+    crc32c_select(CRC32C_AUTO);
+}
+
+// Current CLOCK_MONOTONIC time in milliseconds.
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Current CLOCK_MONOTONIC time in microseconds.
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Starts the retransmission timer, replacing any previous deadline.
+static void timer_start(ll_conn_t *conn, int ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+
+    timerfd_settime(conn->timerFd, 0, &its, NULL);
+    conn->timerExpired = FALSE;
+}
+
+static void timer_stop(ll_conn_t *conn)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    timerfd_settime(conn->timerFd, 0, &its, NULL);
+    conn->timerExpired = FALSE;
+}
+
+// Checks the retransmission timer without blocking.
+// Returns TRUE if it went off since it was last started.
+static int timer_check(ll_conn_t *conn)
+{
+    uint64_t expirations;
+
+    if (!conn->timerExpired && read(conn->timerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+    {
+        conn->timerExpired = TRUE;
+        conn->retryCount++;
+
+        #ifdef DEBUG
+        printf("Timer expired: No. %d\n", conn->retryCount);
+        #endif
+    }
+
+    return conn->timerExpired;
+}
+
+// Starts the receive deadline for one call of llread() or llopen().
+static void start_rx_deadline(ll_conn_t *conn)
+{
+    conn->rxDeadline = conn->rxTimeout > 0 ? now_ms() + conn->rxTimeout : 0;
+}
+
+void llparams_default(ll_params_t *params)
+{
+    params->arq = ARQ_STOP_AND_WAIT;
+    params->seqBits = 1;
+    params->window = 1;
+    params->fcs = FCS_XOR;
+    params->maxPayload = MAX_SIZE;
+    params->ackEvery = 1;
+    params->ackDelay = 0;
+    params->duplex = FALSE;
+    params->compress = COMPRESS_NONE;
+    params->fec = 0;
+    params->baudRate = 0;
+    params->framing = FRAMING_HDLC;
+    params->rxTimeout = 0;
+}
+
+// Checks that the combination of parameters makes sense.
+// Returns 0 if it does, -1 otherwise.
+static int check_params(ll_params_t *params)
+{
+    if (fcs_size(params->fcs) == 0)
+        return -1;
+    if (params->maxPayload < 1 || params->maxPayload > MAX_PAYLOAD)
+        return -1;
+    if (params->compress != COMPRESS_NONE && params->compress != COMPRESS_LZ)
+        return -1;
+    if (params->fec < 0 || params->fec > MAX_FEC)
+        return -1;
+    if (params->baudRate != 0 && params->baudRate < MIN_BAUD_RATE)
+        return -1;
+    if (params->framing != FRAMING_HDLC && params->framing != FRAMING_COBS)
+        return -1;
+    if (params->arq == ARQ_STOP_AND_WAIT)
+    {
+        params->seqBits = 1;
+        params->window = 1;
+        params->ackEvery = 1;
+        params->ackDelay = 0;
+        params->duplex = FALSE;
+        return 0;
+    }
+    if (params->arq != ARQ_GO_BACK_N && params->arq != ARQ_SELECTIVE_REPEAT)
+        return -1;
+    if (params->seqBits != 3 && params->seqBits != 7)
+        return -1;
+
+    // With Selective Repeat the window can only use half of the sequence
+    // numbers, otherwise new frames are mistaken for retransmissions.
+    int maxWindow = params->arq == ARQ_GO_BACK_N ? (1 << params->seqBits) - 1
+                                                 : 1 << (params->seqBits - 1);
+    if (params->window < 1 || params->window > maxWindow)
+        return -1;
+
+    // Delayed acknowledgments need a window, otherwise the transmitter
+    // would wait for every one of them
+    if (params->ackEvery < 1 || params->ackEvery > params->window)
+        return -1;
+    if (params->ackEvery == 1)
+        params->ackDelay = 0;
+    else if (params->ackDelay < 1 || params->ackDelay > RTO_MAX_MS)
+        return -1;
+
+    return 0;
+}
+
+int llcheckparams(ll_params_t *params)
+{
+    // Pick the smallest sequence number that fits the window
+    if (params->seqBits == 0)
+    {
+        int window = params->arq == ARQ_SELECTIVE_REPEAT ? 2 * params->window : params->window + 1;
+        params->seqBits = window <= 8 ? 3 : 7;
+    }
+
+    return check_params(params);
+}
+
+void llgetparams(ll_conn_t *conn, ll_params_t *params)
+{
+    *params = conn->linkParams;
+    params->rxTimeout = conn->rxTimeout;
+}
+
+void llsettimeout(ll_conn_t *conn, int rxTimeout)
+{
+    conn->rxTimeout = rxTimeout > 0 ? rxTimeout : 0;
+}
+
+void llcompress_stats(ll_conn_t *conn, ll_compress_stats_t *stats)
+{
+    *stats = conn->compressStats;
+}
+
+void llfec_stats(ll_conn_t *conn, ll_fec_stats_t *stats)
+{
+    *stats = conn->fecStats;
+}
+
+int lltrace_dump(ll_conn_t *conn, const char *path)
+{
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.role = conn->role;
+    header.seqBits = conn->linkParams.seqBits;
+    header.arq = conn->linkParams.arq;
+    header.window = conn->linkParams.window;
+    header.duplex = conn->linkParams.duplex;
+    header.port = conn->port;
+
+    return trace_dump(&conn->trace, &header, path);
+}
+
+void lltrace_file(ll_conn_t *conn, const char *path, int always)
+{
+    free(conn->tracePath);
+    conn->tracePath = path != NULL ? strdup(path) : NULL;
+    conn->traceAlways = always;
+}
+
+// Writes the trace to the file set by lltrace_file, if there is one and
+// the connection failed or it is always written.
+static void save_trace(ll_conn_t *conn, int failed)
+{
+    if (conn->tracePath == NULL || !(failed || conn->traceAlways))
+        return;
+
+    if (lltrace_dump(conn, conn->tracePath) >= 0)
+        printf("[LL] Trace written to %s\n", conn->tracePath);
+    else
+        perror(conn->tracePath);
+}
+
+void llstats(ll_conn_t *conn, ll_stats_t *stats)
+{
+    *stats = conn->stats;
+    stats->elapsedUs = now_us() - conn->openedAt;
+    stats->lineRate = conn->lineRate;
+}
+
+// Returns the largest payload of an I-frame plus its FEC parity, which
+// FRAME_SIZE takes as the payload.
+static int max_field(ll_conn_t *conn)
+{
+    int length = conn->linkParams.maxPayload;
+    int roots = 2 * conn->linkParams.fec;
+    if (roots > 0)
+        length += (length + MAX_FCS_SIZE + FEC_BLOCK - roots - 1) / (FEC_BLOCK - roots) * roots;
+
+    return length;
+}
+
+int llreorder_occupancy(ll_conn_t *conn, int *peak)
+{
+    if (peak != NULL)
+        *peak = conn->rxPeakOccupancy;
+
+    return conn->rxOccupancy;
+}
+
+// Square root by Newton's method, to avoid linking with libm.
+static double square_root(double x)
+{
+    if (x <= 0)
+        return 0;
+
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++)
+    {
+        double next = (r + x / r) / 2;
+        if (next >= r)
+            break;
+        r = next;
+    }
+
+    return r;
+}
+
+// Returns the bytes of an I-frame besides the header and the data field
+// as they are before stuffing: flags, and with COBS the first code byte of
+// the header and of the data field.
+static int framing_overhead(ll_conn_t *conn)
+{
+    return conn->framing == FRAMING_COBS ? 4 : 2;
+}
+
+// Returns the bytes sent for each I-frame besides the payload: flags,
+// address, control, BCC1, frame check and a share of the acknowledgment.
+static double frame_overhead(ll_conn_t *conn)
+{
+    int ackLength = conn->linkParams.seqBits == 7 ? 6 : 5;
+    if (conn->framing == FRAMING_COBS)
+        ackLength++;
+
+    return framing_overhead(conn) + 2 + parser_control_length(&conn->parser, 0x00) +
+           fcs_size(conn->linkParams.fcs) + (double)ackLength / conn->linkParams.ackEvery;
+}
+
+// Starts the error rate estimate of a new connection as if one frame in
+// the original protocol had been lost, so the first I-frames have MAX_SIZE
+// bytes. The payload grows from there while no frames are lost, instead of
+// sending a window of large frames that a noisy line would never deliver.
+static void reset_error_rate(ll_conn_t *conn)
+{
+    double overhead = frame_overhead(conn);
+
+    // Error rate at which MAX_SIZE is the best payload (see llpayload)
+    conn->errorFrames = 1;
+    conn->errorBytes = MAX_SIZE * (MAX_SIZE + overhead) / overhead;
+}
+
+int llpayload(ll_conn_t *conn, double *ber)
+{
+    int maxPayload = conn->linkParams.maxPayload;
+    double byteErrorRate = conn->errorBytes > 0 ? conn->errorFrames / conn->errorBytes : 0;
+
+    // Errors are assumed to be in different bytes, with one wrong bit each
+    if (ber != NULL)
+        *ber = byteErrorRate / 8;
+
+    if (byteErrorRate <= 0)
+        return maxPayload;
+
+    // A payload of L bytes with H bytes of overhead arrives with
+    // probability (1 - e)^(L + H), about exp(-e (L + H)), and only L of the
+    // L + H bytes sent are data. The goodput L / (L + H) exp(-e (L + H)) is
+    // highest where L^2 + H L - H / e = 0.
+    double overhead = frame_overhead(conn);
+    double best = (square_root(overhead * overhead + 4 * overhead / byteErrorRate) - overhead) / 2;
+
+    if (best >= maxPayload)
+        return maxPayload;
+    if (best < MIN_PAYLOAD)
+        return MIN_PAYLOAD < maxPayload ? MIN_PAYLOAD : maxPayload;
+    return (int)best;
+}
+
+// Byte that starts and ends frames with the current framing.
+static unsigned char delimiter(ll_conn_t *conn)
+{
+    return conn->framing == FRAMING_COBS ? COBS_DELIMITER : FLAG;
+}
+
+// Switches the framing of the frames sent and received.
+static void set_framing(ll_conn_t *conn, int framing)
+{
+    conn->framing = framing;
+    parser_set_framing(&conn->parser, framing);
+}
+
+// Builds the header of a frame (FLAG, A, C, [C2], [C3], BCC1).
+// In full duplex I-frames also acknowledge the frames received so far.
+// Returns the number of bytes written.
+static int build_header(ll_conn_t *conn, unsigned char *frame, int type, int seq)
+{
+    unsigned char C = 0;
+    unsigned char C2 = 0;
+    unsigned char C3 = 0;
+    int bits = conn->linkParams.seqBits;
+
+    switch (type)
+    {
+        case FRAME_I:
+            // I0 = 0x00 and I1 = 0x40 in the original protocol
+            if (bits == 1)
+                C = seq << 6;
+            else if (bits == 3)
+                C = seq << 1;
+            else
+                C2 = seq << 1; // C stays 0x00, N(S) goes in C2
+
+            // N(R) goes in the upper bits of C or in C3, as in HDLC
+            if (conn->linkParams.duplex && bits == 3)
+                C |= conn->rxExpectedSeq << 5;
+            else if (conn->linkParams.duplex)
+                C3 = conn->rxExpectedSeq << 1;
+
+            if (conn->txCompressed[seq])
+                C |= C_COMPRESSED;
+            break;
+
+        case FRAME_RR:
+        case FRAME_REJ:
+        case FRAME_SREJ:
+            C = type == FRAME_RR ? C_RR : type == FRAME_REJ ? C_REJ : C_SREJ;
+            // RR0 = 0x05, RR1 = 0x85, REJ0 = 0x01, REJ1 = 0x81 in the original protocol
+            if (bits == 1)
+                C |= seq << 7;
+            else if (bits == 3)
+                C |= seq << 5;
+            else
+                C2 = seq << 1;
+            break;
+
+        case FRAME_SET:
+            C = C_SET;
+            break;
+        case FRAME_UA:
+            C = C_UA;
+            break;
+        case FRAME_DISC:
+            C = C_DISC;
+            break;
+    }
+
+    unsigned char header[5];
+    int length = 0;
+    int control = parser_control_length(&conn->parser, C);
+    header[length++] = A_FIELD;
+    header[length++] = C;
+    if (control >= 2)
+        header[length++] = C2;
+    if (control == 3)
+        header[length++] = C3;
+    header[length++] = A_FIELD ^ C ^ C2 ^ C3; // BCC1
+
+    unsigned char unused = 0;
+    frame[0] = delimiter(conn);
+
+    // With COBS the header is a block of its own, so it can be built again
+    // without coding the data field again (see retransmit_frame)
+    if (conn->framing == FRAMING_COBS)
+    {
+        cobs_state_t state;
+        int pos = 1 + cobs_init(&frame[1], &state);
+        pos += cobs_encode(&frame[pos], header, length, &state, &unused);
+        cobs_final(&frame[pos], &state);
+        return pos;
+    }
+
+    // The header is stuffed as well. It never has 0x7E or 0x7D in the
+    // original protocol, but C2 and BCC1 can with 7-bit sequence numbers.
+    return 1 + stuff_data(&frame[1], header, length, &unused);
+}
+
+// Builds a frame without information field (RR, REJ, SREJ, SET, UA or
+// DISC) into a buffer of COMMAND_SIZE bytes.
+// Returns the number of bytes written.
+static int build_command(ll_conn_t *conn, unsigned char *frame, int type, int nr)
+{
+    int length = build_header(conn, frame, type, nr);
+    frame[length++] = delimiter(conn);
+
+    return length;
+}
+
+// Appends a block of the data field, stuffed or coded with COBS when
+// cobs is not NULL.
+// Returns the number of bytes written.
+static int append_field(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *cobs,
+                        unsigned char *bcc)
+{
+    return cobs != NULL ? cobs_encode(dst, src, length, cobs, bcc) : stuff_data(dst, src, length, bcc);
+}
+
+// Appends the data field and the frame check with byte stuffing, followed by
+// the end flag. If 0x7E or 0x7D are found in the data field, the byte 0x7D
+// is sent followed by the byte XORed with 0x20.
+// The data field is made of the iov segments one after the other. They are
+// stuffed and the frame check computed in the same pass (see fcs.c).
+// With a FEC code the parity of the data and the frame check is computed
+// into parity and sent after them.
+// With COBS framing the data field is coded as one COBS block instead,
+// followed by a zero byte.
+// Returns the new length of the frame.
+static int build_data_field(unsigned char *frame, int pos, const struct iovec *iov, int iovcnt,
+                            int fcsType, const fec_code_t *fec, unsigned char *parity, int framing)
+{
+    unsigned int fcs = fcs_init(fcsType);
+    unsigned char trailer[MAX_FCS_SIZE];
+    unsigned char unused = 0;
+    fec_state_t state;
+    cobs_state_t cobsState;
+    cobs_state_t *cobs = NULL;
+
+    if (fec != NULL)
+        fec_init(fec, &state, parity);
+    if (framing == FRAMING_COBS)
+    {
+        cobs = &cobsState;
+        pos += cobs_init(&frame[pos], cobs);
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (cobs != NULL)
+            pos += fcs_cobs(fcsType, &frame[pos], iov[i].iov_base, iov[i].iov_len, cobs, &fcs);
+        else
+            pos += fcs_stuff(fcsType, &frame[pos], iov[i].iov_base, iov[i].iov_len, &fcs);
+        if (fec != NULL)
+            fec_update(fec, &state, iov[i].iov_base, iov[i].iov_len);
+    }
+
+    // Add the frame check, which also needs byte stuffing
+    fcs_final(fcsType, fcs, trailer);
+    pos += append_field(&frame[pos], trailer, fcs_size(fcsType), cobs, &unused);
+
+    if (fec != NULL)
+    {
+        fec_update(fec, &state, trailer, fcs_size(fcsType));
+        pos += append_field(&frame[pos], parity, fec_final(fec, &state), cobs, &unused);
+    }
+
+    // Add the end flag
+    if (cobs != NULL)
+    {
+        cobs_final(&frame[pos], cobs);
+        frame[pos++] = COBS_DELIMITER;
+    }
+    else
+        frame[pos++] = FLAG;
+
+    return pos;
+}
+
+// Reads every byte available on the serial port into the ring buffer.
+// Both free parts of the ring are filled with a single read.
+// Returns the number of bytes read, 0 if there were none and -1 on error.
+static int fill_ring(ll_conn_t *conn)
+{
+    unsigned int used = conn->rxTail - conn->rxHead;
+    if (used == RX_RING_SIZE)
+        return 0;
+
+    unsigned int pos = conn->rxTail & (RX_RING_SIZE - 1);
+    unsigned int space = RX_RING_SIZE - used;
+    struct iovec iov[2];
+    int count = 1;
+
+    iov[0].iov_base = &conn->rxRing[pos];
+    iov[0].iov_len = space;
+    if (pos + space > RX_RING_SIZE)
+    {
+        // Free space wraps around the end of the ring
+        iov[0].iov_len = RX_RING_SIZE - pos;
+        iov[1].iov_base = conn->rxRing;
+        iov[1].iov_len = space - iov[0].iov_len;
+        count = 2;
+    }
+
+    int bytes = conn->transport->ops->read(conn->transport, iov, count);
+    if (bytes <= 0)
+        return bytes;
+
+    conn->rxTail += bytes;
+    conn->stats.bytesReceived += bytes;
+    return bytes;
+}
+
+// Gives the bytes in the ring buffer to the parser until it completes a
+// frame. Damaged frames are counted and skipped.
+// Returns TRUE when a frame with a valid header was found.
+static int scan_frame(ll_conn_t *conn, parsed_frame_t *parsed)
+{
+    while (conn->rxHead != conn->rxTail)
+    {
+        unsigned int pos = conn->rxHead & (RX_RING_SIZE - 1);
+        unsigned int length = conn->rxTail - conn->rxHead;
+        if (length > RX_RING_SIZE - pos)
+            length = RX_RING_SIZE - pos;
+
+        int used;
+        int res = parser_scan(&conn->parser, &conn->rxRing[pos], length, parsed, &used);
+        conn->rxHead += used;
+
+        if (res == PARSE_FRAME)
+            return TRUE;
+
+        if (res == PARSE_ERROR)
+        {
+            conn->stats.headerErrors++;
+            trace_add(&conn->trace, TRACE_CODE(TRACE_HEADER_ERROR, TRACE_FRAME_NONE), parsed->C, 0, 0,
+                      parsed->length);
+        }
+    }
+
+    return FALSE;
+}
+
+// Checks the frame check of the information field of a frame from the
+// parser. I-frames use the one agreed in llopen, SET and UA always use BCC2.
+static void decode_frame(ll_conn_t *conn, const parsed_frame_t *parsed, frame_t *frame)
+{
+    frame->type = parsed->type;
+    frame->C = parsed->C;
+    frame->ns = parsed->ns;
+    frame->nr = parsed->nr;
+    frame->compressed = parsed->compressed;
+
+    // BCC2 is part of the XOR of the field, which is zero when they match
+    int fcsType = frame->type == FRAME_I ? conn->linkParams.fcs : FCS_XOR;
+    int fcsLength = fcs_size(fcsType);
+    unsigned char *field = parsed->field;
+    unsigned char checkBCC2 = parsed->bcc;
+    int fieldLength = parsed->fieldLength;
+
+    // With FEC the parity follows the frame check. The errors it can
+    // correct are fixed in place, so the frame check sees the data as sent.
+    int fecFailed = FALSE;
+    if (frame->type == FRAME_I && conn->fecCode != NULL && fieldLength > 0)
+    {
+        int dataLength = fec_data_length(conn->fecCode, fieldLength);
+        int corrected = dataLength < 0 ? -1 : fec_decode(conn->fecCode, field, dataLength, &field[dataLength]);
+
+        if (corrected < 0)
+        {
+            conn->fecStats.framesFailed++;
+            fecFailed = TRUE;
+        }
+        else
+        {
+            if (corrected > 0)
+            {
+                conn->fecStats.framesCorrected++;
+                conn->fecStats.bytesCorrected += corrected;
+            }
+
+            // The XOR was computed over the parity and the bytes as received
+            fieldLength = dataLength;
+            checkBCC2 = 0;
+            for (int i = 0; fcsType == FCS_XOR && i < fieldLength; i++)
+                checkBCC2 ^= field[i];
+        }
+    }
+
+    frame->data = field;
+    frame->length = fieldLength > fcsLength ? fieldLength - fcsLength : 0; // Exclude the check
+    frame->isDataValid = FALSE;
+
+    if (fieldLength == 0)
+        frame->isDataValid = TRUE;
+    else if (fecFailed || fieldLength < fcsLength || frame->length > conn->linkParams.maxPayload)
+        frame->isDataValid = FALSE;
+    else if (fcsType == FCS_XOR)
+        frame->isDataValid = checkBCC2 == 0;
+    else
+    {
+        // The CRC is computed again over the data while it is still in the cache
+        unsigned char trailer[MAX_FCS_SIZE];
+        fcs_final(fcsType, fcs_update(fcsType, fcs_init(fcsType), field, frame->length), trailer);
+        frame->isDataValid = memcmp(trailer, &field[frame->length], fcsLength) == 0;
+    }
+
+    #ifdef DEBUG
+    printf("[LL] Frame received: C = 0x%02X, type %d, %d data bytes, FCS %s\n",
+           frame->C, frame->type, frame->length, frame->isDataValid ? "OK" : "error");
+    #endif
+}
+
+// Adds a frame that was written to the serial port to the trace. The
+// header is destuffed (or decoded) again from the start of the frame.
+static void trace_written(ll_conn_t *conn, int event, const unsigned char *frame, int length)
+{
+    unsigned char header[4] = {0}; // A, C, C2, C3
+    int count = 0;
+
+    if (conn->framing == FRAMING_COBS)
+    {
+        // Every group is a code byte, code - 1 bytes and a zero
+        for (int i = 1; i < length && count < 4 && frame[i] != COBS_DELIMITER;)
+        {
+            int code = frame[i++];
+            for (int k = 1; k < code && i < length && count < 4; k++)
+                header[count++] = frame[i++];
+            if (count < 4)
+                header[count++] = 0;
+        }
+    }
+    else
+    {
+        for (int i = 1; i < length && count < 4 && frame[i] != FLAG; i++)
+        {
+            if (frame[i] == 0x7D && i + 1 < length)
+                header[count++] = frame[++i] ^ 0x20;
+            else
+                header[count++] = frame[i];
+        }
+    }
+
+    parsed_frame_t decoded;
+    parser_classify(&conn->parser, header, &decoded);
+    trace_add(&conn->trace, TRACE_CODE(event, decoded.type), header[1], decoded.ns, decoded.nr, length);
+}
+
+// Writes a whole frame to the serial port, counts it and adds it to the
+// trace.
+// Returns the number of bytes written, -1 on error.
+static int write_frame(ll_conn_t *conn, const unsigned char *frame, int length)
+{
+    struct iovec iov = {(void *)frame, length};
+    int bytes = conn->transport->ops->write(conn->transport, &iov, 1);
+    if (bytes > 0)
+    {
+        conn->stats.framesSent++;
+        conn->stats.bytesSent += bytes;
+        trace_written(conn, TRACE_SENT, frame, bytes);
+    }
+
+    return bytes;
+}
+
+// Starts the timer of delayed acknowledgments, or stops it if ms is 0.
+static void ack_timer_set(ll_conn_t *conn, int ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+
+    timerfd_settime(conn->ackTimerFd, 0, &its, NULL);
+}
+
+// Forgets the delayed acknowledgment, an RR or REJ (or, in full duplex, an
+// I-frame) just went out.
+static void clear_ack(ll_conn_t *conn)
+{
+    if (conn->ackPending > 0)
+        ack_timer_set(conn, 0);
+    conn->ackPending = 0;
+}
+
+// Sends an RR or REJ frame with the given receive sequence number.
+int send_ack(ll_conn_t *conn, int type, int nr)
+{
+    unsigned char ACK[COMMAND_SIZE];
+    int length = build_command(conn, ACK, type, nr);
+
+    int bytes = write_frame(conn, ACK, length);
+
+    // RR and REJ acknowledge every I-frame before nr
+    if (type == FRAME_RR || type == FRAME_REJ)
+        clear_ack(conn);
+
+    if (type == FRAME_RR)
+        conn->stats.rrSent++;
+    else if (type == FRAME_REJ)
+        conn->stats.rejSent++;
+    else
+        conn->stats.srejSent++;
+
+    if (bytes == length)
+    {
+        #ifdef DEBUG
+        printf("%d bytes written\nSent:\n", bytes);
+        for (int i = 0; i < length; i++)
+        {
+            printf("0x%02X, ", ACK[i]);
+        }
+        printf("\n");
+        #endif
+    }
+    else if (bytes == -1)
+    {
+        perror("[LL] Could not write ACK\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Acknowledges an I-frame that was accepted in order. With delayed
+// acknowledgments the RR is only sent for every ackEvery frames, or when
+// the timer started by the first frame not acknowledged goes off.
+// In full duplex the next I-frame we send carries it, and receive_frame()
+// sends an RR if we go to sleep before that.
+static int delay_ack(ll_conn_t *conn)
+{
+    conn->ackPending++;
+    if (conn->linkParams.duplex && conn->linkParams.ackEvery == 1)
+        return 0;
+
+    if (conn->ackPending >= conn->linkParams.ackEvery)
+        return send_ack(conn, FRAME_RR, conn->rxExpectedSeq); // RR is cumulative
+
+    if (conn->ackPending == 1)
+        ack_timer_set(conn, conn->linkParams.ackDelay);
+
+    return 0;
+}
+
+// Sends the delayed acknowledgment if its time came.
+static void check_ack_timer(ll_conn_t *conn)
+{
+    uint64_t expirations;
+
+    if (conn->ackPending > 0 && read(conn->ackTimerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        send_ack(conn, FRAME_RR, conn->rxExpectedSeq);
+}
+
+// Takes the next frame from the ring buffer, reading the serial port
+// when it runs out. Bytes that already arrived are always processed before
+// the timer or the deadline are checked.
+// Returns 1 if a frame was received, 0 if there was no frame (the timer went
+// off, the receive deadline passed or, for WAIT_NONE, no more bytes are
+// available) and -1 on error.
+static int receive_frame(ll_conn_t *conn, frame_t *frame, int wait)
+{
+    while (TRUE)
+    {
+        // A delayed acknowledgment that is due goes out first
+        check_ack_timer(conn);
+
+        // Frames already in the ring buffer come first
+        parsed_frame_t parsed;
+        while (scan_frame(conn, &parsed))
+        {
+            decode_frame(conn, &parsed, frame);
+            int event = frame->type == FRAME_INVALID ? TRACE_HEADER_ERROR
+                        : frame->isDataValid ? TRACE_RECEIVED : TRACE_FCS_ERROR;
+            trace_add(&conn->trace, TRACE_CODE(event, frame->type), frame->C, frame->ns, frame->nr,
+                      parsed.length);
+
+            if (frame->type != FRAME_INVALID)
+            {
+                conn->stats.framesReceived++;
+                return 1;
+            }
+        }
+
+        int bytes = fill_ring(conn);
+        if (bytes < 0)
+        {
+            #ifdef DEBUG
+            printf("[LL] Error reading from serial port\n");
+            #endif
+
+            return -1;
+        }
+        if (bytes > 0)
+            continue;
+
+        int timed = wait == WAIT_TIMER || wait == WAIT_ANY;
+        if (wait == WAIT_NONE)
+            return 0;
+        if (timed && timer_check(conn))
+            return 0;
+
+        // In full duplex the acknowledgment was waiting for an I-frame to
+        // carry it. There is none to send while we sleep.
+        if (conn->ackPending > 0 && conn->linkParams.ackEvery == 1)
+            send_ack(conn, FRAME_RR, conn->rxExpectedSeq);
+
+        // Nothing to read, sleep until bytes arrive, the timer goes off or
+        // the deadline passes.
+        struct pollfd fds[3];
+        int count = 0;
+        fds[count].fd = conn->transport->readFd;
+        fds[count++].events = POLLIN;
+        if (timed)
+        {
+            fds[count].fd = conn->timerFd;
+            fds[count++].events = POLLIN;
+        }
+        if (conn->ackPending > 0)
+        {
+            fds[count].fd = conn->ackTimerFd;
+            fds[count++].events = POLLIN;
+        }
+
+        int timeout = -1;
+        if ((wait == WAIT_RX || wait == WAIT_ANY) && conn->rxDeadline > 0)
+        {
+            long long left = conn->rxDeadline - now_ms();
+            if (left <= 0)
+                return 0;
+            timeout = left;
+        }
+
+        int res = poll(fds, count, timeout);
+        if (res < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+static int handle_frame(ll_conn_t *conn, frame_t *frame, unsigned char *buffer);
 
-// Fixed commands that will be sent or read.
-// SET command
-unsigned char SET[5] = {0x7E, 0x03, 0x03, 0x00, 0x7E};
-// DISC command
-unsigned char DISC[5] = {0x7E, 0x03, 0x0B, 0x03^0x0B, 0x7E};
-// UA command
-unsigned char UA[5] = {0x7E, 0x03, 0x07, 0x03^0x07, 0x7E};
+// Waits for a frame with control byte C, writing RPT again every time the
+// timer goes off (every timeout ms). A copy of the frame is left in *frame if
+// it is not NULL.
+static int wait_command(ll_conn_t *conn, unsigned char C, const unsigned char *RPT, int rptLength, int timeout,
+                        frame_t *frame)
+{
+    frame_t received;
 
+    // Reset the retry counter
+    conn->retryCount = 0;
+    timer_start(conn, timeout);
 
-// Alarm function handler
-void alarmHandler(int signal)
-{
-    alarmEnabled = FALSE;
-    alarmCount++;
-    RETRANSMIT = TRUE;
+    while (TRUE)
+    {
+        // Verify that we have not exceeded the maximum number of retries.
+        if (conn->retryCount >= MAX_RETRIES)
+        {
+            // Retries exceeded
+            #ifdef DEBUG
+            printf("[Read command] Time out. Returning\n");
+            #endif
+            return TIMEOUT_ERROR;
+        }
 
-    #ifdef DEBUG
-    printf("Alarm triggered: No. %d\n", alarmCount);
-    #endif
-	
+        // Check if we need to retransmit and if the command to retransmit is valid.
+        if (conn->timerExpired)
+        {
+            if (RPT != NULL)
+            {
+                // Resend frame
+                write_frame(conn, RPT, rptLength);
+            }
+
+            // Assuming we have not yet exceeded the retries, restart the timer
+            timer_start(conn, timeout);
+        }
+
+        int res = receive_frame(conn, &received, WAIT_TIMER);
+        if (res < 0)
+            return DEFAULT_ERROR;
+        if (res == 0)
+            continue;
+
+        // A command with a damaged information field (the parameters of a
+        // UA) is taken as lost, so RPT is sent again
+        if (received.C == C && !received.isDataValid)
+            continue;
+
+        if (received.C == C)
+        {
+            timer_stop(conn);
+            if (frame != NULL)
+                *frame = received;
+            return 0;
+        }
+
+        // In full duplex the other end may still be sending I-frames
+        if (conn->linkParams.duplex)
+        {
+            if (handle_frame(conn, &received, NULL) == DEFAULT_ERROR)
+                return DEFAULT_ERROR;
+            continue;
+        }
+
+        // The last acknowledgment may have been lost and the transmitter is
+        // still repeating an I-frame. Acknowledge it again.
+        if (received.type == FRAME_I && received.ns != conn->rxExpectedSeq)
+            send_ack(conn, FRAME_RR, conn->rxExpectedSeq);
+    }
 }
 
-int read_command(int fd, unsigned char *CMD, unsigned char *RPT)
+int read_command(ll_conn_t *conn, const unsigned char *CMD, const unsigned char *RPT)
 {
     // return if NULL
     if (CMD == NULL)
     {
         return -1;
     }
-    
-    unsigned char in_byte = 0;
-    unsigned char A = CMD[1];
-    unsigned char C = CMD[2];
-    unsigned char BCC1 = A^C;
-    
-    int state = START;
-    int run = TRUE;
 
-    // Reset the alarm counter
-    alarmCount = 0;
-    alarm(ALARM_TIMEOUT);
+    return wait_command(conn, CMD[2], RPT, BUF_SIZE, COMMAND_TIMEOUT_MS, NULL);
+}
+
+// Writes one parameter with its value in size bytes, most significant first.
+// Returns the new position in the field.
+static int write_param(unsigned char *field, int pos, int type, unsigned int value, int size)
+{
+    field[pos++] = type;
+    field[pos++] = size;
+    for (int i = size - 1; i >= 0; i--)
+        field[pos++] = (value >> (8 * i)) & 0xFF;
+
+    return pos;
+}
+
+// Writes the parameters in the information field of a SET or UA frame.
+// Returns the number of bytes written.
+static int write_params(unsigned char *field, const ll_params_t *params)
+{
+    int pos = 0;
+
+    pos = write_param(field, pos, PARAM_ARQ, params->arq, 1);
+    pos = write_param(field, pos, PARAM_SEQ_BITS, params->seqBits, 1);
+    pos = write_param(field, pos, PARAM_WINDOW, params->window, 1);
+    pos = write_param(field, pos, PARAM_FCS, params->fcs, 1);
+    pos = write_param(field, pos, PARAM_MAX_PAYLOAD, params->maxPayload, 4);
 
-    while (run)
+    // A receiver that does not know them acknowledges every I-frame
+    if (params->ackEvery > 1)
     {
-        // Verify that we have not exceeded the maximum number of retries.
-        if (alarmCount >= MAX_RETRIES)
+        pos = write_param(field, pos, PARAM_ACK_EVERY, params->ackEvery, 1);
+        pos = write_param(field, pos, PARAM_ACK_DELAY, params->ackDelay, 2);
+    }
+
+    // A receiver that does not know it answers as in simplex, which the
+    // transmitter takes as a refusal
+    if (params->duplex)
+        pos = write_param(field, pos, PARAM_DUPLEX, params->duplex, 1);
+    if (params->compress != COMPRESS_NONE)
+        pos = write_param(field, pos, PARAM_COMPRESS, params->compress, 1);
+    if (params->fec > 0)
+        pos = write_param(field, pos, PARAM_FEC, params->fec, 1);
+
+    // A receiver that does not know them stays at SAFE_BAUD_RATE and with
+    // flags and byte stuffing
+    if (params->baudRate > 0)
+        pos = write_param(field, pos, PARAM_BAUD, params->baudRate, 4);
+    if (params->framing != FRAMING_HDLC)
+        pos = write_param(field, pos, PARAM_FRAMING, params->framing, 1);
+
+    return pos;
+}
+
+// Reads the parameters from the information field of a SET or UA frame.
+// Values are 1 to 4 bytes long, most significant first. Unknown parameters
+// are ignored. Returns 0 if the result is a valid set of parameters, -1
+// otherwise.
+static int read_params(const unsigned char *field, int length, ll_params_t *params)
+{
+    llparams_default(params);
+
+    int pos = 0;
+    while (pos + 2 <= length)
+    {
+        int type = field[pos];
+        int paramLength = field[pos + 1];
+        const unsigned char *value = &field[pos + 2];
+
+        if (pos + 2 + paramLength > length)
+            return -1;
+
+        if (paramLength >= 1 && paramLength <= 4)
         {
-            // Retries exceeded
-            #ifdef DEBUG
-            printf("[Read command] Time out. Returning\n");
-            #endif
-            return TIMEOUT_ERROR;
+            unsigned int v = 0;
+            for (int i = 0; i < paramLength; i++)
+                v = (v << 8) | value[i];
+
+            switch (type)
+            {
+                case PARAM_ARQ:
+                    params->arq = v;
+                    break;
+                case PARAM_SEQ_BITS:
+                    params->seqBits = v;
+                    break;
+                case PARAM_WINDOW:
+                    params->window = v;
+                    break;
+                case PARAM_FCS:
+                    // A frame check we do not know falls back to BCC2
+                    params->fcs = fcs_size(v) > 0 ? (int)v : FCS_XOR;
+                    break;
+                case PARAM_MAX_PAYLOAD:
+                    params->maxPayload = v;
+                    break;
+                case PARAM_ACK_EVERY:
+                    params->ackEvery = v;
+                    break;
+                case PARAM_ACK_DELAY:
+                    params->ackDelay = v;
+                    break;
+                case PARAM_DUPLEX:
+                    params->duplex = v != 0;
+                    break;
+                case PARAM_COMPRESS:
+                    // A codec we do not know means no compression
+                    params->compress = v == COMPRESS_LZ ? COMPRESS_LZ : COMPRESS_NONE;
+                    break;
+                case PARAM_FEC:
+                    // More than we can correct means no correction
+                    params->fec = v <= MAX_FEC ? (int)v : 0;
+                    break;
+                case PARAM_BAUD:
+                    params->baudRate = v >= MIN_BAUD_RATE && v <= INT32_MAX ? (int)v : 0;
+                    break;
+                case PARAM_FRAMING:
+                    // A framing we do not know means flags and byte stuffing
+                    params->framing = v == FRAMING_COBS ? FRAMING_COBS : FRAMING_HDLC;
+                    break;
+            }
         }
 
-        // Check if we need to retransmit and if the command to retransmit is valid.
-        if (RETRANSMIT && RPT != NULL)
+        pos += 2 + paramLength;
+    }
+
+    return check_params(params);
+}
+
+// Builds a SET or UA frame. The parameters are only sent when they differ
+// from the original protocol, so the frame stays compatible with it.
+static int build_open_frame(ll_conn_t *conn, unsigned char *frame, int type, const ll_params_t *params)
+{
+    if (params->arq == ARQ_STOP_AND_WAIT && params->fcs == FCS_XOR && params->maxPayload == MAX_SIZE &&
+        params->compress == COMPRESS_NONE && params->fec == 0 && params->baudRate == 0 &&
+        params->framing == FRAMING_HDLC)
+        return build_command(conn, frame, type, 0);
+
+    unsigned char field[MAX_PARAMS_SIZE];
+    struct iovec iov = {field, write_params(field, params)};
+    int length = build_header(conn, frame, type, 0);
+
+    return build_data_field(frame, length, &iov, 1, FCS_XOR, NULL, NULL, conn->framing);
+}
+
+// Allocates the frame buffers for the parameters in linkParams: the
+// I-frames of the transmitter window, the frame being received, the
+// reorder buffer, the kept frames and the compression and FEC scratch space.
+// They are kept in a single block, which replaces the one of the previous
+// connection.
+// Returns 0 if successful, -1 if there is not enough memory.
+static int alloc_buffers(ll_conn_t *conn)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
+    int reorder = conn->linkParams.arq == ARQ_SELECTIVE_REPEAT ? modulus : 0;
+    int kept = conn->linkParams.duplex ? modulus : 0;
+    int compress = conn->linkParams.compress != COMPRESS_NONE;
+    size_t frameSize = FRAME_SIZE(max_field(conn));
+    size_t parity = max_field(conn) - conn->linkParams.maxPayload;
+
+    unsigned char *block = malloc((modulus + 1) * frameSize +
+                                  (reorder + kept + compress) * (size_t)conn->linkParams.maxPayload + parity);
+    if (block == NULL)
+    {
+        perror("[LL] Could not allocate frame buffers");
+        return -1;
+    }
+
+    free(conn->linkBuffers);
+    conn->linkBuffers = block;
+
+    lz_free(conn->txStream);
+    lz_free(conn->rxStream);
+    conn->txStream = NULL;
+    conn->rxStream = NULL;
+    conn->compressBuffer = NULL;
+    if (compress)
+    {
+        conn->txStream = lz_create(conn->linkParams.maxPayload);
+        conn->rxStream = lz_create(conn->linkParams.maxPayload);
+        if (conn->txStream == NULL || conn->rxStream == NULL)
+        {
+            perror("[LL] Could not allocate the compression history");
+            return -1;
+        }
+        conn->compressBuffer = block + (modulus + 1) * frameSize +
+                               (reorder + kept) * (size_t)conn->linkParams.maxPayload;
+    }
+
+    fec_free(conn->fecCode);
+    conn->fecCode = NULL;
+    conn->fecParity = NULL;
+    if (conn->linkParams.fec > 0)
+    {
+        conn->fecCode = fec_create(conn->linkParams.fec);
+        if (conn->fecCode == NULL)
+        {
+            perror("[LL] Could not allocate the FEC tables");
+            return -1;
+        }
+        conn->fecParity = block + (modulus + 1) * frameSize +
+                          (reorder + kept + compress) * (size_t)conn->linkParams.maxPayload;
+    }
+
+    for (int i = 0; i < modulus; i++)
+        conn->txFrames[i] = block + i * frameSize;
+
+    unsigned char *rxFrame = block + modulus * frameSize;
+    parser_init(&conn->parser, rxFrame, frameSize, conn->linkParams.seqBits, conn->linkParams.duplex,
+                conn->linkParams.compress != COMPRESS_NONE);
+    parser_set_framing(&conn->parser, conn->framing);
+
+    for (int i = 0; i < reorder; i++)
+        conn->rxBuffer[i] = rxFrame + frameSize + i * (size_t)conn->linkParams.maxPayload;
+    for (int i = 0; i < kept; i++)
+        conn->keptFrames[i] = rxFrame + frameSize + (reorder + i) * (size_t)conn->linkParams.maxPayload;
+
+    return 0;
+}
+
+// Frees the frame buffers, the timer and the connection itself when the
+// connection is closed.
+static void free_connection(ll_conn_t *conn)
+{
+    free(conn->tracePath);
+    free(conn->linkBuffers);
+    lz_free(conn->txStream);
+    lz_free(conn->rxStream);
+    fec_free(conn->fecCode);
+
+    if (conn->timerFd >= 0)
+        close(conn->timerFd);
+    if (conn->ackTimerFd >= 0)
+        close(conn->ackTimerFd);
+
+    free(conn);
+}
+
+// Waits until the bytes written have left the transport.
+static void drain(ll_conn_t *conn)
+{
+    if (conn->transport->ops->drain != NULL)
+        conn->transport->ops->drain(conn->transport);
+}
+
+// Restores the serial port and frees the connection without telling the
+// other end.
+static int force_close_port(ll_conn_t *conn)
+{
+    int res = 0;
+
+    if (conn->transport != NULL)
+    {
+        // The last frame must leave at the agreed rate before the old one
+        // is restored
+        if (conn->linkParams.baudRate > 0)
         {
-            // Reset retransmit state
-            RETRANSMIT = FALSE;
-            // Resend frame
-            write(fd, RPT, BUF_SIZE);
-            sleep(1);
-
-            // Assuming we have not yet exceeded the retries, restart the alarm
-            alarm(ALARM_TIMEOUT);
-            alarmEnabled = TRUE;
+            drain(conn);
+            usleep(BAUD_SETTLE_MS * 1000);
         }
- 
-        
-        int bytes = read(fd, &in_byte, 1);
-        //printf("Current state: %d\n", state);
-        //printf("Byte read: 0x%02X\n", in_byte);
-        
-        switch (state)
+
+        // Restore the old port settings
+        res = lltransport_close(conn->transport);
+    }
+
+    free_connection(conn);
+
+    return res;
+}
+
+// Milliseconds needed to send the largest frame through the serial port,
+// with 10 bits per byte (8 data bits, start and stop bit). Transports
+// without a line rate take no time.
+static int frame_time(ll_conn_t *conn)
+{
+    if (conn->lineRate <= 0)
+        return 0;
+
+    return (long long)FRAME_SIZE(max_field(conn)) * 1000 * 10 / conn->lineRate;
+}
+
+// Starts the round trip estimates for a new connection. Until a round trip
+// is measured the timeout allows for sending the largest frame.
+// The timeout always allows for the receiver delaying its acknowledgment.
+static void reset_rtt(ll_conn_t *conn)
+{
+    conn->rttValid = FALSE;
+    conn->srtt = 0;
+    conn->rttvar = 0;
+    conn->rto = ACK_TIMEOUT_MS + frame_time(conn) + conn->linkParams.ackDelay;
+}
+
+// Adds a round trip sample (microseconds) to the estimates and sets the
+// timeout from them, as in RFC 6298: RTO = SRTT + 4*RTTVAR.
+static void update_rtt(ll_conn_t *conn, long long sample)
+{
+    if (!conn->rttValid)
+    {
+        conn->srtt = sample;
+        conn->rttvar = sample / 2;
+        conn->rttValid = TRUE;
+    }
+    else
+    {
+        long long error = sample - conn->srtt;
+        conn->srtt += error / 8;
+        conn->rttvar += ((error < 0 ? -error : error) - conn->rttvar) / 4;
+    }
+
+    conn->rto = (conn->srtt + 4 * conn->rttvar + 999) / 1000;
+    if (conn->rto < RTO_MIN_MS)
+        conn->rto = RTO_MIN_MS;
+    conn->rto += conn->linkParams.ackDelay;
+    if (conn->rto > RTO_MAX_MS + frame_time(conn))
+        conn->rto = RTO_MAX_MS + frame_time(conn);
+}
+
+// Doubles the timeout after a retransmission (exponential backoff). It stays
+// that way until a frame that was only sent once is acknowledged.
+static void backoff_rtt(ll_conn_t *conn)
+{
+    conn->rto *= 2;
+    if (conn->rto > RTO_MAX_MS + frame_time(conn))
+        conn->rto = RTO_MAX_MS + frame_time(conn);
+}
+
+// Clears the transmitter and receiver windows for a new connection.
+static void reset_windows(ll_conn_t *conn)
+{
+    conn->txBase = 0;
+    conn->txNextSeq = 0;
+    conn->txOutstanding = 0;
+    conn->txTimeoutAt = 0;
+    conn->rxExpectedSeq = 0;
+    conn->rxRejSent = FALSE;
+    conn->ackPending = 0;
+
+    memset(conn->rxBuffered, 0, sizeof(conn->rxBuffered));
+    memset(conn->rxSrejSent, 0, sizeof(conn->rxSrejSent));
+    conn->rxDeliverSeq = 0;
+    conn->rxOccupancy = 0;
+    conn->rxPeakOccupancy = 0;
+    conn->keptFirst = 0;
+    conn->keptCount = 0;
+    conn->keptRefused = FALSE;
+}
+
+// Switches the serial port to another rate.
+// Returns 0 if successful, -1 otherwise.
+static int set_line_rate(ll_conn_t *conn, int rate)
+{
+    ll_transport_t *transport = conn->transport;
+    if (transport->ops->set_rate == NULL || transport->ops->set_rate(transport, rate) < 0)
+    {
+        perror("[LL] Could not set the line rate");
+        return -1;
+    }
+
+    conn->lineRate = rate;
+    return 0;
+}
+
+// Moves the receiver to the agreed rate and framing once its UA has left,
+// and waits for the transmitter to repeat the SET with them, which is
+// answered with the same UA in the new framing. It waits a little longer
+// than the transmitter tries, so they are back at SAFE_BAUD_RATE and HDLC
+// framing at about the same time if it never comes.
+// Returns 0 if the SET came, TIMEOUT_ERROR if not and DEFAULT_ERROR on error.
+static int confirm_switch_rx(ll_conn_t *conn, const ll_params_t *agreed)
+{
+    frame_t frame;
+
+    // USB adapters return from tcdrain() while the UA is still in their
+    // FIFO, and switching would garble it
+    usleep(BAUD_SETTLE_MS * 1000);
+
+    if (agreed->baudRate == 0 || set_line_rate(conn, agreed->baudRate) == 0)
+    {
+        set_framing(conn, agreed->framing);
+        conn->uaLength = build_open_frame(conn, conn->uaFrame, FRAME_UA, agreed);
+
+        timer_start(conn, MAX_RETRIES * BAUD_CONFIRM_MS + BAUD_CONFIRM_MS / 2);
+        while (TRUE)
         {
-            case START:
-                if (in_byte == FLAG)
-                    state = FLAG_RCV;
+            int res = receive_frame(conn, &frame, WAIT_TIMER);
+            if (res < 0)
+                return DEFAULT_ERROR;
+            if (res == 0)
                 break;
 
-            case FLAG_RCV:
-                if (in_byte == A)
-                    state = A_RCV;
-                else if (in_byte == FLAG)
-                    state = FLAG_RCV;
-                else
-                    state = START;
+            if (frame.type == FRAME_SET)
+            {
+                timer_stop(conn);
+                write_frame(conn, conn->uaFrame, conn->uaLength);
+                return 0;
+            }
+        }
+    }
+
+    set_framing(conn, FRAMING_HDLC);
+    if (agreed->baudRate > 0 && set_line_rate(conn, SAFE_BAUD_RATE) != 0)
+        return DEFAULT_ERROR;
+
+    return TIMEOUT_ERROR;
+}
+
+// Moves the transmitter to the agreed rate and framing and repeats the SET
+// with them, every BAUD_CONFIRM_MS, once the receiver has switched as well.
+// Returns 0 if the UA came back, TIMEOUT_ERROR if not and DEFAULT_ERROR on
+// error.
+static int confirm_switch_tx(ll_conn_t *conn, const ll_params_t *agreed, const ll_params_t *asked,
+                             unsigned char *setFrame)
+{
+    if (agreed->baudRate > 0 && set_line_rate(conn, agreed->baudRate) != 0)
+        return TIMEOUT_ERROR;
+    set_framing(conn, agreed->framing);
+    usleep(2 * BAUD_SETTLE_MS * 1000);
+
+    int setLength = build_open_frame(conn, setFrame, FRAME_SET, asked);
+    write_frame(conn, setFrame, setLength);
+    return wait_command(conn, C_UA, setFrame, setLength, BAUD_CONFIRM_MS, NULL);
+}
+
+// Highest line rate up to limit that the transport can make, 0 if none.
+static int highest_rate(ll_conn_t *conn, int limit)
+{
+    ll_transport_t *transport = conn->transport;
+    if (transport->ops->highest_rate == NULL)
+        return 0;
+
+    return transport->ops->highest_rate(transport, limit);
+}
+
+// Exchanges SET and UA with the other end through the transport.
+// Returns 0 if successful, DEFAULT_ERROR or TIMEOUT_ERROR otherwise.
+static int establish(ll_conn_t *conn, const ll_params_t *requested)
+{
+    conn->lineRate = conn->transport->lineRate;
+
+    // Retransmission and acknowledgment timers, kept until the connection
+    // is closed
+    conn->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    conn->ackTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (conn->timerFd < 0 || conn->ackTimerFd < 0)
+    {
+        perror("timerfd_create");
+        return DEFAULT_ERROR;
+    }
+    timer_stop(conn);
+
+    printf("Will open in %d mode\n", conn->role);
+
+    // Every connection starts with the original protocol until the
+    // parameters are agreed.
+    llparams_default(&conn->linkParams);
+    if (alloc_buffers(conn) != 0)
+        return DEFAULT_ERROR;
+    reset_windows(conn);
+    reset_rtt(conn);
+    reset_error_rate(conn);
+    conn->rxHead = 0;
+    conn->rxTail = 0;
+
+    // In case it is called by RX device.
+    if (conn->role == RX)
+    {
+        // Wait for the SET until the receive deadline, forever if there
+        // is none
+        frame_t frame;
+        ll_params_t agreed;
+        long long start;
+
+        start_rx_deadline(conn);
+        while (TRUE)
+        {
+            int res = receive_frame(conn, &frame, WAIT_RX);
+            if (res < 0)
+                return DEFAULT_ERROR;
+            if (res == 0)
+            {
+                printf("[LL] No SET received before the deadline\n");
+                return TIMEOUT_ERROR;
+            }
+
+            if (frame.type != FRAME_SET)
+                continue;
+
+            // A SET without information field asks for the original protocol
+            if (frame.length == 0)
+                llparams_default(&agreed);
+            else if (!frame.isDataValid || read_params(frame.data, frame.length, &agreed) != 0)
+                continue;
+
+            // Offer the highest rate up to the one asked for that we allow
+            // and our serial port can make
+            int limit = agreed.baudRate;
+            if (requested->baudRate > 0 && requested->baudRate < limit)
+                limit = requested->baudRate;
+            agreed.baudRate = limit > 0 ? highest_rate(conn, limit) : 0;
+
+            // Write UA command to begin communication, with the agreed parameters
+            #ifdef DEBUG
+            printf("Sending UA command...\n");
+            #endif
+            start = now_us();
+            conn->uaLength = build_open_frame(conn, conn->uaFrame, FRAME_UA, &agreed);
+            int bytes = write_frame(conn, conn->uaFrame, conn->uaLength);
+
+            // Wait until all bytes have been written to the serial port
+            drain(conn);
+
+            if (bytes == conn->uaLength)
+            {
+                #ifdef DEBUG
+                printf("%d bytes written\nSent:\n", bytes);
+                for (int i = 0; i < conn->uaLength; i++)
+                {
+                    printf("0x%02X, ", conn->uaFrame[i]);
+                }
+                printf("\n");
+                #endif
+            }
+            else if (bytes <= 0)
+            {
+                perror("Could not write frame\n");
+                return DEFAULT_ERROR;
+            }
+
+            if (agreed.baudRate == 0 && agreed.framing == FRAMING_HDLC)
                 break;
 
-            case A_RCV:
-                if (in_byte == FLAG)
-                    state = FLAG_RCV;
-                else if (in_byte == C)
-                    state = C_RCV;
-                else 
-                    state = START;
+            // Both ends switch now. If the transmitter does not show up at
+            // the new rate or framing we are both back at the safe ones and
+            // it will send the SET again.
+            res = confirm_switch_rx(conn, &agreed);
+            if (res == 0)
                 break;
+            if (res == DEFAULT_ERROR)
+                return DEFAULT_ERROR;
+
+            if (agreed.baudRate > 0)
+                printf("[LL] No SET at %d baud, back to %d baud\n", agreed.baudRate, SAFE_BAUD_RATE);
+            else
+                printf("[LL] No SET with COBS framing, back to HDLC framing\n");
+        }
+
+        conn->linkParams = agreed;
+        if (alloc_buffers(conn) != 0)
+            return DEFAULT_ERROR;
+        reset_rtt(conn);
+        reset_error_rate(conn);
+        conn->openedAt = now_us();
+        conn->timing.openUs = conn->openedAt - start;
+
+        // If we reach this point connection has been established.
+        if (agreed.baudRate > 0)
+            printf("[LL] Line rate %d baud\n", agreed.baudRate);
+        if (agreed.framing == FRAMING_COBS)
+            printf("[LL] COBS framing\n");
+        printf("[LL] Connection established\n");
+        return 0;
+    }
+
+    // This portion will only execute if called as TX device.
+
+    // Ask for the highest rate up to the one requested that our serial
+    // port can make
+    ll_params_t asked = *requested;
+    if (asked.baudRate > 0)
+        asked.baudRate = highest_rate(conn, asked.baudRate);
+
+    long long start = now_us();
+    unsigned char setFrame[MAX_FRAME_SIZE];
+    ll_params_t agreed;
+
+    while (TRUE)
+    {
+        // Write SET command to begin communication
+        #ifdef DEBUG
+        printf("Sending SET command...\n");
+        #endif
+        int setLength = build_open_frame(conn, setFrame, FRAME_SET, &asked);
+        int bytes = write_frame(conn, setFrame, setLength);
+
+        // Wait until all bytes have been written to the serial port
+        drain(conn);
+
+        if (bytes == setLength)
+        {
+            #ifdef DEBUG
+            printf("%d bytes written\nSent:\n", bytes);
+            for (int i = 0; i < setLength; i++)
+            {
+                printf("0x%02X, ", setFrame[i]);
+            }
+            printf("\n");
+            #endif
+        }
+        else if (bytes == -1)
+        {
+            perror("write");
+            return DEFAULT_ERROR;
+        }
+
+        // Read UA command and wait
+        frame_t frame;
+        int err = wait_command(conn, C_UA, setFrame, setLength, COMMAND_TIMEOUT_MS, &frame);
+        if (err != 0)
+            return err;
+
+        #ifdef DEBUG
+        else
+        {
+            printf("UA command received successfully!\n");
+        }
+        #endif
+
+        // A receiver that only knows the original protocol answers with a
+        // plain UA, in which case we fall back to stop-and-wait.
+        if (frame.length == 0)
+            llparams_default(&agreed);
+        else if (read_params(frame.data, frame.length, &agreed) != 0)
+        {
+            printf("[LL] Invalid parameters in UA\n");
+            return DEFAULT_ERROR;
+        }
 
-            case C_RCV:
-                if (in_byte == (BCC1))
-                    state = BCC_OK;
-                else if (in_byte == FLAG)
-                    state = FLAG_RCV;
-                else
-                    state = START;
-                break;
+        if (agreed.baudRate == 0 && agreed.framing == FRAMING_HDLC)
+            break;
 
-            case BCC_OK:
-                if (in_byte == FLAG)
-                {
-                    state = STOP;
-                    //printf("Read successfull\n");
-                    alarm(0); // Disable alarm
-                    alarmEnabled = FALSE;
-                }
-                else
-                    state = START;
-                break;
-            case STOP:
-                    run = FALSE;
-                break;
+        // The receiver switches as soon as its UA has left
+        err = confirm_switch_tx(conn, &agreed, &asked, setFrame);
+        if (err == 0)
+            break;
+        if (err == DEFAULT_ERROR)
+            return DEFAULT_ERROR;
 
-            default:
-                state = START;
-                break;
+        // We cannot hear each other at that rate or with that framing. Go
+        // back to the safe ones after the receiver has given up as well,
+        // and ask again for them.
+        set_framing(conn, FRAMING_HDLC);
+        if (agreed.baudRate > 0)
+        {
+            printf("[LL] No UA at %d baud, back to %d baud\n", agreed.baudRate, SAFE_BAUD_RATE);
+            if (set_line_rate(conn, SAFE_BAUD_RATE) != 0)
+                return DEFAULT_ERROR;
         }
-
-        //printf("New state: %d\n", state);
+        else
+            printf("[LL] No UA with COBS framing, back to HDLC framing\n");
+        usleep(BAUD_CONFIRM_MS * 1000);
+        asked.baudRate = 0;
+        asked.framing = FRAMING_HDLC;
     }
 
+    conn->linkParams = agreed;
+    if (alloc_buffers(conn) != 0)
+        return DEFAULT_ERROR;
+    reset_rtt(conn);
+    reset_error_rate(conn);
+    conn->openedAt = now_us();
+    conn->timing.openUs = conn->openedAt - start;
+
+    // At this point the connection has been established
+    if (agreed.baudRate > 0)
+        printf("[LL] Line rate %d baud\n", agreed.baudRate);
+    if (agreed.framing == FRAMING_COBS)
+        printf("[LL] COBS framing\n");
+    printf("[LL] Connection established\n");
+
     return 0;
 }
 
-int llopen(int portNumber, int role)
+ll_conn_t *llopen_transport(ll_transport_t *transport, int role, const ll_params_t *params, int *error)
 {
+    if (error != NULL)
+        *error = DEFAULT_ERROR;
+    if (transport == NULL)
+        return NULL;
+
     // Check if the status is valid
     if (role != TX && role != RX)
     {
         perror("Invalid role");
-        return DEFAULT_ERROR;
+        lltransport_close(transport);
+        return NULL;
     }
 
-    // Create the serial port name
-    char serialPortName[20];
-    sprintf(serialPortName, "/dev/ttyS%d", portNumber);
+    ll_params_t requested;
+    if (params != NULL)
+        requested = *params;
+    else
+        llparams_default(&requested);
 
-    // Open serial port device for reading and writing, and not as controlling tty
-    // because we don't want to get killed if linenoise sends CTRL-C.
-    int fd = open(serialPortName, O_RDWR | O_NOCTTY);
+    if (llcheckparams(&requested) != 0)
+    {
+        printf("[LL] Invalid link parameters\n");
+        lltransport_close(transport);
+        return NULL;
+    }
 
-    // Check if the port was opened successfully
-    if (fd < 0)
+    ll_conn_t *conn = calloc(1, sizeof(ll_conn_t));
+    if (conn == NULL)
     {
-        perror(serialPortName);
-        return DEFAULT_ERROR;
+        perror("[LL] Could not allocate the connection");
+        lltransport_close(transport);
+        return NULL;
     }
 
-    // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1)
+    conn->transport = transport;
+    conn->timerFd = -1;
+    conn->ackTimerFd = -1;
+    conn->role = role;
+    conn->port = transport->port;
+    trace_init(&conn->trace);
+    conn->rxTimeout = requested.rxTimeout > 0 ? requested.rxTimeout : 0;
+
+    int err = establish(conn, &requested);
+    if (err != 0)
     {
-        perror("tcgetattr");
-        return DEFAULT_ERROR;
+        if (error != NULL)
+            *error = err;
+        force_close_port(conn);
+        return NULL;
     }
 
-    // Clear struct for new port settings
-    memset(&newtio, 0, sizeof(newtio));
+    return conn;
+}
+
+ll_conn_t *llopen(int portNumber, int role, const ll_params_t *params, int *error)
+{
+    if (error != NULL)
+        *error = DEFAULT_ERROR;
 
-    newtio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio.c_iflag = IGNPAR;
-    newtio.c_oflag = 0;
+    // Create the serial port name
+    char serialPortName[20];
+    sprintf(serialPortName, "/dev/ttyS%d", portNumber);
 
-    // Set input mode (non-canonical, no echo,...)
-    newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 1; // Wait 0.1s for a character to arrive
-    newtio.c_cc[VMIN] = 0;  // Can return 0 bytes if nothing has arrived at that point
+    ll_transport_t *transport = lltransport_tty(serialPortName);
+    if (transport == NULL)
+        return NULL;
+    transport->port = portNumber;
 
-    // Now clean the line and activate the settings for the port
-    // tcflush() discards data written to the object referred to
-    // by fd but not transmitted, or data received but not read,
-    // depending on the value of queue_selector:
-    // TCIOFLUSH - flushes data received but not read.
-    tcflush(fd, TCIOFLUSH);
+    return llopen_transport(transport, role, params, error);
+}
 
-    // Set new port settings
-    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+// Sends the I-frame with sequence number seq again.
+static int retransmit_frame(ll_conn_t *conn, int seq)
+{
+    // Karn's rule: the acknowledgment could be for either copy, so this
+    // frame can no longer be used to measure the round trip
+    conn->txResent[seq] = TRUE;
+
+    int bytes_written;
+    unsigned char header[1 + 2*5];
+    const unsigned char *start = conn->txFrames[seq];
+    if (conn->linkParams.duplex)
     {
-        perror("tcsetattr");
-        return DEFAULT_ERROR;
+        // The header is built again so it acknowledges what we received
+        // since the frame was first sent
+        int headerLength = build_header(conn, header, FRAME_I, seq);
+        int skip = conn->txHeaderLength[seq];
+        struct iovec iov[2] = {{header, headerLength},
+                               {conn->txFrames[seq] + skip, conn->txFrameLength[seq] - skip}};
+
+        bytes_written = conn->transport->ops->write(conn->transport, iov, 2);
+        clear_ack(conn);
+        start = header;
+    }
+    else
+    {
+        struct iovec iov = {conn->txFrames[seq], conn->txFrameLength[seq]};
+        bytes_written = conn->transport->ops->write(conn->transport, &iov, 1);
     }
 
-	// Set alarm function handler
-    // Very important: sleep() can be interrupted by signals
-    (void)signal(SIGALRM, alarmHandler);
+    if (bytes_written <= 0)
+    {
+        #ifdef DEBUG
+        printf("[LL] Error writing to serial port. Could not retransmit. (%d)\n", bytes_written);
+        #endif
+        return -1;
+    }
 
-    printf("Will open in %d mode\n", role);
+    conn->stats.framesSent++;
+    conn->stats.bytesSent += bytes_written;
+    trace_written(conn, TRACE_RESENT, start, bytes_written);
 
-    // In case it is called by RX device.
-    if (role == RX)
-    {
-        // NO TIMEOUT
-        // Wait forever until something is received 
-        
-        int state = START;
-        int run = TRUE;
-        unsigned char in_byte;
+    conn->stats.retransmissions++;
+    conn->stats.retransmitBytes += bytes_written;
 
-        while (run)
-        {
-            int bytes = read(fd, &in_byte, 1);
-            if (bytes <= 0)
-            {
-                continue;
-            }
-        
-            switch (state)
-            {
-                case START:
-                    if (in_byte == FLAG)
-                        state = FLAG_RCV;
-                    break;
+    return 0;
+}
 
-            case FLAG_RCV:
-                if (in_byte == SET[1])
-                    state = A_RCV;
-                else if (in_byte == FLAG)
-                    state = FLAG_RCV;
-                else
-                    state = START;
-                break;
+// Sends every unacknowledged I-frame again, starting with the oldest one.
+// Selective Repeat only needs the oldest one, the receiver keeps the rest.
+// Returns the number of I-frames sent, -1 on error.
+static int retransmit_window(ll_conn_t *conn)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
+    int count = conn->linkParams.arq == ARQ_SELECTIVE_REPEAT ? 1 : conn->txOutstanding;
 
-            case A_RCV:
-                if (in_byte == FLAG)
-                    state = FLAG_RCV;
-                else if (in_byte == SET[2])
-                    state = C_RCV;
-                else 
-                    state = START;
-                break;
+    for (int i = 0; i < count; i++)
+    {
+        if (retransmit_frame(conn, (conn->txBase + i) % modulus) < 0)
+            return -1;
+    }
 
-            case C_RCV:
-                if (in_byte == SET[3])
-                    state = BCC_OK;
-                else if (in_byte == FLAG)
-                    state = FLAG_RCV;
-                else
-                    state = START;
-                break;
+    #ifdef DEBUG
+    printf("[LL] Retransmitted %d I-frame(s) from I%d\n", count, conn->txBase);
+    #endif
 
-            case BCC_OK:
-                if (in_byte == FLAG)
-                {
-                    state = STOP;
-                    run = FALSE;
-                }
-                else
-                    state = START;
-                break;
-            case STOP:
-                    run = FALSE;
-                break;
+    return count;
+}
 
-            default:
-                state = START;
-                break;
-            }
+// Counts an I-frame that was lost or damaged in the error rate estimate,
+// once even if it is asked for again.
+static void count_lost(ll_conn_t *conn, int seq)
+{
+    if (conn->txLost[seq])
+        return;
 
-            printf("New state: %d\n", state);
-        }
+    conn->txLost[seq] = TRUE;
+    conn->errorFrames += 1;
+}
 
-        // Write UA command to begin communication
-        #ifdef DEBUG
-        printf("Sending UA command...\n");
-        #endif
-        int bytes = write(fd, UA, BUF_SIZE);
+// Marks every I-frame before nr as acknowledged.
+// Returns TRUE if nr is inside the window.
+static int acknowledge(ll_conn_t *conn, int nr)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
+    int acked = (nr - conn->txBase + modulus) % modulus;
 
-        // Wait until all bytes have been written to the serial port
-        sleep(1);
+    if (acked > conn->txOutstanding)
+    {
+        // Not for any frame in the window, probably a duplicate
+        return FALSE;
+    }
 
-        if (bytes == BUF_SIZE)
-        {
-            #ifdef DEBUG
-            printf("%d bytes written\nSent:\n", bytes);
-            for (int i = 0; i < BUF_SIZE; i++)
-            {
-                printf("0x%02X, ", UA[i]);
-            }
-            printf("\n");
-            #endif
-        }
-        else if (bytes <= 0)
+    if (acked > 0)
+    {
+        // The round trip is measured on the newest frame acknowledged,
+        // unless it was retransmitted or sent before the last timeout: its
+        // acknowledgment may have waited for the frames lost before it
+        long long now = now_us();
+        int newest = (nr - 1 + modulus) % modulus;
+        if (!conn->txResent[newest] && conn->txSentAt[newest] > conn->txTimeoutAt)
+            update_rtt(conn, now - conn->txSentAt[newest]);
+
+        for (int i = 0; i < acked; i++)
         {
-            perror("Could not write frame\n");
-            return DEFAULT_ERROR;
+            int seq = (conn->txBase + i) % modulus;
+            if (!conn->txResent[seq])
+                histogram_add(&conn->stats.latency, now - conn->txSentAt[seq]);
         }
 
-        // If we reach this point connection has been established.
-        printf("[LL] Connection established\n");
-        // Return the file descriptor of the serial port
-        return fd;
+        conn->txBase = nr;
+        conn->txOutstanding -= acked;
+
+        // The receiver made progress, restart the retries
+        conn->retryCount = 0;
+        if (conn->txOutstanding > 0)
+            timer_start(conn, conn->rto);
+        else
+            timer_stop(conn);
     }
 
-    // This portion will only execute if called as TX device.
+    return TRUE;
+}
 
-    // Write SET command to begin communication
-    #ifdef DEBUG
-    printf("Sending SET command...\n");
-    #endif
-    int bytes = write(fd, SET, BUF_SIZE);
+// Counts an I-frame that was received before and is dropped.
+static void count_duplicate(ll_conn_t *conn, frame_t *frame)
+{
+    conn->stats.duplicates++;
+    trace_add(&conn->trace, TRACE_CODE(TRACE_DUPLICATE, TRACE_FRAME_I), frame->C, frame->ns, frame->nr,
+              frame->length);
+}
 
-    // Wait until all bytes have been written to the serial port
-    sleep(1);
+// Sends SREJ for every frame between the expected one and seq that is
+// neither in the reorder buffer nor already requested.
+static void request_missing(ll_conn_t *conn, int seq)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
 
-    if (bytes == BUF_SIZE)
+    for (int s = conn->rxExpectedSeq; s != seq; s = (s + 1) % modulus)
     {
-        #ifdef DEBUG
-        printf("%d bytes written\nSent:\n", bytes);
-        for (int i = 0; i < BUF_SIZE; i++)
+        if (!conn->rxBuffered[s] && !conn->rxSrejSent[s])
         {
-            printf("0x%02X, ", SET[i]);
+            send_ack(conn, FRAME_SREJ, s);
+            conn->rxSrejSent[s] = TRUE;
         }
-        printf("\n");
-        #endif
     }
-    else if (bytes == -1)
+}
+
+// Moves the I-frames that were acknowledged but not handed to the
+// application yet, from rxDeliverSeq to rxExpectedSeq, from the reorder
+// buffer to the kept frames. Their buffers are swapped, not copied.
+static void keep_waiting(ll_conn_t *conn)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
+
+    for (; conn->rxDeliverSeq != conn->rxExpectedSeq; conn->rxDeliverSeq = (conn->rxDeliverSeq + 1) % modulus)
     {
-        perror("write");
-        return DEFAULT_ERROR;
-    }
+        int seq = conn->rxDeliverSeq;
+        int slot = (conn->keptFirst + conn->keptCount) % modulus;
+        unsigned char *empty = conn->keptFrames[slot];
 
-    // Read UA command and wait
-    int err = read_command(fd, UA, SET);
-    if (err != 0)
-        return err;
+        conn->keptFrames[slot] = conn->rxBuffer[seq];
+        conn->keptLength[slot] = conn->rxBufferLength[seq];
+        conn->keptCompressed[slot] = conn->rxCompressed[seq];
+        conn->keptCount++;
 
-    #ifdef DEBUG
-    else
+        conn->rxBuffer[seq] = empty;
+        conn->rxBuffered[seq] = FALSE;
+    }
+}
+
+// Keeps an I-frame that arrived in order while the application was not
+// reading (full duplex llwrite), until the next llread. The frames waiting
+// in the reorder buffer before it, and in Selective Repeat the ones right
+// after it, become kept frames too.
+// Returns FALSE if there is no room for all of them, in which case the
+// frame must not be acknowledged either.
+static int keep_frame(ll_conn_t *conn, frame_t *frame)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
+    int count = (conn->rxExpectedSeq - conn->rxDeliverSeq + modulus) % modulus + 1;
+    if (conn->linkParams.arq == ARQ_SELECTIVE_REPEAT)
     {
-        printf("UA command received successfully!\n");
+        for (int i = 1; i < conn->linkParams.window && conn->rxBuffered[(frame->ns + i) % modulus]; i++)
+            count++;
+    }
+    if (conn->keptCount + count > modulus)
+    {
+        conn->keptRefused = TRUE;
+        return FALSE;
     }
-    #endif
 
-    // At this point the connection has been established
-    printf("[LL] Connection established\n");
+    keep_waiting(conn);
+
+    int slot = (conn->keptFirst + conn->keptCount) % modulus;
+    memcpy(conn->keptFrames[slot], frame->data, frame->length);
+    conn->keptLength[slot] = frame->length;
+    conn->keptCompressed[slot] = frame->compressed;
+    conn->keptCount++;
 
-    // Return the file descriptor of the serial port
-    return fd;
+    conn->rxOccupancy++;
+    if (conn->rxOccupancy > conn->rxPeakOccupancy)
+        conn->rxPeakOccupancy = conn->rxOccupancy;
+
+    return TRUE;
 }
 
-int llwrite(int fd, unsigned char *buffer, int length)
+// Forgets the I-frames kept for the application, which closed the connection.
+static void drop_kept_frames(ll_conn_t *conn)
 {
-    // Starts at 0 and will switch between 0 and 1 for I0 and I1 respectively
-    static int sequenceNumber = 0;
+    int modulus = 1 << conn->linkParams.seqBits;
 
-    // Check if the buffer is valid or not
-    if (buffer == NULL)
+    conn->rxOccupancy -= conn->keptCount;
+    conn->keptCount = 0;
+
+    for (; conn->rxDeliverSeq != conn->rxExpectedSeq; conn->rxDeliverSeq = (conn->rxDeliverSeq + 1) % modulus)
     {
-        perror("Buffer is NULL");
-        return -1;
+        conn->rxBuffered[conn->rxDeliverSeq] = FALSE;
+        conn->rxOccupancy--;
+    }
+}
+
+// Copies the data field of an I-frame to buffer, decompressing it if needed.
+// Data fields must go through here once each and in order, so the history
+// of the receiver stays the same as the one of the transmitter.
+// Returns the length of the data, -1 if it could not be decompressed.
+static int unpack(ll_conn_t *conn, const unsigned char *data, int length, int compressed,
+                  unsigned char *buffer)
+{
+    if (conn->rxStream == NULL)
+    {
+        memcpy(buffer, data, length);
+        conn->stats.deliveredBytes += length;
+        return length;
     }
 
-    // The buffer needs to be constructed into an I frame.
-    // We'll need 6 bytes for the frae
-    // Calculate the size of the I-frame, including byte stuffing
-    int final_size = length;
-    for (int i = 0; i < length; i++)
+    long long start = now_us();
+    int result = length;
+    if (compressed)
+        result = lz_decompress(conn->rxStream, data, length, buffer);
+    else
     {
-        if (buffer[i] == 0x7E || buffer[i] == 0x7D)
-        {
-            final_size++;
-        }
+        memcpy(buffer, data, length);
+        lz_append(conn->rxStream, buffer, length);
     }
+    conn->compressStats.decompressUs += now_us() - start;
 
-    // Calculate BCC2 (error detection byte)
-    unsigned char BCC2 = 0;
-    for (int i = 0; i < length; i++)
+    if (result < 0)
     {
-        BCC2 ^= buffer[i];
+        printf("[LL] Invalid compressed data field\n");
+        return -1;
     }
 
-    // Check if BCC2 needs byte stuffing
-    int is_BCC2_stuffed = (BCC2 == 0x7E || BCC2 == 0x7D) ? 1 : 0;
+    conn->compressStats.receivedBytes += length;
+    conn->compressStats.deliveredBytes += result;
+    conn->stats.deliveredBytes += result;
+
+    return result;
+}
+
+// Hands the I-frame that was expected to the application: it is copied to
+// buffer, kept for the next llread when buffer is NULL, or dropped after
+// llclose.
+// Returns the length of the data copied to buffer, NO_DATA if it was kept or
+// dropped, NO_ROOM if it could not be kept and DEFAULT_ERROR if it could not
+// be decompressed.
+static int deliver_frame(ll_conn_t *conn, frame_t *frame, unsigned char *buffer)
+{
+    if (buffer != NULL)
+    {
+        int length = unpack(conn, frame->data, frame->length, frame->compressed, buffer);
+        return length < 0 ? DEFAULT_ERROR : length;
+    }
 
-    // Allocate memory for the I-frame
-    unsigned char I_frame[6 + final_size + is_BCC2_stuffed];
+    if (!conn->closing && !keep_frame(conn, frame))
+        return NO_ROOM;
 
-    // Construct the I-frame
-    I_frame[0] = FLAG;                      // Start flag
-    I_frame[1] = 0x03;                      // Address field
-    I_frame[2] = sequenceNumber == 0 ? 0x00 : 0x40; // Control field (I0 or I1)
-    I_frame[3] = I_frame[1] ^ I_frame[2];   // BCC1 (Address XOR Control)
+    return NO_DATA;
+}
 
-    // In order to create the data field of the I frame we need to
-    // take into account byte stuffing. This occurs if 0x7E or 0x7D 
-    // are found in the data field. If so, the byte 0x7D is sent
-    // followed by the byte XORed with 0x20.
+// Handles an I-frame in Selective Repeat mode.
+// Returns the length of the data copied to buffer, NO_DATA if nothing can
+// be delivered yet and DEFAULT_ERROR on error.
+static int receive_selective(ll_conn_t *conn, frame_t *frame, unsigned char *buffer)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
+    int distance = (frame->ns - conn->rxExpectedSeq + modulus) % modulus;
 
-    // Add the data field with byte stuffing
-    int pos = 0, frame_pos = 0;
-    while (pos < length)
+    if (!frame->isDataValid)
     {
-        if (buffer[pos] == 0x7E || buffer[pos] == 0x7D)
-        {
-            I_frame[4 + frame_pos] = 0x7D;
-            I_frame[5 + frame_pos] = buffer[pos] ^ 0x20;
-            frame_pos += 2;
-        }
-        else
+        conn->stats.dataErrors++;
+
+        // The header is intact so we know which frame was damaged.
+        // Ask for it, and for any missing frame before it.
+        if (distance < conn->linkParams.window && !conn->rxBuffered[frame->ns])
         {
-            I_frame[4 + frame_pos] = buffer[pos];
-            frame_pos++;
+            request_missing(conn, frame->ns);
+            send_ack(conn, FRAME_SREJ, frame->ns);
+            conn->rxSrejSent[frame->ns] = TRUE;
         }
-        pos++;
+        return NO_DATA;
     }
 
-    // Add BCC2 with byte stuffing if necessary
-    if (is_BCC2_stuffed)
+    if (distance >= conn->linkParams.window)
     {
-        I_frame[4 + frame_pos] = 0x7D;
-        I_frame[5 + frame_pos] = BCC2 ^ 0x20;
-        frame_pos += 2;
+        // Already received, our acknowledgment was lost
+        count_duplicate(conn, frame);
+        send_ack(conn, FRAME_RR, conn->rxExpectedSeq);
+        return NO_DATA;
     }
-    else
+
+    if (distance > 0)
     {
-        I_frame[4 + frame_pos] = BCC2;
-        frame_pos++;
+        // Out of order, keep it and ask only for the missing frames
+        if (conn->rxBuffered[frame->ns])
+            count_duplicate(conn, frame);
+        else
+        {
+            memcpy(conn->rxBuffer[frame->ns], frame->data, frame->length);
+            conn->rxBufferLength[frame->ns] = frame->length;
+            conn->rxCompressed[frame->ns] = frame->compressed;
+            conn->rxBuffered[frame->ns] = TRUE;
+            conn->rxSrejSent[frame->ns] = FALSE;
+
+            conn->rxOccupancy++;
+            if (conn->rxOccupancy > conn->rxPeakOccupancy)
+                conn->rxPeakOccupancy = conn->rxOccupancy;
+        }
+        request_missing(conn, frame->ns);
+        return NO_DATA;
     }
 
-    // Add the end flag
-    I_frame[4 + frame_pos] = FLAG;
+    // The expected frame goes straight to the application. Frames after it
+    // that were waiting in the buffer are acknowledged now and delivered on
+    // the next calls to llread.
+    int length = deliver_frame(conn, frame, buffer);
+    if (length == NO_ROOM)
+        return NO_DATA;
+    if (length == DEFAULT_ERROR)
+        return DEFAULT_ERROR;
+    conn->rxSrejSent[frame->ns] = FALSE;
+
+    conn->rxExpectedSeq = (conn->rxExpectedSeq + 1) % modulus;
+    conn->rxDeliverSeq = conn->rxExpectedSeq;
+    while (conn->rxBuffered[conn->rxExpectedSeq])
+        conn->rxExpectedSeq = (conn->rxExpectedSeq + 1) % modulus;
+
+    // A kept frame goes before the ones that were waiting after it. After
+    // llclose nobody will read them, and their slots must be free when the
+    // sequence numbers come round again.
+    if (conn->closing)
+        drop_kept_frames(conn);
+    else if (buffer == NULL)
+        keep_waiting(conn);
 
-    // The I frame is now completed and we can send it to the receiver.
-    // We need to keep sending the I-frame until we receive an acknowledgment.
-    // State machine variables:
-    int is_ack_valid = FALSE;
-    int run = TRUE;
-    int state = START;
+    delay_ack(conn);
 
-    // Variables to store read data:
-    unsigned char in_byte = 0;
-    unsigned char command_read[BUF_SIZE];
-    int bytes_written = 0;
+    return length;
+}
+
+// Handles an I-frame in stop-and-wait and Go-Back-N modes.
+// Returns the length of the data copied to buffer, NO_DATA if there is
+// none and DEFAULT_ERROR on error.
+static int receive_in_order(ll_conn_t *conn, frame_t *frame, unsigned char *buffer)
+{
+    int modulus = 1 << conn->linkParams.seqBits;
 
-    // Reset the alarm
-    alarmCount = 0;
-    alarmEnabled = FALSE;
-    RETRANSMIT = FALSE;
+    // Distance to the expected frame tells if it is ahead of it
+    // (a frame was lost) or behind it (a repeated frame).
+    int distance = (frame->ns - conn->rxExpectedSeq + modulus) % modulus;
 
-    while (!is_ack_valid)
+    if (!frame->isDataValid)
     {
         #ifdef DEBUG
-        printf("[LL] Sending I-frame...\n");
+        printf("[LL] Frame check error\n");
         #endif
+        conn->stats.dataErrors++;
 
-        //tcflush(fd, TCIOFLUSH); // Flush the serial port
-        // Write the I-frame to the serial port
-        bytes_written = write(fd, I_frame, 5 + frame_pos);
-
-        // Check if the data was really written.
-        if (bytes_written < 0)
+        // Only one REJ is sent per lost frame. If the retransmitted
+        // frame also arrives damaged we ask for it again.
+        if (!conn->rxRejSent || distance == 0)
         {
-            printf("Error writing to serial port\n");
-            return -1;
+            send_ack(conn, FRAME_REJ, conn->rxExpectedSeq);
+            conn->rxRejSent = TRUE;
         }
+        return NO_DATA; // Discard frame;
+    }
 
-        #ifdef DEBUG
-        printf("%d bytes written\n", bytes_written);
-        for (int i = 0; i < 5 + frame_pos; i++)
+    if (distance != 0)
+    {
+        if (distance < conn->linkParams.window)
         {
-            printf("Sent: 0x%02X\n", I_frame[i]);
+            // Out of order, a frame before this one was lost
+            if (!conn->rxRejSent)
+            {
+                send_ack(conn, FRAME_REJ, conn->rxExpectedSeq);
+                conn->rxRejSent = TRUE;
+            }
         }
-        printf("[LL] Waiting for a response from the receiver...\n");
-        #endif
+        else
+        {
+            // Already received, our acknowledgment was lost
+            count_duplicate(conn, frame);
+            send_ack(conn, FRAME_RR, conn->rxExpectedSeq);
+        }
+        return NO_DATA;
+    }
 
-        // Wait until a response is received or timeout
+    // If we reach this point the frame is valid and we can tell the
+    // transmitter that we are ready for the next frame.
+    int length = deliver_frame(conn, frame, buffer);
+    if (length == NO_ROOM)
+        return NO_DATA;
+    if (length == DEFAULT_ERROR)
+        return DEFAULT_ERROR;
 
-        alarmEnabled = TRUE;
-        alarm(ALARM_TIMEOUT);
+    conn->rxExpectedSeq = (conn->rxExpectedSeq + 1) % modulus;
+    conn->rxDeliverSeq = conn->rxExpectedSeq;
+    conn->rxRejSent = FALSE;
+    delay_ack(conn);
 
-        run = TRUE;
-        state = START;
+    return length;
+}
 
-        while (run)
-        {
-            if (alarmCount > MAX_RETRIES)
-            {
-                // Retries exceeded
-                #ifdef DEBUG
-                printf("[LL] Time out. Returning\n");
-                #endif
-                return TIMEOUT_ERROR;
-            }
+// Handles a retransmission timeout, if the timer went off.
+// Returns 1 if it did, 0 if not and a negative value on error.
+static int handle_timeout(ll_conn_t *conn)
+{
+    // Nothing to retransmit if the window is empty
+    if (conn->txOutstanding == 0 || !timer_check(conn))
+        return 0;
 
-            // This is triggered in case no response is received from the receiver
-            if (RETRANSMIT)
-            {
-                // Reset retransmit state
-                RETRANSMIT = FALSE;
-                
-                // Resend frame
-                bytes_written = write(fd, I_frame, 5 + frame_pos);
-                //sleep(1);
+    if (conn->retryCount > MAX_DATA_RETRIES)
+    {
+        // Retries exceeded
+        #ifdef DEBUG
+        printf("[LL] Time out. Returning\n");
+        #endif
+        return TIMEOUT_ERROR;
+    }
 
-                #ifdef DEBUG
-                if (bytes_written <= 0)
-                {
-                    printf("[LL] Error writing to serial port. Could not retransmit. (%d)\n", bytes_written);
-                    return -1;
-                }
-                #endif
+    // Go back to the oldest unacknowledged frame. The frame or its
+    // acknowledgment was lost.
+    conn->stats.timeouts++;
+    conn->txTimeoutAt = now_us();
+    trace_add(&conn->trace, TRACE_CODE(TRACE_TIMEOUT, TRACE_FRAME_I), 0, conn->txBase, 0, 0);
+    count_lost(conn, conn->txBase);
+    int count = retransmit_window(conn);
+    if (count < 0)
+        return -1;
+    conn->stats.retransmitTimeout += count;
 
-                // Assuming we have not yet exceeded the retries, restart the alarm
-                alarm(ALARM_TIMEOUT);
-                alarmEnabled = TRUE;
-            }
+    // Assuming we have not yet exceeded the retries, restart the timer
+    // with twice the timeout
+    backoff_rtt(conn);
+    timer_start(conn, conn->rto);
 
-            // Read incmoming bytes from the serial port
-            int bytes = read(fd, &in_byte, 1);
-            // If no bytes are recieved skip this iteration
-            if (bytes == 0)
-            {
-                #ifdef DEBUG
-                printf("[LL] No bytes read\n");
-                #endif
+    #ifdef DEBUG
+    printf("[LL] Retransmission timeout now %d ms\n", conn->rto);
+    #endif
+    return 1;
+}
 
-                continue;
-            }
-            else if (bytes < 0)
-            {
-                #ifdef DEBUG
-                printf("[LL] Error reading from serial port\n");
-                #endif
+// Handles a response (RR/REJ/SREJ) from the receiver.
+// Returns 0 if successful, -1 if a retransmission failed.
+static int handle_response(ll_conn_t *conn, frame_t *frame)
+{
+    if (frame->type == FRAME_RR)
+    {
+        // RR is cumulative, every frame before N(R) was received
+        #ifdef DEBUG
+        printf("[LL] Acknowledgment (RR%d) received\n", frame->nr);
+        #endif
+        acknowledge(conn, frame->nr);
+    }
+    else if (frame->type == FRAME_REJ)
+    {
+        // Frames before N(R) were received, send again starting at N(R)
+        #ifdef DEBUG
+        printf("[LL] Negative acknowledgment (REJ%d) received\n", frame->nr);
+        #endif
+        if (acknowledge(conn, frame->nr) && conn->txOutstanding > 0)
+        {
+            count_lost(conn, frame->nr);
+            int count = retransmit_window(conn);
+            if (count < 0)
+                return -1;
+            conn->stats.retransmitRej += count;
 
+            timer_start(conn, conn->rto);
+        }
+    }
+    else if (frame->type == FRAME_SREJ)
+    {
+        // Only the frame N(R) is missing, the receiver kept the others
+        #ifdef DEBUG
+        printf("[LL] Selective reject (SREJ%d) received\n", frame->nr);
+        #endif
+        int modulus = 1 << conn->linkParams.seqBits;
+        if ((frame->nr - conn->txBase + modulus) % modulus < conn->txOutstanding)
+        {
+            count_lost(conn, frame->nr);
+            if (retransmit_frame(conn, frame->nr) < 0)
                 return -1;
-            }
-        
-            // Process frame
-            switch (state)
-            {
-                case START:
-                    if (in_byte == FLAG)
-                        state = FLAG_RCV;
-                        command_read[0] = in_byte;
-                    break;
+            conn->stats.retransmitSrej++;
+        }
+    }
 
-                case FLAG_RCV:
-                    if (in_byte == 0x03)
-                    {
-                        state = A_RCV;
-                        command_read[1] = in_byte;
-                    }
-                    else if (in_byte == FLAG)
-                        state = FLAG_RCV;
-                    else
-                        state = START;
-                    break;
+    return 0;
+}
 
-                case A_RCV:
-                    if (in_byte == FLAG)
-                        state = FLAG_RCV;
-                    else if (in_byte == 0x05 || in_byte == 0x85 || in_byte == 0x01 || in_byte == 0x81)
-                    {
-                        state = C_RCV;
-                        command_read[2] = in_byte;
-                    }
-                    else 
-                        state = START;
-                    break;
+// Handles any frame received while the connection is open. The receiver
+// takes I-frames and the transmitter responses; in full duplex both ends
+// take both, and I-frames also acknowledge our own.
+// I-frames are delivered to buffer, or kept for the next llread when it is
+// NULL.
+// Returns the length of the data delivered to buffer, NO_DATA if there is
+// none and DEFAULT_ERROR on error.
+static int handle_frame(ll_conn_t *conn, frame_t *frame, unsigned char *buffer)
+{
+    int duplex = conn->linkParams.duplex;
 
-                case C_RCV:
-                    if (in_byte == (command_read[1] ^ command_read[2]))
-                    {
-                        state = BCC_OK;
-                        command_read[3] = in_byte;
-                    }
-                    else if (in_byte == FLAG)
-                        state = FLAG_RCV;
-                    else
-                        state = START;
-                    break;
+    // The UA was lost and the transmitter is still trying to connect
+    if (frame->type == FRAME_SET && conn->uaLength > 0)
+    {
+        write_frame(conn, conn->uaFrame, conn->uaLength);
+        return NO_DATA;
+    }
 
-                case BCC_OK:
-                    if (in_byte == FLAG) // Read the last flag
-                    {
-                        //state = STOP;
-                        run = FALSE;
-                        command_read[4] = in_byte;
-
-                        // Disable all scheduled alarms to process the command
-                        alarm(0);
-                        alarmEnabled = FALSE;
-                        alarmCount = 0;
-                    }
-                    else
-                        state = START;
-                    break;
-            
-                case STOP:
-                        run = FALSE;
-                    break;
+    // The transmitter is done. llclose will answer it.
+    if (frame->type == FRAME_DISC)
+    {
+        conn->discReceived = TRUE;
+        return NO_DATA;
+    }
 
-                default:
-                    state = START;
-                    break;
-            }
-        }
+    if (frame->type == FRAME_I && (conn->role == RX || duplex))
+    {
+        // N(R) is in the header, which is intact even if the data is not
+        if (duplex)
+            acknowledge(conn, frame->nr);
+
+        if (conn->linkParams.arq == ARQ_SELECTIVE_REPEAT)
+            return receive_selective(conn, frame, buffer);
+        return receive_in_order(conn, frame, buffer);
+    }
+
+    if ((frame->type == FRAME_RR || frame->type == FRAME_REJ || frame->type == FRAME_SREJ) &&
+        (conn->role == TX || duplex))
+    {
+        if (handle_response(conn, frame) < 0)
+            return DEFAULT_ERROR;
+    }
+
+    return NO_DATA;
+}
 
-        // Here we have successfully read a valid supervision frame and need to respond accordingly.
+// Handles one event of the transmitter: a frame from the other end or, if
+// none arrived, a retransmission timeout.
+// Returns 1 if something was processed, 0 if not and a negative value on error.
+static int process_acks(ll_conn_t *conn, int wait)
+{
+    frame_t frame;
+    int res = receive_frame(conn, &frame, wait);
+    if (res < 0)
+        return res;
 
-        // Check if the response is an RR (Receiver Ready) or REJ (Reject)
-        // If sequence number is 0 we are expecting RR1 or REJ0
-        // If sequence number is 1 we are expecting RR0 or REJ1
-        if (command_read[2] == (sequenceNumber == 0 ? 0x85 : 0x05)) // RR1 or RR0
-        {
-            // If we got RR, the ack is valid, yay!
-            is_ack_valid = TRUE;
+    if (res == 0)
+        return handle_timeout(conn);
 
-            // We need to switch the sequence number for the next I frame
-            sequenceNumber = 1 - sequenceNumber; // Switch sequence number
+    if (handle_frame(conn, &frame, NULL) == DEFAULT_ERROR)
+        return -1;
 
-            #ifdef DEBUG
-            printf("[LL] Acknowledgment (RR%d) received\n", sequenceNumber);
-            #endif
+    return 1;
+}
 
-        }
-        else if (command_read[2] == 0x01 || command_read[2] == 0x81) // REJ0 or REJ1
-        {
-            // If we got REJ, the ack is invalid, we need to retransmit :(
-            #ifdef DEBUG
-            printf("[LL] Negative acknowledgment (REJ%d) received\n", sequenceNumber);
-            for (int i = 0; i < BUF_SIZE; i++)
-            {
-                printf("0x%02X, ", command_read[i]);
-            }
-            printf("\n");
-            #endif
+// Waits until every I-frame sent has been acknowledged.
+static int flush_window(ll_conn_t *conn)
+{
+    while (conn->txOutstanding > 0)
+    {
+        int res = process_acks(conn, WAIT_TIMER);
+        if (res < 0)
+            return res;
+    }
 
-            continue;
-        }
+    return 0;
+}
+
+int llwrite(ll_conn_t *conn, unsigned char *buffer, int length)
+{
+    // Check if the buffer is valid or not
+    if (buffer == NULL)
+    {
+        perror("Buffer is NULL");
+        return -1;
     }
 
-    // Return the number of written bytes.
-    return bytes_written;
+    struct iovec iov = {buffer, length};
+
+    return llwritev(conn, &iov, 1);
 }
 
-int send_ack(int fd, unsigned char C_BYTE)
+// Sends the segments in one I-frame, see llwritev.
+static int write_data(ll_conn_t *conn, const struct iovec *iov, int iovcnt)
 {
-    unsigned char ACK[5] = {0x7E, 0x03, C_BYTE, 0x03^C_BYTE, 0x7E};
-    int bytes = write(fd, ACK, BUF_SIZE);
-    //sleep(1);
+    if (iov == NULL || iovcnt < 0)
+    {
+        printf("[LL] Invalid segments\n");
+        return -1;
+    }
 
-    if (bytes == BUF_SIZE)
+    long long length = 0;
+    for (int i = 0; i < iovcnt; i++)
     {
-        #ifdef DEBUG
-        printf("%d bytes written\nSent:\n", bytes);
-        for (int i = 0; i < BUF_SIZE; i++)
+        if (iov[i].iov_base == NULL && iov[i].iov_len > 0)
         {
-            printf("0x%02X, ", ACK[i]);
+            perror("Buffer is NULL");
+            return -1;
         }
-        printf("\n");
-        #endif
+        length += iov[i].iov_len;
     }
-    else if (bytes == -1)
+    if (length > conn->linkParams.maxPayload)
     {
-        perror("[LL] Could not write ACK\n");
+        printf("[LL] Invalid length %lld\n", length);
         return -1;
     }
-}
 
-int llread(int fd, unsigned char* buffer)
-{
-    // In this function we are repeatedly reading I frames and sending
-    // back an acknowledgment to the transmitter. We will keep reading
-    // until we receive the correct sequence number.
+    int res;
+    int modulus = 1 << conn->linkParams.seqBits;
+
+    // Collect acknowledgments that already arrived
+    while ((res = process_acks(conn, WAIT_NONE)) > 0)
+        ;
+    if (res < 0)
+        return res;
+
+    // Wait until there is room in the window
+    while (conn->txOutstanding >= conn->linkParams.window)
+    {
+        res = process_acks(conn, WAIT_TIMER);
+        if (res < 0)
+            return res;
+    }
+
+    // The data field is compressed when that makes it shorter. Every frame
+    // goes into the history, even the ones sent as they are.
+    struct iovec packed;
+    conn->txCompressed[conn->txNextSeq] = FALSE;
+    if (conn->txStream != NULL && length > 0)
+    {
+        long long start = now_us();
+        int packedLength = lz_compress(conn->txStream, iov, iovcnt, conn->compressBuffer, length - 1);
+        conn->compressStats.compressUs += now_us() - start;
 
-    // Here will be stored the frame that is read
-    unsigned char frame[2*MAX_SIZE+6]; // MAX SIZE of frame if all data is stuffed
-    int frameLength = 0;
-    static int exepectedSequenceNumber = 0;
-    int receivedSequenceNumber = 0;
-    int destuffedLength = 0;
+        if (packedLength >= 0)
+        {
+            packed.iov_base = conn->compressBuffer;
+            packed.iov_len = packedLength;
+            iov = &packed;
+            iovcnt = 1;
+            conn->txCompressed[conn->txNextSeq] = TRUE;
+        }
+        conn->compressStats.rawBytes += length;
+        conn->compressStats.sentBytes += packedLength >= 0 ? packedLength : length;
+    }
 
-    // State machine variables
-    int state = START;
-    int run = TRUE;
+    // The segments are stuffed straight into the I frame, which is kept in
+    // the window until it is acknowledged.
+    unsigned char *I_frame = conn->txFrames[conn->txNextSeq];
+    int frame_length = build_header(conn, I_frame, FRAME_I, conn->txNextSeq);
+    conn->txHeaderLength[conn->txNextSeq] = frame_length;
+    frame_length = build_data_field(I_frame, frame_length, iov, iovcnt, conn->linkParams.fcs, conn->fecCode,
+                                    conn->fecParity, conn->framing);
+    conn->txFrameLength[conn->txNextSeq] = frame_length;
 
-    // The byte that is read from the serial port
-    unsigned char in_byte;
-    int bytes = 0;
+    #ifdef DEBUG
+    printf("[LL] Sending I-frame %d...\n", conn->txNextSeq);
+    #endif
 
-    // loop until we get a valid frame
-    int is_frame_valid = FALSE;
+    // Write the I-frame to the serial port
+    int bytes_written = write_frame(conn, I_frame, frame_length);
 
-    while(!is_frame_valid)
+    // Check if the data was really written.
+    if (bytes_written < 0)
     {
-        // Reset the state machine
-        state = START;
-        run = TRUE;
-        frameLength = 0;
+        printf("Error writing to serial port\n");
+        return -1;
+    }
 
-        // Wait until a frame with a valid header is received
-        while (run)
-        {
-            bytes = read(fd, &in_byte, 1); // Read one byte at a time
-            if (bytes == 0)
-            {
-                continue;
-            }
-            else if (bytes < 0)
-            {
-                #ifdef DEBUG
-                printf("[LL] Error reading from serial port\n");
-                #endif
+    // In full duplex the frame carried our acknowledgment
+    if (conn->linkParams.duplex)
+        clear_ack(conn);
+
+    // Whatever is not flags, header, data field, frame check or parity was
+    // added by byte stuffing (or by COBS)
+    int field = iov == &packed ? (int)packed.iov_len : (int)length;
+    int unstuffed = field + fcs_size(conn->linkParams.fcs);
+    if (conn->fecCode != NULL)
+        unstuffed += fec_parity_length(conn->fecCode, unstuffed);
+    conn->stats.iFramesSent++;
+    conn->stats.payloadBytes += field;
+    int header = 2 + parser_control_length(&conn->parser, 0x00);
+    conn->stats.stuffingBytes += frame_length - (framing_overhead(conn) + header + unstuffed);
+    conn->stats.writtenBytes += length;
+
+    conn->txSentAt[conn->txNextSeq] = now_us();
+    conn->txResent[conn->txNextSeq] = FALSE;
+    conn->txLost[conn->txNextSeq] = FALSE;
+
+    // Bytes exposed to errors, for the error rate estimate
+    conn->errorBytes = conn->errorBytes * ERROR_DECAY + frame_length;
+    conn->errorFrames *= ERROR_DECAY;
+
+    // The timer always times the oldest unacknowledged frame
+    if (conn->txOutstanding == 0)
+    {
+        conn->retryCount = 0;
+        timer_start(conn, conn->rto);
+    }
 
-                return -1;
-            }
+    conn->txOutstanding++;
+    conn->txNextSeq = (conn->txNextSeq + 1) % modulus;
 
-            #ifdef DEBUG
-            printf("[LL] Byte read: 0x%02X\n", in_byte);
-            #endif
+    // Stop-and-wait keeps the original behaviour: wait for the acknowledgment
+    if (conn->linkParams.arq == ARQ_STOP_AND_WAIT)
+    {
+        res = flush_window(conn);
+        if (res < 0)
+            return res;
+    }
 
-            switch (state)
-            {
-                case START:
-                    if (in_byte == FLAG)
-                    {
-                        frameLength = 0;
-                        frame[frameLength++] = in_byte;
-                        state = FLAG_RCV;
-                    }
-                    break;
+    // Return the number of written bytes.
+    return bytes_written;
+}
 
-                case FLAG_RCV:
-                    if (in_byte == FLAG)
-                        frameLength = 1; // Keep flag
-                    else if (in_byte == 0x03)
-                    {
-                        frame[frameLength++] = in_byte;
-                        state = A_RCV;
-                    }
-                    else
-                    {
-                        state = START;
-                        frameLength = 0; // Reset frame
-                    }
-                    break;
+int llwritev(ll_conn_t *conn, const struct iovec *iov, int iovcnt)
+{
+    int res = write_data(conn, iov, iovcnt);
+    if (res < 0)
+        save_trace(conn, TRUE);
 
-                case A_RCV:
-                    if (in_byte == FLAG)
-                    {
-                        state = FLAG_RCV;
-                        frameLength = 1; // Keep flag
-                    }   
-                    else if (in_byte == 0x00 || in_byte == 0x40)
-                    {
-                        frame[frameLength++] = in_byte;
-                        receivedSequenceNumber = (in_byte == 0x00) ? 0 : 1;
-                        state = C_RCV;
-                    }
-                    else
-                    {
-                        state = START;
-                        frameLength = 0; // Reset frame
-                        //send_ack(fd, exepectedSequenceNumber == 0 ? 0x01 : 0x81); // Send REJ0 or REJ1
-                        //printf("[LL] received invalid sequence number %02x\n", in_byte);
-                    }
-                    break;
+    return res;
+}
 
-                case C_RCV:
-                    if (in_byte == FLAG)
-                    {
-                        state = FLAG_RCV;
-                        frameLength = 1; // Keep flag
-                    }
-                    else if (in_byte == (frame[1] ^ frame[2])) // Check BCC1
-                    {
-                        frame[frameLength++] = in_byte;
-                        state = BCC_OK;
-                        #ifdef DEBUG
-                        printf("[LL] BCC1 OK\n");
-                        #endif
-                    }
-                    else
-                    {
-                        state = START; // Invalid BCC1, discard frame and start again
-                        frameLength = 0; // Reset frame
-                    }
-                    break;
+int llwritable(ll_conn_t *conn)
+{
+    int res;
 
-                case BCC_OK:
-                    if (in_byte == FLAG)
-                    {
-                        frame[frameLength++] = in_byte;
-                        state = STOP;
-                        run = FALSE;
-                        #ifdef DEBUG
-                        printf("[LL] Frame received successfully!\n");
-                        #endif
-                    }
-                    else
-                        frame[frameLength++] = in_byte;
-                    break;
+    // Collect acknowledgments and handle a timeout that already happened
+    while ((res = process_acks(conn, WAIT_NONE)) > 0)
+        ;
+    if (res < 0)
+        return res;
 
-                default:
-                    state = START;
-                    break;
-            }
-        }
+    return conn->linkParams.window - conn->txOutstanding;
+}
 
-        #ifdef DEBUG
-        printf("[LL] Frame length: %d\n", frameLength);
-        #endif
+int llretries(ll_conn_t *conn)
+{
+    return conn->retryCount;
+}
 
-        // At this point we have a frame with a valid header
-        // We need to read the data field and BCC2, however BCC2 was
-        // performed on the original data field (not stuffed). 
-        // need to perform destuffing first.
-        
-        // Destuff BCC2
-        unsigned char rcv_BCC2;
-        int wasBCC2Stuffed = FALSE;
-        if (frame[frameLength-1 -2] == 0x7D) // Byte stuffing detected
-        {
-            rcv_BCC2 = frame[frameLength-1 -1] ^ 0x20; // XOR the next byte with 0x20
-            wasBCC2Stuffed = TRUE;
-        }
-        else
-        {
-            rcv_BCC2 = frame[frameLength-1 -1];
-        }
+int llrole(ll_conn_t *conn)
+{
+    return conn->role;
+}
 
-        #ifdef DEBUG
-        printf("[LL] BCC2 received: 0x%02X\n", rcv_BCC2);
-        #endif
+int llpollfds(ll_conn_t *conn, struct pollfd *fds)
+{
+    fds[0].fd = conn->transport->readFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = conn->timerFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = conn->ackTimerFd;
+    fds[2].events = POLLIN;
+
+    return LL_POLL_FDS;
+}
 
-        int dataLength = frameLength - 6 - wasBCC2Stuffed; // Exclude FLAG, A, C, BCC1, FLAG, and BCC2
-        #ifdef DEBUG
-        printf("[LL] Data length: %d\n", dataLength);
-        #endif
-        unsigned char destuffedData[dataLength];
-        destuffedLength = 0;
+// Reads the next I-frame in order. With WAIT_NONE it only handles the bytes
+// that already arrived.
+// Returns the length of the data, TIMEOUT_ERROR if there is none yet and -1
+// on error.
+static int read_data(ll_conn_t *conn, unsigned char *buffer, int wait)
+{
+    // In this function we are repeatedly reading I frames and sending
+    // back an acknowledgment to the transmitter. We will keep reading
+    // until we receive the frame with the expected sequence number.
+    int modulus = 1 << conn->linkParams.seqBits;
+    frame_t frame;
+
+    // Frames kept while llwrite waited
+    if (conn->keptCount > 0)
+    {
+        int slot = conn->keptFirst;
+        int length = unpack(conn, conn->keptFrames[slot], conn->keptLength[slot], conn->keptCompressed[slot],
+                            buffer);
 
-        for (int i = 4; i < dataLength+4; i++) // Begin where data begins and end before BCC2
-        {   
-            if (frame[i] == 0x7D) // Byte stuffing detected
+        conn->keptFirst = (slot + 1) % modulus;
+        conn->keptCount--;
+        conn->rxOccupancy--;
+
+        // The other end would only send the frame that found no room again
+        // when its timer goes off. Ask for it now that there is room.
+        if (conn->keptRefused)
+        {
+            conn->keptRefused = FALSE;
+            if (conn->linkParams.arq == ARQ_SELECTIVE_REPEAT)
             {
-                destuffedData[destuffedLength++] = frame[++i] ^ 0x20; // XOR the next byte with 0x20
+                send_ack(conn, FRAME_SREJ, conn->rxExpectedSeq);
+                conn->rxSrejSent[conn->rxExpectedSeq] = TRUE;
             }
             else
             {
-                destuffedData[destuffedLength++] = frame[i];
+                send_ack(conn, FRAME_REJ, conn->rxExpectedSeq);
+                conn->rxRejSent = TRUE;
             }
         }
 
-        #ifdef DEBUG
-        printf("[LL] Destuffed data length: %d\n", destuffedLength);
-        printf("[LL] Data received after destuff: ");
-        for (int i = 0; i < destuffedLength; i++)
-        {
-            printf("0x%02X, ", destuffedData[i]);
-        }
-        printf("\n");
-        #endif
-
-        // Check if BCC2 is correct
-        unsigned char checkBCC2 = 0;
-        for (int i = 0; i < destuffedLength; i++)
-        {
-            checkBCC2 ^= destuffedData[i];
-        }
-        if (checkBCC2 != rcv_BCC2)
-        {
-            #ifdef DEBUG
-            printf("[LL] BCC2 error\n");
-            #endif
-            send_ack(fd, receivedSequenceNumber == 0 ? 0x01 : 0x81); // Send REJ0 or REJ1
-
-            continue; // Discard frame;
-        }
+        return length;
+    }
 
-        #ifdef DEBUG
-        printf("[LL] BCC2 OK\n");
-        #endif
+    // Frames already acknowledged that are waiting in the reorder buffer
+    if (conn->rxDeliverSeq != conn->rxExpectedSeq)
+    {
+        int length = unpack(conn, conn->rxBuffer[conn->rxDeliverSeq], conn->rxBufferLength[conn->rxDeliverSeq],
+                            conn->rxCompressed[conn->rxDeliverSeq], buffer);
 
-        // If we reach this point the frame is valid and we can tell the receiver
-        // that we are ready for the next frame.
+        conn->rxBuffered[conn->rxDeliverSeq] = FALSE;
+        conn->rxOccupancy--;
+        conn->rxDeliverSeq = (conn->rxDeliverSeq + 1) % modulus;
 
-        // Copy the data to the output buffer
-        memcpy(buffer, destuffedData, destuffedLength);
+        return length;
+    }
 
-        // Send acknowledgment
-        send_ack(fd, receivedSequenceNumber == 0 ? 0x85 : 0x05); // Send RR1 or RR0
-        exepectedSequenceNumber = 1 - exepectedSequenceNumber; // Switch sequence number
+    while (TRUE)
+    {
+        // In full duplex our own I-frames may need retransmitting meanwhile
+        int mode = wait;
+        if (wait == WAIT_RX && conn->linkParams.duplex && conn->txOutstanding > 0)
+            mode = WAIT_ANY;
 
-        is_frame_valid = TRUE; // Frame is valid, exit loop
+        int res = receive_frame(conn, &frame, mode);
+        if (res < 0)
+            return -1;
+        if (res == 0)
+        {
+            res = conn->linkParams.duplex ? handle_timeout(conn) : 0;
+            if (res < 0)
+                return -1;
+            if (res > 0)
+                continue;
+            return TIMEOUT_ERROR;
+        }
 
+        int length = handle_frame(conn, &frame, buffer);
+        if (length == DEFAULT_ERROR)
+            return -1;
+        if (length != NO_DATA)
+            return length;
     }
-    
-    return destuffedLength;
 }
 
-int force_close_port(int fd)
+int llread(ll_conn_t *conn, unsigned char *buffer)
 {
-    // Restore the old port settings
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
-    {
-        perror("tcsetattr");
-        return -1;
-    }
+    start_rx_deadline(conn);
+    int res = read_data(conn, buffer, WAIT_RX);
+    if (res < 0)
+        save_trace(conn, TRUE);
+
+    return res;
+}
 
-    close(fd);
+int llread_nowait(ll_conn_t *conn, unsigned char *buffer)
+{
+    // TIMEOUT_ERROR only means nothing arrived yet
+    int res = read_data(conn, buffer, WAIT_NONE);
+    if (res == DEFAULT_ERROR)
+        save_trace(conn, TRUE);
 
-    return 0;
+    return res;
 }
 
-int llclose(int fd, int role)
+int llpeer_closed(ll_conn_t *conn)
 {
-    
-    if (role != TX && role != RX)
-    {
-        perror("Invalid role");
-        force_close_port(fd);
-        return -1;
-    }
+    return conn->discReceived;
+}
 
-    if (role == RX)
+// Answers the DISC of the transmitter.
+// Returns 0 if successful, -1 otherwise.
+static int disconnect_rx(ll_conn_t *conn)
+{
+    // In full duplex our own I-frames must be acknowledged first, as the
+    // transmitter does
+    if (conn->linkParams.duplex)
     {
-        // Read DISC command and wait
-        int err = read_command(fd, DISC, NULL);
-        if (err == -1)
-        {
-            printf("NULL command\n");
-            return -1;
-        }
-        else if (err == -2)
+        long long start = now_us();
+        int err = flush_window(conn);
+        conn->timing.flushUs = now_us() - start;
+        if (err < 0)
         {
-            printf("Read timed out. Did not receive any response.\n"
-                   "The program will end.\n");
+            printf("Could not deliver the remaining I-frames (Code %d)\n", err);
             return -1;
         }
-        #ifdef DEBUG
-        else
-        {
-            printf("DISC command received successfully!\n");
-        }
-        #endif
+    }
 
-        // Respond with DISC command
-        int bytes = write(fd, DISC, BUF_SIZE);
-        sleep(1);
+    // The transmitter waits for every I-frame to be acknowledged before
+    // sending DISC
+    if (conn->ackPending > 0)
+        send_ack(conn, FRAME_RR, conn->rxExpectedSeq);
 
-        if (bytes == BUF_SIZE)
-        {
-            #ifdef DEBUG
-            printf("%d bytes written\nSent:\n", bytes);
-            for (int i = 0; i < BUF_SIZE; i++)
-            {
-                printf("0x%02X, ", DISC[i]);
-            }
-            printf("\n");
-            #endif
-        }
-        else if (bytes == -1)
-        {
-            perror("did not write all bytes");
-            return -1;
-        }
+    // Read DISC command and wait, unless llread already got it
+    int err = conn->discReceived ? 0 : wait_command(conn, C_DISC, NULL, 0, COMMAND_TIMEOUT_MS, NULL);
+    long long start = now_us();
+    if (err == -1)
+    {
+        printf("NULL command\n");
+        return -1;
+    }
+    else if (err == -2)
+    {
+        printf("Read timed out. Did not receive any response.\n"
+               "The program will end.\n");
+        return -1;
+    }
+    #ifdef DEBUG
+    else
+    {
+        printf("DISC command received successfully!\n");
+    }
+    #endif
 
-        // Read UA command and wait
-        err = read_command(fd, UA, DISC);
-        if (err == -1)
-        {
-            printf("NULL command\n");
-            return -1;
-        }
-        else if (err == -2)
-        {
-            printf("Read timed out. Did not receive any response.\n"
-                   "The program will end.\n");
-            return -1;
-        }
+    // Respond with DISC command
+    unsigned char DISC[COMMAND_SIZE];
+    int discLength = build_command(conn, DISC, FRAME_DISC, 0);
+    int bytes = write_frame(conn, DISC, discLength);
+    drain(conn);
+
+    if (bytes == discLength)
+    {
         #ifdef DEBUG
-        else
+        printf("%d bytes written\nSent:\n", bytes);
+        for (int i = 0; i < discLength; i++)
         {
-            printf("UA command received successfully!\n");
+            printf("0x%02X, ", DISC[i]);
         }
+        printf("\n");
         #endif
+    }
+    else if (bytes == -1)
+    {
+        perror("did not write all bytes");
+        return -1;
+    }
 
-        // Restore the old port settings
-        if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
-        {
-            perror("tcsetattr");
-            return -1;
-        }
+    // Read UA command and wait
+    err = wait_command(conn, C_UA, DISC, discLength, COMMAND_TIMEOUT_MS, NULL);
+    if (err == -1)
+    {
+        printf("NULL command\n");
+        return -1;
+    }
+    else if (err == -2)
+    {
+        printf("Read timed out. Did not receive any response.\n"
+               "The program will end.\n");
+        return -1;
+    }
+    #ifdef DEBUG
+    else
+    {
+        printf("UA command received successfully!\n");
+    }
+    #endif
 
-        close(fd);
+    if (!conn->linkParams.duplex)
+        conn->timing.flushUs = 0;
+    conn->timing.closeUs = now_us() - start;
 
-        printf("[LL] Connection closed\n");
+    return 0;
+}
 
-        return 0;
+// Waits for the outstanding I-frames and disconnects.
+// Returns 0 if successful, -1 otherwise.
+static int disconnect_tx(ll_conn_t *conn)
+{
+    // Every I-frame in the window must be acknowledged before disconnecting
+    long long start = now_us();
+    int err = flush_window(conn);
+    conn->timing.flushUs = now_us() - start;
+    if (err < 0)
+    {
+        printf("Could not deliver the remaining I-frames (Code %d)\n", err);
+        return -1;
     }
 
     // Send DISC command
     #ifdef DEBUG
     printf("Disconnecting");
     #endif
-    int bytes = write(fd, DISC, BUF_SIZE);
-    sleep(1);
+    start = now_us();
+    unsigned char DISC[COMMAND_SIZE];
+    int discLength = build_command(conn, DISC, FRAME_DISC, 0);
+    int bytes = write_frame(conn, DISC, discLength);
+    drain(conn);
 
-    if (bytes == BUF_SIZE)
+    if (bytes == discLength)
     {
         #ifdef DEBUG
         printf("%d bytes written\nSent:\n", bytes);
-        for (int i = 0; i < BUF_SIZE; i++)
+        for (int i = 0; i < discLength; i++)
         {
             printf("0x%02X, ", DISC[i]);
         }
@@ -1049,7 +2909,7 @@ int llclose(int fd, int role)
     }
 
     // Read DISC command and wait
-    int err = read_command(fd, DISC, DISC);
+    err = wait_command(conn, C_DISC, DISC, discLength, COMMAND_TIMEOUT_MS, NULL);
     if (err == -1)
     {
         printf("NULL command\n");
@@ -1069,20 +2929,43 @@ int llclose(int fd, int role)
     #endif
 
     // Respond with UA to close connection
-    bytes = write(fd, UA, BUF_SIZE);
-    sleep(1);
+    unsigned char UA[COMMAND_SIZE];
+    bytes = write_frame(conn, UA, build_command(conn, UA, FRAME_UA, 0));
 
-    // Restore the old port settings
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
-    {
-        perror("tcsetattr");
-        return -1;
-    }
+    // The UA must leave the port before its settings are restored
+    drain(conn);
+    conn->timing.closeUs = now_us() - start;
+
+    return 0;
+}
+
+int llabort(ll_conn_t *conn)
+{
+    save_trace(conn, TRUE);
+    return force_close_port(conn);
+}
 
-    close(fd);
+int llclose(ll_conn_t *conn, ll_timing_t *timing, ll_stats_t *stats)
+{
+    // The application will not read anything else
+    conn->closing = TRUE;
+    drop_kept_frames(conn);
 
-    printf("[LL] Connection closed\n");
+    int res = conn->role == RX ? disconnect_rx(conn) : disconnect_tx(conn);
 
-    return 0;
+    if (timing != NULL)
+        *timing = conn->timing;
+    if (stats != NULL)
+        llstats(conn, stats);
+    save_trace(conn, res != 0);
 
-}
\ No newline at end of file
+    // The port is restored and the connection freed even if the other end
+    // did not answer
+    if (force_close_port(conn) != 0)
+        res = -1;
+
+    if (res == 0)
+        printf("[LL] Connection closed\n");
+
+    return res;
+}
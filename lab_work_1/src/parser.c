@@ -0,0 +1,245 @@
+#include "../include/parser.h"
+#include "../include/stuffing.h"
+
+#include <string.h>
+
+#define FLAG_BYTE 0x7E
+
+// States of the scanner. With COBS the zero byte plays the part of the flag.
+enum PARSER_STATE {
+    HUNT,  // Looking for a flag
+    FRAME  // Inside a frame, collecting bytes until the next flag
+};
+
+// What the scanner finds in the bytes up to the next flag
+enum PARSER_INPUT {
+    INPUT_RUN,      // No flag up to the end of the span
+    INPUT_FLAG,     // A flag
+    INPUT_OVERFLOW  // More bytes than the largest frame
+};
+
+// What is done with those bytes
+enum PARSER_ACTION {
+    ACTION_SKIP, // Dropped
+    ACTION_COPY, // Added to the frame
+    ACTION_END,  // Added to the frame, which the flag closes
+    ACTION_DROP  // The frame is too long and is dropped
+};
+
+typedef struct {
+    unsigned char next;   // State after the bytes
+    unsigned char action;
+    unsigned char flag;   // 1 if the flag is used as well
+} transition_t;
+
+// The closing flag of a frame also opens the next one. A frame that grows
+// too long lost its closing flag, so the scanner waits for the next one.
+static const transition_t transitions[2][3] = {
+    //             INPUT_RUN             INPUT_FLAG               INPUT_OVERFLOW
+    [HUNT]  = {{HUNT, ACTION_SKIP, 0}, {FRAME, ACTION_SKIP, 1}, {HUNT, ACTION_SKIP, 0}},
+    [FRAME] = {{FRAME, ACTION_COPY, 0}, {FRAME, ACTION_END, 1}, {HUNT, ACTION_DROP, 0}}
+};
+
+// Decodes one value of the control byte. Only used to build the table.
+static void decode_control(control_info_t *info, unsigned char C, int seqBits, int duplex, int compress)
+{
+    memset(info, 0, sizeof(control_info_t));
+    info->type = FRAME_INVALID;
+
+    // I and S frames carry a second control byte (C2) when 7-bit sequence
+    // numbers are used, and in full duplex I-frames carry N(R) in a third
+    // one (C3)
+    info->length = 1;
+    if (seqBits == 7 && (C & 0x03) != 0x03)
+        info->length = (C & 0x01) == 0 && duplex ? 3 : 2;
+
+    if ((C & 0x01) == 0)
+    {
+        // Information frame. The P/F bit marks a compressed data field, if
+        // compression was agreed.
+        unsigned char I = C;
+        if (compress)
+        {
+            info->compressed = (C & C_COMPRESSED) != 0;
+            I = C & ~C_COMPRESSED;
+        }
+
+        if (seqBits == 1 && (I == 0x00 || I == 0x40))
+        {
+            info->type = FRAME_I;
+            info->ns = I >> 6;
+        }
+        else if (seqBits == 3)
+        {
+            info->type = FRAME_I;
+            info->ns = (C >> 1) & 0x07;
+            info->nr = C >> 5;
+        }
+        else if (seqBits == 7 && I == 0x00)
+        {
+            info->type = FRAME_I;
+            info->nsByte = 2;
+            info->nrByte = duplex ? 3 : 0;
+        }
+    }
+    else if ((C & 0x03) == 0x01)
+    {
+        // Supervision frame
+        unsigned char S = seqBits == 1 ? (C & 0x7F) : seqBits == 3 ? (C & 0x1F) : C;
+
+        if (S == C_RR)
+            info->type = FRAME_RR;
+        else if (S == C_REJ)
+            info->type = FRAME_REJ;
+        else if (S == C_SREJ && seqBits != 1)
+            info->type = FRAME_SREJ;
+
+        if (seqBits == 7)
+            info->nrByte = 2;
+        else
+            info->nr = seqBits == 1 ? C >> 7 : C >> 5;
+    }
+    else if (C == C_SET)
+        info->type = FRAME_SET;
+    else if (C == C_UA)
+        info->type = FRAME_UA;
+    else if (C == C_DISC)
+        info->type = FRAME_DISC;
+}
+
+void parser_init(frame_parser_t *parser, unsigned char *buffer, int size, int seqBits, int duplex, int compress)
+{
+    for (int C = 0; C < 256; C++)
+        decode_control(&parser->control[C], C, seqBits, duplex, compress);
+
+    parser->frame = buffer;
+    parser->frameSize = size;
+    parser->framing = FRAMING_HDLC;
+    parser_reset(parser);
+}
+
+void parser_set_framing(frame_parser_t *parser, int framing)
+{
+    parser->framing = framing;
+    parser_reset(parser);
+}
+
+void parser_reset(frame_parser_t *parser)
+{
+    parser->state = HUNT;
+    parser->length = 0;
+}
+
+int parser_control_length(const frame_parser_t *parser, unsigned char C)
+{
+    return parser->control[C].length;
+}
+
+int parser_classify(const frame_parser_t *parser, const unsigned char *header, parsed_frame_t *frame)
+{
+    const control_info_t *info = &parser->control[header[1]];
+
+    // Sequence numbers in C2 and C3 are shifted left by one, like HDLC
+    frame->type = info->type;
+    frame->C = header[1];
+    frame->ns = info->nsByte != 0 ? header[info->nsByte] >> 1 : info->ns;
+    frame->nr = info->nrByte != 0 ? header[info->nrByte] >> 1 : info->nr;
+    frame->compressed = info->compressed;
+
+    return 2 + info->length;
+}
+
+// Destuffs or decodes the frame just closed by a flag in place (it can
+// only get shorter) and checks its header.
+// Returns PARSE_FRAME, PARSE_ERROR, or PARSE_MORE for an empty frame (two
+// flags in a row).
+static int end_frame(frame_parser_t *parser, parsed_frame_t *frame)
+{
+    unsigned char bcc = 0;
+    int cobs = parser->framing == FRAMING_COBS;
+    int length = cobs ? cobs_decode(parser->frame, parser->frame, parser->length, &bcc)
+                      : destuff_data(parser->frame, parser->frame, parser->length, &bcc);
+    parser->length = 0;
+
+    if (length == 0)
+        return PARSE_MORE;
+
+    frame->C = length > 1 ? parser->frame[1] : 0;
+    frame->length = length;
+    if (length < 3 || parser->frame[0] != A_FIELD)
+        return PARSE_ERROR;
+
+    int header = parser_classify(parser, parser->frame, frame);
+    if (length < header)
+        return PARSE_ERROR;
+
+    // The XOR of the header is zero when BCC1 is right, so the XOR of the
+    // whole frame is the one of the information field
+    unsigned char BCC1 = 0;
+    for (int i = 0; i < header; i++)
+        BCC1 ^= parser->frame[i];
+    if (BCC1 != 0)
+        return PARSE_ERROR;
+
+    // With COBS the header and the information field are coded as two
+    // blocks, which decode with a zero byte between them
+    if (cobs && length > header)
+    {
+        if (parser->frame[header] != 0)
+            return PARSE_ERROR;
+        header++;
+    }
+
+    frame->field = &parser->frame[header];
+    frame->fieldLength = length - header;
+    frame->bcc = bcc;
+    return PARSE_FRAME;
+}
+
+int parser_scan(frame_parser_t *parser, const unsigned char *data, int length, parsed_frame_t *frame, int *used)
+{
+    int pos = 0;
+
+    // memchr() jumps from flag to flag, so the bytes in between are only
+    // touched to copy them out
+    int delimiter = parser->framing == FRAMING_COBS ? COBS_DELIMITER : FLAG_BYTE;
+    while (pos < length)
+    {
+        const unsigned char *start = &data[pos];
+        const unsigned char *flag = memchr(start, delimiter, length - pos);
+        int count = flag == NULL ? length - pos : flag - start;
+
+        int input = parser->length + count > parser->frameSize ? INPUT_OVERFLOW
+                    : flag != NULL ? INPUT_FLAG : INPUT_RUN;
+        const transition_t *t = &transitions[parser->state][input];
+        parser->state = t->next;
+        pos += count + t->flag;
+
+        if (t->action == ACTION_SKIP)
+            continue;
+
+        if (t->action == ACTION_DROP)
+        {
+            frame->C = 0;
+            frame->length = parser->length + count;
+            parser->length = 0;
+            *used = pos;
+            return PARSE_ERROR;
+        }
+
+        memcpy(&parser->frame[parser->length], start, count);
+        parser->length += count;
+        if (t->action == ACTION_COPY)
+            continue;
+
+        int res = end_frame(parser, frame);
+        if (res != PARSE_MORE)
+        {
+            *used = pos;
+            return res;
+        }
+    }
+
+    *used = pos;
+    return PARSE_MORE;
+}
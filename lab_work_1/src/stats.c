@@ -0,0 +1,204 @@
+#include "../include/stats.h"
+
+#include <string.h>
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+// Values below SUB_BUCKETS have a bucket each. Above that, each power of 2
+// is split in SUB_BUCKETS buckets by the bits after the highest one.
+static int bucket_index(unsigned long long value)
+{
+    if (value < SUB_BUCKETS)
+        return value;
+    if (value > 0xFFFFFFFFULL)
+        return HISTOGRAM_BUCKETS - 1;
+
+    int top = 63 - __builtin_clzll(value);
+    int sub = (value >> (top - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1);
+
+    return (top - HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+long long histogram_bucket_value(int index)
+{
+    if (index < SUB_BUCKETS)
+        return index;
+
+    int top = index / SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    int sub = index % SUB_BUCKETS;
+
+    return (long long)(SUB_BUCKETS + sub) << (top - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_add(histogram_t *histogram, long long value)
+{
+    if (value < 0)
+        value = 0;
+
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket_index(value)]++;
+}
+
+long long histogram_percentile(const histogram_t *histogram, double percent)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    // Rank of the value, from 1 to count
+    long rank = (long)(percent / 100 * histogram->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            long long highest = i + 1 < HISTOGRAM_BUCKETS ? histogram_bucket_value(i + 1) - 1 : histogram->max;
+            return highest < histogram->max ? highest : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void llstats_add(ll_stats_t *total, const ll_stats_t *stats)
+{
+    total->framesSent += stats->framesSent;
+    total->bytesSent += stats->bytesSent;
+    total->iFramesSent += stats->iFramesSent;
+    total->payloadBytes += stats->payloadBytes;
+    total->stuffingBytes += stats->stuffingBytes;
+    total->retransmissions += stats->retransmissions;
+    total->retransmitTimeout += stats->retransmitTimeout;
+    total->retransmitRej += stats->retransmitRej;
+    total->retransmitSrej += stats->retransmitSrej;
+    total->retransmitBytes += stats->retransmitBytes;
+    total->timeouts += stats->timeouts;
+
+    total->framesReceived += stats->framesReceived;
+    total->bytesReceived += stats->bytesReceived;
+    total->headerErrors += stats->headerErrors;
+    total->dataErrors += stats->dataErrors;
+    total->duplicates += stats->duplicates;
+    total->rrSent += stats->rrSent;
+    total->rejSent += stats->rejSent;
+    total->srejSent += stats->srejSent;
+
+    total->writtenBytes += stats->writtenBytes;
+    total->deliveredBytes += stats->deliveredBytes;
+    if (stats->elapsedUs > total->elapsedUs)
+        total->elapsedUs = stats->elapsedUs;
+    total->lineRate += stats->lineRate;
+
+    const histogram_t *from = &stats->latency;
+    histogram_t *to = &total->latency;
+    if (from->count > 0)
+    {
+        if (to->count == 0 || from->min < to->min)
+            to->min = from->min;
+        if (from->max > to->max)
+            to->max = from->max;
+        to->count += from->count;
+        to->sum += from->sum;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            to->buckets[i] += from->buckets[i];
+    }
+}
+
+double llstats_goodput(const ll_stats_t *stats)
+{
+    if (stats->elapsedUs <= 0)
+        return 0;
+
+    return (stats->writtenBytes + stats->deliveredBytes) * 1e6 / stats->elapsedUs;
+}
+
+double llstats_efficiency(const ll_stats_t *stats)
+{
+    if (stats->lineRate <= 0)
+        return 0;
+
+    return llstats_goodput(stats) / (stats->lineRate / 10.0);
+}
+
+// Percentiles shown in the summary and in JSON
+static const double percentiles[] = {50, 90, 99, 99.9};
+#define PERCENTILES (int)(sizeof(percentiles) / sizeof(percentiles[0]))
+
+void llstats_print(const ll_stats_t *stats, FILE *file)
+{
+    long long framing = stats->bytesSent - stats->payloadBytes - stats->stuffingBytes - stats->retransmitBytes;
+
+    fprintf(file, "Sent: %ld frames, %lld bytes (payload %lld, stuffing %lld, framing %lld, resent %lld)\n",
+            stats->framesSent, stats->bytesSent, stats->payloadBytes, stats->stuffingBytes, framing,
+            stats->retransmitBytes);
+    fprintf(file, "Retransmissions: %ld (timeout %ld, REJ %ld, SREJ %ld), %ld timeouts\n",
+            stats->retransmissions, stats->retransmitTimeout, stats->retransmitRej, stats->retransmitSrej,
+            stats->timeouts);
+    fprintf(file, "Received: %ld frames, %lld bytes, %ld header errors, %ld frame check errors, %ld duplicates\n",
+            stats->framesReceived, stats->bytesReceived, stats->headerErrors, stats->dataErrors,
+            stats->duplicates);
+    fprintf(file, "Acknowledgments sent: %ld RR, %ld REJ, %ld SREJ\n", stats->rrSent, stats->rejSent,
+            stats->srejSent);
+    fprintf(file, "Goodput: %.0f B/s in %.2f s, efficiency %.1f%% of %lld baud\n", llstats_goodput(stats),
+            stats->elapsedUs / 1e6, 100 * llstats_efficiency(stats), stats->lineRate);
+
+    const histogram_t *latency = &stats->latency;
+    if (latency->count > 0)
+    {
+        fprintf(file, "I-frame to RR: %ld samples, min %.2f ms, mean %.2f ms", latency->count,
+                latency->min / 1000.0, latency->sum / 1000.0 / latency->count);
+        for (int i = 0; i < PERCENTILES; i++)
+            fprintf(file, ", p%g %.2f ms", percentiles[i], histogram_percentile(latency, percentiles[i]) / 1000.0);
+        fprintf(file, ", max %.2f ms\n", latency->max / 1000.0);
+    }
+}
+
+void llstats_json(const ll_stats_t *stats, FILE *file)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"sent\": {\"frames\": %ld, \"bytes\": %lld, \"iFrames\": %ld, \"payloadBytes\": %lld, "
+                  "\"stuffingBytes\": %lld},\n",
+            stats->framesSent, stats->bytesSent, stats->iFramesSent, stats->payloadBytes, stats->stuffingBytes);
+    fprintf(file, "  \"retransmissions\": {\"frames\": %ld, \"timeout\": %ld, \"rej\": %ld, \"srej\": %ld, "
+                  "\"bytes\": %lld, \"timeouts\": %ld},\n",
+            stats->retransmissions, stats->retransmitTimeout, stats->retransmitRej, stats->retransmitSrej,
+            stats->retransmitBytes, stats->timeouts);
+    fprintf(file, "  \"received\": {\"frames\": %ld, \"bytes\": %lld, \"headerErrors\": %ld, \"dataErrors\": %ld, "
+                  "\"duplicates\": %ld},\n",
+            stats->framesReceived, stats->bytesReceived, stats->headerErrors, stats->dataErrors,
+            stats->duplicates);
+    fprintf(file, "  \"acknowledgments\": {\"rr\": %ld, \"rej\": %ld, \"srej\": %ld},\n", stats->rrSent,
+            stats->rejSent, stats->srejSent);
+    fprintf(file, "  \"writtenBytes\": %lld,\n  \"deliveredBytes\": %lld,\n  \"elapsedUs\": %lld,\n"
+                  "  \"lineRate\": %lld,\n  \"goodput\": %.1f,\n  \"efficiency\": %.4f,\n",
+            stats->writtenBytes, stats->deliveredBytes, stats->elapsedUs, stats->lineRate, llstats_goodput(stats),
+            llstats_efficiency(stats));
+
+    // Buckets are given by their smallest value, so another tool can merge
+    // histograms or compute other percentiles
+    const histogram_t *latency = &stats->latency;
+    fprintf(file, "  \"latencyUs\": {\"count\": %ld, \"min\": %lld, \"max\": %lld, \"sum\": %lld, \"percentiles\": {",
+            latency->count, latency->count > 0 ? latency->min : 0, latency->max, latency->sum);
+    for (int i = 0; i < PERCENTILES; i++)
+        fprintf(file, "%s\"p%g\": %lld", i > 0 ? ", " : "", percentiles[i], histogram_percentile(latency, percentiles[i]));
+    fprintf(file, "},\n    \"buckets\": [");
+
+    int first = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if (latency->buckets[i] == 0)
+            continue;
+        fprintf(file, "%s[%lld, %ld]", first ? "" : ", ", histogram_bucket_value(i), latency->buckets[i]);
+        first = 0;
+    }
+    fprintf(file, "]}\n}\n");
+}
@@ -0,0 +1,866 @@
+#include "../include/stuffing.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STUFFING_X86 1
+#endif
+
+#define ESC 0x7D
+#define FLAG_BYTE 0x7E
+
+// Scalar versions. They are also used for the tails the vector versions
+// leave behind.
+
+static int stuff_scalar(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    unsigned char x = *bcc;
+    int pos = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char b = src[i];
+        x ^= b;
+
+        if (b == FLAG_BYTE || b == ESC)
+        {
+            dst[pos++] = ESC;
+            dst[pos++] = b ^ 0x20;
+        }
+        else
+        {
+            dst[pos++] = b;
+        }
+    }
+
+    *bcc = x;
+    return pos;
+}
+
+// Destuffs src[start..end) into dst from pos. *carry tells if the byte
+// before start was an escape, so blocks can be processed one at a time.
+// Returns the new position in dst.
+static int destuff_block(unsigned char *dst, int pos, const unsigned char *src, int start, int end,
+                         int *carry, unsigned char *bcc)
+{
+    unsigned char x = *bcc;
+    int escaped = *carry;
+
+    for (int i = start; i < end; i++)
+    {
+        unsigned char b = src[i];
+
+        if (escaped)
+        {
+            b ^= 0x20;
+            escaped = 0;
+        }
+        else if (b == ESC)
+        {
+            escaped = 1;
+            continue;
+        }
+
+        dst[pos++] = b;
+        x ^= b;
+    }
+
+    *carry = escaped;
+    *bcc = x;
+    return pos;
+}
+
+static int destuff_scalar(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    int carry = 0;
+    int pos = destuff_block(dst, 0, src, 0, length, &carry, bcc);
+
+    return carry ? -1 : pos;
+}
+
+// COBS. A group is a code byte followed by code - 1 bytes that are not
+// zero, and stands for those bytes and a zero, except full groups (code
+// 0xFF) and the last group of a block, which have no zero. Every zero of
+// the data is replaced by the code byte of the group that follows it.
+
+// Codes src[start..end) into dst from pos. *run is the number of bytes of
+// the group being filled, whose code byte is right before them.
+// Returns the new position in dst.
+static int cobs_encode_block(unsigned char *dst, int pos, const unsigned char *src, int start, int end,
+                             int *run, unsigned char *bcc)
+{
+    unsigned char x = *bcc;
+    int r = *run;
+
+    for (int i = start; i < end; i++)
+    {
+        unsigned char b = src[i];
+        x ^= b;
+
+        if (b == 0)
+        {
+            dst[pos - r - 1] = r + 1;
+            r = 0;
+            pos++; // Code byte of the next group
+            continue;
+        }
+
+        dst[pos++] = b;
+        if (++r == COBS_MAX_RUN)
+        {
+            dst[pos - r - 1] = 0xFF;
+            r = 0;
+            pos++;
+        }
+    }
+
+    *run = r;
+    *bcc = x;
+    return pos;
+}
+
+static int cobs_encode_scalar(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+                              unsigned char *bcc)
+{
+    return cobs_encode_block(dst, 0, src, 0, length, &state->run, bcc);
+}
+
+static int cobs_decode_scalar(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    unsigned char x = *bcc;
+    int pos = 0;
+    int i = 0;
+
+    while (i < length)
+    {
+        int code = src[i++];
+        if (code == 0 || i + code - 1 > length)
+            return -1;
+
+        // Left to right, so decoding in place never reads a byte it wrote
+        for (int end = i + code - 1; i < end; i++)
+        {
+            dst[pos++] = src[i];
+            x ^= src[i];
+        }
+
+        if (code != 0xFF && i < length)
+            dst[pos++] = 0;
+    }
+
+    *bcc = x;
+    return pos;
+}
+
+#ifdef STUFFING_X86
+
+// Shuffle tables for 8-byte groups, indexed by the mask of special bytes.
+// Stuffing: every special byte becomes an escape (taken from stuffEscape)
+// followed by the byte itself. Destuffing: escape bytes are dropped.
+static unsigned char stuffShuffle[256][16] __attribute__((aligned(16)));
+static unsigned char stuffEscape[256][16] __attribute__((aligned(16)));
+static unsigned char destuffShuffle[256][16] __attribute__((aligned(16)));
+
+// Loading 32 bytes from tailMask + k gives a mask of the last k bytes of a
+// 32-byte vector (of a 16-byte vector from tailMask + 16 + k)
+static const unsigned char tailMask[64] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static void build_tables(void)
+{
+    for (int m = 0; m < 256; m++)
+    {
+        int j = 0;
+        memset(stuffShuffle[m], 0x80, 16); // 0x80 makes the shuffle write 0
+        memset(stuffEscape[m], 0, 16);
+
+        for (int k = 0; k < 8; k++)
+        {
+            if (m & (1 << k))
+                stuffEscape[m][j++] = ESC;
+            stuffShuffle[m][j++] = k;
+        }
+
+        j = 0;
+        memset(destuffShuffle[m], 0x80, 16);
+        for (int k = 0; k < 8; k++)
+        {
+            if (!(m & (1 << k)))
+                destuffShuffle[m][j++] = k;
+        }
+    }
+}
+
+// XORs the bytes of a vector together.
+__attribute__((target("sse2")))
+static unsigned char fold_xor(__m128i v)
+{
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 8));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 4));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 2));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 1));
+    return (unsigned char)_mm_cvtsi128_si32(v);
+}
+
+// SSE2: blocks of 16 bytes without special bytes are copied with one store
+// and blocks made only of special bytes are expanded by interleaving them
+// with escapes. Mixed blocks go through the scalar loop.
+__attribute__((target("sse2")))
+static int stuff_sse2(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    const __m128i flag = _mm_set1_epi8(FLAG_BYTE);
+    const __m128i esc = _mm_set1_epi8(ESC);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+    __m128i acc = _mm_setzero_si128();
+    unsigned char unused = 0;
+    int pos = 0;
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc));
+        int mask = _mm_movemask_epi8(special);
+
+        acc = _mm_xor_si128(acc, v);
+
+        if (mask == 0)
+        {
+            _mm_storeu_si128((__m128i *)(dst + pos), v);
+            pos += 16;
+        }
+        else if (mask == 0xFFFF)
+        {
+            __m128i t = _mm_xor_si128(v, x20);
+            _mm_storeu_si128((__m128i *)(dst + pos), _mm_unpacklo_epi8(esc, t));
+            _mm_storeu_si128((__m128i *)(dst + pos + 16), _mm_unpackhi_epi8(esc, t));
+            pos += 32;
+        }
+        else
+        {
+            // BCC already taken from the vector
+            pos += stuff_scalar(dst + pos, src + i, 16, &unused);
+        }
+    }
+
+    *bcc ^= fold_xor(acc);
+    return pos + stuff_scalar(dst + pos, src + i, length - i, bcc);
+}
+
+// Blocks made only of escape/byte pairs (the worst case, a payload full of
+// flags) are taken apart by keeping the odd bytes with a pack.
+__attribute__((target("sse2")))
+static int destuff_sse2(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    const __m128i esc = _mm_set1_epi8(ESC);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+    __m128i acc = _mm_setzero_si128();
+    int carry = 0;
+    int pos = 0;
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, esc));
+
+        if (!carry && mask == 0)
+        {
+            _mm_storeu_si128((__m128i *)(dst + pos), v);
+            acc = _mm_xor_si128(acc, v);
+            pos += 16;
+        }
+        else if (!carry && mask == 0x5555)
+        {
+            __m128i t = _mm_srli_epi16(_mm_xor_si128(v, x20), 8);
+            t = _mm_packus_epi16(t, _mm_setzero_si128());
+            _mm_storel_epi64((__m128i *)(dst + pos), t);
+            acc = _mm_xor_si128(acc, t);
+            pos += 8;
+        }
+        else
+        {
+            pos = destuff_block(dst, pos, src, i, i + 16, &carry, bcc);
+        }
+    }
+
+    *bcc ^= fold_xor(acc);
+    pos = destuff_block(dst, pos, src, i, length, &carry, bcc);
+
+    return carry ? -1 : pos;
+}
+
+// Stuffs one group of 8 bytes with a shuffle from the tables. The 16-byte
+// store may write past the result, but never past 2*length.
+// Returns the number of bytes written.
+__attribute__((target("avx2")))
+static inline int stuff_group(unsigned char *dst, const unsigned char *src, __m128i *acc)
+{
+    const __m128i flag = _mm_set1_epi8(FLAG_BYTE);
+    const __m128i esc = _mm_set1_epi8(ESC);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+
+    __m128i v = _mm_loadl_epi64((const __m128i *)src);
+    __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc));
+    int mask = _mm_movemask_epi8(special) & 0xFF;
+    __m128i t = _mm_xor_si128(v, _mm_and_si128(special, x20));
+    __m128i out = _mm_shuffle_epi8(t, _mm_load_si128((const __m128i *)stuffShuffle[mask]));
+
+    out = _mm_or_si128(out, _mm_load_si128((const __m128i *)stuffEscape[mask]));
+    _mm_storeu_si128((__m128i *)dst, out);
+
+    *acc = _mm_xor_si128(*acc, v);
+    return 8 + __builtin_popcount(mask);
+}
+
+// AVX2: blocks of 32 bytes without special bytes are copied with one store
+// and blocks made only of special bytes are interleaved with escapes.
+// Mixed blocks are expanded 8 bytes at a time with shuffles from the
+// tables, so no input falls back to the scalar loop.
+__attribute__((target("avx2")))
+static int stuff_avx2(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    const __m256i flag32 = _mm256_set1_epi8(FLAG_BYTE);
+    const __m256i esc32 = _mm256_set1_epi8(ESC);
+    const __m256i x20 = _mm256_set1_epi8(0x20);
+    const __m128i esc = _mm_set1_epi8(ESC);
+    __m256i acc32 = _mm256_setzero_si256();
+    __m128i acc = _mm_setzero_si128();
+    int pos = 0;
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, flag32), _mm256_cmpeq_epi8(v, esc32));
+        unsigned int mask = _mm256_movemask_epi8(special);
+
+        if (mask == 0)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + pos), v);
+            acc32 = _mm256_xor_si256(acc32, v);
+            pos += 32;
+        }
+        else if (mask == 0xFFFFFFFF)
+        {
+            __m256i t = _mm256_xor_si256(v, x20);
+            __m128i low = _mm256_castsi256_si128(t);
+            __m128i high = _mm256_extracti128_si256(t, 1);
+
+            _mm_storeu_si128((__m128i *)(dst + pos), _mm_unpacklo_epi8(esc, low));
+            _mm_storeu_si128((__m128i *)(dst + pos + 16), _mm_unpackhi_epi8(esc, low));
+            _mm_storeu_si128((__m128i *)(dst + pos + 32), _mm_unpacklo_epi8(esc, high));
+            _mm_storeu_si128((__m128i *)(dst + pos + 48), _mm_unpackhi_epi8(esc, high));
+            acc32 = _mm256_xor_si256(acc32, v);
+            pos += 64;
+        }
+        else
+        {
+            for (int k = 0; k < 32; k += 8)
+                pos += stuff_group(dst + pos, src + i + k, &acc);
+        }
+    }
+
+    for (; i + 8 <= length; i += 8)
+        pos += stuff_group(dst + pos, src + i, &acc);
+
+    acc = _mm_xor_si128(acc, _mm256_castsi256_si128(acc32));
+    acc = _mm_xor_si128(acc, _mm256_extracti128_si256(acc32, 1));
+    *bcc ^= fold_xor(acc);
+
+    return pos + stuff_scalar(dst + pos, src + i, length - i, bcc);
+}
+
+// Destuffs one group of 8 bytes with a shuffle from the tables, dropping
+// the escapes and XORing the byte after each one with 0x20.
+// Returns the number of bytes written.
+__attribute__((target("avx2")))
+static inline int destuff_group(unsigned char *dst, int pos, const unsigned char *src, int i,
+                                int *carry, __m128i *acc, unsigned char *bcc)
+{
+    const __m128i esc = _mm_set1_epi8(ESC);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+    const __m128i low8 = _mm_set_epi32(0, 0, -1, -1);
+
+    __m128i v = _mm_loadl_epi64((const __m128i *)(src + i));
+    __m128i e = _mm_cmpeq_epi8(v, esc);
+    int mask = _mm_movemask_epi8(e) & 0xFF;
+
+    // An escape right after another one (or after the carry) is data,
+    // which only happens in damaged frames. Leave those to the scalar loop.
+    if (mask & ((mask << 1) | *carry))
+        return destuff_block(dst, pos, src, i, i + 8, carry, bcc) - pos;
+
+    __m128i after = _mm_slli_si128(e, 1);
+    if (*carry)
+        after = _mm_or_si128(after, _mm_cvtsi32_si128(0xFF));
+    __m128i t = _mm_xor_si128(v, _mm_and_si128(after, x20));
+
+    _mm_storel_epi64((__m128i *)(dst + pos),
+                     _mm_shuffle_epi8(t, _mm_load_si128((const __m128i *)destuffShuffle[mask])));
+    *acc = _mm_xor_si128(*acc, _mm_and_si128(_mm_andnot_si128(e, t), low8));
+
+    *carry = mask >> 7;
+    return 8 - __builtin_popcount(mask);
+}
+
+// AVX2: same idea as stuffing. Blocks of 32 bytes without escapes are
+// copied, blocks of escape/byte pairs are packed and mixed blocks are
+// compacted 8 bytes at a time with shuffles.
+__attribute__((target("avx2")))
+static int destuff_avx2(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    const __m256i esc32 = _mm256_set1_epi8(ESC);
+    const __m256i x20 = _mm256_set1_epi8(0x20);
+    __m256i acc32 = _mm256_setzero_si256();
+    __m128i acc = _mm_setzero_si128();
+    int carry = 0;
+    int pos = 0;
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, esc32));
+
+        if (!carry && mask == 0)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + pos), v);
+            acc32 = _mm256_xor_si256(acc32, v);
+            pos += 32;
+        }
+        else if (!carry && mask == 0x55555555)
+        {
+            __m256i t = _mm256_srli_epi16(_mm256_xor_si256(v, x20), 8);
+            __m128i out = _mm_packus_epi16(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));
+
+            _mm_storeu_si128((__m128i *)(dst + pos), out);
+            acc = _mm_xor_si128(acc, out);
+            pos += 16;
+        }
+        else
+        {
+            for (int k = 0; k < 32; k += 8)
+                pos += destuff_group(dst, pos, src, i + k, &carry, &acc, bcc);
+        }
+    }
+
+    for (; i + 8 <= length; i += 8)
+        pos += destuff_group(dst, pos, src, i, &carry, &acc, bcc);
+
+    acc = _mm_xor_si128(acc, _mm256_castsi256_si128(acc32));
+    acc = _mm_xor_si128(acc, _mm256_extracti128_si256(acc32, 1));
+    *bcc ^= fold_xor(acc);
+
+    pos = destuff_block(dst, pos, src, i, length, &carry, bcc);
+
+    return carry ? -1 : pos;
+}
+
+// COBS on SSE2. Every zero of a block of 16 bytes becomes the code byte
+// of the group after it, so the block is stored as it is and only the code
+// bytes are written one by one. A group that gets full inside a block
+// ends there, and the next block starts right after it.
+__attribute__((target("sse2")))
+static int cobs_encode_sse2(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+                            unsigned char *bcc)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int run = state->run;
+    int pos = 0;
+    int i = 0;
+
+    while (i + 16 <= length)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        int first = mask != 0 ? __builtin_ctz(mask) : 16;
+
+        if (mask == 0xFFFF)
+        {
+            // Only zeros: all but the last end an empty group (code 1)
+            dst[pos - run - 1] = run + 1;
+            _mm_storeu_si128((__m128i *)(dst + pos), _mm_set1_epi8(1));
+            pos += 16;
+            i += 16;
+            run = 0;
+            continue;
+        }
+
+        _mm_storeu_si128((__m128i *)(dst + pos), v);
+
+        if (run + first >= COBS_MAX_RUN)
+        {
+            // Only the first k bytes fit in the group
+            int k = COBS_MAX_RUN - run;
+            acc = _mm_xor_si128(acc, _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(tailMask + 32 - k)), v));
+            pos += k;
+            dst[pos - COBS_MAX_RUN - 1] = 0xFF;
+            pos++;
+            run = 0;
+            i += k;
+            continue;
+        }
+
+        int code = pos - run - 1;
+        while (mask != 0)
+        {
+            int zeroPos = pos + __builtin_ctz(mask);
+            dst[code] = zeroPos - code;
+            code = zeroPos;
+            mask &= mask - 1;
+        }
+
+        acc = _mm_xor_si128(acc, v);
+        pos += 16;
+        i += 16;
+        run = pos - code - 1;
+    }
+
+    *bcc ^= fold_xor(acc);
+    state->run = run;
+    return cobs_encode_block(dst, pos, src, i, length, &state->run, bcc);
+}
+
+// Groups of 16 bytes or more are copied 16 at a time, the last 16 bytes
+// with one store that overlaps the previous one.
+__attribute__((target("sse2")))
+static int cobs_decode_sse2(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i acc = _mm_setzero_si128();
+    unsigned char x = *bcc;
+    int pos = 0;
+    int i = 0;
+
+    while (i < length)
+    {
+        // Empty groups, not the last one, are zeros in a row
+        if (src[i] == 1 && i + 16 < length &&
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + i)), one)) == 0xFFFF)
+        {
+            _mm_storeu_si128((__m128i *)(dst + pos), _mm_setzero_si128());
+            pos += 16;
+            i += 16;
+            continue;
+        }
+
+        int code = src[i++];
+        int n = code - 1;
+        if (code == 0 || i + n > length)
+            return -1;
+
+        if (n >= 16)
+        {
+            // Loaded first, since decoding in place writes over it
+            __m128i last = _mm_loadu_si128((const __m128i *)(src + i + n - 16));
+            int k = 0;
+
+            for (; k + 16 <= n; k += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i *)(src + i + k));
+                _mm_storeu_si128((__m128i *)(dst + pos + k), v);
+                acc = _mm_xor_si128(acc, v);
+            }
+
+            _mm_storeu_si128((__m128i *)(dst + pos + n - 16), last);
+            acc = _mm_xor_si128(acc, _mm_and_si128(_mm_loadu_si128((const __m128i *)(tailMask + 16 + n - k)), last));
+        }
+        else
+        {
+            for (int k = 0; k < n; k++)
+            {
+                dst[pos + k] = src[i + k];
+                x ^= src[i + k];
+            }
+        }
+
+        i += n;
+        pos += n;
+        if (code != 0xFF && i < length)
+            dst[pos++] = 0;
+    }
+
+    *bcc = x ^ fold_xor(acc);
+    return pos;
+}
+
+// COBS on AVX2, as on SSE2 with blocks of 32 bytes.
+__attribute__((target("avx2")))
+static int cobs_encode_avx2(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+                            unsigned char *bcc)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc32 = _mm256_setzero_si256();
+    int run = state->run;
+    int pos = 0;
+    int i = 0;
+
+    while (i + 32 <= length)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        int first = mask != 0 ? __builtin_ctz(mask) : 32;
+
+        if (mask == 0xFFFFFFFF)
+        {
+            dst[pos - run - 1] = run + 1;
+            _mm256_storeu_si256((__m256i *)(dst + pos), _mm256_set1_epi8(1));
+            pos += 32;
+            i += 32;
+            run = 0;
+            continue;
+        }
+
+        _mm256_storeu_si256((__m256i *)(dst + pos), v);
+
+        if (run + first >= COBS_MAX_RUN)
+        {
+            int k = COBS_MAX_RUN - run;
+            __m256i rest = _mm256_loadu_si256((const __m256i *)(tailMask + 32 - k));
+            acc32 = _mm256_xor_si256(acc32, _mm256_andnot_si256(rest, v));
+            pos += k;
+            dst[pos - COBS_MAX_RUN - 1] = 0xFF;
+            pos++;
+            run = 0;
+            i += k;
+            continue;
+        }
+
+        int code = pos - run - 1;
+        while (mask != 0)
+        {
+            int zeroPos = pos + __builtin_ctz(mask);
+            dst[code] = zeroPos - code;
+            code = zeroPos;
+            mask &= mask - 1;
+        }
+
+        acc32 = _mm256_xor_si256(acc32, v);
+        pos += 32;
+        i += 32;
+        run = pos - code - 1;
+    }
+
+    __m128i acc = _mm_xor_si128(_mm256_castsi256_si128(acc32), _mm256_extracti128_si256(acc32, 1));
+    *bcc ^= fold_xor(acc);
+    state->run = run;
+    return cobs_encode_block(dst, pos, src, i, length, &state->run, bcc);
+}
+
+__attribute__((target("avx2")))
+static int cobs_decode_avx2(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i acc32 = _mm256_setzero_si256();
+    __m128i acc = _mm_setzero_si128();
+    unsigned char x = *bcc;
+    int pos = 0;
+    int i = 0;
+
+    while (i < length)
+    {
+        if (src[i] == 1 && i + 32 < length &&
+            (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(src + i)), one)) ==
+            0xFFFFFFFF)
+        {
+            _mm256_storeu_si256((__m256i *)(dst + pos), _mm256_setzero_si256());
+            pos += 32;
+            i += 32;
+            continue;
+        }
+
+        int code = src[i++];
+        int n = code - 1;
+        if (code == 0 || i + n > length)
+            return -1;
+
+        if (n >= 32)
+        {
+            __m256i last = _mm256_loadu_si256((const __m256i *)(src + i + n - 32));
+            int k = 0;
+
+            for (; k + 32 <= n; k += 32)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(src + i + k));
+                _mm256_storeu_si256((__m256i *)(dst + pos + k), v);
+                acc32 = _mm256_xor_si256(acc32, v);
+            }
+
+            _mm256_storeu_si256((__m256i *)(dst + pos + n - 32), last);
+            __m256i tail = _mm256_loadu_si256((const __m256i *)(tailMask + n - k));
+            acc32 = _mm256_xor_si256(acc32, _mm256_and_si256(tail, last));
+        }
+        else if (n >= 16)
+        {
+            __m128i low = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i high = _mm_loadu_si128((const __m128i *)(src + i + n - 16));
+
+            _mm_storeu_si128((__m128i *)(dst + pos), low);
+            _mm_storeu_si128((__m128i *)(dst + pos + n - 16), high);
+            acc = _mm_xor_si128(acc, low);
+            acc = _mm_xor_si128(acc, _mm_and_si128(_mm_loadu_si128((const __m128i *)(tailMask + n)), high));
+        }
+        else
+        {
+            for (int k = 0; k < n; k++)
+            {
+                dst[pos + k] = src[i + k];
+                x ^= src[i + k];
+            }
+        }
+
+        i += n;
+        pos += n;
+        if (code != 0xFF && i < length)
+            dst[pos++] = 0;
+    }
+
+    acc = _mm_xor_si128(acc, _mm256_castsi256_si128(acc32));
+    acc = _mm_xor_si128(acc, _mm256_extracti128_si256(acc32, 1));
+    *bcc = x ^ fold_xor(acc);
+    return pos;
+}
+
+#endif // STUFFING_X86
+
+// Implementation in use. Both start as the function that picks the best one.
+static int stuff_auto(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc);
+static int destuff_auto(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc);
+static int cobs_encode_auto(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+                            unsigned char *bcc);
+static int cobs_decode_auto(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc);
+
+static int (*stuffImpl)(unsigned char *, const unsigned char *, int, unsigned char *) = stuff_auto;
+static int (*destuffImpl)(unsigned char *, const unsigned char *, int, unsigned char *) = destuff_auto;
+static int (*cobsEncodeImpl)(unsigned char *, const unsigned char *, int, cobs_state_t *, unsigned char *) =
+    cobs_encode_auto;
+static int (*cobsDecodeImpl)(unsigned char *, const unsigned char *, int, unsigned char *) = cobs_decode_auto;
+
+int stuffing_select(int impl)
+{
+    #ifdef STUFFING_X86
+    static int tablesReady = 0;
+    if (!tablesReady)
+    {
+        build_tables();
+        tablesReady = 1;
+    }
+
+    __builtin_cpu_init();
+    if (impl == STUFFING_AUTO)
+    {
+        impl = __builtin_cpu_supports("avx2") ? STUFFING_AVX2
+             : __builtin_cpu_supports("sse2") ? STUFFING_SSE2
+             : STUFFING_SCALAR;
+    }
+
+    if (impl == STUFFING_AVX2 && __builtin_cpu_supports("avx2"))
+    {
+        stuffImpl = stuff_avx2;
+        destuffImpl = destuff_avx2;
+        cobsEncodeImpl = cobs_encode_avx2;
+        cobsDecodeImpl = cobs_decode_avx2;
+        return impl;
+    }
+    if (impl == STUFFING_SSE2 && __builtin_cpu_supports("sse2"))
+    {
+        stuffImpl = stuff_sse2;
+        destuffImpl = destuff_sse2;
+        cobsEncodeImpl = cobs_encode_sse2;
+        cobsDecodeImpl = cobs_decode_sse2;
+        return impl;
+    }
+    #else
+    if (impl == STUFFING_AUTO)
+        impl = STUFFING_SCALAR;
+    #endif
+
+    if (impl == STUFFING_SCALAR)
+    {
+        stuffImpl = stuff_scalar;
+        destuffImpl = destuff_scalar;
+        cobsEncodeImpl = cobs_encode_scalar;
+        cobsDecodeImpl = cobs_decode_scalar;
+        return impl;
+    }
+
+    return -1;
+}
+
+const char *stuffing_name(int impl)
+{
+    switch (impl)
+    {
+        case STUFFING_SCALAR:
+            return "scalar";
+        case STUFFING_SSE2:
+            return "sse2";
+        case STUFFING_AVX2:
+            return "avx2";
+        default:
+            return "unknown";
+    }
+}
+
+static int stuff_auto(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    stuffing_select(STUFFING_AUTO);
+    return stuffImpl(dst, src, length, bcc);
+}
+
+static int destuff_auto(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    stuffing_select(STUFFING_AUTO);
+    return destuffImpl(dst, src, length, bcc);
+}
+
+static int cobs_encode_auto(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state,
+                            unsigned char *bcc)
+{
+    stuffing_select(STUFFING_AUTO);
+    return cobsEncodeImpl(dst, src, length, state, bcc);
+}
+
+static int cobs_decode_auto(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    stuffing_select(STUFFING_AUTO);
+    return cobsDecodeImpl(dst, src, length, bcc);
+}
+
+int stuff_data(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    return stuffImpl(dst, src, length, bcc);
+}
+
+int destuff_data(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    return destuffImpl(dst, src, length, bcc);
+}
+
+int cobs_init(unsigned char *dst, cobs_state_t *state)
+{
+    (void)dst;
+    state->run = 0;
+    return 1;
+}
+
+int cobs_encode(unsigned char *dst, const unsigned char *src, int length, cobs_state_t *state, unsigned char *bcc)
+{
+    return cobsEncodeImpl(dst, src, length, state, bcc);
+}
+
+void cobs_final(unsigned char *dst, cobs_state_t *state)
+{
+    dst[-state->run - 1] = state->run + 1;
+}
+
+int cobs_decode(unsigned char *dst, const unsigned char *src, int length, unsigned char *bcc)
+{
+    return cobsDecodeImpl(dst, src, length, bcc);
+}
@@ -0,0 +1,102 @@
+#include "../include/trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_init(trace_ring_t *ring)
+{
+    memset(ring->records, 0, sizeof(ring->records));
+    ring->head = 0;
+    ring->startTicks = trace_clock();
+    ring->startNs = monotonic_ns();
+}
+
+int trace_dump(const trace_ring_t *ring, trace_header_t *header, const char *path)
+{
+    trace_record_t *copy = malloc(sizeof(ring->records));
+    if (copy == NULL)
+        return -1;
+
+    // Copy without stopping the writer, then drop the records it may have
+    // overwritten meanwhile: it writes record head before moving head past it.
+    // As in a seqlock, the fence keeps the copy before the second load.
+    uint64_t first = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    memcpy(copy, ring->records, sizeof(ring->records));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t last = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    uint64_t oldest = last >= TRACE_RECORDS ? last - TRACE_RECORDS + 1 : 0;
+    uint64_t count = first > oldest ? first - oldest : 0;
+
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->count = count;
+    header->lost = first - count;
+    header->startTicks = ring->startTicks;
+    header->startNs = ring->startNs;
+    header->endTicks = trace_clock();
+    header->endNs = monotonic_ns();
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        free(copy);
+        return -1;
+    }
+
+    int ok = fwrite(header, sizeof(*header), 1, file) == 1;
+    for (uint64_t i = oldest; ok && i < first; i++)
+        ok = fwrite(&copy[i & (TRACE_RECORDS - 1)], sizeof(trace_record_t), 1, file) == 1;
+
+    free(copy);
+    if (fclose(file) != 0 || !ok)
+        return -1;
+
+    return count;
+}
+
+int trace_load(const char *path, trace_header_t *header, trace_record_t **records)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+
+    if (fread(header, sizeof(*header), 1, file) != 1 || header->magic != TRACE_MAGIC ||
+        header->version != TRACE_VERSION || header->count > TRACE_RECORDS)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    *records = malloc((header->count > 0 ? header->count : 1) * sizeof(trace_record_t));
+    if (*records == NULL || fread(*records, sizeof(trace_record_t), header->count, file) != header->count)
+    {
+        free(*records);
+        *records = NULL;
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return header->count;
+}
+
+int64_t trace_time_ns(const trace_header_t *header, uint64_t ticks)
+{
+    // Line through the two readings taken at creation and at the dump. The
+    // time stamp counter runs at a constant rate on current CPUs, so this
+    // is exact to the precision of the readings.
+    double ticks_elapsed = (double)(header->endTicks - header->startTicks);
+    double ns_elapsed = (double)(header->endNs - header->startNs);
+    double scale = ticks_elapsed > 0 ? ns_elapsed / ticks_elapsed : 1;
+
+    return header->startNs + (int64_t)(((double)ticks - (double)header->startTicks) * scale);
+}
@@ -0,0 +1,621 @@
+// posix_openpt() and ptsname() are XSI
+#define _GNU_SOURCE
+
+#include "../include/transport.h"
+#include "../include/baud.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define MEMORY_CAPACITY 65536
+
+static ll_transport_t *new_transport(const ll_transport_ops_t *ops, int readFd, int writeFd)
+{
+    ll_transport_t *transport = calloc(1, sizeof(ll_transport_t));
+    if (transport == NULL)
+    {
+        perror("[LL] Could not allocate the transport");
+        return NULL;
+    }
+
+    transport->ops = ops;
+    transport->readFd = readFd;
+    transport->writeFd = writeFd;
+
+    return transport;
+}
+
+int lltransport_close(ll_transport_t *transport)
+{
+    if (transport == NULL)
+        return 0;
+
+    int res = transport->ops->close != NULL ? transport->ops->close(transport) : 0;
+    free(transport);
+
+    return res;
+}
+
+// Reads from a nonblocking descriptor (pipe, socket, pseudo-terminal).
+// Returns the number of bytes read, 0 if there were none and -1 on error.
+static int fd_read(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    int bytes = readv(transport->readFd, iov, count);
+    if (bytes < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+    // The descriptors are nonblocking, so nothing read means the other end
+    // is gone
+    return bytes > 0 ? bytes : -1;
+}
+
+// Writes every segment, waiting in poll() while the descriptor is full.
+static int fd_write(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    struct iovec left[count];
+    memcpy(left, iov, count * sizeof(struct iovec));
+    struct iovec *next = left;
+    int total = 0;
+
+    while (count > 0)
+    {
+        int bytes = writev(transport->writeFd, next, count);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return -1;
+
+            struct pollfd fd = {transport->writeFd, POLLOUT, 0};
+            if (poll(&fd, 1, -1) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        total += bytes;
+        while (count > 0 && (size_t)bytes >= next->iov_len)
+        {
+            bytes -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + bytes;
+            next->iov_len -= bytes;
+        }
+    }
+
+    return total;
+}
+
+static int fd_close(ll_transport_t *transport)
+{
+    if (transport->writeFd != transport->readFd && transport->writeFd >= 0)
+        close(transport->writeFd);
+    if (transport->readFd >= 0)
+        close(transport->readFd);
+
+    return 0;
+}
+
+static const ll_transport_ops_t fdOps = {"fd", fd_read, fd_write, NULL, NULL, NULL, fd_close};
+static const ll_transport_ops_t pipeOps = {"pipe", fd_read, fd_write, NULL, NULL, NULL, fd_close};
+static const ll_transport_ops_t socketOps = {"socketpair", fd_read, fd_write, NULL, NULL, NULL, fd_close};
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    return 0;
+}
+
+// Makes a transport of two descriptors, closing them if it cannot.
+static ll_transport_t *fd_transport(const ll_transport_ops_t *ops, int readFd, int writeFd)
+{
+    ll_transport_t *transport = NULL;
+
+    if (set_nonblocking(readFd) == 0 && set_nonblocking(writeFd) == 0)
+        transport = new_transport(ops, readFd, writeFd);
+    else
+        perror("[LL] fcntl");
+
+    if (transport == NULL)
+    {
+        close(readFd);
+        if (writeFd != readFd)
+            close(writeFd);
+    }
+
+    return transport;
+}
+
+ll_transport_t *lltransport_fd(int readFd, int writeFd)
+{
+    if (readFd < 0 || writeFd < 0)
+        return NULL;
+
+    return fd_transport(&fdOps, readFd, writeFd);
+}
+
+// Makes both ends of a pair. On error neither is left open.
+static int make_pair(const ll_transport_ops_t *ops, int aRead, int aWrite, int bRead, int bWrite,
+                     ll_transport_t **a, ll_transport_t **b)
+{
+    *a = fd_transport(ops, aRead, aWrite);
+    if (*a == NULL)
+    {
+        close(bRead);
+        if (bWrite != bRead)
+            close(bWrite);
+        return -1;
+    }
+
+    *b = fd_transport(ops, bRead, bWrite);
+    if (*b == NULL)
+    {
+        lltransport_close(*a);
+        *a = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int lltransport_pipe_pair(ll_transport_t **a, ll_transport_t **b)
+{
+    int ab[2], ba[2];
+
+    if (pipe(ab) < 0)
+    {
+        perror("[LL] pipe");
+        return -1;
+    }
+    if (pipe(ba) < 0)
+    {
+        perror("[LL] pipe");
+        close(ab[0]);
+        close(ab[1]);
+        return -1;
+    }
+
+    return make_pair(&pipeOps, ba[0], ab[1], ab[0], ba[1], a, b);
+}
+
+int lltransport_socketpair(ll_transport_t **a, ll_transport_t **b)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        perror("[LL] socketpair");
+        return -1;
+    }
+
+    return make_pair(&socketOps, fds[0], fds[0], fds[1], fds[1], a, b);
+}
+
+// Settings of the port before it was opened, restored on close
+typedef struct {
+    struct termios oldtio;
+} tty_state_t;
+
+static int tty_read(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    // VMIN is 0, so read() returns 0 when nothing has arrived
+    int bytes = readv(transport->readFd, iov, count);
+    if (bytes < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+    return bytes;
+}
+
+static void tty_drain(ll_transport_t *transport)
+{
+    tcdrain(transport->writeFd);
+}
+
+static int tty_set_rate(ll_transport_t *transport, int rate)
+{
+    int actual = baud_set(transport->writeFd, rate);
+    if (actual > 0)
+        transport->lineRate = rate;
+
+    return actual;
+}
+
+static int tty_highest_rate(ll_transport_t *transport, int limit)
+{
+    return baud_highest(transport->writeFd, limit);
+}
+
+static int tty_close(ll_transport_t *transport)
+{
+    tty_state_t *state = transport->state;
+    int res = 0;
+
+    // Restore the old port settings
+    if (tcsetattr(transport->readFd, TCSANOW, &state->oldtio) == -1)
+    {
+        perror("tcsetattr");
+        res = -1;
+    }
+
+    close(transport->readFd);
+    free(state);
+
+    return res;
+}
+
+static const ll_transport_ops_t ttyOps = {"tty", tty_read, fd_write, tty_drain, tty_set_rate, tty_highest_rate,
+                                          tty_close};
+
+ll_transport_t *lltransport_tty(const char *path)
+{
+    // Open serial port device for reading and writing, and not as controlling tty
+    // because we don't want to get killed if linenoise sends CTRL-C.
+    int fd = open(path, O_RDWR | O_NOCTTY);
+
+    // Check if the port was opened successfully
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    // Save current port settings
+    tty_state_t *state = malloc(sizeof(tty_state_t));
+    if (state == NULL || tcgetattr(fd, &state->oldtio) == -1)
+    {
+        perror("tcgetattr");
+        free(state);
+        close(fd);
+        return NULL;
+    }
+
+    // Clear struct for new port settings
+    struct termios newtio;
+    memset(&newtio, 0, sizeof(newtio));
+
+    newtio.c_cflag = B38400 | CS8 | CLOCAL | CREAD; // SAFE_BAUD_RATE
+    newtio.c_iflag = IGNPAR;
+    newtio.c_oflag = 0;
+
+    // Set input mode (non-canonical, no echo,...)
+    // read() returns whatever has arrived without waiting, the waiting is
+    // done in poll() so a whole block can be read at once.
+    newtio.c_lflag = 0;
+    newtio.c_cc[VTIME] = 0; // Inter-character timer unused
+    newtio.c_cc[VMIN] = 0;  // Can return 0 bytes if nothing has arrived at that point
+
+    // Now clean the line and activate the settings for the port
+    // tcflush() discards data written to the object referred to
+    // by fd but not transmitted, or data received but not read,
+    // depending on the value of queue_selector:
+    // TCIOFLUSH - flushes data received but not read.
+    tcflush(fd, TCIOFLUSH);
+
+    // Set new port settings
+    if (tcsetattr(fd, TCSANOW, &newtio) == -1)
+    {
+        perror("tcsetattr");
+        free(state);
+        close(fd);
+        return NULL;
+    }
+
+    ll_transport_t *transport = new_transport(&ttyOps, fd, fd);
+    if (transport == NULL)
+    {
+        tcsetattr(fd, TCSANOW, &state->oldtio);
+        free(state);
+        close(fd);
+        return NULL;
+    }
+    transport->lineRate = SAFE_BAUD_RATE;
+    transport->state = state;
+
+    return transport;
+}
+
+// A pseudo-terminal reads like a serial port, with no rate to set
+static const ll_transport_ops_t ptyOps = {"pty", tty_read, fd_write, NULL, NULL, NULL, fd_close};
+
+// Turns off every translation of a pseudo-terminal end (echo, line
+// editing, CR/LF), so bytes pass as they are.
+static int make_raw(int fd)
+{
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) == -1)
+        return -1;
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+int lltransport_pty_pair(ll_transport_t **a, ll_transport_t **b)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+    {
+        perror("[LL] posix_openpt");
+        if (master >= 0)
+            close(master);
+        return -1;
+    }
+
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (slave < 0 || make_raw(slave) < 0)
+    {
+        perror("[LL] Could not open the pseudo-terminal");
+        if (slave >= 0)
+            close(slave);
+        close(master);
+        return -1;
+    }
+
+    return make_pair(&ptyOps, master, master, slave, slave, a, b);
+}
+
+// Bytes going one way. Head and tail only grow, the position in the buffer
+// is taken with the mask.
+typedef struct {
+    unsigned char *data;
+    unsigned int head; // Next byte to read
+    unsigned int tail; // Next free position
+    int eventFd;       // Readable while the ring has bytes, for poll()
+    int closed;        // One of the ends is gone
+} memory_ring_t;
+
+// Both directions, shared by the two ends
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t space; // Signalled when a reader frees room
+    memory_ring_t rings[2];
+    unsigned int capacity;
+    double byteErrorRate;
+    double dropRate;
+    unsigned int seed;
+    int users;
+} memory_channel_t;
+
+typedef struct {
+    memory_channel_t *channel;
+    memory_ring_t *in;
+    memory_ring_t *out;
+} memory_end_t;
+
+static int memory_read(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    memory_end_t *end = transport->state;
+    memory_channel_t *channel = end->channel;
+    memory_ring_t *ring = end->in;
+    unsigned int mask = channel->capacity - 1;
+    int total = 0;
+
+    pthread_mutex_lock(&channel->lock);
+
+    for (int i = 0; i < count && ring->head != ring->tail; i++)
+    {
+        size_t done = 0;
+        while (done < iov[i].iov_len && ring->head != ring->tail)
+        {
+            // Up to the end of the buffer, or of what was written
+            unsigned int pos = ring->head & mask;
+            size_t chunk = channel->capacity - pos;
+            if (chunk > ring->tail - ring->head)
+                chunk = ring->tail - ring->head;
+            if (chunk > iov[i].iov_len - done)
+                chunk = iov[i].iov_len - done;
+
+            memcpy((unsigned char *)iov[i].iov_base + done, &ring->data[pos], chunk);
+            ring->head += chunk;
+            done += chunk;
+        }
+        total += done;
+    }
+
+    // The eventfd is cleared with the ring, under the lock, so it is
+    // readable exactly while there are bytes (or the writer is gone)
+    if (ring->head == ring->tail)
+    {
+        if (ring->closed)
+            total = total > 0 ? total : -1;
+        else
+        {
+            uint64_t value;
+            if (read(ring->eventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                total = -1;
+        }
+    }
+    if (total > 0)
+        pthread_cond_broadcast(&channel->space);
+
+    pthread_mutex_unlock(&channel->lock);
+
+    return total;
+}
+
+// Copies the segments to the ring, waiting for the reader when it is full.
+static int memory_write(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    memory_end_t *end = transport->state;
+    memory_channel_t *channel = end->channel;
+    memory_ring_t *ring = end->out;
+    unsigned int mask = channel->capacity - 1;
+    int total = 0;
+
+    for (int i = 0; i < count; i++)
+        total += iov[i].iov_len;
+
+    pthread_mutex_lock(&channel->lock);
+
+    // A dropped write is a frame lost on the line
+    if (channel->dropRate > 0 && rand_r(&channel->seed) < channel->dropRate * RAND_MAX)
+    {
+        pthread_mutex_unlock(&channel->lock);
+        return total;
+    }
+    int threshold = channel->byteErrorRate * RAND_MAX;
+
+    for (int i = 0; i < count; i++)
+    {
+        size_t done = 0;
+        while (done < iov[i].iov_len)
+        {
+            while (ring->tail - ring->head == channel->capacity && !ring->closed)
+                pthread_cond_wait(&channel->space, &channel->lock);
+            if (ring->closed)
+            {
+                pthread_mutex_unlock(&channel->lock);
+                return -1;
+            }
+
+            unsigned int pos = ring->tail & mask;
+            size_t chunk = channel->capacity - pos;
+            if (chunk > channel->capacity - (ring->tail - ring->head))
+                chunk = channel->capacity - (ring->tail - ring->head);
+            if (chunk > iov[i].iov_len - done)
+                chunk = iov[i].iov_len - done;
+
+            memcpy(&ring->data[pos], (const unsigned char *)iov[i].iov_base + done, chunk);
+
+            // Like cable.c, one bit of a damaged byte is flipped
+            for (size_t j = 0; threshold > 0 && j < chunk; j++)
+            {
+                if (rand_r(&channel->seed) < threshold)
+                    ring->data[pos + j] ^= 1 << (rand_r(&channel->seed) % 8);
+            }
+
+            if (ring->head == ring->tail)
+            {
+                uint64_t one = 1;
+                if (write(ring->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                    perror("[LL] eventfd");
+            }
+            ring->tail += chunk;
+            done += chunk;
+        }
+    }
+
+    pthread_mutex_unlock(&channel->lock);
+
+    return total;
+}
+
+static void free_channel(memory_channel_t *channel)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (channel->rings[i].eventFd >= 0)
+            close(channel->rings[i].eventFd);
+        free(channel->rings[i].data);
+    }
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->space);
+    free(channel);
+}
+
+static int memory_close(ll_transport_t *transport)
+{
+    memory_end_t *end = transport->state;
+    memory_channel_t *channel = end->channel;
+
+    // The other end reads what is left and then fails, and stops waiting
+    // for room to write
+    pthread_mutex_lock(&channel->lock);
+    end->out->closed = 1;
+    end->in->closed = 1;
+    uint64_t one = 1;
+    if (write(end->out->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("[LL] eventfd");
+    pthread_cond_broadcast(&channel->space);
+    int users = --channel->users;
+    pthread_mutex_unlock(&channel->lock);
+
+    if (users == 0)
+        free_channel(channel);
+    free(end);
+
+    return 0;
+}
+
+static const ll_transport_ops_t memoryOps = {"memory", memory_read, memory_write, NULL, NULL, NULL, memory_close};
+
+int lltransport_memory_pair(ll_transport_t **a, ll_transport_t **b, int capacity, double byteErrorRate,
+                            double dropRate)
+{
+    if (capacity == 0)
+        capacity = MEMORY_CAPACITY;
+    if (capacity < 0 || (capacity & (capacity - 1)) != 0)
+    {
+        printf("[LL] Invalid channel capacity %d (power of 2)\n", capacity);
+        return -1;
+    }
+
+    memory_channel_t *channel = calloc(1, sizeof(memory_channel_t));
+    memory_end_t *ends[2] = {calloc(1, sizeof(memory_end_t)), calloc(1, sizeof(memory_end_t))};
+    ll_transport_t *transports[2] = {NULL, NULL};
+    int ok = channel != NULL && ends[0] != NULL && ends[1] != NULL;
+
+    if (channel != NULL)
+    {
+        pthread_mutex_init(&channel->lock, NULL);
+        pthread_cond_init(&channel->space, NULL);
+        channel->capacity = capacity;
+        channel->byteErrorRate = byteErrorRate;
+        channel->dropRate = dropRate;
+        channel->seed = 1;
+        channel->users = 2;
+        for (int i = 0; i < 2; i++)
+        {
+            channel->rings[i].data = malloc(capacity);
+            channel->rings[i].eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            ok = ok && channel->rings[i].data != NULL && channel->rings[i].eventFd >= 0;
+        }
+    }
+
+    // End i reads ring i and writes the other one
+    for (int i = 0; ok && i < 2; i++)
+    {
+        ends[i]->channel = channel;
+        ends[i]->in = &channel->rings[i];
+        ends[i]->out = &channel->rings[1 - i];
+        transports[i] = new_transport(&memoryOps, channel->rings[i].eventFd, -1);
+        if (transports[i] == NULL)
+            ok = 0;
+        else
+            transports[i]->state = ends[i];
+    }
+
+    if (!ok)
+    {
+        perror("[LL] Could not create the memory channel");
+        free(transports[0]);
+        free(transports[1]);
+        free(ends[0]);
+        free(ends[1]);
+        if (channel != NULL)
+            free_channel(channel);
+        return -1;
+    }
+
+    *a = transports[0];
+    *b = transports[1];
+    return 0;
+}
@@ -0,0 +1,1016 @@
+// RC 24/25
+/*
+*   José Santos and José Filipe
+*   Description:
+*   Microbenchmark for the byte stuffing kernels used by the link layer.
+*   Every implementation the CPU supports is checked against the scalar one
+*   and timed on random, text and worst-case (all 0x7E) payloads.
+*   The COBS coder is checked and timed in the same way, also on all-zero
+*   payloads.
+*   The frame checks are then checked against known values and timed alone
+*   and together with the stuffing.
+*   The compression of the data field is checked on a stream of frames and
+*   its cost compared with the time it saves on the serial port.
+*   Last, the Reed-Solomon FEC is timed, and the goodput with and without it
+*   estimated over a BER sweep by sending stuffed I-frames through a noisy
+*   channel like the one of cable.c.
+*   Then the frame trace is checked through a dump and load after the
+*   ring wraps around, and the cost of adding a record is timed.
+*   Finally, whole connections are run between two threads through each
+*   transport without a line rate (transport.h), to measure the frames per
+*   second the protocol itself can handle, and both ends of a full duplex
+*   connection send packets through a transport that loses some of them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include "../include/stuffing.h"
+#include "../include/fcs.h"
+#include "../include/compress.h"
+#include "../include/fec.h"
+#include "../include/trace.h"
+#include "../include/linklayer.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define MIN_BENCH_TIME 0.2 // Seconds spent on each measurement
+
+// Payload types
+#define PAYLOAD_RANDOM 0
+#define PAYLOAD_TEXT 1
+#define PAYLOAD_FLAGS 2
+#define PAYLOAD_ZEROS 3
+
+const char *payloadNames[] = {"random", "text", "all-0x7E", "all-0x00"};
+const int sizes[] = {255, 4096, 65536};
+const char *fcsNames[] = {"xor", "crc16", "crc32c"};
+const int baudRates[] = {9600, 38400, 115200, 921600};
+
+#define COMPRESS_BLOCK 1024          // Data field of each frame
+#define COMPRESS_STREAM (1 << 20)    // Bytes compressed in each pass
+
+#define FEC_PAYLOAD 1024  // Payload of the I-frames of the BER sweep
+#define FEC_FRAMES 2000   // I-frames sent at each BER
+#define FEC_HEADER 6      // FLAG, A, C, BCC1, FLAG of the I-frame, not protected
+#define FEC_ACK 5         // Size of the RR that acknowledges it
+const int fecErrors[] = {0, 2, 4, 8};
+const double bitErrorRates[] = {1e-5, 1e-4, 3e-4, 1e-3, 3e-3};
+
+#define LINK_PAYLOAD 1024 // Packets sent through each transport
+#define LINK_PACKETS 20000
+#define LINK_WINDOW 7
+
+#define DUPLEX_PACKETS 200   // Packets sent each way in full duplex
+#define DUPLEX_WINDOW 8      // Selective Repeat with 7-bit sequence numbers
+#define DUPLEX_DROP 0.02     // Writes lost by the memory transport
+#define DUPLEX_MAX_TIME 1.0  // Seconds allowed for the exchange, losses are recovered in milliseconds
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void fill_payload(unsigned char *buffer, int length, int type)
+{
+    const char *text = "2026-10-17 12:00:01 link up, 38400 baud, frames=1024 rej=3 ";
+    int textLength = strlen(text);
+
+    for (int i = 0; i < length; i++)
+    {
+        if (type == PAYLOAD_RANDOM)
+            buffer[i] = rand() & 0xFF;
+        else if (type == PAYLOAD_TEXT)
+            buffer[i] = text[i % textLength];
+        else if (type == PAYLOAD_FLAGS)
+            buffer[i] = 0x7E;
+        else
+            buffer[i] = 0x00;
+    }
+}
+
+// Checks an implementation against the scalar one.
+int check_impl(const unsigned char *payload, int length, unsigned char *expected, int expectedLength,
+               unsigned char expectedBCC)
+{
+    unsigned char *stuffed = malloc(2 * length + 32);
+    unsigned char *destuffed = malloc(2 * length + 32);
+    unsigned char bcc = 0;
+    int ok = TRUE;
+
+    int stuffedLength = stuff_data(stuffed, payload, length, &bcc);
+    if (stuffedLength != expectedLength || bcc != expectedBCC ||
+        memcmp(stuffed, expected, stuffedLength) != 0)
+        ok = FALSE;
+
+    bcc = 0;
+    int destuffedLength = destuff_data(destuffed, stuffed, stuffedLength, &bcc);
+    if (destuffedLength != length || bcc != expectedBCC || memcmp(destuffed, payload, length) != 0)
+        ok = FALSE;
+
+    // Destuffing in place must give the same result
+    bcc = 0;
+    destuffedLength = destuff_data(stuffed, stuffed, stuffedLength, &bcc);
+    if (destuffedLength != length || bcc != expectedBCC || memcmp(stuffed, payload, length) != 0)
+        ok = FALSE;
+
+    free(stuffed);
+    free(destuffed);
+    return ok;
+}
+
+// Codes a payload with COBS as one block. Returns its length.
+int cobs_block(unsigned char *coded, const unsigned char *payload, int length, unsigned char *bcc)
+{
+    cobs_state_t state;
+    int pos = cobs_init(coded, &state);
+    pos += cobs_encode(&coded[pos], payload, length, &state, bcc);
+    cobs_final(&coded[pos], &state);
+
+    return pos;
+}
+
+// Checks each COBS implementation against the scalar one, decoding in
+// place, and times it. The overhead is the same for every payload, at most
+// one byte every 254, so the time should not depend on it either.
+int bench_cobs(void)
+{
+    int failures = 0;
+
+    printf("\n%-8s %-9s %7s %12s %12s %9s\n", "cobs", "payload", "size", "encode GB/s", "decode GB/s",
+           "overhead");
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int length = sizes[s];
+        int codedSize = length + length / COBS_MAX_RUN + 32;
+        unsigned char *payload = malloc(length);
+        unsigned char *coded = malloc(codedSize);
+        unsigned char *expected = malloc(codedSize);
+        unsigned char *decoded = malloc(codedSize);
+
+        for (int type = PAYLOAD_RANDOM; type <= PAYLOAD_ZEROS; type++)
+        {
+            fill_payload(payload, length, type);
+
+            unsigned char expectedBCC = 0;
+            stuffing_select(STUFFING_SCALAR);
+            int expectedLength = cobs_block(expected, payload, length, &expectedBCC);
+
+            for (int impl = STUFFING_SCALAR; impl <= STUFFING_AVX2; impl++)
+            {
+                if (stuffing_select(impl) != impl)
+                    continue;
+
+                unsigned char bcc = 0;
+                int codedLength = cobs_block(coded, payload, length, &bcc);
+                int ok = codedLength == expectedLength && bcc == expectedBCC &&
+                         memcmp(coded, expected, codedLength) == 0 && memchr(coded, 0, codedLength) == NULL;
+
+                bcc = 0;
+                int decodedLength = cobs_decode(coded, coded, codedLength, &bcc);
+                if (!ok || decodedLength != length || bcc != expectedBCC || memcmp(coded, payload, length) != 0)
+                {
+                    printf("%-8s %-9s %7d MISMATCH\n", stuffing_name(impl), payloadNames[type], length);
+                    failures++;
+                    continue;
+                }
+
+                long iterations = 0;
+                double start = now();
+                double elapsed;
+                do
+                {
+                    for (int i = 0; i < 64; i++)
+                        cobs_block(coded, payload, length, &bcc);
+                    iterations += 64;
+                    elapsed = now() - start;
+                } while (elapsed < MIN_BENCH_TIME);
+                double encodeRate = (double)length * iterations / elapsed / 1e9;
+
+                iterations = 0;
+                start = now();
+                do
+                {
+                    for (int i = 0; i < 64; i++)
+                        cobs_decode(decoded, expected, expectedLength, &bcc);
+                    iterations += 64;
+                    elapsed = now() - start;
+                } while (elapsed < MIN_BENCH_TIME);
+                double decodeRate = (double)length * iterations / elapsed / 1e9;
+
+                printf("%-8s %-9s %7d %12.2f %12.2f %9d\n", stuffing_name(impl), payloadNames[type], length,
+                       encodeRate, decodeRate, expectedLength - length);
+            }
+        }
+
+        free(payload);
+        free(coded);
+        free(expected);
+        free(decoded);
+    }
+
+    stuffing_select(STUFFING_AUTO);
+    return failures;
+}
+
+// Checks the CRCs against their standard check values and the CRC-32C
+// implementations against each other.
+int check_fcs(void)
+{
+    const unsigned char *check = (const unsigned char *)"123456789";
+    const unsigned int expected[] = {0x31, 0x906E, 0xE3069283};
+    unsigned char trailer[MAX_FCS_SIZE];
+    int ok = TRUE;
+
+    for (int type = FCS_XOR; type <= FCS_CRC32C; type++)
+    {
+        unsigned int fcs = fcs_update(type, fcs_init(type), check, 9);
+        fcs_final(type, fcs, trailer);
+
+        unsigned int value = 0;
+        for (int i = 0; i < fcs_size(type); i++)
+            value |= trailer[i] << (8 * i);
+
+        if (value != expected[type])
+        {
+            printf("%s check value 0x%X, expected 0x%X\n", fcsNames[type], value, expected[type]);
+            ok = FALSE;
+        }
+    }
+
+    unsigned char data[1000];
+    fill_payload(data, sizeof(data), PAYLOAD_RANDOM);
+
+    crc32c_select(CRC32C_TABLE);
+    unsigned int table = fcs_update(FCS_CRC32C, fcs_init(FCS_CRC32C), data, sizeof(data));
+    if (crc32c_select(CRC32C_SSE42) == CRC32C_SSE42)
+    {
+        // Odd split so the tail of each block is handled too
+        unsigned int fcs = fcs_update(FCS_CRC32C, fcs_init(FCS_CRC32C), data, 333);
+        fcs = fcs_update(FCS_CRC32C, fcs, data + 333, sizeof(data) - 333);
+        if (fcs != table)
+        {
+            printf("crc32c sse4.2 does not match the table\n");
+            ok = FALSE;
+        }
+    }
+    crc32c_select(CRC32C_AUTO);
+
+    return ok;
+}
+
+// Times each frame check alone and together with the stuffing, as done
+// when an I-frame is built.
+void bench_fcs(void)
+{
+    int length = 4096;
+    unsigned char *payload = malloc(length);
+    unsigned char *stuffed = malloc(2 * length + 32);
+    fill_payload(payload, length, PAYLOAD_RANDOM);
+
+    stuffing_select(STUFFING_AUTO);
+    printf("\n%-8s %7s %12s %12s\n", "fcs", "size", "check GB/s", "stuff+check");
+
+    for (int type = FCS_XOR; type <= FCS_CRC32C; type++)
+    {
+        unsigned int fcs = fcs_init(type);
+        long iterations = 0;
+        double start = now();
+        double elapsed;
+        do
+        {
+            for (int i = 0; i < 64; i++)
+                fcs = fcs_update(type, fcs, payload, length);
+            iterations += 64;
+            elapsed = now() - start;
+        } while (elapsed < MIN_BENCH_TIME);
+        double checkRate = (double)length * iterations / elapsed / 1e9;
+
+        iterations = 0;
+        start = now();
+        do
+        {
+            for (int i = 0; i < 64; i++)
+                fcs_stuff(type, stuffed, payload, length, &fcs);
+            iterations += 64;
+            elapsed = now() - start;
+        } while (elapsed < MIN_BENCH_TIME);
+        double stuffRate = (double)length * iterations / elapsed / 1e9;
+
+        printf("%-8s %7d %12.2f %12.2f\n", fcsNames[type], length, checkRate, stuffRate);
+    }
+
+    free(payload);
+    free(stuffed);
+}
+
+// Fills a buffer with log lines, which are less repetitive than the text
+// payload but still compress like real text does.
+void fill_log(unsigned char *buffer, int length)
+{
+    int pos = 0;
+    while (pos < length)
+    {
+        char line[128];
+        int lineLength = snprintf(line, sizeof(line), "2026-10-17 12:%02d:%02d port %d frame %d rej %d rtt %d ms\n",
+                                  rand() % 60, rand() % 60, rand() % 4, rand() % 100000, rand() % 10,
+                                  rand() % 500);
+        for (int i = 0; i < lineLength && pos < length; i++)
+            buffer[pos++] = line[i];
+    }
+}
+
+// Compresses a stream of frames with a new history and decompresses it again.
+// Returns the compressed length, -1 if the round trip failed.
+long compress_pass(const unsigned char *stream, unsigned char *packed, int *packedLength,
+                   unsigned char *output, double *compressTime, double *decompressTime)
+{
+    lz_stream_t *tx = lz_create(COMPRESS_BLOCK);
+    lz_stream_t *rx = lz_create(COMPRESS_BLOCK);
+    long total = 0;
+
+    // Frames that do not shrink are sent as they are, like llwrite does
+    double start = now();
+    for (int f = 0; f < COMPRESS_STREAM / COMPRESS_BLOCK; f++)
+    {
+        struct iovec iov = {(void *)(stream + f * COMPRESS_BLOCK), COMPRESS_BLOCK};
+        packedLength[f] = lz_compress(tx, &iov, 1, packed + f * COMPRESS_BLOCK, COMPRESS_BLOCK - 1);
+        total += packedLength[f] >= 0 ? packedLength[f] : COMPRESS_BLOCK;
+    }
+    *compressTime = now() - start;
+
+    int ok = TRUE;
+    start = now();
+    for (int f = 0; f < COMPRESS_STREAM / COMPRESS_BLOCK; f++)
+    {
+        unsigned char *out = output + f * COMPRESS_BLOCK;
+        if (packedLength[f] >= 0)
+            ok &= lz_decompress(rx, packed + f * COMPRESS_BLOCK, packedLength[f], out) == COMPRESS_BLOCK;
+        else
+        {
+            memcpy(out, stream + f * COMPRESS_BLOCK, COMPRESS_BLOCK);
+            lz_append(rx, out, COMPRESS_BLOCK);
+        }
+    }
+    *decompressTime = now() - start;
+
+    lz_free(tx);
+    lz_free(rx);
+
+    if (!ok || memcmp(stream, output, COMPRESS_STREAM) != 0)
+        return -1;
+    return total;
+}
+
+// Checks the compression round trip and tells at which baud rates it pays
+// off: the time saved on the serial port (10 bits per byte) against the time
+// spent compressing and decompressing, per MB of data.
+int bench_compress(void)
+{
+    unsigned char *stream = malloc(COMPRESS_STREAM);
+    unsigned char *packed = malloc(COMPRESS_STREAM);
+    unsigned char *output = malloc(COMPRESS_STREAM);
+    int *packedLength = malloc(COMPRESS_STREAM / COMPRESS_BLOCK * sizeof(int));
+    const char *names[] = {"random", "text", "log"};
+    int failures = 0;
+
+    printf("\n%-8s %7s %8s %12s %14s", "payload", "frame", "ratio", "comp MB/s", "decomp MB/s");
+    for (int b = 0; b < (int)(sizeof(baudRates) / sizeof(baudRates[0])); b++)
+        printf(" %9d", baudRates[b]);
+    printf("  (s saved per MB)\n");
+
+    for (int type = 0; type < 3; type++)
+    {
+        if (type == 2)
+            fill_log(stream, COMPRESS_STREAM);
+        else
+            fill_payload(stream, COMPRESS_STREAM, type == 0 ? PAYLOAD_RANDOM : PAYLOAD_TEXT);
+
+        // Best of a few passes, each one a new connection
+        double compressTime = 1e9;
+        double decompressTime = 1e9;
+        long total = 0;
+        for (int pass = 0; pass < 5; pass++)
+        {
+            double c, d;
+            total = compress_pass(stream, packed, packedLength, output, &c, &d);
+            if (total < 0)
+                break;
+            compressTime = c < compressTime ? c : compressTime;
+            decompressTime = d < decompressTime ? d : decompressTime;
+        }
+
+        if (total < 0)
+        {
+            printf("%-8s %7d MISMATCH\n", names[type], COMPRESS_BLOCK);
+            failures++;
+            continue;
+        }
+
+        double ratio = (double)total / COMPRESS_STREAM;
+        printf("%-8s %7d %8.3f %12.1f %14.1f", names[type], COMPRESS_BLOCK, ratio,
+               COMPRESS_STREAM / compressTime / 1e6, COMPRESS_STREAM / decompressTime / 1e6);
+
+        // Both ends spend their time, but they work while the frames are on
+        // the wire, so only the slower one delays the transfer
+        double cpu = (compressTime > decompressTime ? compressTime : decompressTime) * 1e6 / COMPRESS_STREAM;
+        for (int b = 0; b < (int)(sizeof(baudRates) / sizeof(baudRates[0])); b++)
+            printf(" %9.2f", (1 - ratio) * 1e6 * 10 / baudRates[b] - cpu);
+        printf("\n");
+    }
+
+    free(stream);
+    free(packed);
+    free(output);
+    free(packedLength);
+
+    return failures;
+}
+
+// Sends one I-frame through a channel that flips one bit of a byte with the
+// probability byteErrorRate, as cable.c does, and receives it.
+// Returns TRUE if the payload arrived intact, FALSE if it was discarded or
+// arrived wrong. The length of the stuffed frame is stored in frameLength.
+int noisy_frame(const fec_code_t *code, const unsigned char *payload, double byteErrorRate, int *frameLength,
+                unsigned char *field, unsigned char *stuffed, unsigned char *parity)
+{
+    unsigned char unused = 0;
+
+    // Data field: payload, CRC-16 and the parity of both
+    memcpy(field, payload, FEC_PAYLOAD);
+    fcs_final(FCS_CRC16, fcs_update(FCS_CRC16, fcs_init(FCS_CRC16), field, FEC_PAYLOAD), &field[FEC_PAYLOAD]);
+    int length = FEC_PAYLOAD + fcs_size(FCS_CRC16);
+    if (code != NULL)
+    {
+        fec_state_t state;
+        fec_init(code, &state, parity);
+        fec_update(code, &state, field, length);
+        int parityLength = fec_final(code, &state);
+        memcpy(&field[length], parity, parityLength);
+        length += parityLength;
+    }
+    int stuffedLength = stuff_data(stuffed, field, length, &unused);
+    *frameLength = stuffedLength + FEC_HEADER;
+
+    int threshold = byteErrorRate * RAND_MAX;
+    for (int i = 0; i < stuffedLength; i++)
+    {
+        if (rand() < threshold)
+            stuffed[i] ^= 1 << (rand() % 8);
+
+        // A flag in the middle cuts the frame, it is lost
+        if (stuffed[i] == 0x7E)
+            return FALSE;
+    }
+
+    length = destuff_data(field, stuffed, stuffedLength, &unused);
+    if (length < 0)
+        return FALSE;
+
+    if (code != NULL)
+    {
+        // Errors in 0x7D shift the rest of the frame, which the code cannot fix
+        int dataLength = fec_data_length(code, length);
+        if (dataLength < 0 || fec_decode(code, field, dataLength, &field[dataLength]) < 0)
+            return FALSE;
+        length = dataLength;
+    }
+
+    unsigned char trailer[MAX_FCS_SIZE];
+    if (length != FEC_PAYLOAD + fcs_size(FCS_CRC16))
+        return FALSE;
+    fcs_final(FCS_CRC16, fcs_update(FCS_CRC16, fcs_init(FCS_CRC16), field, FEC_PAYLOAD), trailer);
+    if (memcmp(trailer, &field[FEC_PAYLOAD], fcs_size(FCS_CRC16)) != 0)
+        return FALSE;
+
+    return memcmp(field, payload, FEC_PAYLOAD) == 0;
+}
+
+// Times the FEC and estimates the goodput at each BER: frames that arrive
+// intact over all the bytes sent, assuming Selective Repeat so only the
+// frames that fail are sent again.
+int bench_fec(void)
+{
+    int fieldSize = 2 * (FEC_PAYLOAD + MAX_FCS_SIZE);
+    unsigned char *payload = malloc(FEC_PAYLOAD);
+    unsigned char *field = malloc(fieldSize);
+    unsigned char *stuffed = malloc(2 * fieldSize);
+    unsigned char *parity = malloc(fieldSize);
+    int failures = 0;
+
+    fill_payload(payload, FEC_PAYLOAD, PAYLOAD_RANDOM);
+
+    printf("\n%-8s %7s %10s %14s %16s\n", "fec", "size", "parity", "encode MB/s", "correct 1 MB/s");
+    for (int e = 1; e < (int)(sizeof(fecErrors) / sizeof(fecErrors[0])); e++)
+    {
+        fec_code_t *code = fec_create(fecErrors[e]);
+        int length = FEC_PAYLOAD + fcs_size(FCS_CRC16);
+        fec_state_t state;
+
+        long iterations = 0;
+        double start = now();
+        double elapsed;
+        do
+        {
+            fec_init(code, &state, parity);
+            fec_update(code, &state, payload, length);
+            fec_final(code, &state);
+            iterations++;
+            elapsed = now() - start;
+        } while (elapsed < MIN_BENCH_TIME);
+        double encodeRate = (double)length * iterations / elapsed / 1e6;
+        int parityLength = fec_parity_length(code, length);
+
+        // One wrong byte in every block, which must be corrected
+        memcpy(field, payload, length);
+        fec_init(code, &state, parity);
+        fec_update(code, &state, field, length);
+        fec_final(code, &state);
+        iterations = 0;
+        start = now();
+        do
+        {
+            for (int i = 0; i < length; i += FEC_BLOCK - 2 * fecErrors[e])
+                field[i] ^= 0x5A;
+            if (fec_decode(code, field, length, parity) < 0 || memcmp(field, payload, length) != 0)
+            {
+                printf("t=%-6d %7d MISMATCH\n", fecErrors[e], length);
+                failures++;
+                break;
+            }
+            iterations++;
+            elapsed = now() - start;
+        } while (elapsed < MIN_BENCH_TIME);
+        double decodeRate = (double)length * iterations / elapsed / 1e6;
+
+        printf("t=%-6d %7d %10d %14.1f %16.1f\n", fecErrors[e], length, parityLength, encodeRate, decodeRate);
+        fec_free(code);
+    }
+
+    printf("\n%-8s", "BER");
+    for (int e = 0; e < (int)(sizeof(fecErrors) / sizeof(fecErrors[0])); e++)
+        printf("  t=%-2d ok  goodput", fecErrors[e]);
+    printf("  (%d B frames, %% of 115200 baud)\n", FEC_PAYLOAD);
+
+    for (int b = 0; b < (int)(sizeof(bitErrorRates) / sizeof(bitErrorRates[0])); b++)
+    {
+        // Probability of a wrong byte, with at most one wrong bit per byte
+        double intact = 1;
+        for (int i = 0; i < 8; i++)
+            intact *= 1 - bitErrorRates[b];
+
+        printf("%-8.0e", bitErrorRates[b]);
+        for (int e = 0; e < (int)(sizeof(fecErrors) / sizeof(fecErrors[0])); e++)
+        {
+            fec_code_t *code = fecErrors[e] > 0 ? fec_create(fecErrors[e]) : NULL;
+            int received = 0;
+            long bytes = 0;
+
+            srand(b * 16 + e);
+            for (int f = 0; f < FEC_FRAMES; f++)
+            {
+                int frameLength;
+                received += noisy_frame(code, payload, 1 - intact, &frameLength, field, stuffed, parity);
+                bytes += frameLength + FEC_ACK;
+            }
+
+            printf("   %5.1f%% %7.1f%%", 100.0 * received / FEC_FRAMES, 100.0 * received * FEC_PAYLOAD / bytes);
+            fec_free(code);
+        }
+        printf("\n");
+    }
+
+    free(payload);
+    free(field);
+    free(stuffed);
+    free(parity);
+
+    return failures;
+}
+
+// Checks that the trace keeps the newest records in order, and times
+// trace_add. Returns the number of failed checks.
+int bench_trace(void)
+{
+    trace_ring_t *ring = malloc(sizeof(trace_ring_t));
+    trace_header_t header;
+    trace_record_t *records = NULL;
+    char path[] = "/tmp/bench_trace_XXXXXX";
+    int failures = 0;
+
+    trace_init(ring);
+    int added = TRACE_RECORDS + TRACE_RECORDS / 2;
+    for (int i = 0; i < added; i++)
+        trace_add(ring, TRACE_CODE(TRACE_SENT, TRACE_FRAME_I), 0, i & 0x7F, 0, i);
+
+    int fd = mkstemp(path);
+    memset(&header, 0, sizeof(header));
+    // The oldest slot is left out, the writer could be overwriting it
+    int kept = TRACE_RECORDS - 1;
+    int count = fd < 0 ? -1 : trace_dump(ring, &header, path);
+    if (count != kept || trace_load(path, &header, &records) != kept || header.lost != (unsigned int)(added - kept))
+        failures++;
+    for (int i = 0; failures == 0 && i < kept; i++)
+    {
+        if (records[i].length != (unsigned int)(added - kept + i) ||
+            (i > 0 && records[i].time < records[i - 1].time))
+            failures++;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+        unlink(path);
+    }
+    free(records);
+
+    long iterations = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < 1024; i++)
+            trace_add(ring, TRACE_CODE(TRACE_RECEIVED, TRACE_FRAME_RR), 0x05, 0, i & 0x7F, 5);
+        iterations += 1024;
+        elapsed = now() - start;
+    } while (elapsed < MIN_BENCH_TIME);
+
+    double addNs = elapsed * 1e9 / iterations;
+
+    // Most of it is reading the clock
+    iterations = 0;
+    start = now();
+    do
+    {
+        for (int i = 0; i < 1024; i++)
+            trace_clock();
+        iterations += 1024;
+        elapsed = now() - start;
+    } while (elapsed < MIN_BENCH_TIME);
+
+    printf("\n%-8s %12s %12s\n", "trace", "ns/record", "clock ns");
+    printf("%-8s %12.2f %12.2f %s\n", "add", addNs, elapsed * 1e9 / iterations,
+           failures > 0 ? "MISMATCH" : "");
+
+    free(ring);
+    return failures;
+}
+
+// Receiving end of a connection run by bench_link.
+typedef struct {
+    ll_transport_t *transport;
+    int packets;  // Packets that arrived in order with the right contents
+    int failures; // Packets that did not
+} link_rx_t;
+
+// Fills a packet with its number, so the receiver can check it.
+void fill_packet(unsigned char *packet, int number)
+{
+    for (int i = 0; i < LINK_PAYLOAD; i++)
+        packet[i] = (unsigned char)(number * 7 + i);
+}
+
+void *link_receiver(void *arg)
+{
+    link_rx_t *rx = arg;
+    unsigned char *packet = malloc(MAX_PAYLOAD);
+    unsigned char *expected = malloc(LINK_PAYLOAD);
+
+    ll_conn_t *conn = llopen_transport(rx->transport, RX, NULL, NULL);
+    while (conn != NULL && rx->packets + rx->failures < LINK_PACKETS)
+    {
+        int length = llread(conn, packet);
+        if (length < 0)
+            break;
+
+        fill_packet(expected, rx->packets + rx->failures);
+        if (length == LINK_PAYLOAD && memcmp(packet, expected, LINK_PAYLOAD) == 0)
+            rx->packets++;
+        else
+            rx->failures++;
+    }
+    if (conn != NULL)
+        llclose(conn, NULL, NULL);
+
+    free(packet);
+    free(expected);
+    return NULL;
+}
+
+// Sends LINK_PACKETS packets from this thread to another one through a
+// pair of transports, and prints the packets and frames per second.
+// Returns the number of failed checks.
+int bench_link(const char *name, ll_transport_t *txEnd, ll_transport_t *rxEnd, int arq)
+{
+    link_rx_t rx = {rxEnd, 0, 0};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, link_receiver, &rx) != 0)
+    {
+        lltransport_close(txEnd);
+        lltransport_close(rxEnd);
+        return 1;
+    }
+
+    ll_params_t params;
+    llparams_default(&params);
+    params.arq = arq;
+    params.window = arq == ARQ_STOP_AND_WAIT ? 1 : LINK_WINDOW;
+    params.seqBits = 0;
+    params.fcs = FCS_CRC32C;
+    params.maxPayload = LINK_PAYLOAD;
+
+    // llopen and llclose report on stdout, which would break the table
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    unsigned char packet[LINK_PAYLOAD];
+    ll_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    int sent = 0;
+    double start = now();
+
+    ll_conn_t *conn = llopen_transport(txEnd, TX, &params, NULL);
+    for (; conn != NULL && sent < LINK_PACKETS; sent++)
+    {
+        fill_packet(packet, sent);
+        if (llwrite(conn, packet, LINK_PAYLOAD) < 0)
+            break;
+    }
+    if (conn != NULL)
+        llclose(conn, NULL, &stats);
+    double elapsed = now() - start;
+
+    pthread_join(thread, NULL);
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    int failures = sent != LINK_PACKETS || rx.packets != LINK_PACKETS;
+    printf("%-14s %-6s %10.0f %10.0f %8.1f %8ld %s\n", name, arq == ARQ_STOP_AND_WAIT ? "s&w" : "gbn",
+           rx.packets / elapsed, stats.framesSent / elapsed, (double)rx.packets * LINK_PAYLOAD / elapsed / 1e6,
+           stats.retransmitTimeout + stats.retransmitRej + stats.retransmitSrej, failures > 0 ? "MISMATCH" : "");
+
+    return failures;
+}
+
+// Runs the protocol through every transport without a line rate.
+// Returns the number of failed checks.
+int bench_transports(void)
+{
+    const char *names[] = {"memory", "memory+errors", "socketpair", "pipe", "pty"};
+    int failures = 0;
+
+    printf("\n%-14s %-6s %10s %10s %8s %8s\n", "transport", "arq", "packets/s", "frames/s", "MB/s", "resent");
+
+    for (int arq = ARQ_STOP_AND_WAIT; arq <= ARQ_GO_BACK_N; arq++)
+    {
+        for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        {
+            ll_transport_t *a, *b;
+            int res;
+
+            // The errors cost some retransmissions but every packet must
+            // still arrive intact
+            if (i == 0)
+                res = lltransport_memory_pair(&a, &b, 0, 0, 0);
+            else if (i == 1)
+                res = lltransport_memory_pair(&a, &b, 0, 1e-5, 1e-3);
+            else if (i == 2)
+                res = lltransport_socketpair(&a, &b);
+            else if (i == 3)
+                res = lltransport_pipe_pair(&a, &b);
+            else
+                res = lltransport_pty_pair(&a, &b);
+
+            if (res != 0)
+            {
+                printf("%-14s could not be created\n", names[i]);
+                failures++;
+                continue;
+            }
+            failures += bench_link(names[i], a, b, arq);
+        }
+    }
+
+    return failures;
+}
+
+// One end of the full duplex connection run by bench_duplex.
+typedef struct {
+    ll_transport_t *transport;
+    int role;
+    int packets;    // Packets that arrived in order with the right contents
+    double seconds; // Time to send and receive every packet, without llopen and llclose
+} duplex_end_t;
+
+// Sends DUPLEX_PACKETS packets and takes the ones of the other end as they
+// arrive, as test/main.c does in full duplex.
+void *duplex_end(void *arg)
+{
+    duplex_end_t *end = arg;
+    unsigned char *packet = malloc(MAX_PAYLOAD);
+    unsigned char *expected = malloc(LINK_PAYLOAD);
+
+    // The receiver takes the parameters of the transmitter
+    ll_params_t params;
+    llparams_default(&params);
+    params.arq = ARQ_SELECTIVE_REPEAT;
+    params.window = DUPLEX_WINDOW;
+    params.seqBits = 7;
+    params.fcs = FCS_CRC32C;
+    params.maxPayload = LINK_PAYLOAD;
+    params.duplex = TRUE;
+
+    ll_conn_t *conn = llopen_transport(end->transport, end->role, end->role == TX ? &params : NULL, NULL);
+    int sent = 0;
+    int received = 0;
+    int error = conn == NULL;
+    double start = now();
+    while (!error && (sent < DUPLEX_PACKETS || received < DUPLEX_PACKETS))
+    {
+        if (sent < DUPLEX_PACKETS)
+        {
+            fill_packet(packet, sent);
+            if (llwrite(conn, packet, LINK_PAYLOAD) < 0)
+                error = TRUE;
+            sent++;
+        }
+
+        while (!error && received < DUPLEX_PACKETS)
+        {
+            // Only wait for packets once ours are all sent
+            int length = sent < DUPLEX_PACKETS ? llread_nowait(conn, packet) : llread(conn, packet);
+            if (length == TIMEOUT_ERROR && sent < DUPLEX_PACKETS)
+                break;
+            if (length < 0)
+            {
+                error = TRUE;
+                break;
+            }
+
+            fill_packet(expected, received++);
+            if (length == LINK_PAYLOAD && memcmp(packet, expected, LINK_PAYLOAD) == 0)
+                end->packets++;
+        }
+    }
+    end->seconds = now() - start;
+
+    if (conn != NULL)
+        llclose(conn, NULL, NULL);
+
+    free(packet);
+    free(expected);
+    return NULL;
+}
+
+// Runs a full duplex connection through a memory transport that drops
+// writes, with both ends sending at the same time. Losses must be
+// recovered without either end waiting on the other for long.
+// Returns the number of failed checks.
+int bench_duplex(void)
+{
+    ll_transport_t *a, *b;
+    if (lltransport_memory_pair(&a, &b, 0, 0, DUPLEX_DROP) != 0)
+    {
+        printf("\nduplex could not be created\n");
+        return 1;
+    }
+
+    duplex_end_t tx = {a, TX, 0, 0};
+    duplex_end_t rx = {b, RX, 0, 0};
+
+    // llopen and llclose report on stdout, on both threads
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    pthread_t thread;
+    int started = pthread_create(&thread, NULL, duplex_end, &rx) == 0;
+    if (started)
+    {
+        duplex_end(&tx);
+        pthread_join(thread, NULL);
+    }
+    else
+    {
+        lltransport_close(a);
+        lltransport_close(b);
+    }
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    if (!started)
+        return 1;
+
+    double seconds = tx.seconds > rx.seconds ? tx.seconds : rx.seconds;
+    int failures = tx.packets != DUPLEX_PACKETS || rx.packets != DUPLEX_PACKETS || seconds > DUPLEX_MAX_TIME;
+    printf("\n%-14s %-6s %10s %10s %8s\n", "duplex", "arq", "packets", "drop", "ms");
+    printf("%-14s %-6s %10d %10.2f %8.1f %s\n", "memory+drops", "sr", tx.packets + rx.packets, DUPLEX_DROP,
+           seconds * 1e3, seconds > DUPLEX_MAX_TIME ? "SLOW" : failures > 0 ? "MISMATCH" : "");
+
+    return failures;
+}
+
+int main(void)
+{
+    int failures = 0;
+
+    printf("%-8s %-9s %7s %12s %12s\n", "impl", "payload", "size", "stuff GB/s", "destuff GB/s");
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int length = sizes[s];
+        unsigned char *payload = malloc(length);
+        unsigned char *stuffed = malloc(2 * length + 32);
+        unsigned char *expected = malloc(2 * length + 32);
+        unsigned char *destuffed = malloc(2 * length + 32);
+
+        for (int type = PAYLOAD_RANDOM; type <= PAYLOAD_FLAGS; type++)
+        {
+            fill_payload(payload, length, type);
+
+            // Reference result
+            unsigned char expectedBCC = 0;
+            stuffing_select(STUFFING_SCALAR);
+            int expectedLength = stuff_data(expected, payload, length, &expectedBCC);
+
+            for (int impl = STUFFING_SCALAR; impl <= STUFFING_AVX2; impl++)
+            {
+                if (stuffing_select(impl) != impl)
+                    continue;
+
+                if (!check_impl(payload, length, expected, expectedLength, expectedBCC))
+                {
+                    printf("%-8s %-9s %7d MISMATCH\n", stuffing_name(impl), payloadNames[type], length);
+                    failures++;
+                    continue;
+                }
+
+                unsigned char bcc = 0;
+                long iterations = 0;
+                double start = now();
+                double elapsed;
+                do
+                {
+                    for (int i = 0; i < 64; i++)
+                        stuff_data(stuffed, payload, length, &bcc);
+                    iterations += 64;
+                    elapsed = now() - start;
+                } while (elapsed < MIN_BENCH_TIME);
+                double stuffRate = (double)length * iterations / elapsed / 1e9;
+
+                iterations = 0;
+                start = now();
+                do
+                {
+                    for (int i = 0; i < 64; i++)
+                        destuff_data(destuffed, expected, expectedLength, &bcc);
+                    iterations += 64;
+                    elapsed = now() - start;
+                } while (elapsed < MIN_BENCH_TIME);
+                double destuffRate = (double)length * iterations / elapsed / 1e9;
+
+                printf("%-8s %-9s %7d %12.2f %12.2f\n", stuffing_name(impl), payloadNames[type], length,
+                       stuffRate, destuffRate);
+            }
+        }
+
+        free(payload);
+        free(stuffed);
+        free(expected);
+        free(destuffed);
+    }
+
+    failures += bench_cobs();
+    if (!check_fcs())
+        failures++;
+    bench_fcs();
+    failures += bench_compress();
+    failures += bench_fec();
+    failures += bench_trace();
+    failures += bench_transports();
+    failures += bench_duplex();
+
+    if (failures > 0)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
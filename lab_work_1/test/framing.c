@@ -0,0 +1,718 @@
+// RC 24/25
+/*
+*   José Santos and José Filipe
+*   Description:
+*   Benchmark of the CPU cost of framing in the link layer, stage by stage:
+*   the frame check (BCC2 or CRC) alone, byte stuffing with the frame check
+*   and destuffing, the frame parser (parser.h) alone, llwrite building and
+*   stuffing I-frames, llread taking them from the transport, and whole
+*   transfers between two threads. Every stage runs with payloads from 1
+*   byte to MAX_PAYLOAD of random, text and all-escape bytes, and is
+*   reported in ns/byte and frames/s.
+*   llwrite and llread run on scripted transports (transport.h) that play
+*   back the bytes of a real transfer recorded first, so each one is timed
+*   without the other end. The payloads come from a fixed seed and each
+*   stage keeps the best of a few runs, so two reports of the same build
+*   are close. The report can be written as JSON (-j) and compared with an
+*   earlier one (-b). With -o frames are coded with COBS instead of byte
+*   stuffing, in the kernels and in the connections.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "../include/linklayer.h"
+#include "../include/stuffing.h"
+#include "../include/parser.h"
+
+#define REPEATS 3                  // Runs of each stage, the fastest is kept
+#define TARGET_BYTES (4 << 20)     // Payload bytes per run...
+#define MIN_FRAMES 64              // ...within these limits
+#define MAX_FRAMES 20000
+#define MAX_RESULTS 256
+
+// Payload types
+#define PAYLOAD_RANDOM 0
+#define PAYLOAD_TEXT 1
+#define PAYLOAD_ESCAPE 2
+
+// Stages
+#define STAGE_CHECK 0
+#define STAGE_STUFF 1
+#define STAGE_DESTUFF 2
+#define STAGE_PARSE 3
+#define STAGE_LLWRITE 4
+#define STAGE_LLREAD 5
+#define STAGE_TRANSFER 6
+#define STAGES 7
+
+const char *payloadNames[] = {"random", "text", "escape"};
+const char *stageNames[] = {"check", "stuff", "destuff", "parse", "llwrite", "llread", "transfer"};
+const char *fcsNames[] = {"xor", "crc16", "crc32c"};
+const int sizes[] = {1, 16, 64, 255, 1024, 4096, 16384, MAX_PAYLOAD};
+
+typedef struct {
+    int stage;
+    int payload;
+    int size;
+    int frames;
+    double seconds; // Best of the runs
+    double baseNsPerByte; // From the baseline, 0 if it has none
+} result_t;
+
+// Bytes written through a transport, one message per write
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t size;
+    size_t *ends; // End of each message in data
+    int count;
+    int countSize;
+} capture_t;
+
+// Transport that records what is written before passing it on
+typedef struct {
+    ll_transport_t *inner;
+    capture_t *capture;
+} recorder_t;
+
+// Transport that plays back what the other end wrote in a recorded
+// transfer. The transmitter gets one message for each of its writes, as if
+// the receiver answered at once; the receiver gets everything from the
+// start. What is written is dropped.
+typedef struct {
+    const capture_t *input;
+    int gated;      // One message of input per write
+    int released;   // Messages of input that can be read
+    size_t readPos; // Bytes of input read
+} script_t;
+
+// One frame check for the whole run, given with -c
+static int fcsType = FCS_XOR;
+// Framing of the whole run, FRAMING_COBS with -o
+static int framing = FRAMING_HDLC;
+// Results of the kernels, so the compiler cannot leave them out
+static volatile unsigned char sink;
+const char *framingNames[] = {"hdlc", "cobs"};
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void fill_payload(unsigned char *buffer, int length, int type)
+{
+    const char *text = "2026-10-17 12:00:01 link up, 38400 baud, frames=1024 rej=3 ";
+    int textLength = strlen(text);
+
+    for (int i = 0; i < length; i++)
+    {
+        if (type == PAYLOAD_RANDOM)
+            buffer[i] = rand() & 0xFF;
+        else if (type == PAYLOAD_TEXT)
+            buffer[i] = text[i % textLength];
+        else
+            buffer[i] = i & 1 ? 0x7D : 0x7E;
+    }
+}
+
+// Sends the messages of llopen and llclose to /dev/null while a stage runs,
+// so they do not break the table.
+static int savedStdout = -1;
+
+void quiet(int on)
+{
+    fflush(stdout);
+    if (on)
+    {
+        savedStdout = dup(STDOUT_FILENO);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+    else
+    {
+        dup2(savedStdout, STDOUT_FILENO);
+        close(savedStdout);
+    }
+}
+
+void capture_add(capture_t *capture, const struct iovec *iov, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        while (capture->length + iov[i].iov_len > capture->size)
+        {
+            capture->size = capture->size > 0 ? 2 * capture->size : 1 << 20;
+            capture->data = realloc(capture->data, capture->size);
+        }
+        memcpy(&capture->data[capture->length], iov[i].iov_base, iov[i].iov_len);
+        capture->length += iov[i].iov_len;
+    }
+
+    if (capture->count == capture->countSize)
+    {
+        capture->countSize = capture->countSize > 0 ? 2 * capture->countSize : 1024;
+        capture->ends = realloc(capture->ends, capture->countSize * sizeof(size_t));
+    }
+    capture->ends[capture->count++] = capture->length;
+}
+
+int recorder_read(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    recorder_t *recorder = transport->state;
+    return recorder->inner->ops->read(recorder->inner, iov, count);
+}
+
+int recorder_write(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    recorder_t *recorder = transport->state;
+    capture_add(recorder->capture, iov, count);
+    return recorder->inner->ops->write(recorder->inner, iov, count);
+}
+
+int recorder_close(ll_transport_t *transport)
+{
+    recorder_t *recorder = transport->state;
+    int res = lltransport_close(recorder->inner);
+    free(recorder);
+    return res;
+}
+
+const ll_transport_ops_t recorderOps = {"recorder", recorder_read, recorder_write, NULL, NULL, NULL,
+                                        recorder_close};
+
+ll_transport_t *new_recorder(ll_transport_t *inner, capture_t *capture)
+{
+    ll_transport_t *transport = calloc(1, sizeof(ll_transport_t));
+    recorder_t *recorder = calloc(1, sizeof(recorder_t));
+    recorder->inner = inner;
+    recorder->capture = capture;
+
+    transport->ops = &recorderOps;
+    transport->readFd = inner->readFd;
+    transport->writeFd = -1;
+    transport->state = recorder;
+    return transport;
+}
+
+// The eventfd is readable while there are bytes to read, for poll()
+void script_signal(ll_transport_t *transport)
+{
+    script_t *script = transport->state;
+    size_t available = script->released > 0 ? script->input->ends[script->released - 1] : 0;
+    uint64_t value = 1;
+
+    if (script->readPos < available)
+        write(transport->readFd, &value, sizeof(value));
+    else
+        read(transport->readFd, &value, sizeof(value));
+}
+
+int script_read(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    script_t *script = transport->state;
+    size_t available = script->released > 0 ? script->input->ends[script->released - 1] : 0;
+    int total = 0;
+
+    for (int i = 0; i < count && script->readPos < available; i++)
+    {
+        size_t chunk = available - script->readPos;
+        if (chunk > iov[i].iov_len)
+            chunk = iov[i].iov_len;
+        memcpy(iov[i].iov_base, &script->input->data[script->readPos], chunk);
+        script->readPos += chunk;
+        total += chunk;
+    }
+
+    script_signal(transport);
+    return total;
+}
+
+int script_write(ll_transport_t *transport, const struct iovec *iov, int count)
+{
+    script_t *script = transport->state;
+    int total = 0;
+
+    for (int i = 0; i < count; i++)
+        total += iov[i].iov_len;
+
+    if (script->gated && script->released < script->input->count)
+    {
+        script->released++;
+        script_signal(transport);
+    }
+
+    return total;
+}
+
+int script_close(ll_transport_t *transport)
+{
+    close(transport->readFd);
+    free(transport->state);
+    return 0;
+}
+
+const ll_transport_ops_t scriptOps = {"script", script_read, script_write, NULL, NULL, NULL, script_close};
+
+ll_transport_t *new_script(const capture_t *input, int gated)
+{
+    ll_transport_t *transport = calloc(1, sizeof(ll_transport_t));
+    script_t *script = calloc(1, sizeof(script_t));
+    script->input = input;
+    script->gated = gated;
+    script->released = gated ? 0 : input->count;
+
+    transport->ops = &scriptOps;
+    transport->readFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    transport->writeFd = -1;
+    transport->state = script;
+    script_signal(transport);
+    return transport;
+}
+
+// Link parameters of every connection: the original stop-and-wait protocol
+// with I-frames as large as the payload
+void link_params(ll_params_t *params, int size)
+{
+    llparams_default(params);
+    params->fcs = fcsType;
+    params->maxPayload = size;
+    params->framing = framing;
+}
+
+// Receiving end of a transfer.
+typedef struct {
+    ll_transport_t *transport;
+    int size;
+    int frames;
+    const unsigned char *payload; // Expected in every packet, NULL to skip the check
+    int received;
+    int failures;
+    double seconds; // From the first packet to the last one
+} receiver_t;
+
+void *receiver_thread(void *arg)
+{
+    receiver_t *rx = arg;
+    unsigned char *packet = malloc(MAX_PAYLOAD);
+
+    ll_conn_t *conn = llopen_transport(rx->transport, RX, NULL, NULL);
+    double start = now();
+    while (conn != NULL && rx->received + rx->failures < rx->frames)
+    {
+        int length = llread(conn, packet);
+        if (length < 0)
+            break;
+
+        if (length == rx->size && (rx->payload == NULL || memcmp(packet, rx->payload, length) == 0))
+            rx->received++;
+        else
+            rx->failures++;
+    }
+    rx->seconds = now() - start;
+    if (conn != NULL)
+        llclose(conn, NULL, NULL);
+
+    free(packet);
+    return NULL;
+}
+
+// Sends frames packets from this thread to a receiver thread.
+// Returns the time the transmitter took to send them, -1 if they did not
+// all arrive intact.
+double transfer(ll_transport_t *txEnd, ll_transport_t *rxEnd, const unsigned char *payload, int size, int frames)
+{
+    receiver_t rx = {rxEnd, size, frames, payload, 0, 0, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, receiver_thread, &rx);
+
+    ll_params_t params;
+    link_params(&params, size);
+
+    ll_conn_t *conn = llopen_transport(txEnd, TX, &params, NULL);
+    int sent = 0;
+    double start = now();
+    for (; conn != NULL && sent < frames; sent++)
+    {
+        if (llwrite(conn, (unsigned char *)payload, size) < 0)
+            break;
+    }
+    double seconds = now() - start;
+    if (conn != NULL)
+        llclose(conn, NULL, NULL);
+
+    pthread_join(thread, NULL);
+
+    return sent == frames && rx.received == frames ? seconds : -1;
+}
+
+// Records both directions of a transfer: SET, the I-frames, DISC and UA
+// written by the transmitter, and UA, one RR per I-frame and DISC written
+// by the receiver.
+// Returns 0 if successful, -1 otherwise.
+int record(const unsigned char *payload, int size, int frames, capture_t *txCapture, capture_t *rxCapture)
+{
+    // With COBS the SET and UA are sent once more after switching
+    int extra = framing == FRAMING_COBS ? 1 : 0;
+
+    // A retransmission would break the one answer per frame of the script
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        ll_transport_t *a, *b;
+        if (lltransport_memory_pair(&a, &b, 0, 0, 0) != 0)
+            return -1;
+
+        txCapture->length = rxCapture->length = 0;
+        txCapture->count = rxCapture->count = 0;
+        if (transfer(new_recorder(a, txCapture), new_recorder(b, rxCapture), payload, size, frames) >= 0 &&
+            txCapture->count == frames + 3 + extra && rxCapture->count == frames + 2 + extra)
+            return 0;
+    }
+
+    return -1;
+}
+
+// Times llwrite alone, answered by the recorded receiver.
+double run_llwrite(const capture_t *rxCapture, const unsigned char *payload, int size, int frames)
+{
+    ll_params_t params;
+    link_params(&params, size);
+
+    ll_conn_t *conn = llopen_transport(new_script(rxCapture, TRUE), TX, &params, NULL);
+    if (conn == NULL)
+        return -1;
+
+    int sent = 0;
+    double start = now();
+    for (; sent < frames; sent++)
+    {
+        if (llwrite(conn, (unsigned char *)payload, size) < 0)
+            break;
+    }
+    double seconds = now() - start;
+
+    if (llclose(conn, NULL, NULL) != 0 || sent != frames)
+        return -1;
+    return seconds;
+}
+
+// Times llread alone, fed with the recorded transmitter.
+double run_llread(const capture_t *txCapture, const unsigned char *payload, int size, int frames, int check)
+{
+    receiver_t rx = {new_script(txCapture, FALSE), size, frames, check ? payload : NULL, 0, 0, 0};
+    receiver_thread(&rx);
+
+    return rx.received == frames ? rx.seconds : -1;
+}
+
+// Stuffs the payload with its frame check, or codes it with COBS as one
+// block. Returns the length of the result.
+int stuff_payload(unsigned char *stuffed, const unsigned char *payload, int size, unsigned int *fcs)
+{
+    if (framing == FRAMING_HDLC)
+        return fcs_stuff(fcsType, stuffed, payload, size, fcs);
+
+    cobs_state_t state;
+    int length = cobs_init(stuffed, &state);
+    length += fcs_cobs(fcsType, &stuffed[length], payload, size, &state, fcs);
+    cobs_final(&stuffed[length], &state);
+    return length;
+}
+
+// Times the kernels llwrite and llread use on every I-frame.
+double run_kernel(int stage, const unsigned char *payload, int size, int frames, unsigned char *stuffed,
+                  unsigned char *destuffed)
+{
+    unsigned int fcs = fcs_init(fcsType);
+    unsigned char trailer[MAX_FCS_SIZE] = {0};
+    unsigned char bcc = 0;
+    int stuffedLength = stuff_payload(stuffed, payload, size, &fcs);
+
+    double start = now();
+    for (int i = 0; i < frames; i++)
+    {
+        if (stage == STAGE_CHECK)
+        {
+            fcs = fcs_update(fcsType, fcs_init(fcsType), payload, size);
+            fcs_final(fcsType, fcs, trailer);
+        }
+        else if (stage == STAGE_STUFF)
+        {
+            fcs = fcs_init(fcsType);
+            stuff_payload(stuffed, payload, size, &fcs);
+        }
+        else if (framing == FRAMING_COBS)
+            cobs_decode(destuffed, stuffed, stuffedLength, &bcc);
+        else
+            destuff_data(destuffed, stuffed, stuffedLength, &bcc);
+    }
+    double seconds = now() - start;
+
+    // The results must not be thrown away by the compiler
+    sink ^= trailer[0] ^ bcc ^ destuffed[0];
+    if (stage == STAGE_DESTUFF && memcmp(destuffed, payload, size) != 0)
+        return -1;
+
+    return seconds;
+}
+
+// Times the frame parser of llread alone on the recorded transmitter, given
+// in blocks the size of the receive ring of the link layer.
+double run_parser(const capture_t *txCapture, int size, int frames)
+{
+    int bufferSize = 2 * (5 + size + MAX_FCS_SIZE) + 2;
+    unsigned char *buffer = malloc(bufferSize);
+    frame_parser_t parser;
+    parsed_frame_t frame;
+    int found = 0;
+
+    // Parameters of link_params()
+    parser_init(&parser, buffer, bufferSize, 1, FALSE, FALSE);
+    parser_set_framing(&parser, framing);
+
+    double start = now();
+    for (size_t pos = 0; pos < txCapture->length;)
+    {
+        int length = txCapture->length - pos < 4096 ? txCapture->length - pos : 4096;
+        int used;
+
+        if (parser_scan(&parser, &txCapture->data[pos], length, &frame, &used) == PARSE_FRAME)
+            found += frame.type == FRAME_I && frame.fieldLength == size + fcs_size(fcsType);
+        pos += used;
+    }
+    double seconds = now() - start;
+
+    free(buffer);
+    return found == frames ? seconds : -1;
+}
+
+// Reads the results of an earlier report written with -j.
+void load_baseline(const char *path, result_t *results, int count)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char stage[16], payload[16];
+        int size, frames;
+        double nsPerByte;
+
+        if (sscanf(line, " {\"stage\": \"%15[^\"]\", \"payload\": \"%15[^\"]\", \"size\": %d, \"frames\": %d, "
+                         "\"nsPerByte\": %lf", stage, payload, &size, &frames, &nsPerByte) != 5)
+            continue;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (strcmp(stageNames[results[i].stage], stage) == 0 &&
+                strcmp(payloadNames[results[i].payload], payload) == 0 && results[i].size == size)
+                results[i].baseNsPerByte = nsPerByte;
+        }
+    }
+
+    fclose(file);
+}
+
+void print_result(const result_t *result)
+{
+    double nsPerByte = result->seconds * 1e9 / ((double)result->frames * result->size);
+
+    printf("%-9s %-7s %6d %6d %10.3f %11.1f %12.0f", stageNames[result->stage], payloadNames[result->payload],
+           result->size, result->frames, nsPerByte, result->seconds * 1e9 / result->frames,
+           result->frames / result->seconds);
+    if (result->seconds <= 0)
+        printf(" FAILED");
+    else if (result->baseNsPerByte > 0)
+        printf(" %+8.1f%%", (nsPerByte / result->baseNsPerByte - 1) * 100);
+    printf("\n");
+}
+
+int save_report(const char *path, const result_t *results, int count)
+{
+    FILE *json = fopen(path, "w");
+    if (json == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    // One result per line, which is what -b reads back
+    fprintf(json, "{\n  \"benchmark\": \"framing\",\n  \"fcs\": \"%s\",\n  \"stuffing\": \"%s\",\n  \"framing\": \"%s\",\n"
+                  "  \"repeats\": %d,\n  \"results\": [\n",
+            fcsNames[fcsType], stuffing_name(stuffing_select(STUFFING_AUTO)), framingNames[framing], REPEATS);
+    for (int i = 0; i < count; i++)
+    {
+        const result_t *result = &results[i];
+        fprintf(json, "    {\"stage\": \"%s\", \"payload\": \"%s\", \"size\": %d, \"frames\": %d, "
+                      "\"nsPerByte\": %.4f, \"nsPerFrame\": %.1f, \"framesPerSecond\": %.0f}%s\n",
+                stageNames[result->stage], payloadNames[result->payload], result->size, result->frames,
+                result->seconds * 1e9 / ((double)result->frames * result->size),
+                result->seconds * 1e9 / result->frames, result->frames / result->seconds,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(json, "  ]\n}\n");
+
+    return fclose(json) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *reportPath = NULL;
+    const char *baselinePath = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:oj:b:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                if (strcmp(optarg, "xor") == 0)
+                    fcsType = FCS_XOR;
+                else if (strcmp(optarg, "crc16") == 0)
+                    fcsType = FCS_CRC16;
+                else if (strcmp(optarg, "crc32c") == 0)
+                    fcsType = FCS_CRC32C;
+                else
+                {
+                    printf("Unknown frame check: %s (xor, crc16 or crc32c)\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                framing = FRAMING_COBS;
+                break;
+            case 'j':
+                reportPath = optarg;
+                break;
+            case 'b':
+                baselinePath = optarg;
+                break;
+            default:
+                printf("Usage: %s [-c xor|crc16|crc32c] [-o] [-j Report.json] [-b Baseline.json]\n"
+                       "Example: %s -j new.json -b old.json (compare with an earlier report)\n"
+                       "         %s -o -b hdlc.json (COBS framing, compared with byte stuffing)\n",
+                       argv[0], argv[0], argv[0]);
+                exit(1);
+        }
+    }
+
+    result_t *results = calloc(MAX_RESULTS, sizeof(result_t));
+    int count = 0;
+
+    // Results are listed stage by stage, the runs share the recordings
+    unsigned char *payload = malloc(MAX_PAYLOAD);
+    unsigned char *stuffed = malloc(2 * MAX_PAYLOAD + 2 * MAX_FCS_SIZE);
+    unsigned char *destuffed = malloc(MAX_PAYLOAD + MAX_FCS_SIZE);
+    capture_t txCapture, rxCapture;
+    memset(&txCapture, 0, sizeof(txCapture));
+    memset(&rxCapture, 0, sizeof(rxCapture));
+    srand(1);
+
+    for (int type = PAYLOAD_RANDOM; type <= PAYLOAD_ESCAPE; type++)
+    {
+        for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+        {
+            int size = sizes[s];
+            int frames = TARGET_BYTES / size;
+            if (frames < MIN_FRAMES)
+                frames = MIN_FRAMES;
+            if (frames > MAX_FRAMES)
+                frames = MAX_FRAMES;
+            fill_payload(payload, size, type);
+
+            quiet(TRUE);
+            int recorded = record(payload, size, frames, &txCapture, &rxCapture) == 0;
+
+            for (int stage = 0; stage < STAGES; stage++)
+            {
+                double best = -1;
+                for (int r = 0; r < REPEATS; r++)
+                {
+                    double seconds = -1;
+                    ll_transport_t *a, *b;
+
+                    if (stage <= STAGE_DESTUFF)
+                        seconds = run_kernel(stage, payload, size, frames, stuffed, destuffed);
+                    else if (stage == STAGE_PARSE && recorded)
+                        seconds = run_parser(&txCapture, size, frames);
+                    else if (stage == STAGE_LLWRITE && recorded)
+                        seconds = run_llwrite(&rxCapture, payload, size, frames);
+                    else if (stage == STAGE_LLREAD && recorded)
+                        seconds = run_llread(&txCapture, payload, size, frames, r == 0);
+                    else if (stage == STAGE_TRANSFER && lltransport_memory_pair(&a, &b, 0, 0, 0) == 0)
+                        seconds = transfer(a, b, payload, size, frames);
+
+                    if (seconds < 0)
+                    {
+                        best = -1;
+                        break;
+                    }
+                    if (best < 0 || seconds < best)
+                        best = seconds;
+                }
+
+                result_t *result = &results[count++];
+                result->stage = stage;
+                result->payload = type;
+                result->size = size;
+                result->frames = frames;
+                result->seconds = best;
+            }
+            quiet(FALSE);
+        }
+    }
+
+    if (baselinePath != NULL)
+        load_baseline(baselinePath, results, count);
+
+    printf("frame check %s, stuffing %s, framing %s, best of %d runs\n", fcsNames[fcsType],
+           stuffing_name(stuffing_select(STUFFING_AUTO)), framingNames[framing], REPEATS);
+    printf("%-9s %-7s %6s %6s %10s %11s %12s%s\n", "stage", "payload", "size", "frames", "ns/byte", "ns/frame",
+           "frames/s", baselinePath != NULL ? "  vs base" : "");
+
+    int failures = 0;
+    for (int stage = 0; stage < STAGES; stage++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (results[i].stage != stage)
+                continue;
+            print_result(&results[i]);
+            failures += results[i].seconds <= 0;
+        }
+    }
+
+    if (reportPath != NULL && save_report(reportPath, results, count) != 0)
+        failures++;
+
+    free(results);
+    free(payload);
+    free(stuffed);
+    free(destuffed);
+    free(txCapture.data);
+    free(txCapture.ends);
+    free(rxCapture.data);
+    free(rxCapture.ends);
+
+    if (failures > 0)
+    {
+        printf("%d stage(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
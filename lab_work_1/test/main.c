@@ -33,8 +33,10 @@ int main(int argc, char *argv[])
     if (argc < 3)
     {
         printf("Incorrect program usage\n"
-               "Usage: %s <SerialPortNumber> <Role>\n"
-               "Example: %s 1 0\nThis will open /dev/ttyS1 in RX mode\n",
+               "Usage: %s <SerialPortNumber> <Role> [duplex]\n"
+               "Example: %s 1 0\nThis will open /dev/ttyS1 in RX mode\n"
+               "         %s 1 1 duplex\nBoth ends send and receive the test packets (start it on both)\n",
+               argv[0],
                argv[0],
                argv[0]);
         exit(1);
@@ -52,16 +54,30 @@ int main(int argc, char *argv[])
     const char *portNumberString = argv[1];
     int portNumber = atoi(portNumberString);
 
+    // Full duplex needs a sliding window, the receiver accepts what the
+    // transmitter asks for
+    ll_params_t params;
+    llparams_default(&params);
+    int duplex = argc > 3 && strcmp(argv[3], "duplex") == 0;
+    if (duplex)
+    {
+        params.arq = ARQ_GO_BACK_N;
+        params.window = 7;
+        params.seqBits = 3;
+        params.duplex = TRUE;
+    }
+
     // Begin communication
-    int fd = llopen(portNumber, role);
-    if (fd == DEFAULT_ERROR)
+    int err;
+    ll_conn_t *conn = llopen(portNumber, role, &params, &err);
+    if (conn == NULL && err == TIMEOUT_ERROR)
     {
-        printf("Connection could not be established\n");
+        printf("Connection time out. The program will now close.\n");
         exit(1);
     }
-    else if (fd == TIMEOUT_ERROR)
+    else if (conn == NULL)
     {
-        printf("Connection time out. The program will now close.\n");
+        printf("Connection could not be established\n");
         exit(1);
     }
     
@@ -70,7 +86,46 @@ int main(int argc, char *argv[])
     unsigned char rcv_packet[MAX_SIZE];
 
 
-    switch (role)
+    // Each end sends a packet and then takes whatever already arrived
+    if (duplex)
+    {
+        printf("Full duplex mode\n");
+        int sent = 0;
+        int packet_count = 0;
+        while (sent < 10 || packet_count < 10)
+        {
+            if (sent < 10)
+            {
+                data[0] = sent++;
+                if (llwrite(conn, data, sizeof(data)) < 0)
+                {
+                    printf("Error sending data\n");
+                    exit(1);
+                }
+            }
+
+            while (packet_count < 10)
+            {
+                // Only wait for packets once ours are all sent
+                int bytes = sent < 10 ? llread_nowait(conn, rcv_packet) : llread(conn, rcv_packet);
+                if (bytes == TIMEOUT_ERROR && sent < 10)
+                    break;
+                if (bytes < 0)
+                {
+                    printf("Error receiving data (Code %d)\n", bytes);
+                    exit(1);
+                }
+                printf("Received packet %d: ", packet_count);
+                for (int i = 0; i < bytes; i++)
+                {
+                    printf("0x%02X ", rcv_packet[i]);
+                }
+                printf("\n");
+                packet_count++;
+            }
+        }
+    }
+    else switch (role)
     {
         case RX:
             printf("Receiver mode\n");
@@ -78,7 +133,7 @@ int main(int argc, char *argv[])
             // Receive the data from the sender
             while (packet_count < 10)
             {
-                int bytes = llread(fd, rcv_packet);
+                int bytes = llread(conn, rcv_packet);
                 if (bytes < 0)
                 {
                     printf("Error receiving data (Code %d)\n", bytes);
@@ -98,7 +153,7 @@ int main(int argc, char *argv[])
             // Send the data to the receiver
             for (int i = 0; i < 10; i++)
             {
-                int bytes = llwrite(fd, data, sizeof(data));
+                int bytes = llwrite(conn, data, sizeof(data));
                 if (bytes < 0)
                 {
                     printf("Error sending data (Code %d)\n", bytes);
@@ -115,7 +170,7 @@ int main(int argc, char *argv[])
 
 
     // When data is done close the connection
-    llclose(fd, role);
+    llclose(conn, NULL, NULL);
 
     return 0;
 }
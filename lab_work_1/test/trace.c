@@ -0,0 +1,300 @@
+// RC 24/25
+/*
+*   José Santos and José Filipe
+*   Description:
+*   Decoder of the frame traces written by lltrace_dump (-T in the
+*   transmitter and receiver). The records of every file given are merged
+*   into one timeline, so the traces of both ends of a link can be read
+*   together when they ran on the same machine. Acknowledgments are matched
+*   to the I-frames they acknowledge to show the round trip of each one,
+*   and every I-frame that was sent more than once is listed at the end with
+*   the time and the cause of each copy.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/linklayer.h"
+
+#define MAX_FILES 16
+
+// I-frame from the first time it was sent until it was acknowledged
+#define MAX_COPIES 8
+typedef struct {
+    int file;
+    int ns;
+    int copies;
+    int64_t sentAt[MAX_COPIES]; // Time of each copy (ns)
+    const char *cause[MAX_COPIES];
+    int64_t ackedAt;            // 0 if never acknowledged
+} chain_t;
+
+// A trace file and the window of the transmitter, rebuilt from its records
+typedef struct {
+    trace_header_t header;
+    trace_record_t *records;
+    int count;
+    int next; // Next record to merge
+    char name[16];
+
+    int base;
+    int outstanding;
+    int chain[MAX_MODULUS]; // Chain of the I-frame in flight with each N(S), -1 if unknown
+    const char *cause;      // Why the next copy is sent
+
+    // Round trips of the I-frames sent only once (Karn's rule), in ns
+    long rttCount;
+    int64_t rttMin, rttMax, rttSum;
+} trace_file_t;
+
+static const char *eventNames[] = {"sent", "resent", "received", "fcs-error", "header-error", "duplicate",
+                                   "timeout"};
+static const char *frameNames[] = {"?", "I", "RR", "REJ", "SREJ", "SET", "UA", "DISC"};
+
+static chain_t *chains;
+static int chainCount;
+static int chainSize;
+
+static int new_chain(int file, int ns, int64_t time)
+{
+    if (chainCount == chainSize)
+    {
+        chainSize = chainSize > 0 ? 2 * chainSize : 1024;
+        chains = realloc(chains, chainSize * sizeof(chain_t));
+        if (chains == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    chain_t *chain = &chains[chainCount];
+    memset(chain, 0, sizeof(*chain));
+    chain->file = file;
+    chain->ns = ns;
+    chain->copies = 1;
+    chain->sentAt[0] = time;
+    chain->cause[0] = "new";
+
+    return chainCount++;
+}
+
+// Marks the I-frames before nr as acknowledged, as acknowledge() does in
+// the link layer.
+// Writes what was acknowledged to note.
+static void acknowledge(trace_file_t *file, int nr, int64_t time, char *note, int size)
+{
+    int modulus = 1 << file->header.seqBits;
+    int acked = (nr - file->base + modulus) % modulus;
+    if (acked == 0 || acked > file->outstanding)
+        return;
+
+    for (int i = 0; i < acked; i++)
+    {
+        int seq = (file->base + i) % modulus;
+        if (file->chain[seq] < 0)
+            continue;
+
+        chain_t *chain = &chains[file->chain[seq]];
+        chain->ackedAt = time;
+
+        if (chain->copies == 1)
+        {
+            int64_t rtt = time - chain->sentAt[0];
+            if (file->rttCount == 0 || rtt < file->rttMin)
+                file->rttMin = rtt;
+            if (rtt > file->rttMax)
+                file->rttMax = rtt;
+            file->rttSum += rtt;
+            file->rttCount++;
+        }
+    }
+
+    file->base = nr;
+    file->outstanding -= acked;
+
+    int last = file->chain[(nr - 1 + modulus) % modulus];
+    if (last < 0)
+        return;
+
+    chain_t *newest = &chains[last];
+    if (newest->copies == 1)
+        snprintf(note, size, "acks %d, rtt %.3f ms", acked, (time - newest->sentAt[0]) / 1e6);
+    else
+        snprintf(note, size, "acks %d, I%d sent %d times", acked, newest->ns, newest->copies);
+}
+
+// Follows the window of the transmitter and prints one record.
+static void show_record(trace_file_t *files, int index, const trace_record_t *record, int64_t origin)
+{
+    trace_file_t *file = &files[index];
+    int64_t time = trace_time_ns(&file->header, record->time);
+    int event = record->event & 0x0F;
+    int type = record->event >> 4;
+    int modulus = 1 << file->header.seqBits;
+    char note[64] = "";
+
+    if (type == TRACE_FRAME_I && event == TRACE_SENT)
+    {
+        if (file->outstanding == 0)
+            file->base = record->ns;
+        if (file->outstanding < modulus)
+            file->outstanding++;
+        file->chain[record->ns % modulus] = new_chain(index, record->ns, time);
+    }
+    else if (type == TRACE_FRAME_I && event == TRACE_RESENT && file->chain[record->ns % modulus] >= 0)
+    {
+        chain_t *chain = &chains[file->chain[record->ns % modulus]];
+        if (chain->copies < MAX_COPIES)
+        {
+            chain->sentAt[chain->copies] = time;
+            chain->cause[chain->copies] = file->cause;
+        }
+        chain->copies++;
+        snprintf(note, sizeof(note), "copy %d, %s", chain->copies, file->cause);
+    }
+    else if (event == TRACE_TIMEOUT)
+        file->cause = "timeout";
+    else if (event == TRACE_RECEIVED && (type == TRACE_FRAME_RR || type == TRACE_FRAME_REJ ||
+                                         (type == TRACE_FRAME_I && file->header.duplex)))
+    {
+        acknowledge(file, record->nr, time, note, sizeof(note));
+        if (type == TRACE_FRAME_REJ)
+            file->cause = "REJ";
+    }
+    else if (event == TRACE_RECEIVED && type == TRACE_FRAME_SREJ)
+        file->cause = "SREJ";
+
+    char frame[32];
+    if (type == TRACE_FRAME_I && file->header.duplex)
+        snprintf(frame, sizeof(frame), "I ns=%d nr=%d", record->ns, record->nr);
+    else if (type == TRACE_FRAME_I || event == TRACE_TIMEOUT)
+        snprintf(frame, sizeof(frame), "I ns=%d", record->ns);
+    else if (type == TRACE_FRAME_RR || type == TRACE_FRAME_REJ || type == TRACE_FRAME_SREJ)
+        snprintf(frame, sizeof(frame), "%s nr=%d", frameNames[type], record->nr);
+    else
+        snprintf(frame, sizeof(frame), "%s", frameNames[type < 8 ? type : 0]);
+
+    printf("%12.3f  %-6s %-12s %-14s C=0x%02X %6u B  %s\n", (time - origin) / 1e6, file->name,
+           event < 7 ? eventNames[event] : "?", frame, record->control, record->length, note);
+}
+
+static void show_summary(trace_file_t *files, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        trace_file_t *file = &files[i];
+        int sent = 0, resent = 0, timeouts = 0, errors = 0;
+
+        for (int j = 0; j < file->count; j++)
+        {
+            int event = file->records[j].event & 0x0F;
+            int type = file->records[j].event >> 4;
+            sent += type == TRACE_FRAME_I && event == TRACE_SENT;
+            resent += event == TRACE_RESENT;
+            timeouts += event == TRACE_TIMEOUT;
+            errors += event == TRACE_FCS_ERROR || event == TRACE_HEADER_ERROR;
+        }
+
+        printf("%s: %d records (%u lost), %d I-frames sent, %d sent again, %d timeouts, %d frames damaged\n",
+               file->name, file->count, file->header.lost, sent, resent, timeouts, errors);
+        if (file->rttCount > 0)
+            printf("%s: round trip of %ld I-frames sent once: min %.3f ms, mean %.3f ms, max %.3f ms\n",
+                   file->name, file->rttCount, file->rttMin / 1e6, file->rttSum / 1e6 / file->rttCount,
+                   file->rttMax / 1e6);
+    }
+
+    int shown = 0;
+    for (int i = 0; i < chainCount; i++)
+    {
+        chain_t *chain = &chains[i];
+        if (chain->copies == 1)
+            continue;
+
+        if (shown++ == 0)
+            printf("\nI-frames sent more than once (ms):\n");
+
+        printf("%s I%d:", files[chain->file].name, chain->ns);
+        for (int j = 0; j < chain->copies && j < MAX_COPIES; j++)
+            printf(" %.3f (%s)", (chain->sentAt[j] - files[0].header.startNs) / 1e6, chain->cause[j]);
+        if (chain->copies > MAX_COPIES)
+            printf(" ... %d copies", chain->copies);
+        if (chain->ackedAt != 0)
+            printf(" -> acked at %.3f\n", (chain->ackedAt - files[0].header.startNs) / 1e6);
+        else
+            printf(" -> not acknowledged\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc - 1 > MAX_FILES)
+    {
+        printf("Usage: %s <TraceFile> [<TraceFile>...]\n"
+               "Example: %s tx.bin rx.bin (both ends of a link in one timeline)\n",
+               argv[0], argv[0]);
+        exit(1);
+    }
+
+    int count = argc - 1;
+    trace_file_t files[MAX_FILES];
+    memset(files, 0, sizeof(files));
+
+    for (int i = 0; i < count; i++)
+    {
+        trace_file_t *file = &files[i];
+        file->count = trace_load(argv[i + 1], &file->header, &file->records);
+        if (file->count < 0)
+        {
+            printf("%s is not a trace file\n", argv[i + 1]);
+            exit(1);
+        }
+
+        snprintf(file->name, sizeof(file->name), "%s/%d", file->header.role == TX ? "TX" : "RX",
+                 file->header.port);
+        file->cause = "?";
+        for (int j = 0; j < MAX_MODULUS; j++)
+            file->chain[j] = -1;
+
+        printf("%s: %s, %d-bit sequence numbers, window %d%s, %d records\n", argv[i + 1], file->name,
+               file->header.seqBits, file->header.window, file->header.duplex ? ", full duplex" : "",
+               file->count);
+    }
+
+    // Times are shown from the creation of the first trace
+    int64_t origin = files[0].header.startNs;
+    printf("\n%12s  %-6s %-12s %-14s %-6s %8s\n", "ms", "link", "event", "frame", "C", "length");
+
+    while (TRUE)
+    {
+        int first = -1;
+        int64_t firstTime = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (files[i].next == files[i].count)
+                continue;
+
+            int64_t time = trace_time_ns(&files[i].header, files[i].records[files[i].next].time);
+            if (first < 0 || time < firstTime)
+            {
+                first = i;
+                firstTime = time;
+            }
+        }
+        if (first < 0)
+            break;
+
+        show_record(files, first, &files[first].records[files[first].next], origin);
+        files[first].next++;
+    }
+
+    printf("\n");
+    show_summary(files, count);
+
+    for (int i = 0; i < count; i++)
+        free(files[i].records);
+    free(chains);
+
+    return 0;
+}